@@ -0,0 +1,83 @@
+// Measures the legacy obfuscation of an http.url tag, which every finished span with one goes
+// through when DD_TRACE_CPP_LEGACY_OBFUSCATION is set, against the std::regex_replace it used to
+// be. And measures the UrlNormalizer that TracerOptions::url_normalization_rules configures, with
+// and without its cache.
+//
+// Usage: obfuscation_benchmark [URLs obfuscated per measurement]
+
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "../src/obfuscation.h"
+#include "../src/url_normalizer.h"
+
+using namespace datadog::opentracing;
+
+namespace {
+
+const std::vector<std::string> urls{
+    "/",
+    "/search?id=100&private=true",
+    "/user/1/repo/50/",
+    "/user/asdf123/repository/01234567-9ABC-DEF0-1234",
+    "http://i-012a3b45c6d78901e//api/v1/check_run?api_key=0abcdef1a23b4c5d67ef8a90b1cde234",
+    "https://example.com/api/v2/orders/8f14e45f-ceea-467f-a8dd-0f1f9e5e7d3b/items/42/"
+    "shipments?expand=carrier&page=3&per_page=100&sort=-created_at"};
+
+template <typename Obfuscate>
+void benchmark(const std::string& name, Obfuscate obfuscate, int iterations) {
+  size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    for (auto& url : urls) {
+      bytes += obfuscate(url).size();
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << name << ": " << static_cast<double>(ns) / iterations / urls.size()
+            << "ns per URL (" << bytes / iterations << " bytes out per " << urls.size()
+            << " URLs)" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? std::stoi(argv[1]) : 100000;
+  // Both copy the URL, as the tag's string is overwritten in place.
+  benchmark(
+      "scanner",
+      [](std::string url) {
+        legacyObfuscateUrl(url);
+        return url;
+      },
+      iterations);
+  std::regex path_mixed_alphanumerics{
+      "(\\/)(?:(?:([^?\\/&]*)(?:\\?[^\\/]+))|(?:(?![vV]\\d{1,2}\\/)[^\\/"
+      "\\d\\?]*[\\d-]+[^\\/]*))"};
+  benchmark(
+      "std::regex_replace",
+      [&](const std::string& url) {
+        return std::regex_replace(url, path_mixed_alphanumerics, "$1$2?");
+      },
+      iterations / 10 + 1);
+
+  UrlNormalizerRules rules;
+  rules.integers = true;
+  rules.uuids = true;
+  rules.hex = true;
+  rules.routes = {"/users/{id}/repository/{id}", "/api/v2/orders/{id}/items/{id}/shipments",
+                  "/search"};
+  for (size_t cache_size : {size_t{1000}, size_t{0}}) {
+    rules.cache_size = cache_size;
+    UrlNormalizer normalizer{rules};
+    benchmark(
+        cache_size == 0 ? "url normalizer (uncached)" : "url normalizer (cached)",
+        [&](const std::string& url) { return normalizer.normalize(url); }, iterations);
+  }
+  return 0;
+}
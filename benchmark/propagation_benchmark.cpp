@@ -0,0 +1,208 @@
+// Measures Tracer::Inject and Tracer::Extract for each propagation style, and for std::ostream and
+// std::istream carriers in each encoding, in time and in heap allocations.
+//
+// The carriers do no work of their own, so what's measured is the tracer's.
+//
+// Usage: propagation_benchmark [injects and extracts per style]
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../src/sample.h"
+#include "../src/tracer.h"
+#include "../src/writer.h"
+
+using namespace datadog::opentracing;
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC takes the frees below, once inlined into the library's templates, for a mismatch.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+namespace {
+std::atomic<uint64_t> allocations{0};
+}  // namespace
+
+// Counts every allocation in the process, including the library's.
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+// A Writer that discards the traces it's given.
+class NullWriter : public Writer {
+ public:
+  NullWriter() : Writer(std::make_shared<RulesSampler>()) {}
+  void write(Trace) override {}
+  void flush(std::chrono::milliseconds) override {}
+};
+
+// Totals up the headers it's given, without keeping them.
+class CountingWriter : public ot::HTTPHeadersWriter {
+ public:
+  ot::expected<void> Set(ot::string_view key, ot::string_view value) const override {
+    bytes += key.size() + value.size();
+    return {};
+  }
+
+  mutable size_t bytes = 0;
+};
+
+void benchmarkInject(const std::string& name, std::set<PropagationStyle> styles, int injects) {
+  TracerOptions options;
+  options.inject = styles;
+  auto sampler = std::make_shared<RulesSampler>();
+  auto tracer = std::make_shared<Tracer>(options, std::make_shared<NullWriter>(), sampler);
+  auto span = tracer->StartSpan("operation");
+  span->SetBaggageItem("user", "1234");
+  CountingWriter carrier;
+  // The first inject decides the sampling priority, which isn't what's being measured.
+  tracer->Inject(span->context(), carrier);
+
+  uint64_t allocations_before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < injects; i++) {
+    tracer->Inject(span->context(), carrier);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  uint64_t allocated = allocations.load() - allocations_before;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << name << ": " << static_cast<double>(ns) / injects << "ns and "
+            << static_cast<double>(allocated) / injects << " allocations per inject ("
+            << carrier.bytes / (injects + 1) << " bytes of headers)" << std::endl;
+  span->Finish();
+}
+
+// A request's worth of headers, with the Datadog and B3 ones among them.
+class RequestHeaders : public ot::HTTPHeadersReader {
+ public:
+  RequestHeaders() {
+    headers_ = {{"Host", "example.com"},
+                {"User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101"},
+                {"Accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"},
+                {"Accept-Language", "en-US,en;q=0.5"},
+                {"Accept-Encoding", "gzip, deflate, br"},
+                {"Connection", "keep-alive"},
+                {"x-datadog-trace-id", "1234567890123456789"},
+                {"x-datadog-parent-id", "987654321"},
+                {"x-datadog-sampling-priority", "1"},
+                {"X-B3-TraceId", "112210f47de98115"},
+                {"X-B3-SpanId", "3ade68b1"},
+                {"X-B3-Sampled", "1"},
+                {"ot-baggage-user", "1234"}};
+    for (size_t i = headers_.size(); i < 40; i++) {
+      headers_.emplace_back("X-Custom-Header-" + std::to_string(i), "value");
+    }
+  }
+
+  ot::expected<void> ForeachKey(
+      std::function<ot::expected<void>(ot::string_view key, ot::string_view value)> f)
+      const override {
+    for (auto& header : headers_) {
+      auto result = f(header.first, header.second);
+      if (!result) {
+        return result;
+      }
+    }
+    return {};
+  }
+
+  size_t size() const { return headers_.size(); }
+
+ private:
+  std::vector<std::pair<std::string, std::string>> headers_;
+};
+
+void benchmarkExtract(const std::string& name, std::set<PropagationStyle> styles, int extracts) {
+  TracerOptions options;
+  options.extract = styles;
+  auto tracer = std::make_shared<Tracer>(options, std::make_shared<NullWriter>(),
+                                         std::make_shared<RulesSampler>());
+  RequestHeaders carrier;
+  size_t extracted = 0;
+
+  uint64_t allocations_before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < extracts; i++) {
+    auto context = tracer->Extract(carrier);
+    if (context && *context != nullptr) {
+      extracted++;
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  uint64_t allocated = allocations.load() - allocations_before;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << name << ": " << static_cast<double>(ns) / extracts << "ns and "
+            << static_cast<double>(allocated) / extracts << " allocations per extract of "
+            << carrier.size() << " headers (" << extracted << " extracted)" << std::endl;
+}
+
+void benchmarkStream(const std::string& name, bool compact, int iterations) {
+  TracerOptions options;
+  options.inject_binary_compact = compact;
+  auto tracer = std::make_shared<Tracer>(options, std::make_shared<NullWriter>(),
+                                         std::make_shared<RulesSampler>());
+  auto span = tracer->StartSpan("operation");
+  span->SetBaggageItem("user", "1234");
+  span->SetBaggageItem("session", "e3b0c44298fc1c149afbf4c8996fb924");
+  std::stringstream carrier;
+  tracer->Inject(span->context(), carrier);
+  size_t size = carrier.str().size();
+  size_t extracted = 0;
+
+  uint64_t allocations_before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    carrier.str("");
+    carrier.clear();
+    tracer->Inject(span->context(), carrier);
+    auto context = tracer->Extract(carrier);
+    if (context && *context != nullptr) {
+      extracted++;
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  uint64_t allocated = allocations.load() - allocations_before;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << name << ": " << static_cast<double>(ns) / iterations << "ns and "
+            << static_cast<double>(allocated) / iterations
+            << " allocations per inject and extract of " << size << " bytes (" << extracted
+            << " extracted)" << std::endl;
+  span->Finish();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? std::stoi(argv[1]) : 1000000;
+  const std::set<PropagationStyle> both{PropagationStyle::Datadog, PropagationStyle::B3};
+  benchmarkInject("Datadog", {PropagationStyle::Datadog}, iterations);
+  benchmarkInject("B3", {PropagationStyle::B3}, iterations);
+  benchmarkInject("Datadog and B3", both, iterations);
+  benchmarkExtract("Datadog", {PropagationStyle::Datadog}, iterations);
+  benchmarkExtract("B3", {PropagationStyle::B3}, iterations);
+  benchmarkExtract("Datadog and B3", both, iterations);
+  benchmarkStream("JSON", false, iterations / 10);
+  benchmarkStream("Compact binary", true, iterations / 10);
+  return 0;
+}
@@ -0,0 +1,126 @@
+// Measures setting a request's worth of tags on a span: one SetTag call per tag with string keys,
+// the same with TagKeys, and one SetTags call with TagKeys. Then measures setting tags with deeply
+// nested list and map values, which are serialized as JSON.
+//
+// Usage: tag_benchmark [requests]
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../src/sample.h"
+#include "../src/span.h"
+#include "../src/tracer.h"
+#include "../src/writer.h"
+
+using namespace datadog::opentracing;
+
+namespace {
+
+// A Writer that discards the traces it's given.
+class NullWriter : public Writer {
+ public:
+  NullWriter() : Writer(std::make_shared<RulesSampler>()) {}
+  void write(Trace) override {}
+  void flush(std::chrono::milliseconds) override {}
+};
+
+// Returns a value nested `depth` lists and maps deep, alternately, with scalars at each level.
+ot::Value nestedValue(int depth) {
+  if (depth == 0) {
+    return std::string("leaf \"value\"");
+  }
+  if (depth % 2 == 0) {
+    return std::vector<ot::Value>{nestedValue(depth - 1), int64_t{depth}, 0.5, true, "string"};
+  }
+  return std::unordered_map<std::string, ot::Value>{{"nested", nestedValue(depth - 1)},
+                                                    {"depth", int64_t{depth}},
+                                                    {"ratio", 0.25},
+                                                    {"name", "string\n"}};
+}
+
+template <class SetTags>
+void benchmark(const std::string& name, int requests, SetTags set_tags) {
+  auto tracer = std::make_shared<Tracer>(TracerOptions{}, std::make_shared<NullWriter>(),
+                                         std::make_shared<RulesSampler>());
+  auto span = tracer->StartSpan("request");
+  auto& datadog_span = dynamic_cast<DatadogSpan&>(*span);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; i++) {
+    set_tags(datadog_span);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << name << ": " << static_cast<double>(ns) / requests << "ns per request"
+            << std::endl;
+  span->Finish();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int requests = argc > 1 ? std::stoi(argv[1]) : 1000000;
+  const std::string url = "http://example.com/users/1234/orders?page=2";
+
+  benchmark("SetTag with string keys", requests, [&](DatadogSpan& span) {
+    span.SetTag("component", "http");
+    span.SetTag("span.kind", "server");
+    span.SetTag("http.method", "GET");
+    span.SetTag("http.url", url);
+    span.SetTag("http.host", "example.com");
+    span.SetTag("http.user_agent", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0)");
+    span.SetTag("http.client_ip", "192.0.2.1");
+    span.SetTag("http.request.content_length", 0);
+    span.SetTag("http.status_code", 200);
+    span.SetTag("http.response.content_length", 5120);
+    span.SetTag("peer.hostname", "client.example.com");
+    span.SetTag("error", false);
+  });
+
+  const TagKey component{"component"}, kind{"span.kind"}, method{"http.method"},
+      url_key{"http.url"}, host{"http.host"}, user_agent{"http.user_agent"},
+      client_ip{"http.client_ip"}, request_length{"http.request.content_length"},
+      status{"http.status_code"}, response_length{"http.response.content_length"},
+      peer{"peer.hostname"}, error{"error"};
+
+  benchmark("SetTag with TagKeys", requests, [&](DatadogSpan& span) {
+    span.SetTag(component, "http");
+    span.SetTag(kind, "server");
+    span.SetTag(method, "GET");
+    span.SetTag(url_key, url);
+    span.SetTag(host, "example.com");
+    span.SetTag(user_agent, "Mozilla/5.0 (X11; Linux x86_64; rv:109.0)");
+    span.SetTag(client_ip, "192.0.2.1");
+    span.SetTag(request_length, 0);
+    span.SetTag(status, 200);
+    span.SetTag(response_length, 5120);
+    span.SetTag(peer, "client.example.com");
+    span.SetTag(error, false);
+  });
+
+  benchmark("SetTags with TagKeys", requests, [&](DatadogSpan& span) {
+    span.SetTags({{component, "http"},
+                  {kind, "server"},
+                  {method, "GET"},
+                  {url_key, url},
+                  {host, "example.com"},
+                  {user_agent, "Mozilla/5.0 (X11; Linux x86_64; rv:109.0)"},
+                  {client_ip, "192.0.2.1"},
+                  {request_length, 0},
+                  {status, 200},
+                  {response_length, 5120},
+                  {peer, "client.example.com"},
+                  {error, false}});
+  });
+
+  for (int depth : {2, 8, 32}) {
+    const ot::Value value = nestedValue(depth);
+    benchmark("SetTag with a value nested " + std::to_string(depth) + " deep", requests / 10,
+              [&](DatadogSpan& span) { span.SetTag(component, value); });
+  }
+  return 0;
+}
@@ -0,0 +1,168 @@
+// Measures contention between many application threads handing Traces to the AgentWriter.
+//
+// Compares the lock-free MpscQueue with the mutex-protected deque it replaced, with 64 producer
+// threads and one consumer, and then times AgentWriter::write itself from 64 threads.
+//
+// Usage: writer_queue_benchmark [writes per thread]
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/agent_writer.h"
+#include "../src/mpsc_queue.h"
+#include "../src/span.h"
+#include "../src/transport.h"
+
+using namespace datadog::opentracing;
+
+namespace {
+
+const int num_producers = 64;
+const size_t queue_capacity = 7000;
+
+// A Handle that accepts everything and sends nothing.
+class NullHandle : public Handle {
+ public:
+  HandleResult setopt(HandleOption, const char*) override { return HandleResult::ok; }
+  HandleResult setopt(HandleOption, long) override { return HandleResult::ok; }
+  HandleResult setopt(HandleOption, size_t) override { return HandleResult::ok; }
+  void setHeaders(std::map<std::string, std::string>) override {}
+  HandleResult perform() override { return HandleResult::ok; }
+  std::string getError() override { return ""; }
+  std::string getResponse() override { return "{}"; }
+};
+
+// SpanData can only be constructed by subclasses (or by Spans).
+struct BenchmarkSpanData : public SpanData {
+  BenchmarkSpanData(uint64_t trace_id, uint64_t span_id)
+      : SpanData{"web", "service", "resource", "operation", trace_id, span_id, 0, 0, 0, 0} {}
+};
+
+// The bounded queue that AgentWriter used before MpscQueue.
+class MutexQueue {
+ public:
+  bool tryPush(std::unique_ptr<int>& value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (values_.size() >= queue_capacity) {
+      return false;
+    }
+    values_.push_back(std::move(value));
+    return true;
+  }
+
+  bool tryPop(std::unique_ptr<int>& value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (values_.empty()) {
+      return false;
+    }
+    value = std::move(values_.front());
+    values_.pop_front();
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::deque<std::unique_ptr<int>> values_;
+};
+
+// Runs num_producers threads each pushing writes_per_thread values, while one thread pops them.
+// Values that don't fit are dropped, as AgentWriter does. Prints throughput and drops.
+template <class Queue>
+void benchmarkQueue(const std::string& name, Queue& queue, int writes_per_thread) {
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> dropped{0};
+  uint64_t popped = 0;
+  std::thread consumer([&]() {
+    std::unique_ptr<int> value;
+    while (!done) {
+      while (queue.tryPop(value)) {
+        popped++;
+      }
+      std::this_thread::yield();
+    }
+    while (queue.tryPop(value)) {
+      popped++;
+    }
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> producers;
+  for (int i = 0; i < num_producers; i++) {
+    producers.emplace_back([&]() {
+      for (int j = 0; j < writes_per_thread; j++) {
+        std::unique_ptr<int> value{new int{j}};
+        if (!queue.tryPush(value)) {
+          dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  done = true;
+  consumer.join();
+
+  uint64_t writes = static_cast<uint64_t>(num_producers) * writes_per_thread;
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << name << ": " << writes << " pushes in " << ns / 1000000 << "ms, "
+            << static_cast<double>(ns) / writes << "ns per push, " << popped << " popped, "
+            << dropped << " dropped" << std::endl;
+}
+
+void benchmarkAgentWriter(int writes_per_thread) {
+  AgentWriterOptions options;
+  options.retry_periods = {};
+  AgentWriter writer{std::unique_ptr<Handle>{new NullHandle{}},
+                     options,
+                     "localhost",
+                     8126,
+                     "",
+                     std::make_shared<RulesSampler>()};
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> producers;
+  for (int i = 0; i < num_producers; i++) {
+    producers.emplace_back([&, i]() {
+      for (int j = 0; j < writes_per_thread; j++) {
+        Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+        trace->emplace_back(new BenchmarkSpanData{static_cast<uint64_t>(i) + 1,
+                                                  static_cast<uint64_t>(j) + 1});
+        writer.write(std::move(trace));
+      }
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  writer.flush(std::chrono::seconds(30));
+
+  uint64_t writes = static_cast<uint64_t>(num_producers) * writes_per_thread;
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << "AgentWriter::write: " << writes << " writes in " << ns / 1000000 << "ms, "
+            << static_cast<double>(ns) / writes << "ns per write (including making the trace), "
+            << writer.droppedTraces() << " dropped" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int writes_per_thread = argc > 1 ? std::stoi(argv[1]) : 100000;
+  std::cout << num_producers << " producer threads, " << writes_per_thread << " writes each"
+            << std::endl;
+
+  MutexQueue mutex_queue;
+  benchmarkQueue("mutex + deque", mutex_queue, writes_per_thread);
+  MpscQueue<std::unique_ptr<int>> mpsc_queue{queue_capacity};
+  benchmarkQueue("MpscQueue", mpsc_queue, writes_per_thread);
+  benchmarkAgentWriter(writes_per_thread / 10);
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Fuzzes Tracer::Extract from a std::istream, which reads both the compact binary encoding and
+// JSON. Whatever it extracts must survive being injected, in the compact encoding, and extracted
+// again.
+//
+// Usage: span_context_fuzzer [libFuzzer options] [corpus directories]
+
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+#include "../src/propagation.h"
+#include "../src/sample.h"
+#include "../src/tracer.h"
+#include "../src/writer.h"
+
+using namespace datadog::opentracing;
+
+namespace {
+
+// A Writer that discards the traces it's given.
+class NullWriter : public Writer {
+ public:
+  NullWriter() : Writer(std::make_shared<RulesSampler>()) {}
+  void write(Trace) override {}
+  void flush(std::chrono::milliseconds) override {}
+};
+
+std::shared_ptr<Tracer> makeTracer() {
+  TracerOptions options;
+  options.inject_binary_compact = true;
+  options.log_func = [](LogLevel, ot::string_view) {};
+  return std::make_shared<Tracer>(options, std::make_shared<NullWriter>(),
+                                  std::make_shared<RulesSampler>());
+}
+
+std::unordered_map<std::string, std::string> baggage(const ot::SpanContext& context) {
+  std::unordered_map<std::string, std::string> items;
+  context.ForeachBaggageItem([&](const std::string& key, const std::string& value) {
+    items.emplace(key, value);
+    return true;
+  });
+  return items;
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  static auto tracer = makeTracer();
+  std::istringstream carrier{std::string(reinterpret_cast<const char*>(data), size)};
+  auto extracted = tracer->Extract(carrier);
+  if (!extracted || *extracted == nullptr) {
+    return 0;
+  }
+  auto& context = dynamic_cast<const SpanContext&>(**extracted);
+
+  std::stringstream injected;
+  if (!tracer->Inject(context, injected)) {
+    std::abort();
+  }
+  auto reextracted = tracer->Extract(injected);
+  if (!reextracted || *reextracted == nullptr) {
+    std::abort();
+  }
+  auto& recontext = dynamic_cast<const SpanContext&>(**reextracted);
+  if (recontext.traceId() != context.traceId() || recontext.id() != context.id() ||
+      baggage(recontext) != baggage(context)) {
+    std::abort();
+  }
+  return 0;
+}
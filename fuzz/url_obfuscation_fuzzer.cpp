@@ -0,0 +1,31 @@
+// Fuzzes legacyObfuscateUrl against the regular expression it replaced. The two must agree on
+// every input.
+//
+// Usage: url_obfuscation_fuzzer [libFuzzer options] [corpus directories]
+
+#include <cstdint>
+#include <cstdlib>
+#include <regex>
+#include <string>
+
+#include "../src/obfuscation.h"
+
+using namespace datadog::opentracing;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  // std::regex recurses for each character it matches, so long inputs overflow its stack before
+  // they find anything that short ones don't.
+  if (size > 512) {
+    return 0;
+  }
+  static const std::regex path_mixed_alphanumerics{
+      "(\\/)(?:(?:([^?\\/&]*)(?:\\?[^\\/]+))|(?:(?![vV]\\d{1,2}\\/)[^\\/"
+      "\\d\\?]*[\\d-]+[^\\/]*))"};
+  std::string url(reinterpret_cast<const char*>(data), size);
+  std::string expected = std::regex_replace(url, path_mixed_alphanumerics, "$1$2?");
+  legacyObfuscateUrl(url);
+  if (url != expected) {
+    std::abort();
+  }
+  return 0;
+}
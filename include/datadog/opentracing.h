@@ -114,6 +114,58 @@ struct TracerOptions {
   // If no scheme is set in the URL, a path to a UNIX domain socket is assumed.
   // Can also be set by the environment variable DD_TRACE_AGENT_URL.
   std::string agent_url = "";
+  // The number of requests to the agent that may be in flight at once. Values above 1 let a
+  // flush of many traces (or a slow agent) overlap requests rather than making them in turn. Can
+  // also be set by the environment variable DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS.
+  size_t agent_max_concurrent_requests = 1;
+  // If true, the tracer talks HTTP to the agent itself, over a persistent connection, instead of
+  // using libcurl. This is cheaper per request, but doesn't support https or concurrent requests.
+  // Builds without libcurl (such as the Bazel one) always do this, and Windows builds never do.
+  // Can also be set by the environment variable DD_TRACE_AGENT_NATIVE_TRANSPORT.
+  bool agent_native_transport = false;
+  // If set, traces that can't be sent to the agent (after retrying) are kept in files in this
+  // directory, and sent once the agent accepts traces again, even after a restart. The directory
+  // must not be shared with another tracer. Not supported on Windows. Can also be set by the
+  // environment variable DD_TRACE_AGENT_SPOOL_DIRECTORY.
+  std::string agent_spool_directory = "";
+  // After this many requests to the agent fail in a row, traces are dropped rather than sent until
+  // the agent responds again, which is checked less and less often. Zero means never. Can also be
+  // set by the environment variable DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES.
+  size_t agent_max_consecutive_failures = 5;
+  // If set, the tracers of every process on the host that set it to the same name share one
+  // connection to the agent: they pass their traces through shared memory of this name (such as
+  // "/datadog-trace-collector") to whichever of them is sending traces at the time. For servers
+  // that run many worker processes. Not supported on Windows. Can also be set by the environment
+  // variable DD_TRACE_AGENT_COLLECTOR_NAME.
+  std::string agent_collector_name = "";
+  // If set, the tracers of every process on the host that set it to the same name share one limit
+  // of 100 traces per second kept by sampling rules, through shared memory of this name (such as
+  // "/datadog-sampling-limiter"), rather than each having its own. Not supported on Windows. Can
+  // also be set by the environment variable DD_TRACE_SAMPLING_LIMITER_NAME.
+  std::string sampling_limiter_name = "";
+  // If true, injecting into a std::ostream writes a compact binary encoding rather than JSON.
+  // Extracting from a std::istream reads either, but older tracers only read JSON, so set this
+  // only once every service that extracts what this one injects has been upgraded. Can also be
+  // set by the environment variable DD_PROPAGATION_INJECT_BINARY_COMPACT.
+  bool inject_binary_compact = false;
+  // Rules for normalizing the http.url tag and resource names of finished spans, to keep their
+  // cardinality down. If set, the query string is dropped from both, and their paths are
+  // normalized as configured, instead of http.url's query string just being dropped. Resource
+  // names are only normalized for spans with an http.url tag or of type "http" or "web", and only
+  // if they look like URLs ("scheme://..." or "/path", optionally after a method, as in
+  // "GET /path"). Configuration is a JSON object such as:
+  //   {"segments": ["integer", "uuid", "hex"], "routes": ["/users/{id}/orders/{id}"]}
+  // "segments" lists the kinds of path segment to replace with "?": decimal integers, UUIDs, and
+  // runs of at least 8 hex digits with a decimal digit among them. A path that matches a route
+  // ("{...}" matching any one segment) is replaced by the first route it matches, before any
+  // segments are. "cache_size" is how many normalized values to remember (default 1000). Invalid
+  // rules are ignored. Can also be set by the environment variable
+  // DD_TRACE_URL_NORMALIZATION_RULES.
+  std::string url_normalization_rules = "";
+  // If set, the tracer's telemetry (see getTelemetry()) is sent to this DogStatsD endpoint every
+  // 10 seconds. Either udp://host:port or unix:///path/to/dsd.socket. Can also be set by the
+  // environment variable DD_TRACE_TELEMETRY_DOGSTATSD_URL. Not supported on Windows.
+  std::string telemetry_dogstatsd_url = "";
   // A logging function that is called by the tracer when noteworthy events occur.
   // The default value uses std::cerr, and applications can inject their own logging function.
   LogFunc log_func = [](LogLevel level, ot::string_view message) {
@@ -155,6 +207,42 @@ class TraceEncoder {
   virtual void handleResponse(const std::string& response) = 0;
 };
 
+// A summary of the durations recorded in a histogram, in microseconds. Percentiles are accurate to
+// within about 3%.
+struct LatencySummary {
+  uint64_t count = 0;
+  double mean = 0;
+  uint64_t p50 = 0;
+  uint64_t p90 = 0;
+  uint64_t p99 = 0;
+  uint64_t max = 0;
+};
+
+// What the tracers in this process have been doing, since it started.
+struct TelemetrySnapshot {
+  uint64_t spans_created = 0;
+  // Finished traces given to the writer.
+  uint64_t traces_written = 0;
+  // Traces dropped by the writer before they could be sent: because too many were waiting, the
+  // agent wasn't accepting them, or sending them failed too many times.
+  uint64_t traces_dropped = 0;
+  // Traces, payloads and bytes of payload sent to (and accepted by) the agent.
+  uint64_t traces_sent = 0;
+  uint64_t payloads_sent = 0;
+  uint64_t payload_bytes = 0;
+  // Requests to the agent that failed, and how many of those were retried.
+  uint64_t requests_failed = 0;
+  uint64_t retries = 0;
+  // Traces with spans that haven't finished yet.
+  int64_t pending_traces = 0;
+  // How long it takes to encode a batch of traces, and to make each request to the agent.
+  LatencySummary encode_time;
+  LatencySummary request_latency;
+};
+
+// Returns the current values of the tracer's telemetry. Cheap enough to call every second or so.
+DD_OPENTRACING_API TelemetrySnapshot getTelemetry();
+
 // makeTracer returns an opentracing::Tracer that submits traces to the Datadog Agent.
 // This should be used when control over the HTTP requests to the Datadog Agent is not required.
 DD_OPENTRACING_API std::shared_ptr<ot::Tracer> makeTracer(const TracerOptions& options);
@@ -1,42 +1,169 @@
 #include "agent_writer.h"
 
+#ifndef _MSC_VER
+#include <pthread.h>
+#endif
+
 #include <iostream>
+#include <new>
+#include <set>
 
 #include "encoder.h"
 #include "sample.h"
 #include "span.h"
+#include "telemetry.h"
 #include "transport.h"
+#ifndef DD_OPENTRACING_NO_CURL
+#include "curl_transport.h"
+#elif defined(_MSC_VER)
+#error "When compiling with MSVC, libcurl is the only transport"
+#endif
 
 namespace datadog {
 namespace opentracing {
 
 namespace {
 const std::string agent_protocol = "http://";
-// Retry sending traces to agent a couple of times. Any more than that and the agent won't accept
-// them.
-// write_period 1s + timeout 2s + (retry & timeout) 2.5s + (retry and timeout) 4.5s = 10s.
-const std::vector<std::chrono::milliseconds> default_retry_periods{
-    std::chrono::milliseconds(500), std::chrono::milliseconds(2500)};
 // Agent communication timeout.
 const long default_timeout_ms = 2000L;
 }  // namespace
 
+namespace {
+// Roughly how many bytes the given Trace will take up once encoded. Close enough to decide when
+// to flush, without having to encode anything.
+size_t estimateEncodedSize(const Trace &trace) {
+  // The field names and numeric fields of each span come to about this much.
+  const size_t span_overhead = 130;
+  size_t size = 0;
+  for (auto &span : *trace) {
+    size += span_overhead + span->type.size() + span->service.size() + span->resource.size() +
+            span->name.size();
+    for (auto &tag : span->meta) {
+      size += tag.first.size() + tag.second.size() + 4;
+    }
+    for (auto &metric : span->metrics) {
+      size += metric.first.size() + 11;
+    }
+  }
+  return size;
+}
+
+AgentWriterOptions withWritePeriod(std::chrono::milliseconds write_period) {
+  AgentWriterOptions options;
+  options.write_period = write_period;
+  return options;
+}
+
+AgentWriterOptions withQueueAndRetries(std::chrono::milliseconds write_period,
+                                       size_t max_queued_traces,
+                                       std::vector<std::chrono::milliseconds> retry_periods) {
+  AgentWriterOptions options = withWritePeriod(write_period);
+  options.max_queued_traces = max_queued_traces;
+  options.retry_periods = retry_periods;
+  return options;
+}
+
+std::unique_ptr<Handle> makeHandle(const AgentWriterOptions &options) {
+#ifdef DD_OPENTRACING_NO_CURL
+  // Built without libcurl, so the native transport is the only one.
+  (void)options;
+  return std::unique_ptr<Handle>{new NativeHandle{}};
+#else
+#ifndef _MSC_VER
+  if (options.native_transport) {
+    return std::unique_ptr<Handle>{new NativeHandle{}};
+  }
+#endif
+  if (options.max_concurrent_requests > 1) {
+    return std::unique_ptr<Handle>{new MultiCurlHandle{options.max_concurrent_requests}};
+  }
+  return std::unique_ptr<Handle>{new CurlHandle{}};
+#endif
+}
+
+// The AgentWriters in the process that haven't stopped, for the fork handlers. Never destroyed,
+// since a fork could happen while static objects are being destroyed.
+struct ForkRegistry {
+  std::mutex mutex;
+  std::set<AgentWriter *> writers;
+};
+
+ForkRegistry &forkRegistry() {
+  static ForkRegistry *registry = new ForkRegistry{};
+  return *registry;
+}
+}  // namespace
+
 AgentWriter::AgentWriter(std::string host, uint32_t port, std::string url,
                          std::chrono::milliseconds write_period,
                          std::shared_ptr<RulesSampler> sampler)
-    : AgentWriter(std::unique_ptr<Handle>{new CurlHandle{}}, write_period,
-                  default_max_queued_traces, default_retry_periods, host, port, url, sampler) {}
+    : AgentWriter(host, port, url, withWritePeriod(write_period), sampler) {}
+
+AgentWriter::AgentWriter(std::string host, uint32_t port, std::string url,
+                         AgentWriterOptions options, std::shared_ptr<RulesSampler> sampler)
+    : AgentWriter(makeHandle(options), [options]() { return makeHandle(options); }, options, host,
+                  port, url, sampler) {}
 
 AgentWriter::AgentWriter(std::unique_ptr<Handle> handle, std::chrono::milliseconds write_period,
                          size_t max_queued_traces,
                          std::vector<std::chrono::milliseconds> retry_periods, std::string host,
                          uint32_t port, std::string url, std::shared_ptr<RulesSampler> sampler)
-    : Writer(sampler),
-      write_period_(write_period),
-      max_queued_traces_(max_queued_traces),
-      retry_periods_(retry_periods) {
+    : AgentWriter(std::move(handle),
+                  withQueueAndRetries(write_period, max_queued_traces, retry_periods), host, port,
+                  url, sampler) {}
+
+AgentWriter::AgentWriter(std::unique_ptr<Handle> handle, AgentWriterOptions options,
+                         std::string host, uint32_t port, std::string url,
+                         std::shared_ptr<RulesSampler> sampler)
+    : AgentWriter(std::move(handle), nullptr, options, host, port, url, sampler) {}
+
+AgentWriter::AgentWriter(std::unique_ptr<Handle> handle, HandleFactory make_handle,
+                         AgentWriterOptions options, std::string host, uint32_t port,
+                         std::string url, std::shared_ptr<RulesSampler> sampler)
+    : Writer(sampler, options.max_payload_bytes, options.max_traces_per_payload),
+      write_period_(options.write_period),
+      max_queued_traces_(options.max_queued_traces),
+      flush_queued_traces_(options.flush_queued_traces),
+      flush_queued_bytes_(options.flush_queued_bytes),
+      retry_periods_(options.retry_periods),
+      max_queued_payloads_(options.max_queued_payloads),
+      replay_period_(retry_periods_.empty() ? write_period_ : retry_periods_.back()),
+      max_consecutive_failures_(options.max_consecutive_failures),
+      min_probe_period_(options.min_probe_period),
+      max_probe_period_(options.max_probe_period),
+      logger_(options.logger),
+      request_errors_(options.logger, options.log_period),
+      traces_(options.max_queued_traces),
+      probe_period_(options.min_probe_period) {
   setUpHandle(handle, host, port, url);
-  startWriting(std::move(handle));
+  if (make_handle != nullptr) {
+    make_handle_ = [this, make_handle, host, port, url]() {
+      auto handle = make_handle();
+      setUpHandle(handle, host, port, url);
+      return handle;
+    };
+  }
+  // The encoder has no traces yet, so this is an empty list of them.
+  probe_ = EncodedPayload{trace_encoder_->headers(), trace_encoder_->payload(), 0};
+  if (!options.spool.directory.empty()) {
+    try {
+      SpoolOptions spool_options = options.spool;
+      spool_options.logger = options.logger;
+      spool_options.log_period = options.log_period;
+      spool_ = std::make_unique<Spool>(spool_options);
+      spooled_ = !spool_->empty();
+    } catch (const std::runtime_error &error) {
+      // Carry on without one.
+      log(LogLevel::error, std::string("Unable to spool traces: ") + error.what());
+    }
+  }
+  handle_ = std::move(handle);
+  registerForkHandlers();
+  // Registered along with starting the threads, so that a fork can't come between the two.
+  ForkRegistry &registry = forkRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  startWriting();
+  registry.writers.insert(this);
 }
 
 void AgentWriter::setUpHandle(std::unique_ptr<Handle> &handle, std::string host, uint32_t port,
@@ -59,26 +186,26 @@ void AgentWriter::setUpHandle(std::unique_ptr<Handle> &handle, std::string host,
         url.substr(0, https_scheme.size()) == https_scheme) {
       std::string agent_uri = url + trace_encoder_->path();
       // http:// or https://
-      auto rcode = handle->setopt(CURLOPT_URL, agent_uri.c_str());
-      if (rcode != CURLE_OK) {
+      auto rcode = handle->setopt(HandleOption::url, agent_uri.c_str());
+      if (rcode != HandleResult::ok) {
         throw std::runtime_error(std::string("Unable to set agent URL: ") +
-                                 curl_easy_strerror(rcode));
+                                 handleResultString(rcode));
       }
       urlopt_set = true;
     } else if (url.substr(0, unix_scheme.size()) == unix_scheme) {
       // unix://
       url = url.substr(unix_scheme.size());
-      auto rcode = handle->setopt(CURLOPT_UNIX_SOCKET_PATH, url.c_str());
-      if (rcode != CURLE_OK) {
+      auto rcode = handle->setopt(HandleOption::unix_socket_path, url.c_str());
+      if (rcode != HandleResult::ok) {
         throw std::runtime_error(std::string("Unable to set unix socket path: ") +
-                                 curl_easy_strerror(rcode));
+                                 handleResultString(rcode));
       }
     } else if (url.substr(0, 1) == "/") {
       // plain file path
-      auto rcode = handle->setopt(CURLOPT_UNIX_SOCKET_PATH, url.c_str());
-      if (rcode != CURLE_OK) {
+      auto rcode = handle->setopt(HandleOption::unix_socket_path, url.c_str());
+      if (rcode != HandleResult::ok) {
         throw std::runtime_error(std::string("Unable to set unix socket path: ") +
-                                 curl_easy_strerror(rcode));
+                                 handleResultString(rcode));
       }
     } else {
       throw std::runtime_error(std::string("Unable to set agent URL: unknown url scheme: " + url));
@@ -87,22 +214,28 @@ void AgentWriter::setUpHandle(std::unique_ptr<Handle> &handle, std::string host,
   if (!urlopt_set) {
     std::string agent_uri =
         agent_protocol + host + ":" + std::to_string(port) + trace_encoder_->path();
-    auto rcode = handle->setopt(CURLOPT_URL, agent_uri.c_str());
-    if (rcode != CURLE_OK) {
+    auto rcode = handle->setopt(HandleOption::url, agent_uri.c_str());
+    if (rcode != HandleResult::ok) {
       throw std::runtime_error(std::string("Unable to set agent URL: ") +
-                               curl_easy_strerror(rcode));
+                               handleResultString(rcode));
     }
   }
-  auto rcode = handle->setopt(CURLOPT_TIMEOUT_MS, default_timeout_ms);
-  if (rcode != CURLE_OK) {
+  auto rcode = handle->setopt(HandleOption::timeout_ms, default_timeout_ms);
+  if (rcode != HandleResult::ok) {
     throw std::runtime_error(std::string("Unable to set agent timeout: ") +
-                             curl_easy_strerror(rcode));
+                             handleResultString(rcode));
   }
 }
 
 AgentWriter::~AgentWriter() { stop(); }
 
 void AgentWriter::stop() {
+  {
+    // Waits for any fork in progress to finish first.
+    ForkRegistry &registry = forkRegistry();
+    std::unique_lock<std::mutex> lock(registry.mutex);
+    registry.writers.erase(this);
+  }
   {
     std::unique_lock<std::mutex> lock(mutex_);
     if (stop_writing_) {
@@ -111,115 +244,530 @@ void AgentWriter::stop() {
     stop_writing_ = true;
   }
   condition_.notify_all();
-  worker_->join();
+  handle_->wakeUp();
+  encoder_->join();
+  transport_->join();
+  handle_.reset();
+  if (spool_ != nullptr) {
+    // Keep the payloads that were waiting to be retried, for whoever uses the spool next.
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto &retry : retries_) {
+      spool_->push(retry.second.payload);
+    }
+    retries_.clear();
+  }
 }
 
 void AgentWriter::write(Trace trace) {
-  std::unique_lock<std::mutex> lock(mutex_);
   if (stop_writing_) {
     return;
   }
-  if (trace_encoder_->pendingTraces() >= max_queued_traces_) {
+  telemetry().traces_written.add();
+  enqueue(QueuedTrace{std::move(trace), std::string{}, 0});
+}
+
+void AgentWriter::writeEncoded(std::string encoded_trace) {
+  if (stop_writing_) {
     return;
   }
-  trace_encoder_->addTrace(std::move(trace));
-}
-
-void AgentWriter::startWriting(std::unique_ptr<Handle> handle) {
-  // Start worker that sends Traces to agent.
-  // We can capture 'this' because destruction of this stops the thread and the lambda.
-  worker_ = std::make_unique<std::thread>(
-      [this](std::unique_ptr<Handle> handle) {
-        size_t num_traces = 0;
-        std::map<std::string, std::string> headers;
-        std::string payload;
-        while (true) {
-          // Encode traces when there are new ones.
-          {
-            // Wait to be told about new traces (or to stop).
-            std::unique_lock<std::mutex> lock(mutex_);
-            condition_.wait_for(lock, write_period_,
-                                [&]() -> bool { return flush_worker_ || stop_writing_; });
-            if (stop_writing_) {
-              return;  // Stop the thread.
-            }
-            num_traces = trace_encoder_->pendingTraces();
-            if (num_traces == 0) {
-              continue;
-            }
-            headers = trace_encoder_->headers();
-            payload = trace_encoder_->payload();
-            trace_encoder_->clearTraces();
-          }  // lock on mutex_ ends.
-          // Send spans, not in critical period.
-          bool success = retryFiniteOnFail(
-              [&]() { return AgentWriter::postTraces(handle, headers, payload); });
-          if (success) {
-            trace_encoder_->handleResponse(handle->getResponse());
-          }
-          // Let thread calling 'flush' know that we're done flushing.
-          {
-            std::unique_lock<std::mutex> lock(mutex_);
-            flush_worker_ = false;
-          }
-          condition_.notify_all();
-        }
-      },
-      std::move(handle));
+  enqueue(QueuedTrace{nullptr, std::move(encoded_trace), 0});
 }
 
-void AgentWriter::flush(std::chrono::milliseconds timeout) try {
-  std::unique_lock<std::mutex> lock(mutex_);
-  flush_worker_ = true;
+void AgentWriter::enqueue(QueuedTrace queued_trace) {
+  if (circuit_open_.load(std::memory_order_relaxed)) {
+    // The agent isn't accepting traces, don't spend anything on this one.
+    dropped_traces_.fetch_add(1, std::memory_order_relaxed);
+    telemetry().traces_dropped.add();
+    return;
+  }
+  // Count the trace before pushing it, so that the encoder_ thread never pops more than have been
+  // counted.
+  size_t queued = queued_traces_.fetch_add(1);
+  if (queued >= max_queued_traces_) {
+    queued_traces_.fetch_sub(1);
+    dropped_traces_.fetch_add(1, std::memory_order_relaxed);
+    telemetry().traces_dropped.add();
+    return;
+  }
+  size_t size = queued_trace.trace != nullptr ? estimateEncodedSize(queued_trace.trace)
+                                              : queued_trace.encoded.size();
+  size_t bytes = queued_bytes_.fetch_add(size) + size;
+  queued_trace.size = size;
+  if (!traces_.tryPush(queued_trace)) {
+    // Can't happen while queued_traces_ is within the queue's capacity, but just in case.
+    queued_bytes_.fetch_sub(size);
+    queued_traces_.fetch_sub(1);
+    dropped_traces_.fetch_add(1, std::memory_order_relaxed);
+    telemetry().traces_dropped.add();
+    return;
+  }
+  // The encoder_ thread is asleep until there's something to do. Only the first trace, and the
+  // one that takes the queue past a flush limit, need to wake it.
+  bool first = queued == 0;
+  bool flush = queued + 1 == flush_queued_traces_ ||
+               (bytes >= flush_queued_bytes_ && bytes - size < flush_queued_bytes_);
+  if (!first && !flush) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (first) {
+      oldest_queued_ = std::chrono::steady_clock::now();
+    }
+    if (flush) {
+      flush_worker_ = true;
+    }
+  }
   condition_.notify_all();
-  // Wait until flush is complete.
-  condition_.wait_for(lock, timeout, [&]() -> bool { return !flush_worker_ || stop_writing_; });
-} catch (const std::bad_alloc &) {
 }
 
-bool AgentWriter::retryFiniteOnFail(std::function<bool()> f) const {
-  for (std::chrono::milliseconds backoff : retry_periods_) {
-    if (f()) {
-      return true;
+uint64_t AgentWriter::droppedTraces() const { return dropped_traces_.load(); }
+
+void AgentWriter::startWriting() {
+  // We can capture 'this' because destruction of this stops the threads and the lambdas.
+  encoder_ = std::make_unique<std::thread>([this]() { runEncoder(); });
+  transport_ = std::make_unique<std::thread>([this]() { runTransport(); });
+}
+
+void AgentWriter::runEncoder() {
+  std::deque<QueuedTrace> traces;
+  while (true) {
+    {
+      // Wait for there to be traces (or to stop), then for them to be due to be sent.
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(
+          lock, [&]() -> bool {
+            return flush_worker_ || stop_writing_ || forking_ || queued_traces_ > 0;
+          });
+      condition_.wait_until(lock, oldest_queued_ + write_period_,
+                            [&]() -> bool { return flush_worker_ || stop_writing_ || forking_; });
+      if (stop_writing_ || forking_) {
+        return;  // Stop the thread.
+      }
+      // The flush is taken care of by taking every trace queued so far, even if there are none.
+      flush_worker_ = false;
+      QueuedTrace queued_trace;
+      size_t bytes = 0;
+      while (traces_.tryPop(queued_trace)) {
+        bytes += queued_trace.size;
+        traces.push_back(std::move(queued_trace));
+      }
+      queued_bytes_.fetch_sub(bytes);
+      if (queued_traces_.fetch_sub(traces.size()) > traces.size()) {
+        // Some traces are still being pushed. They'll be in the next batch.
+        oldest_queued_ = std::chrono::steady_clock::now();
+      }
+      if (circuit_open_ && !traces.empty()) {
+        // They were queued before the circuit opened. Nothing but probes is sent until it closes,
+        // so don't spend anything encoding them either.
+        dropped_traces_.fetch_add(traces.size(), std::memory_order_relaxed);
+        telemetry().traces_dropped.add(traces.size());
+        traces.clear();
+      }
+      if (traces.empty()) {
+        condition_.notify_all();
+        continue;
+      }
+      encoding_ = true;
+    }  // lock on mutex_ ends.
+    // Encode traces, not in critical period. Only this thread uses the encoder's trace buffer.
+    auto encode_start = std::chrono::steady_clock::now();
+    for (auto &trace : traces) {
+      if (trace.trace != nullptr) {
+        trace_encoder_->addTrace(std::move(trace.trace));
+      } else {
+        trace_encoder_->addEncodedTrace(std::move(trace.encoded));
+      }
+    }
+    traces.clear();
+    size_t too_large = 0;
+    std::vector<EncodedPayload> payloads = trace_encoder_->payloads(too_large);
+    trace_encoder_->clearTraces();
+    telemetry().encode_time.record(std::chrono::steady_clock::now() - encode_start);
+    if (too_large > 0) {
+      request_errors_.Log(LogLevel::error, "Dropping " + std::to_string(too_large) +
+                                               " traces, which are too large to fit in a payload");
+      dropped_traces_.fetch_add(too_large, std::memory_order_relaxed);
+      telemetry().traces_dropped.add(too_large);
     }
     {
       std::unique_lock<std::mutex> lock(mutex_);
-      condition_.wait_for(lock, backoff, [&]() -> bool { return stop_writing_; });
-      if (stop_writing_) {
-        return false;
+      for (auto &payload : payloads) {
+        if (payloads_.size() >= max_queued_payloads_) {
+          // The agent isn't keeping up. Newer traces are more useful than older ones.
+          request_errors_.Log(LogLevel::error,
+                              "Dropping " + std::to_string(payloads_.front().num_traces) +
+                                  " traces, the agent is not accepting them fast enough");
+          dropped_traces_.fetch_add(payloads_.front().num_traces, std::memory_order_relaxed);
+          telemetry().traces_dropped.add(payloads_.front().num_traces);
+          payloads_.pop_front();
+        }
+        payloads_.push_back(std::move(payload));
       }
+      encoding_ = false;
     }
+    condition_.notify_all();
+    handle_->wakeUp();  // In case the transport_ thread is busy waiting on requests in flight.
   }
-  return f();  // Final try after final sleep.
 }
 
-bool AgentWriter::postTraces(std::unique_ptr<Handle> &handle,
-                             std::map<std::string, std::string> headers, std::string payload) try {
-  handle->setHeaders(headers);
+void AgentWriter::runTransport() {
+  std::vector<Request> requests;
+  bool replay = false;
+  while (true) {
+    std::chrono::milliseconds run_timeout = write_period_;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto retry_due = [&]() -> bool {
+        return !retries_.empty() && retries_.begin()->first <= std::chrono::steady_clock::now();
+      };
+      // Spooled payloads are only sent when there's nothing newer waiting.
+      auto replay_due = [&]() -> bool {
+        return spooled_ && !replaying_ && payloads_.empty() &&
+               next_replay_ <= std::chrono::steady_clock::now();
+      };
+      // While the circuit is open, only probes are sent.
+      auto probe_due = [&]() -> bool {
+        return !probing_ && next_probe_ <= std::chrono::steady_clock::now();
+      };
+      auto can_send = [&]() -> bool {
+        if (in_flight_ >= handle_->maxInFlight()) {
+          return false;
+        }
+        if (circuit_open_) {
+          return probe_due();
+        }
+        return !payloads_.empty() || retry_due() || replay_due();
+      };
+      // When the next retry, replay or probe is due, if any.
+      auto next_due = [&]() -> std::chrono::steady_clock::time_point {
+        auto due = std::chrono::steady_clock::time_point::max();
+        if (circuit_open_) {
+          return probing_ ? due : next_probe_;
+        }
+        if (!retries_.empty()) {
+          due = retries_.begin()->first;
+        }
+        if (spooled_ && !replaying_) {
+          due = std::min(due, next_replay_);
+        }
+        return due;
+      };
+      if (in_flight_ == 0) {
+        // Nothing is in flight, so wait here for a payload to send (or to stop).
+        auto due = next_due();
+        auto woken = [&]() -> bool { return can_send() || stop_writing_ || forking_; };
+        if (due == std::chrono::steady_clock::time_point::max()) {
+          condition_.wait(lock, woken);
+        } else {
+          condition_.wait_until(lock, due, woken);
+        }
+      }
+      if (stop_writing_ || forking_) {
+        return;  // Stop the thread.
+      }
+      if (circuit_open_) {
+        if (in_flight_ < handle_->maxInFlight() && probe_due()) {
+          requests.push_back({probe_, 0, Source::probe});
+          probing_ = true;
+          in_flight_++;
+        }
+      } else {
+        while (in_flight_ < handle_->maxInFlight() && retry_due()) {
+          requests.push_back(std::move(retries_.begin()->second));
+          retries_.erase(retries_.begin());
+          in_flight_++;
+        }
+        while (in_flight_ < handle_->maxInFlight() && !payloads_.empty()) {
+          requests.push_back({std::move(payloads_.front()), 0, Source::queue});
+          payloads_.pop_front();
+          in_flight_++;
+        }
+        replay = in_flight_ < handle_->maxInFlight() && replay_due();
+        if (replay) {
+          replaying_ = true;
+          in_flight_++;
+        }
+      }
+      auto due = next_due();
+      if (due != std::chrono::steady_clock::time_point::max()) {
+        run_timeout = std::min(run_timeout, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                due - std::chrono::steady_clock::now()));
+      }
+    }  // lock on mutex_ ends.
+    if (replay) {
+      replay = false;
+      // Only this thread uses spool_, so it's read outside the lock.
+      Request request{EncodedPayload{}, 0, Source::spool};
+      bool found = false;
+      try {
+        found = spool_->peek(request.payload);
+      } catch (const std::bad_alloc &) {
+      }
+      if (found) {
+        requests.push_back(std::move(request));
+      } else {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          replaying_ = false;
+          spooled_ = !spool_->empty();
+          next_replay_ = std::chrono::steady_clock::now() + replay_period_;
+          in_flight_--;
+        }
+        condition_.notify_all();
+      }
+    }
+    // Send spans, not in critical period.
+    for (auto &request : requests) {
+      send(std::move(request));
+    }
+    requests.clear();
+    if (handle_->inFlight() > 0) {
+      handle_->run(std::max(run_timeout, std::chrono::milliseconds(0)));
+    }
+  }
+}
 
-  // We have to set the size manually, because msgpack uses null characters.
-  CURLcode rcode = handle->setopt(CURLOPT_POSTFIELDSIZE, payload.size());
-  if (rcode != CURLE_OK) {
-    std::cerr << "Error setting agent request size: " << curl_easy_strerror(rcode) << std::endl;
-    return false;
+void AgentWriter::send(Request request) {
+  // Shared with the callback, which owns the payload until the request is complete.
+  struct SharedRequest {
+    Request request;
+    bool completed;
+  };
+  Source source = request.source;
+  std::shared_ptr<SharedRequest> shared;
+  try {
+    shared = std::make_shared<SharedRequest>(SharedRequest{std::move(request), false});
+    auto start = std::chrono::steady_clock::now();
+    auto callback = [this, shared, start](HandleResult rcode, const std::string &error,
+                                          const std::string &response) {
+      shared->completed = true;
+      Request &request = shared->request;
+      Telemetry &counts = telemetry();
+      counts.request_latency.record(std::chrono::steady_clock::now() - start);
+      if (rcode == HandleResult::ok) {
+        trace_encoder_->handleResponse(response);
+        if (request.source != Source::probe) {
+          counts.traces_sent.add(request.payload.num_traces);
+          counts.payloads_sent.add();
+          counts.payload_bytes.add(request.payload.body.size());
+        }
+      } else {
+        request_errors_.Log(LogLevel::error, error);
+        counts.requests_failed.add();
+      }
+      // A spooled payload isn't retried, it stays at the front of the spool until it's sent: until
+      // the agent responds 2xx, which is the only response that's ok. Any other payload is spooled
+      // once it's out of retries.
+      size_t failures = request.failures;
+      bool retry = rcode != HandleResult::ok && request.source == Source::queue &&
+                   failures < retry_periods_.size() && !stop_writing_;
+      if (retry) {
+        counts.retries.add();
+      }
+      if (rcode == HandleResult::ok && request.source == Source::spool) {
+        spool_->pop();
+      } else if (rcode != HandleResult::ok && request.source == Source::queue && !retry) {
+        if (spool_ == nullptr || !spool_->push(request.payload)) {
+          dropped_traces_.fetch_add(request.payload.num_traces, std::memory_order_relaxed);
+          counts.traces_dropped.add(request.payload.num_traces);
+        }
+      }
+      bool spooled = spool_ != nullptr && !spool_->empty();
+      bool opened = false;
+      bool closed = false;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        in_flight_--;
+        if (request.source == Source::spool) {
+          replaying_ = false;
+        } else if (request.source == Source::probe) {
+          probing_ = false;
+        }
+        spooled_ = spooled;
+        if (rcode == HandleResult::ok) {
+          consecutive_failures_ = 0;
+          closed = circuit_open_;
+          circuit_open_ = false;
+          // The agent accepting any request is the cue to send what's been spooled.
+          next_replay_ = std::chrono::steady_clock::time_point{};
+        } else {
+          consecutive_failures_++;
+          next_replay_ = now + replay_period_;
+          if (request.source == Source::probe) {
+            probe_period_ = std::min(probe_period_ * 2, max_probe_period_);
+            next_probe_ = now + probe_period_;
+          } else if (!circuit_open_ && max_consecutive_failures_ > 0 &&
+                     consecutive_failures_ >= max_consecutive_failures_) {
+            opened = true;
+            circuit_open_ = true;
+            probe_period_ = min_probe_period_;
+            next_probe_ = now + probe_period_;
+          }
+        }
+        if (retry) {
+          request.failures++;
+          retries_.emplace(now + retry_periods_[failures], std::move(request));
+        }
+      }
+      if (opened) {
+        log(LogLevel::error, "Unable to send traces to the agent after " +
+                                 std::to_string(max_consecutive_failures_) +
+                                 " attempts, dropping traces until it responds");
+      } else if (closed) {
+        log(LogLevel::info, "The agent is responding again, sending traces");
+      }
+      // Let thread calling 'flush' know if we're done flushing.
+      condition_.notify_all();
+    };
+    handle_->post(shared->request.payload.headers, shared->request.payload.body, callback);
+  } catch (const std::bad_alloc &) {
+    // Drop spans, but live to fight another day.
+    if (shared == nullptr || !shared->completed) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        in_flight_--;
+        if (source == Source::spool) {
+          replaying_ = false;
+        } else if (source == Source::probe) {
+          probing_ = false;
+        }
+      }
+      condition_.notify_all();
+    }
   }
+}
 
-  rcode = handle->setopt(CURLOPT_POSTFIELDS, payload.data());
-  if (rcode != CURLE_OK) {
-    std::cerr << "Error setting agent request body: " << curl_easy_strerror(rcode) << std::endl;
+bool AgentWriter::isIdle() const {
+  if (flush_worker_ || queued_traces_ > 0 || encoding_ || in_flight_ > 0) {
     return false;
   }
+  if (circuit_open_) {
+    return true;  // Nothing more is sent until the circuit closes.
+  }
+  return payloads_.empty() && retries_.empty() &&
+         (!spooled_ || next_replay_ > std::chrono::steady_clock::now());
+}
 
-  rcode = handle->perform();
-  if (rcode != CURLE_OK) {
-    std::cerr << "Error sending traces to agent: " << curl_easy_strerror(rcode) << std::endl
-              << handle->getError() << std::endl;
-    return false;
+void AgentWriter::log(LogLevel level, const std::string &message) const {
+  if (logger_ != nullptr) {
+    logger_->Log(level, message);
+  } else {
+    std::cerr << message << std::endl;
+  }
+}
+
+void AgentWriter::registerForkHandlers() {
+#ifdef _MSC_VER
+// When compiling with MSVC, pthreads are not used.
+#else
+  static std::once_flag fork_handlers;
+  std::call_once(fork_handlers,
+                 []() { pthread_atfork(prepareFork, afterForkInParent, afterForkInChild); });
+#endif
+}
+
+void AgentWriter::prepareFork() {
+  // Held until after the fork, so that no AgentWriter starts or stops meanwhile.
+  ForkRegistry &registry = forkRegistry();
+  registry.mutex.lock();
+  for (AgentWriter *writer : registry.writers) {
+    writer->pauseForFork();
+  }
+}
+
+void AgentWriter::afterForkInParent() {
+  ForkRegistry &registry = forkRegistry();
+  for (AgentWriter *writer : registry.writers) {
+    writer->resumeAfterFork(false);
+  }
+  registry.mutex.unlock();
+}
+
+void AgentWriter::afterForkInChild() {
+  ForkRegistry &registry = forkRegistry();
+  for (AgentWriter *writer : registry.writers) {
+    writer->resumeAfterFork(true);
+  }
+  registry.mutex.unlock();
+}
+
+void AgentWriter::pauseForFork() {
+  if (stop_writing_) {
+    return;  // Only if it couldn't carry on after an earlier fork, see resumeAfterFork().
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    forking_ = true;
+  }
+  condition_.notify_all();
+  handle_->wakeUp();
+  encoder_->join();
+  transport_->join();
+  // Held until after the fork, so that no other thread is partway through changing anything.
+  mutex_.lock();
+}
+
+void AgentWriter::resumeAfterFork(bool in_child) {
+  if (stop_writing_) {
+    return;
+  }
+  if (in_child) {
+    // Only the thread that called fork() carries on in the child, so mutex_ and condition_ may
+    // still count threads of the parent's as waiting on them (in flush(), say). Rather than unlock
+    // them, start them afresh.
+    new (&mutex_) std::mutex{};
+    new (&condition_) std::condition_variable{};
+    // Everything the child inherited that was waiting to be sent is left to the parent. A Trace
+    // that was partway through being pushed when the parent forked would never finish being
+    // pushed, so the queue has to be cleared rather than drained.
+    traces_.clear();
+    queued_traces_ = 0;
+    queued_bytes_ = 0;
+    payloads_.clear();
+    retries_.clear();
+    flush_worker_ = false;
+    spool_.reset();
+    spooled_ = false;
+    if (make_handle_ != nullptr) {
+      // The parent's Handle has the parent's connections and requests in flight. Destroying it
+      // could disturb them (by shutting down a TLS connection, say), so it's abandoned instead.
+      handle_.release();
+      try {
+        handle_ = make_handle_();
+      } catch (const std::runtime_error &error) {
+        log(LogLevel::error,
+            std::string("Unable to send traces after fork(), dropping them: ") + error.what());
+        stop_writing_ = true;
+        return;
+      }
+    } else if (handle_->inFlight() > 0) {
+      // The Handle was given to the constructor, so there's no other to be had, and this one's
+      // requests would complete in the child as well as the parent.
+      log(LogLevel::error,
+          "Unable to send traces after fork(), dropping them: requests were in flight");
+      stop_writing_ = true;
+      return;
+    }
+    in_flight_ = 0;
+    replaying_ = false;
+    probing_ = false;
+    forking_ = false;
+  } else {
+    forking_ = false;
+    mutex_.unlock();
   }
-  return true;
+  startWriting();
+}
+
+void AgentWriter::flush(std::chrono::milliseconds timeout) try {
+  std::unique_lock<std::mutex> lock(mutex_);
+  flush_worker_ = true;
+  condition_.notify_all();
+  // Wait until flush is complete.
+  condition_.wait_for(lock, timeout, [&]() -> bool { return isIdle() || stop_writing_; });
 } catch (const std::bad_alloc &) {
-  // Drop spans, but live to fight another day.
-  return true;  // Don't attempt to retry.
 }
 
 }  // namespace opentracing
@@ -1,18 +1,22 @@
 #ifndef DD_OPENTRACING_AGENT_WRITER_H
 #define DD_OPENTRACING_AGENT_WRITER_H
 
-#include <curl/curl.h>
-
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <thread>
 #include <vector>
 
+#include "encoder.h"
+#include "logger.h"
+#include "mpsc_queue.h"
 #include "sample.h"
+#include "spool.h"
 #include "writer.h"
 
 namespace datadog {
@@ -20,24 +24,94 @@ namespace opentracing {
 
 class Handle;
 
+// Configuration for an AgentWriter. The defaults are suitable for most applications.
+struct AgentWriterOptions {
+  // The longest a Trace waits to be sent, unless a flush is triggered sooner by one of the limits
+  // below. While no Traces are waiting, the writer sleeps.
+  std::chrono::milliseconds write_period = std::chrono::seconds(1);
+  // Traces written while this many are already waiting to be sent are dropped.
+  size_t max_queued_traces = 7000;
+  // A flush is triggered as soon as this many Traces, or this many bytes of them (estimated), are
+  // waiting to be sent. So a burst of Traces is sent straight away instead of sitting in memory.
+  size_t flush_queued_traces = 1000;
+  size_t flush_queued_bytes = 4 * 1024 * 1024;
+  // How long to wait before retrying each time. If empty, only try once. Retries are scheduled
+  // rather than waited for, so a payload waiting to be retried doesn't hold up the others. Any
+  // more than a couple of retries and the agent won't accept the traces anyway:
+  // write_period 1s + timeout 2s + (retry & timeout) 2.5s + (retry and timeout) 4.5s = 10s.
+  std::vector<std::chrono::milliseconds> retry_periods{std::chrono::milliseconds(500),
+                                                       std::chrono::milliseconds(2500)};
+  // Limits on the size of each request sent to the agent. A flush sends as many requests as it
+  // takes to stay under both limits, and each request is retried independently. A trace larger
+  // than max_payload_bytes is dropped, and a max_traces_per_payload of 0 is taken as 1.
+  size_t max_payload_bytes = AgentHttpEncoder::default_max_payload_bytes;
+  size_t max_traces_per_payload = AgentHttpEncoder::default_max_traces_per_payload;
+  // Encoded payloads wait in a queue of this size to be sent. If the agent is slow to accept them
+  // the queue fills, and the oldest payload is dropped to make room for each new one.
+  size_t max_queued_payloads = 16;
+  // How many requests to the agent may be in flight at once. If more than one, requests are made
+  // using curl's multi interface. Only used when the AgentWriter creates its own Handle.
+  size_t max_concurrent_requests = 1;
+  // If true, talks to the agent with a NativeHandle, one request at a time over a persistent
+  // connection, instead of using curl. Only used when the AgentWriter creates its own Handle.
+  // Builds without libcurl (with DD_OPENTRACING_NO_CURL defined) always use a NativeHandle, and
+  // MSVC builds, which don't have one, ignore this.
+  bool native_transport = false;
+  // Where to keep payloads that still fail after every retry, or that are waiting to be retried
+  // when the writer stops, instead of dropping them. They're sent, oldest first, once the agent
+  // accepts a request again. If spool.directory is empty, there's no spool. Its logger and
+  // log_period are set to these options' own.
+  SpoolOptions spool;
+  // After this many requests to the agent fail in a row, the writer stops sending traces (the
+  // circuit is open) until a probe, a request with no traces in it, succeeds. A request fails if
+  // it can't be made, or the agent responds with a status other than 2xx. Meanwhile traces are
+  // dropped, as they're written or before they're encoded, and those already encoded wait. Zero
+  // means never.
+  size_t max_consecutive_failures = 5;
+  // How long to wait before the first probe. The wait doubles after each probe that fails, up to
+  // max_probe_period.
+  std::chrono::milliseconds min_probe_period = std::chrono::seconds(1);
+  std::chrono::milliseconds max_probe_period = std::chrono::seconds(60);
+  // Where errors sending to the agent are logged, at most once per log_period. If nullptr, they go
+  // to std::cerr.
+  std::shared_ptr<const Logger> logger;
+  std::chrono::milliseconds log_period = std::chrono::seconds(60);
+};
+
 // A Writer that sends Traces (collections of Spans) to a Datadog agent.
+//
+// An AgentWriter keeps working across fork(), so that it can be created before a server forks
+// its workers. Its threads are stopped before the fork and started again after it, in the parent
+// and the child process. The child gets a new Handle (unless the Handle was given to the
+// constructor, in which case the child stops writing if that Handle had requests in flight), and
+// starts with nothing to send: the Traces and payloads it inherits are left to the parent, so
+// that they're not sent twice, and so is the spool.
 class AgentWriter : public Writer {
  public:
-  // Creates an AgentWriter that uses curl to send Traces to a Datadog agent. May throw a
-  // runtime_exception.
+  // Creates an AgentWriter that uses curl, or a NativeHandle, to send Traces to a Datadog agent.
+  // May throw a runtime_exception.
   AgentWriter(std::string host, uint32_t port, std::string unix_socket,
               std::chrono::milliseconds write_period, std::shared_ptr<RulesSampler> sampler);
 
+  AgentWriter(std::string host, uint32_t port, std::string unix_socket, AgentWriterOptions options,
+              std::shared_ptr<RulesSampler> sampler);
+
   AgentWriter(std::unique_ptr<Handle> handle, std::chrono::milliseconds write_period,
               size_t max_queued_traces, std::vector<std::chrono::milliseconds> retry_periods,
               std::string host, uint32_t port, std::string unix_socket,
               std::shared_ptr<RulesSampler> sampler);
 
+  AgentWriter(std::unique_ptr<Handle> handle, AgentWriterOptions options, std::string host,
+              uint32_t port, std::string unix_socket, std::shared_ptr<RulesSampler> sampler);
+
   // Does not flush on destruction, buffered traces may be lost. Stops all threads.
   ~AgentWriter() override;
 
   void write(Trace trace) override;
 
+  // Writes a trace that's already been encoded, by AgentHttpEncoder::encodeTrace().
+  void writeEncoded(std::string encoded_trace);
+
   // Send all buffered Traces to the destination now. Will block until sending is complete, or
   // timeout passes.
   void flush(std::chrono::milliseconds timeout) override;
@@ -45,46 +119,167 @@ class AgentWriter : public Writer {
   // Permanently stops writing Traces. Calls to write() and flush() will do nothing.
   void stop();
 
+  // The number of Traces dropped so far: because too many were already waiting to be sent, because
+  // the circuit was open, because they were too large to send, or because they couldn't be sent
+  // (or spooled) after every retry.
+  uint64_t droppedTraces() const;
+
+  // Registers the pthread_atfork handlers that keep AgentWriters working across fork(), if they
+  // haven't been already. Anything whose own fork handlers use an AgentWriter should call this
+  // before registering them, so that it's paused before the AgentWriter, and resumed after it.
+  static void registerForkHandlers();
+
   // Default value of `max_queued_traces` in the constructor overload without
   // that parameter. This implementation detail is exposed for use in the unit
   // test.
   static const size_t default_max_queued_traces = 7000;
 
  private:
-  // Initialises the curl handle. May throw a runtime_exception.
+  using HandleFactory = std::function<std::unique_ptr<Handle>()>;
+
+  // If make_handle isn't nullptr, it makes the Handle for a child process after a fork.
+  AgentWriter(std::unique_ptr<Handle> handle, HandleFactory make_handle,
+              AgentWriterOptions options, std::string host, uint32_t port, std::string unix_socket,
+              std::shared_ptr<RulesSampler> sampler);
+
+  // Initialises the handle. May throw a runtime_exception.
   void setUpHandle(std::unique_ptr<Handle> &handle, std::string host, uint32_t port,
                    std::string unix_socket);
 
-  // Starts asynchronously writing traces. They will be written periodically (set by write_period_)
-  // or when flush() is called manually.
-  void startWriting(std::unique_ptr<Handle> handle);
-  // Posts the given Traces to the Agent. Returns true if it succeeds, otherwise false.
-  static bool postTraces(std::unique_ptr<Handle> &handle,
-                         std::map<std::string, std::string> headers, std::string payload);
-  // Retries the given function a finite number of times according to retry_periods_. Retries when
-  // f() returns false.
-  bool retryFiniteOnFail(std::function<bool()> f) const;
-
-  // How often to send Traces.
+  // Starts asynchronously writing traces, using handle_. They will be written when the oldest has
+  // waited for write_period_, when enough are queued, or when flush() is called manually.
+  void startWriting();
+  // Body of the encoder_ thread.
+  void runEncoder();
+  // Body of the transport_ thread.
+  void runTransport();
+  // Returns true if every trace given to the encoder_ thread has been sent (or dropped or
+  // spooled), and no spooled payload is due to be sent. Expects mutex_ to be locked already.
+  bool isIdle() const;
+  // Logs the message to logger_, or std::cerr if there isn't one.
+  void log(LogLevel level, const std::string &message) const;
+
+  // The pthread_atfork handlers, for every AgentWriter in the process. The first is called before
+  // fork(), and the others after it in the parent and child processes.
+  static void prepareFork();
+  static void afterForkInParent();
+  static void afterForkInChild();
+  // Stops the threads and locks mutex_, so that the fork copies the AgentWriter in a consistent
+  // state.
+  void pauseForFork();
+  // Unlocks mutex_ and starts the threads again. In the child, first starts afresh as described
+  // above.
+  void resumeAfterFork(bool in_child);
+  // Where the payload of a Request came from: the payloads_ queue, spool_, or probe_.
+  enum class Source { queue, spool, probe };
+  // A payload to send to the agent, how many times sending it has failed so far, and where it came
+  // from.
+  struct Request {
+    EncodedPayload payload;
+    size_t failures;
+    Source source;
+  };
+  // Posts the given Request to the agent. If it fails, schedules a retry according to
+  // retry_periods_. Called only from the transport_ thread.
+  void send(Request request);
+
+  // The longest a Trace waits to be sent.
   const std::chrono::milliseconds write_period_;
   const size_t max_queued_traces_;
+  const size_t flush_queued_traces_;
+  const size_t flush_queued_bytes_;
   // How long to wait before retrying each time. If empty, only try once.
   const std::vector<std::chrono::milliseconds> retry_periods_;
+  const size_t max_queued_payloads_;
+  // How long to wait between tries at sending a spooled payload while the agent isn't accepting
+  // requests.
+  const std::chrono::milliseconds replay_period_;
+  const size_t max_consecutive_failures_;
+  const std::chrono::milliseconds min_probe_period_;
+  const std::chrono::milliseconds max_probe_period_;
+  // A payload of no traces, sent to find out whether the agent is back.
+  EncodedPayload probe_;
+  // Makes a Handle, already set up, for use in a child process. May be nullptr, in which case the
+  // child uses the parent's.
+  HandleFactory make_handle_;
+  // May be nullptr, see log().
+  const std::shared_ptr<const Logger> logger_;
+  // For the errors that keep happening while the agent is unavailable.
+  RateLimitedLogger request_errors_;
 
-  // The thread on which traces are encoded and send to the agent. Receives traces on the
-  // traces_ queue as notified by condition_. Encodes traces to buffer_ and sends to the
-  // agent.
-  std::unique_ptr<std::thread> worker_ = nullptr;
-  // Locks access to the traces_ queue and the stop_writing_ and flush_worker_ signals.
+  // Writing happens in two stages, so that a slow agent doesn't hold up encoding (and so cause
+  // traces to be dropped from a full traces_ queue).
+  // The thread on which traces are encoded. Receives traces on the traces_ queue as notified by
+  // condition_, encodes them into payloads and puts them on the payloads_ queue.
+  std::unique_ptr<std::thread> encoder_ = nullptr;
+  // The thread on which payloads are sent to the agent. Receives payloads on the payloads_ queue
+  // as notified by condition_, and sends them using handle_, as many at once as it allows.
+  std::unique_ptr<std::thread> transport_ = nullptr;
+  // Used only by the transport_ thread, except for wakeUp(). Destroyed when the threads stop.
+  std::unique_ptr<Handle> handle_;
+  // Payloads that couldn't be sent. Used only by the transport_ thread (and by stop(), once it has
+  // stopped). May be nullptr.
+  std::unique_ptr<Spool> spool_;
+  // Locks access to the payloads_ and retries_ queues, the encoding_ and in_flight_ states, and
+  // the stop_writing_ and flush_worker_ signals.
   mutable std::mutex mutex_;
-  // Notifies worker thread when there are new traces in the queue or it should stop.
+  // Notifies the threads when there is new work for them or they should stop, and flush() when
+  // they're done.
   mutable std::condition_variable condition_;
+  // A Trace waiting to be encoded (or, if trace is nullptr, one that already has been), and
+  // roughly how large it'll be once it is.
+  struct QueuedTrace {
+    Trace trace;
+    std::string encoded;
+    size_t size;
+  };
+  // Queues the trace for the encoder_ thread, unless it's to be dropped.
+  void enqueue(QueuedTrace queued_trace);
+  // Traces waiting to be encoded. write() pushes to it without taking mutex_, and only the
+  // encoder_ thread pops from it.
+  MpscQueue<QueuedTrace> traces_;
+  // How many Traces are in (or being pushed to) traces_, and how many bytes they come to. write()
+  // counts each Trace before pushing it, so these never undercount.
+  std::atomic<size_t> queued_traces_{0};
+  std::atomic<size_t> queued_bytes_{0};
+  // Traces dropped because traces_ was full.
+  std::atomic<uint64_t> dropped_traces_{0};
+  // When the oldest Trace in traces_ was written. Locked by mutex_.
+  std::chrono::steady_clock::time_point oldest_queued_;
+  // Payloads waiting to be sent. Locked by mutex_.
+  std::deque<EncodedPayload> payloads_;
+  // True while the encoder_ thread is encoding traces it has taken from traces_. Locked by mutex_.
+  bool encoding_ = false;
+  // Payloads that failed to send, by when they're next to be tried. Locked by mutex_.
+  std::multimap<std::chrono::steady_clock::time_point, Request> retries_;
+  // The number of requests the transport_ thread has made that haven't completed yet. Locked by
+  // mutex_.
+  size_t in_flight_ = 0;
+  // Whether spool_ has payloads in it, whether one of them is being sent, and when to next try
+  // sending one. They're sent one at a time, straight away while the agent is accepting requests,
+  // otherwise no more often than the last of the retry_periods_. Locked by mutex_.
+  bool spooled_ = false;
+  bool replaying_ = false;
+  std::chrono::steady_clock::time_point next_replay_;
+  // The number of requests that have failed since the last one that succeeded. Locked by mutex_.
+  size_t consecutive_failures_ = 0;
+  // While the circuit is open, nothing is sent but probe_, one at a time, and write() and the
+  // encoder_ thread drop traces. Only set with mutex_ locked, but also read by write() without it.
+  std::atomic<bool> circuit_open_{false};
+  // Whether a probe is in flight, when the next is due, and how long to wait after it if it fails.
+  // Locked by mutex_.
+  bool probing_ = false;
+  std::chrono::steady_clock::time_point next_probe_;
+  std::chrono::milliseconds probe_period_;
   // These two bools, stop_writing_ and flush_worker_, act as signals. They are the predicates on
   // which the condition_ variable acts.
-  // If set to true, stops worker. Locked by mutex_;
-  bool stop_writing_ = false;
-  // If set to true, flushes worker (which sets it false again). Locked by mutex_;
+  // If set to true, stops both threads. Only set with mutex_ locked, but also read by write()
+  // without it.
+  std::atomic<bool> stop_writing_{false};
+  // If set to true, flushes the encoder_ thread (which sets it false again). Locked by mutex_;
   bool flush_worker_ = false;
+  // If set to true, stops both threads so that the process can fork. Locked by mutex_.
+  bool forking_ = false;
 };
 
 }  // namespace opentracing
@@ -0,0 +1,279 @@
+#include "collector_writer.h"
+
+#ifndef _MSC_VER
+#include <pthread.h>
+#endif
+
+#include <new>
+#include <set>
+
+#include "encoder.h"
+#include "sample.h"
+#include "span.h"
+#include "telemetry.h"
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+// How many traces the collector takes from the ring at a time.
+const size_t traces_per_pop = 1000;
+
+// Gives the sampling rates from the agent to the process's sampler, and shares them with the other
+// processes through the ring.
+class SharingSampler : public RulesSampler {
+ public:
+  SharingSampler(std::shared_ptr<RulesSampler> sampler, TraceRing &ring)
+      : sampler_(sampler), ring_(ring) {}
+
+  void updatePrioritySampler(json config) override {
+    if (sampler_ != nullptr) {
+      sampler_->updatePrioritySampler(config);
+    }
+    ring_.setSamplingRates(config.dump());
+  }
+
+ private:
+  std::shared_ptr<RulesSampler> sampler_;
+  TraceRing &ring_;
+};
+
+// The CollectorWriters in the process that haven't stopped, for the fork handlers.
+struct ForkRegistry {
+  std::mutex mutex;
+  std::set<CollectorWriter *> writers;
+};
+
+ForkRegistry &forkRegistry() {
+  static ForkRegistry *registry = new ForkRegistry{};
+  return *registry;
+}
+}  // namespace
+
+CollectorWriter::CollectorWriter(std::string host, uint32_t port, std::string url,
+                                 CollectorWriterOptions options,
+                                 std::shared_ptr<RulesSampler> sampler)
+    : CollectorWriter(
+          [host, port, url, options](std::shared_ptr<RulesSampler> sampler) {
+            return std::unique_ptr<AgentWriter>{
+                new AgentWriter(host, port, url, options.agent_writer, sampler)};
+          },
+          options, sampler) {}
+
+CollectorWriter::CollectorWriter(AgentWriterFactory make_agent_writer,
+                                 CollectorWriterOptions options,
+                                 std::shared_ptr<RulesSampler> sampler)
+    : Writer(sampler),
+      make_agent_writer_(make_agent_writer),
+      collect_period_(options.collect_period),
+      sampler_(sampler),
+      errors_(options.agent_writer.logger, options.agent_writer.log_period),
+      ring_(options.name, options.ring_bytes) {
+#ifndef _MSC_VER
+  // After AgentWriter's, so that the collector_ thread is paused before any AgentWriter it uses,
+  // and resumed after.
+  AgentWriter::registerForkHandlers();
+  static std::once_flag fork_handlers;
+  std::call_once(fork_handlers,
+                 []() { pthread_atfork(prepareFork, afterForkInParent, afterForkInChild); });
+#endif
+  ForkRegistry &registry = forkRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  collector_ = std::thread([this]() { run(); });
+  registry.writers.insert(this);
+}
+
+CollectorWriter::~CollectorWriter() {
+  {
+    ForkRegistry &registry = forkRegistry();
+    std::unique_lock<std::mutex> lock(registry.mutex);
+    registry.writers.erase(this);
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  collector_.join();
+}
+
+void CollectorWriter::write(Trace trace) {
+  telemetry().traces_written.add();
+  bool written = false;
+  try {
+    written = ring_.push(AgentHttpEncoder::encodeTrace(trace));
+  } catch (const std::bad_alloc &) {
+  }
+  if (!written) {
+    dropped_traces_.fetch_add(1, std::memory_order_relaxed);
+    telemetry().traces_dropped.add();
+  }
+}
+
+void CollectorWriter::flush(std::chrono::milliseconds timeout) try {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (agent_writer_ == nullptr) {
+    lock.unlock();
+    // Another process is the collector (or will be), so all there is to do is wait for it.
+    uint64_t pushed = ring_.pushed();
+    while (ring_.popped() < pushed && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return;
+  }
+  // A collection that starts from now on takes every trace written so far.
+  uint64_t collection = collections_started_ + 1;
+  collect_now_ = true;
+  condition_.notify_all();
+  if (!condition_.wait_until(lock, deadline,
+                             [&]() { return collections_finished_ >= collection || stop_; })) {
+    return;
+  }
+  auto agent_writer = agent_writer_;
+  lock.unlock();
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+  agent_writer->flush(std::max(remaining, std::chrono::milliseconds(0)));
+} catch (const std::bad_alloc &) {
+}
+
+bool CollectorWriter::isCollector() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return agent_writer_ != nullptr;
+}
+
+uint64_t CollectorWriter::droppedTraces() const { return dropped_traces_.load(); }
+
+void CollectorWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    if (forking_) {
+      // Wait for the fork to be over, rather than end the thread. The ring's collector lock
+      // belongs to this thread, and would be released if it ended.
+      paused_ = true;
+      condition_.notify_all();
+      condition_.wait(lock, [&]() { return !forking_; });
+      paused_ = false;
+      continue;
+    }
+    if (agent_writer_ == nullptr) {
+      lock.unlock();
+      std::shared_ptr<AgentWriter> agent_writer;
+      if (ring_.tryCollect()) {
+        try {
+          agent_writer = make_agent_writer_(std::make_shared<SharingSampler>(sampler_, ring_));
+        } catch (const std::runtime_error &error) {
+          errors_.Log(LogLevel::error, std::string("Unable to collect traces: ") + error.what());
+          ring_.stopCollecting();
+        }
+      }
+      if (agent_writer == nullptr) {
+        // Keep up with the sampling rates the agent gave the collector.
+        std::string rates;
+        if (sampler_ != nullptr && ring_.samplingRates(sampling_rates_version_, rates)) {
+          try {
+            sampler_->updatePrioritySampler(json::parse(rates));
+          } catch (const json::exception &) {
+          }
+        }
+      }
+      lock.lock();
+      agent_writer_ = agent_writer;
+    }
+    if (agent_writer_ != nullptr) {
+      uint64_t collection = ++collections_started_;
+      lock.unlock();
+      collect();
+      lock.lock();
+      collections_finished_ = collection;
+      condition_.notify_all();
+    }
+    condition_.wait_for(lock, collect_period_,
+                        [&]() { return stop_ || forking_ || collect_now_; });
+    collect_now_ = false;
+  }
+  if (agent_writer_ != nullptr) {
+    ring_.stopCollecting();
+  }
+}
+
+void CollectorWriter::collect() {
+  std::vector<std::string> traces;
+  size_t popped;
+  do {
+    traces.clear();
+    bool popping = true;
+    size_t written = 0;
+    try {
+      popped = ring_.pop(traces, traces_per_pop);
+      popping = false;
+      for (auto &trace : traces) {
+        agent_writer_->writeEncoded(std::move(trace));
+        written++;
+      }
+    } catch (const std::bad_alloc &) {
+      // Drop the rest of the batch, including the trace ring_.pop() couldn't copy, which is gone
+      // from the ring too. What's left in the ring is collected next time.
+      uint64_t dropped = traces.size() - written + (popping ? 1 : 0);
+      dropped_traces_.fetch_add(dropped, std::memory_order_relaxed);
+      telemetry().traces_dropped.add(dropped);
+      return;
+    }
+  } while (popped == traces_per_pop);
+}
+
+void CollectorWriter::prepareFork() {
+  ForkRegistry &registry = forkRegistry();
+  registry.mutex.lock();
+  for (CollectorWriter *writer : registry.writers) {
+    writer->pauseForFork();
+  }
+}
+
+void CollectorWriter::afterForkInParent() {
+  ForkRegistry &registry = forkRegistry();
+  for (CollectorWriter *writer : registry.writers) {
+    writer->resumeAfterFork(false);
+  }
+  registry.mutex.unlock();
+}
+
+void CollectorWriter::afterForkInChild() {
+  ForkRegistry &registry = forkRegistry();
+  for (CollectorWriter *writer : registry.writers) {
+    writer->resumeAfterFork(true);
+  }
+  registry.mutex.unlock();
+}
+
+void CollectorWriter::pauseForFork() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  forking_ = true;
+  condition_.notify_all();
+  condition_.wait(lock, [&]() { return paused_; });
+  // Held until after the fork, see AgentWriter::pauseForFork().
+  lock.release();
+}
+
+void CollectorWriter::resumeAfterFork(bool in_child) {
+  forking_ = false;
+  if (!in_child) {
+    mutex_.unlock();
+    condition_.notify_all();
+    return;
+  }
+  // See AgentWriter::resumeAfterFork(). The collector_ thread doesn't exist in the child, so it's
+  // started afresh too.
+  new (&mutex_) std::mutex{};
+  new (&condition_) std::condition_variable{};
+  paused_ = false;
+  collect_now_ = false;
+  // The parent is still the collector, if it was. Its AgentWriter has already been resumed in the
+  // child (see the constructor), so it can be stopped.
+  agent_writer_.reset();
+  new (&collector_) std::thread([this]() { run(); });
+}
+
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,122 @@
+#ifndef DD_OPENTRACING_COLLECTOR_WRITER_H
+#define DD_OPENTRACING_COLLECTOR_WRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "agent_writer.h"
+#include "trace_ring.h"
+#include "writer.h"
+
+namespace datadog {
+namespace opentracing {
+
+// Configuration for a CollectorWriter.
+struct CollectorWriterOptions {
+  // The name of the shared memory that the processes on the host share traces through. Processes
+  // share only if they use the same name and ring_bytes.
+  std::string name = "/datadog-trace-collector";
+  // The size of the ring that traces wait in to be collected. Traces written while it's full are
+  // dropped.
+  size_t ring_bytes = 16 * 1024 * 1024;
+  // How often the collector takes traces from the ring. Also how often the other processes check
+  // whether there still is a collector, and take over if not.
+  std::chrono::milliseconds collect_period = std::chrono::milliseconds(100);
+  // For the collector's AgentWriter, which sends the traces it collects.
+  AgentWriterOptions agent_writer;
+};
+
+// A Writer for servers that run many processes on a host, like nginx with its workers. Instead of
+// each process sending its own traces to the agent, they each encode them into a ring in shared
+// memory, and one of them, the collector, sends them all. So there is one AgentWriter for the
+// host rather than one per process, and the agent gets fewer, larger payloads.
+//
+// Every CollectorWriter on the host that uses the same ring is a candidate to be the collector,
+// and the first to try becomes it. If it stops, or its process dies, another takes over. The
+// collector also passes the sampling rates the agent gives it on to the others.
+//
+// Like AgentWriter, a CollectorWriter keeps working across fork(). A child process is never the
+// collector straight away, even if its parent is, but it's a candidate like any other.
+class CollectorWriter : public Writer {
+ public:
+  using AgentWriterFactory =
+      std::function<std::unique_ptr<AgentWriter>(std::shared_ptr<RulesSampler> sampler)>;
+
+  // Creates a CollectorWriter that sends traces to the agent at the given address, if it becomes
+  // the collector. May throw runtime_error.
+  CollectorWriter(std::string host, uint32_t port, std::string unix_socket,
+                  CollectorWriterOptions options, std::shared_ptr<RulesSampler> sampler);
+  // Creates a CollectorWriter that, if it becomes the collector, sends traces with an AgentWriter
+  // made by make_agent_writer. The sampler given to it passes the agent's sampling rates on to
+  // the other processes. May throw runtime_error.
+  CollectorWriter(AgentWriterFactory make_agent_writer, CollectorWriterOptions options,
+                  std::shared_ptr<RulesSampler> sampler);
+
+  // Stops collecting, leaving the traces still in the ring to the next collector.
+  ~CollectorWriter() override;
+
+  void write(Trace trace) override;
+
+  // Waits until the traces written so far (by any process) have been collected, and then, if this
+  // is the collector, until they've been sent. Or until timeout passes.
+  void flush(std::chrono::milliseconds timeout) override;
+
+  // Whether this is the collector.
+  bool isCollector() const;
+  // The number of traces dropped so far because the ring was full, or there wasn't memory to
+  // collect them.
+  uint64_t droppedTraces() const;
+
+ private:
+  // Body of the collector_ thread.
+  void run();
+  // Takes every trace in the ring, and writes it to agent_writer_.
+  void collect();
+
+  // The pthread_atfork handlers, for every CollectorWriter in the process. See AgentWriter.
+  static void prepareFork();
+  static void afterForkInParent();
+  static void afterForkInChild();
+  // Pauses the collector_ thread and locks mutex_.
+  void pauseForFork();
+  // Unlocks mutex_ and resumes the collector_ thread, or in the child, starts a new one.
+  void resumeAfterFork(bool in_child);
+
+  const AgentWriterFactory make_agent_writer_;
+  const std::chrono::milliseconds collect_period_;
+  std::shared_ptr<RulesSampler> sampler_;
+  // For the errors that keep happening if, say, the collector can't make its AgentWriter.
+  RateLimitedLogger errors_;
+  TraceRing ring_;
+  std::atomic<uint64_t> dropped_traces_{0};
+  // Tries to become the collector, and collects once it is. Otherwise keeps the sampler up to
+  // date with the rates the collector shares.
+  std::thread collector_;
+  // The version of the sampling rates last given to sampler_. Used only by the collector_ thread.
+  uint64_t sampling_rates_version_ = 0;
+  // Locks the fields below.
+  mutable std::mutex mutex_;
+  // Notifies the collector_ thread to collect now, or to stop, and flush() when it has collected.
+  std::condition_variable condition_;
+  bool collect_now_ = false;
+  bool stop_ = false;
+  // Pauses the collector_ thread so that the process can fork, and whether it has.
+  bool forking_ = false;
+  bool paused_ = false;
+  // Sends the traces collected. Only set once this is the collector.
+  std::shared_ptr<AgentWriter> agent_writer_;
+  // The number of times the collector_ thread has started, and finished, collecting.
+  uint64_t collections_started_ = 0;
+  uint64_t collections_finished_ = 0;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_COLLECTOR_WRITER_H
@@ -0,0 +1,328 @@
+#include "curl_transport.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+CURLoption toCurlOption(HandleOption option) {
+  switch (option) {
+    case HandleOption::url:
+      return CURLOPT_URL;
+    case HandleOption::unix_socket_path:
+      return CURLOPT_UNIX_SOCKET_PATH;
+    case HandleOption::timeout_ms:
+      return CURLOPT_TIMEOUT_MS;
+    case HandleOption::post_fields:
+      return CURLOPT_POSTFIELDS;
+    case HandleOption::post_field_size:
+    default:
+      return CURLOPT_POSTFIELDSIZE;
+  }
+}
+
+HandleResult fromCurlCode(CURLcode rcode) {
+  switch (rcode) {
+    case CURLE_OK:
+      return HandleResult::ok;
+    case CURLE_UNSUPPORTED_PROTOCOL:
+      return HandleResult::unsupported_protocol;
+    case CURLE_URL_MALFORMAT:
+      return HandleResult::url_malformat;
+    case CURLE_COULDNT_CONNECT:
+      return HandleResult::couldnt_connect;
+    case CURLE_OUT_OF_MEMORY:
+      return HandleResult::out_of_memory;
+    case CURLE_OPERATION_TIMEDOUT:
+      return HandleResult::operation_timedout;
+    case CURLE_SEND_ERROR:
+      return HandleResult::send_error;
+    case CURLE_RECV_ERROR:
+      return HandleResult::recv_error;
+    case CURLE_WEIRD_SERVER_REPLY:
+      return HandleResult::weird_server_reply;
+    case CURLE_HTTP_RETURNED_ERROR:
+      return HandleResult::http_returned_error;
+    case CURLE_UNKNOWN_OPTION:
+      return HandleResult::unknown_option;
+    default:
+      return HandleResult::failed;
+  }
+}
+// Returns HandleResult::http_returned_error, and describes the status in error, if the response
+// to a completed request isn't 2xx, so that it fails just as it does with a NativeHandle. The
+// body of the response is still received, unlike with CURLOPT_FAILONERROR.
+HandleResult checkResponseCode(CURL* handle, char* error) {
+  long status = 0;
+  curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+  if (status >= 200 && status < 300) {
+    return HandleResult::ok;
+  }
+  std::snprintf(error, CURL_ERROR_SIZE, "Agent responded with HTTP status %ld", status);
+  return HandleResult::http_returned_error;
+}
+}  // namespace
+
+size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  CurlHandle* handle = static_cast<CurlHandle*>(userdata);
+  handle->response_buffer_.write(ptr, size * nmemb);
+
+  if (!handle->response_buffer_) {
+    std::cerr << "Unable to write to response buffer" << std::endl;
+    return -1;
+  }
+  return size * nmemb;
+}
+
+CurlHandle::CurlHandle() {
+  curl_global_init(CURL_GLOBAL_ALL);
+  handle_ = curl_easy_init();
+  // Set the error buffer.
+  auto rcode = curl_easy_setopt(handle_, CURLOPT_ERRORBUFFER, curl_error_buffer_);
+  if (rcode != CURLE_OK) {
+    tearDownHandle();
+    throw std::runtime_error(std::string("Unable to set curl error buffer: ") +
+                             curl_easy_strerror(rcode));
+  }
+  rcode = curl_easy_setopt(handle_, CURLOPT_POST, 1);
+  if (rcode != CURLE_OK) {
+    tearDownHandle();
+    throw std::runtime_error(std::string("Unable to set curl POST option ") +
+                             curl_easy_strerror(rcode));
+  }
+  // Don't write responses to stdout.
+  rcode = curl_easy_setopt(handle_, CURLOPT_WRITEFUNCTION, write_callback);
+  if (rcode != CURLE_OK) {
+    tearDownHandle();
+    throw std::runtime_error(std::string("Unable to set curl write callback: ") +
+                             curl_easy_strerror(rcode));
+  }
+  rcode = curl_easy_setopt(handle_, CURLOPT_WRITEDATA, static_cast<void*>(this));
+  if (rcode != CURLE_OK) {
+    tearDownHandle();
+    throw std::runtime_error(std::string("Unable to set curl write callback userdata: ") +
+                             curl_easy_strerror(rcode));
+  }
+}
+
+CurlHandle::~CurlHandle() { tearDownHandle(); }
+
+void CurlHandle::tearDownHandle() {
+  curl_easy_cleanup(handle_);
+  curl_global_cleanup();
+}
+
+HandleResult CurlHandle::setopt(HandleOption key, const char* value) {
+  return fromCurlCode(curl_easy_setopt(handle_, toCurlOption(key), value));
+}
+
+HandleResult CurlHandle::setopt(HandleOption key, long value) {
+  return fromCurlCode(curl_easy_setopt(handle_, toCurlOption(key), value));
+}
+
+HandleResult CurlHandle::setopt(HandleOption key, size_t value) {
+  return setopt(key, static_cast<long>(value));
+}
+
+void CurlHandle::setHeaders(std::map<std::string, std::string> headers) {
+  for (auto& header : headers) {
+    headers_[header.first] = header.second;  // Overwrite.
+  }
+}
+
+HandleResult CurlHandle::perform() {
+  // Clear response buffer.
+  response_buffer_.clear();
+  response_buffer_.str(std::string{});
+  // TODO[willgittoes-dd]: Find a way to not copy these strings each time, without unreasonable
+  // coupling to libcurl internals.
+  struct curl_slist* http_headers = nullptr;
+  for (auto& pair : headers_) {
+    std::string header = pair.first + ": " + pair.second;
+    http_headers = curl_slist_append(http_headers, header.c_str());
+  }
+  CURLcode rcode = curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, http_headers);
+  if (rcode != CURLE_OK) {
+    std::strncpy(curl_error_buffer_, "Unable to write headers", CURL_ERROR_SIZE - 1);
+    curl_slist_free_all(http_headers);
+    return fromCurlCode(rcode);
+  }
+  curl_error_buffer_[0] = '\0';
+  rcode = curl_easy_perform(handle_);
+  curl_slist_free_all(http_headers);
+  if (rcode != CURLE_OK && curl_error_buffer_[0] == '\0') {
+    // Not every error fills in the buffer, and a HandleResult can't say which error it was.
+    std::strncpy(curl_error_buffer_, curl_easy_strerror(rcode), CURL_ERROR_SIZE - 1);
+  }
+  if (rcode == CURLE_OK) {
+    return checkResponseCode(handle_, curl_error_buffer_);
+  }
+  return fromCurlCode(rcode);
+}
+
+std::string CurlHandle::getError() { return std::string(curl_error_buffer_); }
+std::string CurlHandle::getResponse() { return response_buffer_.str(); }
+
+// A request made by a MultiCurlHandle, and everything that needs to live as long as it does.
+struct MultiCurlHandle::Request {
+  ~Request() {
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(handle);
+  }
+
+  CURL* handle = nullptr;
+  struct curl_slist* headers = nullptr;
+  std::stringstream response;
+  char error[CURL_ERROR_SIZE] = {0};
+  Callback callback;
+};
+
+namespace {
+size_t request_write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  std::stringstream* response = static_cast<std::stringstream*>(userdata);
+  response->write(ptr, size * nmemb);
+
+  if (!*response) {
+    std::cerr << "Unable to write to response buffer" << std::endl;
+    return -1;
+  }
+  return size * nmemb;
+}
+}  // namespace
+
+MultiCurlHandle::MultiCurlHandle(size_t max_in_flight)
+    : max_in_flight_(max_in_flight), multi_handle_(curl_multi_init()) {
+  if (multi_handle_ == nullptr) {
+    throw std::runtime_error("Unable to create curl multi handle");
+  }
+  // There's no point in opening more connections than there are requests.
+  auto rcode = curl_multi_setopt(multi_handle_, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                                 static_cast<long>(max_in_flight_));
+  if (rcode != CURLM_OK) {
+    curl_multi_cleanup(multi_handle_);
+    throw std::runtime_error(std::string("Unable to set curl connection limit: ") +
+                             curl_multi_strerror(rcode));
+  }
+}
+
+MultiCurlHandle::~MultiCurlHandle() {
+  // Requests still in flight are abandoned, without calling their callbacks.
+  for (auto& request : requests_) {
+    curl_multi_remove_handle(multi_handle_, request.first);
+  }
+  requests_.clear();
+  curl_multi_cleanup(multi_handle_);
+}
+
+void MultiCurlHandle::post(const std::map<std::string, std::string>& headers,
+                           const std::string& body, Callback callback) {
+  std::unique_ptr<Request> request{new Request{}};
+  request->handle = curl_easy_duphandle(handle_);
+  if (request->handle == nullptr) {
+    callback(HandleResult::out_of_memory,
+             "Error sending traces to agent: Unable to copy curl handle", "");
+    return;
+  }
+  request->callback = std::move(callback);
+  std::map<std::string, std::string> all_headers = headers_;
+  for (auto& header : headers) {
+    all_headers[header.first] = header.second;  // Overwrite.
+  }
+  for (auto& pair : all_headers) {
+    std::string header = pair.first + ": " + pair.second;
+    request->headers = curl_slist_append(request->headers, header.c_str());
+  }
+
+  // The copied handle still refers to the buffers of the original, so point it at this request's.
+  CURL* handle = request->handle;
+  CURLcode rcode = curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, request->error);
+  if (rcode == CURLE_OK) {
+    rcode = curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, request_write_callback);
+  }
+  if (rcode == CURLE_OK) {
+    rcode = curl_easy_setopt(handle, CURLOPT_WRITEDATA, static_cast<void*>(&request->response));
+  }
+  if (rcode == CURLE_OK) {
+    rcode = curl_easy_setopt(handle, CURLOPT_HTTPHEADER, request->headers);
+  }
+  // We have to set the size manually, because msgpack uses null characters.
+  if (rcode == CURLE_OK) {
+    rcode = curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.size()));
+  }
+  if (rcode == CURLE_OK) {
+    rcode = curl_easy_setopt(handle, CURLOPT_POSTFIELDS, body.data());
+  }
+  if (rcode != CURLE_OK) {
+    request->callback(fromCurlCode(rcode),
+                      std::string("Error setting up agent request: ") + curl_easy_strerror(rcode),
+                      "");
+    return;
+  }
+  auto mrcode = curl_multi_add_handle(multi_handle_, handle);
+  if (mrcode != CURLM_OK) {
+    request->callback(HandleResult::failed, std::string("Error sending traces to agent: ") +
+                                                 curl_multi_strerror(mrcode),
+                      "");
+    return;
+  }
+  requests_[handle] = std::move(request);
+}
+
+size_t MultiCurlHandle::maxInFlight() { return max_in_flight_; }
+
+size_t MultiCurlHandle::inFlight() { return requests_.size(); }
+
+void MultiCurlHandle::run(std::chrono::milliseconds timeout) {
+  int running = 0;
+  size_t in_flight = requests_.size();
+  curl_multi_perform(multi_handle_, &running);
+  finishRequests();
+  if (requests_.size() < in_flight) {
+    return;  // Let the caller make more requests.
+  }
+  curl_multi_poll(multi_handle_, nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+  curl_multi_perform(multi_handle_, &running);
+  finishRequests();
+}
+
+void MultiCurlHandle::wakeUp() { curl_multi_wakeup(multi_handle_); }
+
+void MultiCurlHandle::finishRequests() {
+  int remaining = 0;
+  while (CURLMsg* message = curl_multi_info_read(multi_handle_, &remaining)) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+    CURLcode rcode = message->data.result;
+    auto it = requests_.find(message->easy_handle);
+    if (it == requests_.end()) {
+      continue;
+    }
+    std::unique_ptr<Request> request = std::move(it->second);
+    requests_.erase(it);
+    curl_multi_remove_handle(multi_handle_, request->handle);
+    if (rcode != CURLE_OK) {
+      request->callback(fromCurlCode(rcode),
+                        std::string("Error sending traces to agent: ") +
+                            curl_easy_strerror(rcode) + "\n" + request->error,
+                        "");
+      continue;
+    }
+    HandleResult result = checkResponseCode(request->handle, request->error);
+    if (result != HandleResult::ok) {
+      request->callback(result,
+                        std::string("Error sending traces to agent: ") +
+                            handleResultString(result) + "\n" + request->error,
+                        "");
+      continue;
+    }
+    request->callback(HandleResult::ok, "", request->response.str());
+  }
+}
+
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,77 @@
+#ifndef DD_OPENTRACING_CURL_TRANSPORT_H
+#define DD_OPENTRACING_CURL_TRANSPORT_H
+
+#include <curl/curl.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "transport.h"
+
+namespace datadog {
+namespace opentracing {
+
+// A Handle that uses real curl to really send things. Not thread-safe.
+class CurlHandle : public Handle {
+ public:
+  // May throw runtime_error.
+  CurlHandle();
+  ~CurlHandle() override;
+  HandleResult setopt(HandleOption key, const char* value) override;
+  HandleResult setopt(HandleOption key, long value) override;
+  HandleResult setopt(HandleOption key, size_t value) override;
+  void setHeaders(std::map<std::string, std::string> headers) override;
+  HandleResult perform() override;
+  std::string getError() override;
+  std::string getResponse() override;
+
+ protected:
+  CURL* handle_;
+  // Not unordered, just so that the headers are always in the same order. Makes testing just a bit
+  // easier, and the number of headers is so low that the log(n) insert doesn't matter.
+  std::map<std::string, std::string> headers_;
+
+ private:
+  // For things that need cleaning up if the constructor fails as well as on destruction.
+  void tearDownHandle();
+
+  char curl_error_buffer_[CURL_ERROR_SIZE];
+  std::stringstream response_buffer_;  // So much more humane than a fixed sized buffer.
+
+  // Called with the response from perform().
+  friend size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata);
+};
+
+// A Handle that uses curl's multi interface to have up to max_in_flight requests in flight at
+// once. Options set with setopt() apply to every request, which are each made on a copy of the
+// underlying CurlHandle. Not thread-safe, except for wakeUp().
+class MultiCurlHandle : public CurlHandle {
+ public:
+  // May throw runtime_error.
+  MultiCurlHandle(size_t max_in_flight);
+  ~MultiCurlHandle() override;
+  void post(const std::map<std::string, std::string>& headers, const std::string& body,
+            Callback callback) override;
+  size_t maxInFlight() override;
+  size_t inFlight() override;
+  void run(std::chrono::milliseconds timeout) override;
+  void wakeUp() override;
+
+ private:
+  struct Request;
+
+  // Calls the callbacks of, and cleans up after, requests that have completed.
+  void finishRequests();
+
+  const size_t max_in_flight_;
+  CURLM* multi_handle_;
+  std::map<CURL*, std::unique_ptr<Request>> requests_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_CURL_TRANSPORT_H
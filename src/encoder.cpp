@@ -2,6 +2,7 @@
 
 #include <datadog/version.h>
 
+#include <algorithm>
 #include <nlohmann/json.hpp>
 
 #include "sample.h"
@@ -21,9 +22,19 @@ const std::string header_dd_meta_tracer_version = "Datadog-Meta-Tracer-Version";
 const std::string header_dd_trace_count = "X-Datadog-Trace-Count";
 
 const size_t RESPONSE_ERROR_REGION_SIZE = 50;
+// The largest possible msgpack array header, which prefixes the traces in a payload.
+const size_t MAX_ARRAY_HEADER_SIZE = 5;
 }  // namespace
 
-AgentHttpEncoder::AgentHttpEncoder(std::shared_ptr<RulesSampler> sampler) : sampler_(sampler) {
+AgentHttpEncoder::AgentHttpEncoder(std::shared_ptr<RulesSampler> sampler)
+    : AgentHttpEncoder(sampler, default_max_payload_bytes, default_max_traces_per_payload) {}
+
+AgentHttpEncoder::AgentHttpEncoder(std::shared_ptr<RulesSampler> sampler,
+                                   std::size_t max_payload_bytes,
+                                   std::size_t max_traces_per_payload)
+    : max_payload_bytes_(max_payload_bytes),
+      max_traces_per_payload_(std::max<std::size_t>(max_traces_per_payload, 1)),
+      sampler_(sampler) {
   // Set up common headers and default encoder
   common_headers_ = {{header_content_type, "application/msgpack"},
                      {header_dd_meta_lang, "cpp"},
@@ -35,9 +46,12 @@ const std::string agent_api_path = "/v0.4/traces";
 
 const std::string& AgentHttpEncoder::path() { return agent_api_path; }
 
-void AgentHttpEncoder::clearTraces() { traces_.clear(); }
+void AgentHttpEncoder::clearTraces() {
+  traces_.clear();
+  encoded_traces_.clear();
+}
 
-std::size_t AgentHttpEncoder::pendingTraces() { return traces_.size(); }
+std::size_t AgentHttpEncoder::pendingTraces() { return traces_.size() + encoded_traces_.size(); }
 
 const std::map<std::string, std::string> AgentHttpEncoder::headers() {
   std::map<std::string, std::string> headers(common_headers_);
@@ -54,6 +68,64 @@ const std::string AgentHttpEncoder::payload() {
 
 void AgentHttpEncoder::addTrace(Trace trace) { traces_.push_back(std::move(trace)); }
 
+void AgentHttpEncoder::addEncodedTrace(std::string encoded_trace) {
+  encoded_traces_.push_back(std::move(encoded_trace));
+}
+
+std::string AgentHttpEncoder::encodeTrace(const Trace& trace) {
+  std::stringstream buffer;
+  msgpack::pack(buffer, trace);
+  return buffer.str();
+}
+
+std::vector<EncodedPayload> AgentHttpEncoder::payloads(std::size_t& dropped_traces) {
+  std::vector<EncodedPayload> result;
+  // Traces are encoded one at a time, then concatenated behind an array header once we know how
+  // many fit in the payload.
+  std::string encoded_traces;
+  size_t num_traces = 0;
+  auto add = [&](const std::string& encoded) {
+    if (encoded.size() + MAX_ARRAY_HEADER_SIZE > max_payload_bytes_) {
+      dropped_traces++;
+      return;
+    }
+    if (num_traces == max_traces_per_payload_ ||
+        encoded_traces.size() + encoded.size() + MAX_ARRAY_HEADER_SIZE > max_payload_bytes_) {
+      result.push_back(makePayload(encoded_traces, num_traces));
+      encoded_traces.clear();
+      num_traces = 0;
+    }
+    encoded_traces += encoded;
+    num_traces++;
+  };
+  for (auto& trace : traces_) {
+    buffer_.clear();
+    buffer_.str(std::string{});
+    msgpack::pack(buffer_, trace);
+    add(buffer_.str());
+  }
+  for (auto& encoded : encoded_traces_) {
+    add(encoded);
+  }
+  if (num_traces > 0) {
+    result.push_back(makePayload(encoded_traces, num_traces));
+  }
+  return result;
+}
+
+EncodedPayload AgentHttpEncoder::makePayload(const std::string& encoded_traces,
+                                             std::size_t num_traces) {
+  buffer_.clear();
+  buffer_.str(std::string{});
+  msgpack::packer<std::stringstream> packer(buffer_);
+  packer.pack_array(static_cast<uint32_t>(num_traces));
+  buffer_.write(encoded_traces.data(), encoded_traces.size());
+
+  EncodedPayload payload{common_headers_, buffer_.str(), num_traces};
+  payload.headers[header_dd_trace_count] = std::to_string(num_traces);
+  return payload;
+}
+
 void AgentHttpEncoder::handleResponse(const std::string& response) {
   if (sampler_ != nullptr) {
     try {
@@ -5,6 +5,7 @@
 
 #include <deque>
 #include <sstream>
+#include <vector>
 
 namespace datadog {
 namespace opentracing {
@@ -13,9 +14,20 @@ class RulesSampler;
 struct SpanData;
 using Trace = std::unique_ptr<std::vector<std::unique_ptr<SpanData>>>;
 
+// The body of a single HTTP request to the agent, along with the headers that describe it.
+struct EncodedPayload {
+  std::map<std::string, std::string> headers;
+  std::string body;
+  std::size_t num_traces;
+};
+
 class AgentHttpEncoder : public TraceEncoder {
  public:
   AgentHttpEncoder(std::shared_ptr<RulesSampler> sampler);
+  // Creates an encoder whose payloads() are each no larger than max_payload_bytes, and contain no
+  // more than max_traces_per_payload traces. A max_traces_per_payload of 0 is taken as 1.
+  AgentHttpEncoder(std::shared_ptr<RulesSampler> sampler, std::size_t max_payload_bytes,
+                   std::size_t max_traces_per_payload);
   ~AgentHttpEncoder() override {}
 
   // Returns the path that is used to submit HTTP requests to the agent.
@@ -28,11 +40,31 @@ class AgentHttpEncoder : public TraceEncoder {
   const std::string payload() override;
   void handleResponse(const std::string& response) override;
   void addTrace(Trace trace);
+  // Adds a trace that's already been encoded, by encodeTrace(). It's only included in payloads().
+  void addEncodedTrace(std::string encoded_trace);
+  // Returns the collection of traces encoded as one or more payloads, each within the size limits
+  // given in the constructor. A trace that can't fit in a payload on its own is dropped, and
+  // counted in dropped_traces.
+  std::vector<EncodedPayload> payloads(std::size_t& dropped_traces);
+
+  // Encodes the trace as payloads() would, for addEncodedTrace().
+  static std::string encodeTrace(const Trace& trace);
+
+  // Default size limits for payloads(). The agent rejects requests larger than this, and a
+  // smaller request is cheaper to retry.
+  static const std::size_t default_max_payload_bytes = 10 * 1024 * 1024;
+  static const std::size_t default_max_traces_per_payload = 1000;
 
  private:
+  // Creates the payload holding the given concatenation of encoded traces.
+  EncodedPayload makePayload(const std::string& encoded_traces, std::size_t num_traces);
+
+  const std::size_t max_payload_bytes_;
+  const std::size_t max_traces_per_payload_;
   // Holds the headers that are used for all HTTP requests.
   std::map<std::string, std::string> common_headers_;
   std::deque<Trace> traces_;
+  std::deque<std::string> encoded_traces_;
   std::stringstream buffer_;
   // Responses from the Agent may contain configuration for the sampler. May be nullptr if priority
   // sampling is not enabled.
@@ -0,0 +1,403 @@
+#include "http_connection.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // Platforms without it have SO_NOSIGPIPE instead.
+#endif
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+const std::string header_separator = "\r\n\r\n";
+// The agent's responses are small JSON objects. Anything larger than this is a bad response.
+const size_t max_response_size = 1024 * 1024;
+// Room for the status line, headers and chunk framing, on top of the body.
+const size_t max_buffer_size = max_response_size + 64 * 1024;
+
+std::string toLower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) -> char { return static_cast<char>(std::tolower(c)); });
+  return s;
+}
+
+// Makes fd non-blocking, and stops writes to a closed connection from raising SIGPIPE.
+bool configureSocket(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return false;
+  }
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0) {
+    return false;
+  }
+#endif
+  return true;
+}
+}  // namespace
+
+HttpConnection::HttpConnection(std::string unix_socket, std::string host, uint32_t port,
+                               std::string path, std::chrono::milliseconds timeout)
+    : unix_socket_(unix_socket),
+      host_(host),
+      port_(port),
+      timeout_(timeout),
+      request_prefix_("POST " + path + " HTTP/1.1\r\nHost: " + host + ":" + std::to_string(port) +
+                      "\r\n") {}
+
+HttpConnection::~HttpConnection() { disconnect(); }
+
+int HttpConnection::status() const { return status_; }
+const std::string& HttpConnection::statusLine() const { return status_line_; }
+const std::string& HttpConnection::response() const { return response_; }
+const std::string& HttpConnection::error() const { return error_; }
+
+HttpConnection::Result HttpConnection::post(const std::map<std::string, std::string>& headers,
+                                            const char* body, size_t body_size) {
+  headers_.clear();
+  for (auto& header : headers) {
+    headers_.append(header.first).append(": ").append(header.second).append("\r\n");
+  }
+  headers_.append("Content-Length: ").append(std::to_string(body_size)).append(header_separator);
+
+  auto deadline = std::chrono::steady_clock::now() + timeout_;
+  bool reused_connection = fd_ >= 0;
+  Result result = attempt(body, body_size, deadline);
+  if (reused_connection &&
+      (result == Result::send_error || result == Result::connection_closed)) {
+    // The agent closed the idle connection, and hasn't seen any of this request. Start afresh.
+    result = attempt(body, body_size, deadline);
+  }
+  return result;
+}
+
+HttpConnection::Result HttpConnection::attempt(const char* body, size_t body_size,
+                                               std::chrono::steady_clock::time_point deadline) {
+  Result result = Result::ok;
+  if (fd_ < 0) {
+    result = connect(deadline);
+  }
+  if (result == Result::ok) {
+    result = send(body, body_size, deadline);
+  }
+  if (result == Result::ok) {
+    result = receiveResponse(deadline);
+  }
+  if (result != Result::ok) {
+    disconnect();
+  }
+  return result;
+}
+
+HttpConnection::Result HttpConnection::connect(std::chrono::steady_clock::time_point deadline) {
+  addrinfo* addresses = nullptr;
+  sockaddr_un unix_address{};
+  addrinfo unix_info{};
+  if (!unix_socket_.empty()) {
+    if (unix_socket_.size() >= sizeof(unix_address.sun_path)) {
+      return fail(Result::connect_error, "Unix socket path is too long: " + unix_socket_);
+    }
+    unix_address.sun_family = AF_UNIX;
+    std::strncpy(unix_address.sun_path, unix_socket_.c_str(), sizeof(unix_address.sun_path) - 1);
+    unix_info.ai_family = AF_UNIX;
+    unix_info.ai_socktype = SOCK_STREAM;
+    unix_info.ai_addr = reinterpret_cast<sockaddr*>(&unix_address);
+    unix_info.ai_addrlen = sizeof(unix_address);
+  } else {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rcode = getaddrinfo(host_.c_str(), std::to_string(port_).c_str(), &hints, &addresses);
+    if (rcode != 0) {
+      return fail(Result::connect_error,
+                  "Unable to resolve " + host_ + ": " + std::string(gai_strerror(rcode)));
+    }
+  }
+
+  std::string message = "No address to connect to";
+  Result result = Result::connect_error;
+  for (addrinfo* address = addresses != nullptr ? addresses : &unix_info; address != nullptr;
+       address = address->ai_next) {
+    fd_ = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd_ < 0 || !configureSocket(fd_)) {
+      message = std::strerror(errno);
+      disconnect();
+      continue;
+    }
+    if (::connect(fd_, address->ai_addr, address->ai_addrlen) == 0) {
+      result = Result::ok;
+      break;
+    }
+    if (errno == EINPROGRESS || errno == EAGAIN) {
+      if (!waitFor(POLLOUT, deadline)) {
+        message = "Timed out";
+        result = Result::timed_out;
+        disconnect();
+        break;
+      }
+      int error = 0;
+      socklen_t error_size = sizeof(error);
+      if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &error_size) == 0 && error == 0) {
+        result = Result::ok;
+        break;
+      }
+      errno = error;
+    }
+    message = std::strerror(errno);
+    disconnect();
+  }
+  if (addresses != nullptr) {
+    freeaddrinfo(addresses);
+  }
+  if (result != Result::ok) {
+    return fail(result, "Unable to connect to agent: " + message);
+  }
+  return Result::ok;
+}
+
+HttpConnection::Result HttpConnection::send(const char* body, size_t body_size,
+                                            std::chrono::steady_clock::time_point deadline) {
+  iovec parts[3];
+  parts[0].iov_base = const_cast<char*>(request_prefix_.data());
+  parts[0].iov_len = request_prefix_.size();
+  parts[1].iov_base = const_cast<char*>(headers_.data());
+  parts[1].iov_len = headers_.size();
+  parts[2].iov_base = const_cast<char*>(body);
+  parts[2].iov_len = body_size;
+  msghdr message{};
+  message.msg_iov = parts;
+  message.msg_iovlen = 3;
+
+  while (message.msg_iovlen > 0) {
+    ssize_t sent = sendmsg(fd_, &message, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (!waitFor(POLLOUT, deadline)) {
+          return fail(Result::timed_out, "Timed out sending to agent");
+        }
+        continue;
+      }
+      return fail(Result::send_error,
+                  "Error sending to agent: " + std::string(std::strerror(errno)));
+    }
+    // Skip past whatever was sent, which may end part way through one of the parts.
+    size_t remaining = static_cast<size_t>(sent);
+    while (message.msg_iovlen > 0 && remaining >= message.msg_iov->iov_len) {
+      remaining -= message.msg_iov->iov_len;
+      message.msg_iov++;
+      message.msg_iovlen--;
+    }
+    if (message.msg_iovlen > 0) {
+      message.msg_iov->iov_base = static_cast<char*>(message.msg_iov->iov_base) + remaining;
+      message.msg_iov->iov_len -= remaining;
+    }
+  }
+  return Result::ok;
+}
+
+HttpConnection::Result HttpConnection::receiveResponse(
+    std::chrono::steady_clock::time_point deadline) {
+  buffer_.clear();
+  response_.clear();
+  status_ = 0;
+  status_line_.clear();
+
+  size_t header_end;
+  while ((header_end = buffer_.find(header_separator)) == std::string::npos) {
+    Result result = receive(deadline);
+    if (result == Result::connection_closed && !buffer_.empty()) {
+      return fail(Result::receive_error, "Agent closed the connection mid-response");
+    }
+    if (result != Result::ok) {
+      return result;
+    }
+  }
+
+  // Status line, eg "HTTP/1.1 200 OK".
+  const std::string version = "HTTP/1.";
+  if (buffer_.compare(0, version.size(), version) != 0 || buffer_.size() < 12 ||
+      !std::isdigit(static_cast<unsigned char>(buffer_[9])) ||
+      !std::isdigit(static_cast<unsigned char>(buffer_[10])) ||
+      !std::isdigit(static_cast<unsigned char>(buffer_[11]))) {
+    return fail(Result::bad_response, "Unable to parse status line of response from agent");
+  }
+  status_ = std::stoi(buffer_.substr(9, 3));
+  status_line_ = buffer_.substr(0, buffer_.find("\r\n"));
+
+  bool has_length = false;
+  size_t content_length = 0;
+  bool chunked = false;
+  bool close_after = false;
+  size_t line_start = buffer_.find("\r\n") + 2;
+  while (line_start < header_end) {
+    size_t line_end = buffer_.find("\r\n", line_start);
+    size_t colon = buffer_.find(':', line_start);
+    if (colon != std::string::npos && colon < line_end) {
+      std::string name = toLower(buffer_.substr(line_start, colon - line_start));
+      size_t value_start = std::min(buffer_.find_first_not_of(' ', colon + 1), line_end);
+      std::string value = toLower(buffer_.substr(value_start, line_end - value_start));
+      if (name == "content-length") {
+        has_length = true;
+        content_length = std::strtoul(value.c_str(), nullptr, 10);
+        if (content_length > max_response_size) {
+          return fail(Result::bad_response, "Response from agent is too large");
+        }
+      } else if (name == "transfer-encoding") {
+        chunked = value.find("chunked") != std::string::npos;
+      } else if (name == "connection") {
+        close_after = value == "close";
+      }
+    }
+    line_start = line_end + 2;
+  }
+
+  size_t body_start = header_end + header_separator.size();
+  if (chunked) {
+    // Each chunk is its size in hex, CRLF, the data and another CRLF. A chunk of size 0 ends it.
+    size_t position = body_start;
+    while (true) {
+      size_t size_end;
+      while ((size_end = buffer_.find("\r\n", position)) == std::string::npos) {
+        Result result = receive(deadline);
+        if (result != Result::ok) {
+          return result == Result::connection_closed
+                     ? fail(Result::receive_error, "Agent closed the connection mid-response")
+                     : result;
+        }
+      }
+      // At least one hex digit, and nothing else before any chunk extension.
+      const char* size_start = buffer_.c_str() + position;
+      char* size_stop = nullptr;
+      errno = 0;
+      unsigned long long chunk_size = std::isxdigit(static_cast<unsigned char>(*size_start))
+                                          ? std::strtoull(size_start, &size_stop, 16)
+                                          : 0;
+      if (size_stop == nullptr || errno == ERANGE ||
+          (size_stop != buffer_.c_str() + size_end && *size_stop != ';')) {
+        return fail(Result::bad_response, "Unable to parse chunk size of response from agent");
+      }
+      if (chunk_size > max_response_size - response_.size()) {
+        return fail(Result::bad_response, "Response from agent is too large");
+      }
+      size_t chunk_end = size_end + 2 + static_cast<size_t>(chunk_size) + 2;
+      if (chunk_end <= position) {
+        return fail(Result::bad_response, "Unable to parse chunks of response from agent");
+      }
+      while (buffer_.size() < chunk_end) {
+        Result result = receive(deadline);
+        if (result != Result::ok) {
+          return result == Result::connection_closed
+                     ? fail(Result::receive_error, "Agent closed the connection mid-response")
+                     : result;
+        }
+      }
+      if (chunk_size == 0) {
+        break;  // Any trailers are ignored.
+      }
+      response_.append(buffer_, size_end + 2, static_cast<size_t>(chunk_size));
+      position = chunk_end;
+    }
+  } else if (has_length) {
+    while (buffer_.size() < body_start + content_length) {
+      Result result = receive(deadline);
+      if (result != Result::ok) {
+        return result == Result::connection_closed
+                   ? fail(Result::receive_error, "Agent closed the connection mid-response")
+                   : result;
+      }
+    }
+    response_ = buffer_.substr(body_start, content_length);
+  } else {
+    // The body is everything until the agent closes the connection.
+    Result result;
+    while ((result = receive(deadline)) == Result::ok) {
+    }
+    if (result != Result::connection_closed) {
+      return result;
+    }
+    response_ = buffer_.substr(body_start);
+    close_after = true;
+  }
+  if (close_after) {
+    disconnect();
+  }
+  return Result::ok;
+}
+
+HttpConnection::Result HttpConnection::receive(std::chrono::steady_clock::time_point deadline) {
+  char chunk[4096];
+  while (true) {
+    ssize_t received = recv(fd_, chunk, sizeof(chunk), 0);
+    if (received > 0) {
+      if (buffer_.size() + static_cast<size_t>(received) > max_buffer_size) {
+        return fail(Result::bad_response, "Response from agent is too large");
+      }
+      buffer_.append(chunk, static_cast<size_t>(received));
+      return Result::ok;
+    }
+    if (received == 0) {
+      error_ = "Agent closed the connection";
+      return Result::connection_closed;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return fail(Result::receive_error,
+                  "Error receiving from agent: " + std::string(std::strerror(errno)));
+    }
+    if (!waitFor(POLLIN, deadline)) {
+      return fail(Result::timed_out, "Timed out waiting for agent to respond");
+    }
+  }
+}
+
+bool HttpConnection::waitFor(short events, std::chrono::steady_clock::time_point deadline) {
+  while (true) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (remaining.count() <= 0) {
+      return false;
+    }
+    pollfd descriptor{fd_, events, 0};
+    int ready = poll(&descriptor, 1, static_cast<int>(remaining.count()));
+    if (ready > 0) {
+      return true;  // Ready, or in error, which the next call will find out.
+    }
+    if (ready < 0 && errno != EINTR) {
+      return true;
+    }
+  }
+}
+
+void HttpConnection::disconnect() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+HttpConnection::Result HttpConnection::fail(Result result, const std::string& message) {
+  error_ = message;
+  return result;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,85 @@
+#ifndef DD_OPENTRACING_HTTP_CONNECTION_H
+#define DD_OPENTRACING_HTTP_CONNECTION_H
+
+#include <chrono>
+#include <map>
+#include <string>
+
+namespace datadog {
+namespace opentracing {
+
+// A persistent HTTP/1.1 connection to the agent, over either a unix domain socket or TCP. It does
+// only what talking to the agent takes: POST a body, then read the status and body of the
+// response. Doesn't depend on libcurl. Not thread-safe.
+class HttpConnection {
+ public:
+  enum class Result {
+    ok,
+    connect_error,
+    send_error,
+    receive_error,
+    // The connection was closed before any of the response was received.
+    connection_closed,
+    timed_out,
+    bad_response,
+  };
+
+  // If unix_socket is not empty, requests are made over that socket and host is only used for the
+  // Host header. Otherwise they're made over TCP to host and port. Requests are POSTed to path.
+  // Nothing is connected until the first request.
+  HttpConnection(std::string unix_socket, std::string host, uint32_t port, std::string path,
+                 std::chrono::milliseconds timeout);
+  ~HttpConnection();
+
+  HttpConnection(const HttpConnection&) = delete;
+  HttpConnection& operator=(const HttpConnection&) = delete;
+
+  // POSTs the given body with the given headers, and waits for the response. The whole request is
+  // written with a single call to sendmsg (the send(2) flavour of writev). If the connection kept
+  // from an earlier request turns out to have been closed by the agent, reconnects and tries
+  // once more. The whole request must complete within the timeout.
+  Result post(const std::map<std::string, std::string>& headers, const char* body,
+              size_t body_size);
+
+  // The status code, whole status line (such as "HTTP/1.1 200 OK") and body of the last response
+  // received.
+  int status() const;
+  const std::string& statusLine() const;
+  const std::string& response() const;
+  // A description of why the last request wasn't ok.
+  const std::string& error() const;
+
+ private:
+  Result attempt(const char* body, size_t body_size,
+                 std::chrono::steady_clock::time_point deadline);
+  Result connect(std::chrono::steady_clock::time_point deadline);
+  Result send(const char* body, size_t body_size, std::chrono::steady_clock::time_point deadline);
+  Result receiveResponse(std::chrono::steady_clock::time_point deadline);
+  // Reads whatever is available into buffer_, waiting until the deadline for something to arrive.
+  Result receive(std::chrono::steady_clock::time_point deadline);
+  // Waits for the connection to be ready for the given poll(2) events. Returns false on timeout.
+  bool waitFor(short events, std::chrono::steady_clock::time_point deadline);
+  void disconnect();
+  Result fail(Result result, const std::string& message);
+
+  const std::string unix_socket_;
+  const std::string host_;
+  const uint32_t port_;
+  const std::chrono::milliseconds timeout_;
+  // The request line and Host header, which are the same for every request.
+  const std::string request_prefix_;
+  // The rest of the headers, rebuilt in place for each request.
+  std::string headers_;
+  // Raw bytes received from the agent.
+  std::string buffer_;
+  int fd_ = -1;
+  int status_ = 0;
+  std::string status_line_;
+  std::string response_;
+  std::string error_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_HTTP_CONNECTION_H
@@ -2,84 +2,139 @@
 
 #include <algorithm>
 #include <iostream>
+#include <new>
 #include <numeric>
+#include <stdexcept>
+
+#ifndef _MSC_VER
+#include "shared_memory.h"
+#endif
 
 namespace datadog {
 namespace opentracing {
 
-Limiter::Limiter(TimeProvider now_func, long max_tokens, double refresh_rate,
-                 long tokens_per_refresh)
-    : now_func_(now_func),
-      num_tokens_(max_tokens),
-      max_tokens_(max_tokens),
-      tokens_per_refresh_(tokens_per_refresh),
-      previous_rates_(9, 1.0) {
+#ifndef _MSC_VER
+// A State that any process can lock, in shared memory.
+struct Limiter::Shared {
+  Shared(const State& state) : state(state) {}
+
+  SharedMutex mutex;
+  State state;
+};
+#endif
+
+Limiter::State::State(std::chrono::steady_clock::time_point now, long max_tokens,
+                      double refresh_rate, long tokens_per_refresh)
+    : num_tokens(max_tokens), max_tokens(max_tokens), tokens_per_refresh(tokens_per_refresh) {
   // calculate refresh interval: (1/rate) * tokens per refresh as nanoseconds
-  refresh_interval_ =
+  refresh_interval =
       std::chrono::duration_cast<std::chrono::nanoseconds>(
           std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::seconds(1)) /
           refresh_rate) *
-      tokens_per_refresh_;
+      tokens_per_refresh;
 
-  auto now = now_func_().relative_time;
-  next_refresh_ = now + refresh_interval_;
-  current_period_ = std::chrono::time_point_cast<std::chrono::seconds>(now);
-  previous_rates_sum_ = std::accumulate(previous_rates_.begin(), previous_rates_.end(), 0.0);
+  next_refresh = now + refresh_interval;
+  current_period = std::chrono::time_point_cast<std::chrono::seconds>(now);
+  previous_rates.fill(1.0);
+  previous_rates_sum = std::accumulate(previous_rates.begin(), previous_rates.end(), 0.0);
+}
+
+Limiter::Limiter(TimeProvider now_func, long max_tokens, double refresh_rate,
+                 long tokens_per_refresh)
+    : now_func_(now_func),
+      local_state_(new State{now_func_().relative_time, max_tokens, refresh_rate,
+                             tokens_per_refresh}) {}
+
+Limiter::Limiter(TimeProvider now_func, long max_tokens, double refresh_rate,
+                 long tokens_per_refresh, const std::string& shared_memory_name)
+    : now_func_(now_func) {
+#ifdef _MSC_VER
+  // When compiling with MSVC, there's no shared memory.
+  (void)max_tokens;
+  (void)refresh_rate;
+  (void)tokens_per_refresh;
+  throw std::runtime_error("Sharing a limiter is not supported on this platform: " +
+                           shared_memory_name);
+#else
+  // The steady clock is the same for every process on the host (CLOCK_MONOTONIC), so its time
+  // points can be shared.
+  State state{now_func_().relative_time, max_tokens, refresh_rate, tokens_per_refresh};
+  memory_.reset(new SharedMemory{shared_memory_name, sizeof(Shared),
+                                 [&](void* data) { new (data) Shared{state}; }});
+  shared_ = static_cast<Shared*>(memory_->data());
+#endif
 }
 
+Limiter::~Limiter() {}
+
 LimitResult Limiter::allow() { return allow(1); }
 
 LimitResult Limiter::allow(long tokens_requested) {
-  auto now = now_func_().relative_time;
+#ifndef _MSC_VER
+  if (shared_ != nullptr) {
+    std::lock_guard<SharedMutex> lock_guard{shared_->mutex};
+    return allow(shared_->state, tokens_requested);
+  }
+#endif
   std::lock_guard<std::mutex> lock_guard{mutex_};
+  return allow(*local_state_, tokens_requested);
+}
+
+LimitResult Limiter::allow(State& state, long tokens_requested) {
+  auto now = now_func_().relative_time;
 
   // update effective rate calculations
   auto intervals = std::chrono::duration_cast<std::chrono::seconds>(
-                       std::chrono::time_point_cast<std::chrono::seconds>(now) - current_period_)
+                       std::chrono::time_point_cast<std::chrono::seconds>(now) -
+                       state.current_period)
                        .count();
   if (intervals > 0) {
-    if (std::size_t(intervals) >= previous_rates_.size()) {
-      std::fill(previous_rates_.begin() + 1, previous_rates_.end(), 1.0);
+    if (std::size_t(intervals) >= state.previous_rates.size()) {
+      std::fill(state.previous_rates.begin() + 1, state.previous_rates.end(), 1.0);
     } else {
-      std::move_backward(previous_rates_.begin(), previous_rates_.end() - intervals,
-                         previous_rates_.end());
-      if (num_requested_ > 0) {
-        previous_rates_[intervals - 1] = double(num_allowed_) / double(num_requested_);
+      std::move_backward(state.previous_rates.begin(), state.previous_rates.end() - intervals,
+                         state.previous_rates.end());
+      if (state.num_requested > 0) {
+        state.previous_rates[intervals - 1] =
+            double(state.num_allowed) / double(state.num_requested);
       } else {
-        previous_rates_[intervals - 1] = 1.0;
+        state.previous_rates[intervals - 1] = 1.0;
       }
       if (intervals - 2 > 0) {
-        std::fill(previous_rates_.begin(), previous_rates_.begin() + intervals - 2, 1.0);
+        std::fill(state.previous_rates.begin(), state.previous_rates.begin() + intervals - 2,
+                  1.0);
       }
     }
-    previous_rates_sum_ = std::accumulate(previous_rates_.begin(), previous_rates_.end(), 0.0);
-    num_allowed_ = 0;
-    num_requested_ = 0;
-    current_period_ = now;
+    state.previous_rates_sum =
+        std::accumulate(state.previous_rates.begin(), state.previous_rates.end(), 0.0);
+    state.num_allowed = 0;
+    state.num_requested = 0;
+    state.current_period = now;
   }
 
-  num_requested_++;
+  state.num_requested++;
   // refill "tokens"
-  if (now >= next_refresh_) {
-    auto intervals = (now - next_refresh_).count() / refresh_interval_.count() + 1;
+  if (now >= state.next_refresh) {
+    auto intervals = (now - state.next_refresh).count() / state.refresh_interval.count() + 1;
     if (intervals > 0) {
-      next_refresh_ += refresh_interval_ * intervals;
-      num_tokens_ += intervals * tokens_per_refresh_;
-      if (num_tokens_ > max_tokens_) {
-        num_tokens_ = max_tokens_;
+      state.next_refresh += state.refresh_interval * intervals;
+      state.num_tokens += intervals * state.tokens_per_refresh;
+      if (state.num_tokens > state.max_tokens) {
+        state.num_tokens = state.max_tokens;
       }
     }
   }
   // determine if allowed or not
   bool allowed = false;
-  if (num_tokens_ >= tokens_requested) {
+  if (state.num_tokens >= tokens_requested) {
     allowed = true;
-    num_allowed_++;
-    num_tokens_ -= tokens_requested;
+    state.num_allowed++;
+    state.num_tokens -= tokens_requested;
   }
 
-  auto effective_rate = (previous_rates_sum_ + double(num_allowed_) / double(num_requested_)) /
-                        (previous_rates_.size() + 1);
+  auto effective_rate =
+      (state.previous_rates_sum + double(state.num_allowed) / double(state.num_requested)) /
+      (state.previous_rates.size() + 1);
   return {allowed, effective_rate};
 }
 
@@ -1,8 +1,10 @@
 #ifndef DD_OPENTRACING_LIMITER_H
 #define DD_OPENTRACING_LIMITER_H
 
+#include <array>
+#include <memory>
 #include <mutex>
-#include <vector>
+#include <string>
 
 #include "clock.h"
 
@@ -14,27 +16,52 @@ struct LimitResult {
   double effective_rate;
 };
 
+class SharedMemory;
+
 class Limiter {
  public:
   Limiter(TimeProvider clock, long max_tokens, double refresh_rate, long tokens_per_refresh);
+  // A Limiter whose tokens, and effective rate, are shared by every Limiter on the host made with
+  // the same shared memory name, so that together they allow no more than one would. The first
+  // of them made decides max_tokens, refresh_rate and tokens_per_refresh for them all. May throw
+  // runtime_error, and always does when compiled with MSVC.
+  Limiter(TimeProvider clock, long max_tokens, double refresh_rate, long tokens_per_refresh,
+          const std::string& shared_memory_name);
+  ~Limiter();
 
   LimitResult allow();
   LimitResult allow(long tokens);
 
  private:
-  mutable std::mutex mutex_;
+  struct State {
+    State(std::chrono::steady_clock::time_point now, long max_tokens, double refresh_rate,
+          long tokens_per_refresh);
+
+    long num_tokens;
+    long max_tokens;
+    std::chrono::steady_clock::duration refresh_interval;
+    long tokens_per_refresh;
+    std::chrono::steady_clock::time_point next_refresh;
+    // effective rate fields
+    std::array<double, 9> previous_rates;
+    double previous_rates_sum;
+    std::chrono::steady_clock::time_point current_period;
+    long num_allowed = 0;
+    long num_requested = 0;
+  };
+  struct Shared;
+
+  LimitResult allow(State& state, long tokens);
+
   TimeProvider now_func_;
-  long num_tokens_;
-  long max_tokens_;
-  std::chrono::steady_clock::duration refresh_interval_;
-  long tokens_per_refresh_;
-  std::chrono::steady_clock::time_point next_refresh_;
-  // effective rate fields
-  std::vector<double> previous_rates_;
-  double previous_rates_sum_;
-  std::chrono::steady_clock::time_point current_period_;
-  long num_allowed_ = 0;
-  long num_requested_ = 0;
+  // Locks local_state_.
+  mutable std::mutex mutex_;
+  std::unique_ptr<State> local_state_;
+#ifndef _MSC_VER
+  // Or, when shared, the memory the state (and its lock) is in.
+  std::unique_ptr<SharedMemory> memory_;
+#endif
+  Shared* shared_ = nullptr;
 };
 
 }  // namespace opentracing
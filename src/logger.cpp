@@ -1,5 +1,7 @@
 #include "logger.h"
 
+#include <iostream>
+
 namespace datadog {
 namespace opentracing {
 
@@ -58,5 +60,32 @@ void VerboseLogger::Trace(uint64_t trace_id, uint64_t span_id, ot::string_view m
   log_func_(LogLevel::debug, format_message(trace_id, span_id, message));
 }
 
+RateLimitedLogger::RateLimitedLogger(std::shared_ptr<const Logger> logger,
+                                     std::chrono::milliseconds period)
+    : logger_(logger), period_(period) {}
+
+void RateLimitedLogger::Log(LogLevel level, ot::string_view message) noexcept try {
+  std::string text = message;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_log_) {
+      suppressed_++;
+      return;
+    }
+    next_log_ = now + period_;
+    if (suppressed_ > 0) {
+      text += " (" + std::to_string(suppressed_) + " similar messages were suppressed)";
+      suppressed_ = 0;
+    }
+  }
+  if (logger_ != nullptr) {
+    logger_->Log(level, text);
+  } else {
+    std::cerr << text << std::endl;
+  }
+} catch (const std::bad_alloc &) {
+}
+
 }  // namespace opentracing
 }  // namespace datadog
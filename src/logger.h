@@ -1,6 +1,10 @@
 #ifndef DD_OPENTRACING_LOGGER_H
 #define DD_OPENTRACING_LOGGER_H
 
+#include <chrono>
+#include <memory>
+#include <mutex>
+
 #include "datadog/opentracing.h"
 
 namespace datadog {
@@ -49,6 +53,22 @@ class VerboseLogger final : public Logger {
   void Trace(uint64_t trace_id, uint64_t span_id, ot::string_view message) const noexcept override;
 };
 
+// Passes messages on to a Logger at most once per period, so that a problem that keeps happening
+// (like the agent being down) doesn't flood the log. The messages in between are counted, and the
+// count is added to the next message passed on. If there's no Logger, messages go to std::cerr.
+class RateLimitedLogger {
+ public:
+  RateLimitedLogger(std::shared_ptr<const Logger> logger, std::chrono::milliseconds period);
+  void Log(LogLevel level, ot::string_view message) noexcept;
+
+ private:
+  const std::shared_ptr<const Logger> logger_;
+  const std::chrono::milliseconds period_;
+  std::mutex mutex_;
+  std::chrono::steady_clock::time_point next_log_;
+  uint64_t suppressed_ = 0;
+};
+
 }  // namespace opentracing
 }  // namespace datadog
 
@@ -0,0 +1,113 @@
+#ifndef DD_OPENTRACING_MPSC_QUEUE_H
+#define DD_OPENTRACING_MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace datadog {
+namespace opentracing {
+
+// A bounded, lock-free queue that any number of threads can push to, and one thread pops from.
+// It's a ring of cells, each with a sequence number that says whether the cell is ready to be
+// pushed to or popped from on the current lap of the ring (after Dmitry Vyukov's bounded MPMC
+// queue). Producers claim a cell with a compare-and-swap on the tail; the consumer, being the
+// only one, just advances the head.
+template <class T>
+class MpscQueue {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit MpscQueue(size_t capacity)
+      : mask_(roundUpToPowerOfTwo(capacity) - 1), cells_(new Cell[mask_ + 1]) {
+    for (size_t i = 0; i <= mask_; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Pushes the given value, unless the queue is full, in which case it returns false and value is
+  // left as it was. Thread-safe.
+  bool tryPush(T& value) {
+    size_t position = tail_.position.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[position & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      auto lap = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+      if (lap == 0) {
+        // The cell is free on this lap. Claim it, unless another producer got there first.
+        if (tail_.position.compare_exchange_weak(position, position + 1,
+                                                 std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (lap < 0) {
+        return false;  // The consumer hasn't popped this cell from the last lap yet.
+      } else {
+        position = tail_.position.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Pops the oldest value into value. Returns false if the queue is empty (or the oldest value is
+  // still being pushed). Must only be called from one thread at a time.
+  bool tryPop(T& value) {
+    size_t position = head_.position;
+    Cell& cell = cells_[position & mask_];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if (sequence != position + 1) {
+      return false;
+    }
+    value = std::move(cell.value);
+    cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+    head_.position = position + 1;
+    return true;
+  }
+
+  // Empties the queue, including any cell a producer claimed but hadn't finished pushing to. Not
+  // thread-safe at all: only for when nothing else can be using the queue, like in the child
+  // process after a fork(), where the threads that were pushing no longer exist.
+  void clear() {
+    for (size_t i = 0; i <= mask_; i++) {
+      cells_[i].value = T{};
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    tail_.position.store(0, std::memory_order_relaxed);
+    head_.position = 0;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  static size_t roundUpToPowerOfTwo(size_t n) {
+    size_t power = 1;
+    while (power < n) {
+      power <<= 1;
+    }
+    return power;
+  }
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  // Each on a cache line of its own, so that producers and the consumer don't contend for one.
+  struct {
+    char padding[64];
+    std::atomic<size_t> position{0};
+  } tail_;
+  struct {
+    char padding[64];
+    size_t position = 0;
+  } head_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_MPSC_QUEUE_H
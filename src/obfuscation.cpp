@@ -0,0 +1,74 @@
+#include "obfuscation.h"
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// Returns whether the segment starting at the specified `begin` of the specified `url` starts
+// with a version, like "v1/" or "V01/", that must not be obfuscated.
+bool is_version(const std::string& url, size_t begin) {
+  size_t size = url.size();
+  if (begin + 2 >= size || (url[begin] != 'v' && url[begin] != 'V') || !is_digit(url[begin + 1])) {
+    return false;
+  }
+  if (url[begin + 2] == '/') {
+    return true;
+  }
+  return begin + 3 < size && is_digit(url[begin + 2]) && url[begin + 3] == '/';
+}
+
+}  // namespace
+
+void legacyObfuscateUrl(std::string& url) {
+  // The result is never longer than the URL, so it's written over the URL as it's read. out is
+  // where the next character of the result goes, and never passes i.
+  size_t size = url.size();
+  size_t out = 0;
+  size_t i = 0;
+  while (i < size) {
+    if (url[i] != '/') {
+      url[out++] = url[i++];
+      continue;
+    }
+    size_t begin = i + 1;
+    // Find the end of the segment, and the first '?' or '&' in it, and the first '?', '-' or
+    // digit in it.
+    size_t end = begin;
+    size_t name_end = std::string::npos;
+    size_t first_mark = std::string::npos;
+    for (; end < size && url[end] != '/'; end++) {
+      char c = url[end];
+      if (name_end == std::string::npos && (c == '?' || c == '&')) {
+        name_end = end;
+      }
+      if (first_mark == std::string::npos && (c == '?' || c == '-' || is_digit(c))) {
+        first_mark = end;
+      }
+    }
+    if (name_end != std::string::npos && url[name_end] == '?' && name_end + 1 < end) {
+      // A name and a query string: keep the name.
+      url[out++] = '/';
+      for (size_t j = begin; j < name_end; j++) {
+        url[out++] = url[j];
+      }
+      url[out++] = '?';
+    } else if (first_mark != std::string::npos && url[first_mark] != '?' &&
+               !is_version(url, begin)) {
+      // A digit or '-' before any query string.
+      url[out++] = '/';
+      url[out++] = '?';
+    } else {
+      for (size_t j = i; j < end; j++) {
+        url[out++] = url[j];
+      }
+    }
+    i = end;
+  }
+  url.resize(out);
+}
+
+}  // namespace opentracing
+}  // namespace datadog
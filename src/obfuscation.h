@@ -0,0 +1,21 @@
+#ifndef DD_OPENTRACING_OBFUSCATION_H
+#define DD_OPENTRACING_OBFUSCATION_H
+
+#include <string>
+
+namespace datadog {
+namespace opentracing {
+
+// Heavy-handed obfuscation of a URL, in place, for DD_TRACE_CPP_LEGACY_OBFUSCATION. Replaces each
+// path segment that has a query string with the segment's name and a '?', and each segment with a
+// digit or '-' in it (except a version, like "v1/") with a '?'. Hostnames count as segments.
+//
+// Gives the same result as replacing each match of the regular expression
+//   (\/)(?:(?:([^?\/&]*)(?:\?[^\/]+))|(?:(?![vV]\d{1,2}\/)[^\/\d\?]*[\d-]+[^\/]*))
+// with "$1$2?", which it used to be, in one pass and without allocating.
+void legacyObfuscateUrl(std::string& url);
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_OBFUSCATION_H
@@ -1,11 +1,15 @@
 // Implementation of the exposed makeTracer function.
-// This is kept separately to isolate the AgentWriter and its cURL dependency.
+// This is kept separately to isolate the AgentWriter and its cURL dependency (which builds with
+// DD_OPENTRACING_NO_CURL defined do without).
 // Users of the library that do not use this tracer are able to avoid the
 // additional dependency and implementation details.
 
 #include <datadog/opentracing.h>
 
 #include "agent_writer.h"
+#ifndef _MSC_VER
+#include "collector_writer.h"
+#endif
 #include "sample.h"
 #include "tracer.h"
 #include "tracer_options.h"
@@ -25,10 +29,32 @@ std::shared_ptr<ot::Tracer> makeTracer(const TracerOptions &options) {
   }
   TracerOptions opts = maybe_options.value();
 
-  auto sampler = std::make_shared<RulesSampler>();
-  auto writer = std::shared_ptr<Writer>{
-      new AgentWriter(opts.agent_host, opts.agent_port, opts.agent_url,
-                      std::chrono::milliseconds(llabs(opts.write_period_ms)), sampler)};
+  auto sampler = opts.sampling_limiter_name.empty()
+                     ? std::make_shared<RulesSampler>()
+                     : std::make_shared<RulesSampler>(opts.sampling_limiter_name);
+  AgentWriterOptions writer_options;
+  writer_options.write_period = std::chrono::milliseconds(llabs(opts.write_period_ms));
+  writer_options.max_concurrent_requests = opts.agent_max_concurrent_requests;
+  writer_options.native_transport = opts.agent_native_transport;
+  writer_options.spool.directory = opts.agent_spool_directory;
+  writer_options.max_consecutive_failures = opts.agent_max_consecutive_failures;
+  writer_options.logger = std::make_shared<StandardLogger>(opts.log_func);
+  std::shared_ptr<Writer> writer;
+  if (opts.agent_collector_name.empty()) {
+    writer.reset(new AgentWriter(opts.agent_host, opts.agent_port, opts.agent_url, writer_options,
+                                 sampler));
+  } else {
+#ifdef _MSC_VER
+    // Rejected by applyTracerOptionsFromEnvironment().
+    throw std::runtime_error("agent_collector_name is not supported on this platform");
+#else
+    CollectorWriterOptions collector_options;
+    collector_options.name = opts.agent_collector_name;
+    collector_options.agent_writer = writer_options;
+    writer.reset(new CollectorWriter(opts.agent_host, opts.agent_port, opts.agent_url,
+                                     collector_options, sampler));
+#endif
+  }
   return std::shared_ptr<ot::Tracer>{new Tracer{opts, writer, sampler}};
 }
 
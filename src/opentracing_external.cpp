@@ -28,7 +28,9 @@ std::tuple<std::shared_ptr<ot::Tracer>, std::shared_ptr<TraceEncoder>> makeTrace
   }
   TracerOptions opts = maybe_options.value();
 
-  auto sampler = std::make_shared<RulesSampler>();
+  auto sampler = opts.sampling_limiter_name.empty()
+                     ? std::make_shared<RulesSampler>()
+                     : std::make_shared<RulesSampler>(opts.sampling_limiter_name);
   auto writer = std::make_shared<ExternalWriter>(sampler);
   auto encoder = writer->encoder();
   return std::tuple<std::shared_ptr<ot::Tracer>, std::shared_ptr<TraceEncoder>>{
@@ -1,7 +1,9 @@
 #include "propagation.h"
 
 #include <algorithm>
+#include <array>
 #include <iostream>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <sstream>
 #include <stdexcept>
@@ -16,33 +18,86 @@ using json = nlohmann::json;
 namespace datadog {
 namespace opentracing {
 
+// Big enough for a uint64_t in decimal (20 digits) or hex (16).
+using IdBuffer = std::array<char, 20>;
+
 struct HeadersImpl {
   const char *trace_id_header;
   const char *span_id_header;
   const char *sampling_priority_header;
   const char *origin_header;
   const int base;
-  std::string (*encode_id)(uint64_t);
-  std::string (*encode_sampling_priority)(SamplingPriority);
+  // Formats the id into the end of the buffer, and returns the part of it used.
+  ot::string_view (*encode_id)(uint64_t, IdBuffer &);
+  ot::string_view (*encode_sampling_priority)(SamplingPriority);
 };
 
 namespace {
-std::string asHex(uint64_t id) {
-  std::stringstream stream;
-  stream << std::hex << id;
-  return stream.str();
+// The decimal digits of 0 to 99, in pairs.
+const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+ot::string_view asDecimal(uint64_t id, IdBuffer &buffer) {
+  char *end = buffer.data() + buffer.size();
+  char *begin = end;
+  while (id >= 100) {
+    const char *pair = digit_pairs + 2 * (id % 100);
+    id /= 100;
+    *--begin = pair[1];
+    *--begin = pair[0];
+  }
+  if (id >= 10) {
+    const char *pair = digit_pairs + 2 * id;
+    *--begin = pair[1];
+    *--begin = pair[0];
+  } else {
+    *--begin = static_cast<char>('0' + id);
+  }
+  return {begin, static_cast<size_t>(end - begin)};
+}
+
+ot::string_view asHex(uint64_t id, IdBuffer &buffer) {
+  static const char hex_digits[] = "0123456789abcdef";
+  char *end = buffer.data() + buffer.size();
+  char *begin = end;
+  do {
+    *--begin = hex_digits[id & 0xf];
+    id >>= 4;
+  } while (id != 0);
+  return {begin, static_cast<size_t>(end - begin)};
 }
 
 // B3 style header propagation only supports "drop" and "keep", with no distinction between
 // user/sampler as the decision maker. Here we clamp the serialized values.
-std::string clampB3SamplingPriorityValue(SamplingPriority p) {
+ot::string_view clampB3SamplingPriorityValue(SamplingPriority p) {
   if (static_cast<int>(p) > 0) {
     return "1";  // Keep, as SamplingPriority::SamplerKeep.
   }
   return "0";  // Drop, as SamplingPriority::SamplerDrop.
 }
 
-std::string to_string(SamplingPriority p) { return std::to_string(static_cast<int>(p)); }
+ot::string_view to_string(SamplingPriority p) {
+  switch (p) {
+    case SamplingPriority::UserDrop:
+      return "-1";
+    case SamplingPriority::SamplerDrop:
+      return "0";
+    case SamplingPriority::SamplerKeep:
+      return "1";
+    case SamplingPriority::UserKeep:
+      return "2";
+  }
+  return "";
+}
 
 // Header names for trace data. Hax constexpr map-like object.
 constexpr struct {
@@ -52,7 +107,7 @@ constexpr struct {
                       "x-datadog-sampling-priority",
                       "x-datadog-origin",
                       10,
-                      std::to_string,
+                      asDecimal,
                       to_string};
   // https://github.com/openzipkin/b3-propagation
   HeadersImpl b3{"X-B3-TraceId",
@@ -79,21 +134,204 @@ const std::string json_sampling_priority_key = "sampling_priority";
 const std::string json_origin_key = "origin";
 const std::string json_baggage_key = "baggage";
 
-// Does what it says on the tin. Just looks at each char, so don't try and use this on
-// unicode strings, only used for comparing HTTP header names.
-// Rolled my own because I don't want to import all of libboost for a couple of functions!
-bool equals_ignore_case(const std::string &a, const std::string &b) {
-  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
-                    [](char a, char b) { return tolower(a) == tolower(b); });
+// The compact binary encoding of a SpanContext, for std::ostream/istream carriers between
+// services that all read it:
+//
+//   magic     1 byte, compact_magic (JSON can't start with it)
+//   version   1 byte, compact_version
+//   flags     1 byte, compact_has_*
+//   trace id  8 bytes, little-endian
+//   parent id 8 bytes, little-endian
+//   sampling priority  1 byte, signed, if compact_has_sampling_priority
+//   origin    varint length then bytes, if compact_has_origin
+//   baggage   varint count, then for each item, varint length then bytes of its key and value
+//
+// Varints are LEB128: 7 bits at a time, least significant first, with the top bit set on every
+// byte but the last. Readers reject versions they don't know.
+const unsigned char compact_magic = 0xdd;
+const unsigned char compact_version = 1;
+const unsigned char compact_has_sampling_priority = 1 << 0;
+const unsigned char compact_has_origin = 1 << 1;
+// Strings are read this much at a time, so that a corrupt length can't allocate more than the
+// stream actually holds.
+const size_t compact_read_chunk = 4096;
+
+void writeFixed64(std::string &out, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+void writeVarint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+void writeString(std::string &out, const std::string &value) {
+  writeVarint(out, value.size());
+  out.append(value);
+}
+
+bool readByte(std::istream &in, unsigned char &value) {
+  auto c = in.get();
+  if (c == std::istream::traits_type::eof()) {
+    return false;
+  }
+  value = static_cast<unsigned char>(c);
+  return true;
+}
+
+bool readFixed64(std::istream &in, uint64_t &value) {
+  value = 0;
+  for (int i = 0; i < 8; i++) {
+    unsigned char byte;
+    if (!readByte(in, byte)) {
+      return false;
+    }
+    value |= static_cast<uint64_t>(byte) << (8 * i);
+  }
+  return true;
+}
+
+bool readVarint(std::istream &in, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    unsigned char byte;
+    if (!readByte(in, byte)) {
+      return false;
+    }
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;  // Longer than any uint64_t.
+}
+
+bool readString(std::istream &in, std::string &value) {
+  uint64_t size;
+  if (!readVarint(in, size)) {
+    return false;
+  }
+  value.clear();
+  while (value.size() < size) {
+    auto chunk =
+        static_cast<size_t>(std::min<uint64_t>(size - value.size(), compact_read_chunk));
+    size_t offset = value.size();
+    value.resize(offset + chunk);
+    in.read(&value[offset], chunk);
+    if (static_cast<size_t>(in.gcount()) != chunk) {
+      return false;
+    }
+  }
+  return true;
 }
 
 // Checks to see if the given string has the given prefix.
-bool has_prefix(const std::string &str, const std::string &prefix) {
+bool has_prefix(ot::string_view str, ot::string_view prefix) {
   if (str.size() < prefix.size()) {
     return false;
   }
-  auto result = std::mismatch(prefix.begin(), prefix.end(), str.begin());
-  return result.first == prefix.end();
+  return std::equal(prefix.begin(), prefix.end(), str.begin());
+}
+
+// Like tolower, but only for ASCII, so that it doesn't depend on the locale. Only used for HTTP
+// header names.
+constexpr char lowerCase(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+// The part of a SpanContext that a header holds.
+enum class HeaderField { trace_id, parent_id, sampling_priority, origin };
+
+constexpr unsigned styleBit(PropagationStyle style) { return 1u << static_cast<unsigned>(style); }
+
+// The headers that SpanContexts are extracted from, other than baggage.
+struct KnownHeader {
+  // In lower case.
+  const char *name;
+  size_t size;
+  HeaderField field;
+  // The styles it's part of, as styleBits.
+  unsigned styles;
+};
+
+constexpr KnownHeader known_headers[] = {
+    {"x-datadog-trace-id", 18, HeaderField::trace_id, styleBit(PropagationStyle::Datadog)},
+    {"x-datadog-parent-id", 19, HeaderField::parent_id, styleBit(PropagationStyle::Datadog)},
+    {"x-datadog-sampling-priority", 27, HeaderField::sampling_priority,
+     styleBit(PropagationStyle::Datadog)},
+    {"x-datadog-origin", 16, HeaderField::origin,
+     styleBit(PropagationStyle::Datadog) | styleBit(PropagationStyle::B3)},
+    {"x-b3-traceid", 12, HeaderField::trace_id, styleBit(PropagationStyle::B3)},
+    {"x-b3-spanid", 11, HeaderField::parent_id, styleBit(PropagationStyle::B3)},
+    {"x-b3-sampled", 12, HeaderField::sampling_priority, styleBit(PropagationStyle::B3)},
+};
+constexpr size_t num_known_headers = sizeof(known_headers) / sizeof(known_headers[0]);
+
+// A perfect hash of the known headers: no two of them have the same size and sixth character, so
+// a header name is looked up in known_header_slots with just those. Names shorter than that
+// aren't known.
+constexpr size_t known_header_slots = 16;
+constexpr size_t known_header_hashed_char = 5;
+
+constexpr size_t headerSlot(const char *name, size_t size) {
+  return (size + static_cast<unsigned char>(lowerCase(name[known_header_hashed_char]))) %
+         known_header_slots;
+}
+
+constexpr bool knownHeadersAreConsistent() {
+  for (size_t i = 0; i < num_known_headers; i++) {
+    const KnownHeader &header = known_headers[i];
+    for (size_t c = 0; c < header.size; c++) {
+      if (header.name[c] == '\0' || lowerCase(header.name[c]) != header.name[c]) {
+        return false;
+      }
+    }
+    if (header.name[header.size] != '\0' || header.size <= known_header_hashed_char) {
+      return false;
+    }
+    for (size_t j = 0; j < i; j++) {
+      if (headerSlot(header.name, header.size) ==
+          headerSlot(known_headers[j].name, known_headers[j].size)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+static_assert(knownHeadersAreConsistent(),
+              "known_headers must be lower case, sized correctly, and in slots of their own");
+
+// The known header in each slot, if any, as its index in known_headers plus one.
+struct KnownHeaderTable {
+  constexpr KnownHeaderTable() : slots{} {
+    for (size_t i = 0; i < num_known_headers; i++) {
+      slots[headerSlot(known_headers[i].name, known_headers[i].size)] = i + 1;
+    }
+  }
+
+  size_t slots[known_header_slots];
+};
+constexpr KnownHeaderTable known_header_table{};
+
+// Returns the known header with the given name, ignoring case, or nullptr if it isn't one.
+const KnownHeader *findKnownHeader(ot::string_view name) {
+  if (name.size() <= known_header_hashed_char) {
+    return nullptr;
+  }
+  size_t index = known_header_table.slots[headerSlot(name.data(), name.size())];
+  if (index == 0) {
+    return nullptr;
+  }
+  const KnownHeader &header = known_headers[index - 1];
+  if (header.size != name.size() ||
+      !std::equal(name.begin(), name.end(), header.name,
+                  [](char a, char b) { return lowerCase(a) == b; })) {
+    return nullptr;
+  }
+  return &header;
 }
 
 // If the result of `SpanContext::deserialize` can be determined solely from
@@ -138,6 +376,12 @@ uint64_t parse_uint64(const std::string &text, int base) {
   return result;
 }
 
+// The baggage of every context without any, so that they don't each allocate their own.
+std::shared_ptr<const std::unordered_map<std::string, std::string>> emptyBaggage() {
+  static const auto empty = std::make_shared<const std::unordered_map<std::string, std::string>>();
+  return empty;
+}
+
 }  // namespace
 
 std::vector<ot::string_view> getPropagationHeaderNames(const std::set<PropagationStyle> &styles,
@@ -159,7 +403,21 @@ OptionalSamplingPriority asSamplingPriority(int i) {
       i > static_cast<int>(SamplingPriority::MaximumValue)) {
     return nullptr;
   }
-  return std::make_unique<SamplingPriority>(static_cast<SamplingPriority>(i));
+  return static_cast<SamplingPriority>(i);
+}
+
+constexpr int SharedSamplingPriority::unset;
+
+void SharedSamplingPriority::set(OptionalSamplingPriority priority) {
+  priority_.store(priority == nullptr ? unset : static_cast<int>(*priority));
+}
+
+OptionalSamplingPriority SharedSamplingPriority::get() const {
+  int value = priority_.load();
+  if (value == unset) {
+    return nullptr;
+  }
+  return static_cast<SamplingPriority>(value);
 }
 
 SpanContext::SpanContext(std::shared_ptr<const Logger> logger, uint64_t id, uint64_t trace_id,
@@ -169,7 +427,8 @@ SpanContext::SpanContext(std::shared_ptr<const Logger> logger, uint64_t id, uint
       id_(id),
       trace_id_(trace_id),
       origin_(origin),
-      baggage_(std::move(baggage)) {}
+      baggage_(baggage.empty() ? emptyBaggage()
+                               : std::make_shared<const Baggage>(std::move(baggage))) {}
 
 SpanContext SpanContext::NginxOpenTracingCompatibilityHackSpanContext(
     std::shared_ptr<const Logger> logger, uint64_t id, uint64_t trace_id,
@@ -181,27 +440,23 @@ SpanContext SpanContext::NginxOpenTracingCompatibilityHackSpanContext(
 
 SpanContext::SpanContext(const SpanContext &other)
     : nginx_opentracing_compatibility_hack_(other.nginx_opentracing_compatibility_hack_),
+      logger_(other.logger_),
       id_(other.id_),
       trace_id_(other.trace_id_),
+      propagated_sampling_priority_(other.propagated_sampling_priority_),
       origin_(other.origin_),
-      baggage_(other.baggage_) {
-  if (other.propagated_sampling_priority_ != nullptr) {
-    propagated_sampling_priority_.reset(
-        new SamplingPriority(*other.propagated_sampling_priority_));
-  }
-}
+      shared_sampling_priority_(other.shared_sampling_priority_),
+      baggage_(other.baggage()) {}
 
 SpanContext &SpanContext::operator=(const SpanContext &other) {
-  std::lock_guard<std::mutex> lock{mutex_};
+  logger_ = other.logger_;
   id_ = other.id_;
   trace_id_ = other.trace_id_;
   origin_ = other.origin_;
-  baggage_ = other.baggage_;
+  shared_sampling_priority_ = other.shared_sampling_priority_;
+  std::atomic_store(&baggage_, other.baggage());
   nginx_opentracing_compatibility_hack_ = other.nginx_opentracing_compatibility_hack_;
-  if (other.propagated_sampling_priority_ != nullptr) {
-    propagated_sampling_priority_.reset(
-        new SamplingPriority(*other.propagated_sampling_priority_));
-  }
+  propagated_sampling_priority_ = other.propagated_sampling_priority_;
   return *this;
 }
 
@@ -210,33 +465,35 @@ SpanContext::SpanContext(SpanContext &&other)
       logger_(other.logger_),
       id_(other.id_),
       trace_id_(other.trace_id_),
-      propagated_sampling_priority_(std::move(other.propagated_sampling_priority_)),
+      propagated_sampling_priority_(other.propagated_sampling_priority_),
       origin_(other.origin_),
-      baggage_(std::move(other.baggage_)) {}
+      shared_sampling_priority_(std::move(other.shared_sampling_priority_)),
+      baggage_(other.baggage()) {}
 
 SpanContext &SpanContext::operator=(SpanContext &&other) {
-  std::lock_guard<std::mutex> lock{mutex_};
   logger_ = other.logger_;
   id_ = other.id_;
   trace_id_ = other.trace_id_;
   origin_ = other.origin_;
-  propagated_sampling_priority_ = std::move(other.propagated_sampling_priority_);
-  baggage_ = std::move(other.baggage_);
+  propagated_sampling_priority_ = other.propagated_sampling_priority_;
+  shared_sampling_priority_ = std::move(other.shared_sampling_priority_);
+  std::atomic_store(&baggage_, other.baggage());
   nginx_opentracing_compatibility_hack_ = other.nginx_opentracing_compatibility_hack_;
   return *this;
 }
 
 bool SpanContext::operator==(const SpanContext &other) const {
+  auto baggage = this->baggage();
+  auto other_baggage = other.baggage();
   if (logger_ != other.logger_ || id_ != other.id_ || trace_id_ != other.trace_id_ ||
-      baggage_ != other.baggage_ ||
+      (baggage != other_baggage && *baggage != *other_baggage) ||
       nginx_opentracing_compatibility_hack_ != other.nginx_opentracing_compatibility_hack_) {
     return false;
   }
   if (propagated_sampling_priority_ == nullptr) {
     return other.propagated_sampling_priority_ == nullptr;
   }
-  return other.propagated_sampling_priority_ != nullptr &&
-         *propagated_sampling_priority_ == *other.propagated_sampling_priority_ &&
+  return propagated_sampling_priority_ == other.propagated_sampling_priority_ &&
          origin_ == other.origin_;
 }
 
@@ -244,8 +501,8 @@ bool SpanContext::operator!=(const SpanContext &other) const { return !(*this ==
 
 void SpanContext::ForeachBaggageItem(
     std::function<bool(const std::string &, const std::string &)> f) const {
-  std::lock_guard<std::mutex> lock{mutex_};
-  for (const auto &baggage_item : baggage_) {
+  auto baggage = this->baggage();
+  for (const auto &baggage_item : *baggage) {
     if (!f(baggage_item.first, baggage_item.second)) {
       return;
     }
@@ -253,7 +510,6 @@ void SpanContext::ForeachBaggageItem(
 }
 
 std::unique_ptr<ot::SpanContext> SpanContext::Clone() const noexcept {
-  std::lock_guard<std::mutex> lock{mutex_};
   return std::unique_ptr<opentracing::SpanContext>(new SpanContext(*this));
 }
 
@@ -261,58 +517,68 @@ std::string SpanContext::ToTraceID() const noexcept { return std::to_string(trac
 
 std::string SpanContext::ToSpanID() const noexcept { return std::to_string(id_); }
 
-uint64_t SpanContext::id() const {
-  // Not locked, since id_ never modified.
-  return id_;
-}
+uint64_t SpanContext::id() const { return id_; }
 
-uint64_t SpanContext::traceId() const {
-  // Not locked, since trace_id_ never modified.
-  return trace_id_;
-}
+uint64_t SpanContext::traceId() const { return trace_id_; }
 
 OptionalSamplingPriority SpanContext::getPropagatedSamplingPriority() const {
-  // Not locked. Both these members are only ever written in the constructor/builder.
-  OptionalSamplingPriority p = nullptr;
-  if (propagated_sampling_priority_ != nullptr) {
-    p.reset(new SamplingPriority(*propagated_sampling_priority_));
-  }
-  return p;
+  return propagated_sampling_priority_;
 }
 
-const std::string SpanContext::origin() const {
-  // Not locked, since origin_ never modified.
-  return origin_;
-}
+const std::string SpanContext::origin() const { return origin_; }
 
 void SpanContext::setBaggageItem(ot::string_view key, ot::string_view value) noexcept try {
-  std::lock_guard<std::mutex> lock{mutex_};
-  baggage_.emplace(key, value);
+  // Copies the baggage, which other contexts may share, and replaces it with the copy. Retried if
+  // it was replaced by another thread in the meantime.
+  auto baggage = this->baggage();
+  std::shared_ptr<const Baggage> changed;
+  do {
+    if (baggage->find(key) != baggage->end()) {
+      return;  // Items can't be changed once set.
+    }
+    auto copy = std::make_shared<Baggage>(*baggage);
+    copy->emplace(key, value);
+    changed = std::move(copy);
+  } while (!std::atomic_compare_exchange_weak(&baggage_, &baggage, changed));
 } catch (const std::bad_alloc &) {
 }
 
 std::string SpanContext::baggageItem(ot::string_view key) const {
-  std::lock_guard<std::mutex> lock{mutex_};
-  auto lookup = baggage_.find(key);
-  if (lookup != baggage_.end()) {
+  auto baggage = this->baggage();
+  auto lookup = baggage->find(key);
+  if (lookup != baggage->end()) {
     return lookup->second;
   }
   return {};
 }
 
-SpanContext SpanContext::withId(uint64_t id) const {
-  std::lock_guard<std::mutex> lock{mutex_};
-  auto baggage = baggage_;  // (Shallow) copy baggage.
-  SpanContext context{logger_, id, trace_id_, origin_, std::move(baggage)};
-  if (propagated_sampling_priority_ != nullptr) {
-    context.propagated_sampling_priority_.reset(
-        new SamplingPriority(*propagated_sampling_priority_));
+std::shared_ptr<const SpanContext::Baggage> SpanContext::baggage() const {
+  return std::atomic_load(&baggage_);
+}
+
+OptionalSamplingPriority SpanContext::samplingPriority(
+    const std::shared_ptr<SpanBuffer> &pending_traces) const {
+  if (shared_sampling_priority_ != nullptr) {
+    return shared_sampling_priority_->get();
   }
+  return pending_traces->getSamplingPriority(trace_id_);
+}
+
+void SpanContext::setSharedSamplingPriority(
+    std::shared_ptr<const SharedSamplingPriority> priority) {
+  shared_sampling_priority_ = std::move(priority);
+}
+
+SpanContext SpanContext::withId(uint64_t id) const {
+  SpanContext context{logger_, id, trace_id_, origin_, {}};
+  // Shared until either context changes it.
+  context.baggage_ = baggage();
+  context.propagated_sampling_priority_ = propagated_sampling_priority_;
   return context;
 }
 
 ot::expected<void> SpanContext::serialize(std::ostream &writer,
-                                          const std::shared_ptr<SpanBuffer> pending_traces,
+                                          const std::shared_ptr<SpanBuffer> &pending_traces,
                                           bool prioritySamplingEnabled) const try {
   // check ostream state
   if (!writer.good()) {
@@ -323,14 +589,14 @@ ot::expected<void> SpanContext::serialize(std::ostream &writer,
   // JSON numbers only support 64bit IEEE 754, so we encode these as strings.
   j[json_trace_id_key] = std::to_string(trace_id_);
   j[json_parent_id_key] = std::to_string(id_);
-  OptionalSamplingPriority sampling_priority = pending_traces->getSamplingPriority(trace_id_);
+  OptionalSamplingPriority sampling_priority = samplingPriority(pending_traces);
   if (sampling_priority != nullptr && prioritySamplingEnabled) {
     j[json_sampling_priority_key] = static_cast<int>(*sampling_priority);
     if (!origin_.empty()) {
       j[json_origin_key] = origin_;
     }
   }
-  j[json_baggage_key] = baggage_;
+  j[json_baggage_key] = *baggage();
 
   writer << j.dump();
   // check ostream state
@@ -343,9 +609,57 @@ ot::expected<void> SpanContext::serialize(std::ostream &writer,
   return ot::make_unexpected(std::make_error_code(std::errc::not_enough_memory));
 }
 
+ot::expected<void> SpanContext::serializeCompact(std::ostream &writer,
+                                                 const std::shared_ptr<SpanBuffer> &pending_traces,
+                                                 bool prioritySamplingEnabled) const try {
+  if (!writer.good()) {
+    return ot::make_unexpected(std::make_error_code(std::errc::io_error));
+  }
+
+  OptionalSamplingPriority sampling_priority = nullptr;
+  if (prioritySamplingEnabled) {
+    sampling_priority = samplingPriority(pending_traces);
+  }
+  unsigned char flags = 0;
+  if (sampling_priority != nullptr) {
+    // As in JSON, the origin only goes with a sampling priority.
+    flags |= compact_has_sampling_priority;
+    if (!origin_.empty()) {
+      flags |= compact_has_origin;
+    }
+  }
+  std::string encoded;
+  encoded.reserve(3 + 8 + 8 + 1 + 1);
+  encoded.push_back(static_cast<char>(compact_magic));
+  encoded.push_back(static_cast<char>(compact_version));
+  encoded.push_back(static_cast<char>(flags));
+  writeFixed64(encoded, trace_id_);
+  writeFixed64(encoded, id_);
+  if (flags & compact_has_sampling_priority) {
+    encoded.push_back(static_cast<char>(static_cast<int>(*sampling_priority)));
+  }
+  if (flags & compact_has_origin) {
+    writeString(encoded, origin_);
+  }
+  auto baggage = this->baggage();
+  writeVarint(encoded, baggage->size());
+  for (const auto &baggage_item : *baggage) {
+    writeString(encoded, baggage_item.first);
+    writeString(encoded, baggage_item.second);
+  }
+
+  writer.write(encoded.data(), encoded.size());
+  if (!writer.good()) {
+    return ot::make_unexpected(std::make_error_code(std::errc::io_error));
+  }
+  return {};
+} catch (const std::bad_alloc &) {
+  return ot::make_unexpected(std::make_error_code(std::errc::not_enough_memory));
+}
+
 ot::expected<void> SpanContext::serialize(const ot::TextMapWriter &writer,
-                                          const std::shared_ptr<SpanBuffer> pending_traces,
-                                          std::set<PropagationStyle> styles,
+                                          const std::shared_ptr<SpanBuffer> &pending_traces,
+                                          const std::set<PropagationStyle> &styles,
                                           bool prioritySamplingEnabled) const try {
   ot::expected<void> result;
   for (PropagationStyle style : styles) {
@@ -361,21 +675,23 @@ ot::expected<void> SpanContext::serialize(const ot::TextMapWriter &writer,
 }
 
 ot::expected<void> SpanContext::serialize(const ot::TextMapWriter &writer,
-                                          const std::shared_ptr<SpanBuffer> pending_traces,
+                                          const std::shared_ptr<SpanBuffer> &pending_traces,
                                           const HeadersImpl &headers_impl,
                                           bool prioritySamplingEnabled) const {
-  std::lock_guard<std::mutex> lock{mutex_};
-  auto result = writer.Set(headers_impl.trace_id_header, headers_impl.encode_id(trace_id_));
+  // Formatted on the stack, so that injecting doesn't allocate.
+  IdBuffer id_buffer;
+  auto result =
+      writer.Set(headers_impl.trace_id_header, headers_impl.encode_id(trace_id_, id_buffer));
   if (!result) {
     return result;
   }
-  result = writer.Set(headers_impl.span_id_header, headers_impl.encode_id(id_));
+  result = writer.Set(headers_impl.span_id_header, headers_impl.encode_id(id_, id_buffer));
   if (!result) {
     return result;
   }
 
   if (prioritySamplingEnabled) {
-    OptionalSamplingPriority sampling_priority = pending_traces->getSamplingPriority(trace_id_);
+    OptionalSamplingPriority sampling_priority = samplingPriority(pending_traces);
     if (sampling_priority != nullptr) {
       result = writer.Set(headers_impl.sampling_priority_header,
                           headers_impl.encode_sampling_priority(*sampling_priority));
@@ -397,9 +713,19 @@ ot::expected<void> SpanContext::serialize(const ot::TextMapWriter &writer,
     }
   }
 
-  for (auto baggage_item : baggage_) {
-    std::string key = std::string(baggage_prefix) + baggage_item.first;
-    result = writer.Set(key, baggage_item.second);
+  // Keys that fit are prefixed on the stack too.
+  std::array<char, 256> key_buffer;
+  std::copy(baggage_prefix.begin(), baggage_prefix.end(), key_buffer.begin());
+  auto baggage = this->baggage();
+  for (const auto &baggage_item : *baggage) {
+    const std::string &name = baggage_item.first;
+    if (baggage_prefix.size() + name.size() <= key_buffer.size()) {
+      std::copy(name.begin(), name.end(), key_buffer.begin() + baggage_prefix.size());
+      result = writer.Set({key_buffer.data(), baggage_prefix.size() + name.size()},
+                          baggage_item.second);
+    } else {
+      result = writer.Set(std::string(baggage_prefix) + name, baggage_item.second);
+    }
     if (!result) {
       return result;
     }
@@ -418,6 +744,9 @@ ot::expected<std::unique_ptr<ot::SpanContext>> SpanContext::deserialize(
   if (reader.eof()) {
     return {};
   }
+  if (reader.peek() == compact_magic) {
+    return deserializeCompact(logger, reader);
+  }
 
   uint64_t trace_id, parent_id;
   OptionalSamplingPriority sampling_priority = nullptr;
@@ -464,82 +793,200 @@ ot::expected<std::unique_ptr<ot::SpanContext>> SpanContext::deserialize(
   return ot::make_unexpected(std::make_error_code(std::errc::not_enough_memory));
 }
 
-ot::expected<std::unique_ptr<ot::SpanContext>> SpanContext::deserialize(
-    std::shared_ptr<const Logger> logger, const ot::TextMapReader &reader,
-    std::set<PropagationStyle> styles) try {
-  std::unique_ptr<ot::SpanContext> context = nullptr;
-  for (PropagationStyle style : styles) {
-    auto result = SpanContext::deserialize(logger, reader, propagation_headers[style]);
-    if (!result) {
-      return ot::make_unexpected(result.error());
+ot::expected<std::unique_ptr<ot::SpanContext>> SpanContext::deserializeCompact(
+    std::shared_ptr<const Logger> logger, std::istream &reader) {
+  unsigned char magic, version, flags;
+  if (!readByte(reader, magic) || !readByte(reader, version)) {
+    return ot::make_unexpected(ot::span_context_corrupted_error);
+  }
+  if (version != compact_version) {
+    return ot::make_unexpected(ot::span_context_corrupted_error);
+  }
+  uint64_t trace_id, parent_id;
+  if (!readByte(reader, flags) || !readFixed64(reader, trace_id) ||
+      !readFixed64(reader, parent_id)) {
+    return ot::make_unexpected(ot::span_context_corrupted_error);
+  }
+  OptionalSamplingPriority sampling_priority = nullptr;
+  if (flags & compact_has_sampling_priority) {
+    unsigned char priority;
+    if (!readByte(reader, priority)) {
+      return ot::make_unexpected(ot::span_context_corrupted_error);
     }
-    if (result.value() != nullptr) {
-      if (context != nullptr && *dynamic_cast<SpanContext *>(result.value().get()) !=
-                                    *dynamic_cast<SpanContext *>(context.get())) {
-        std::cerr << "Attempt to deserialize SpanContext with conflicting Datadog and B3 headers"
-                  << std::endl;
-        return ot::make_unexpected(ot::span_context_corrupted_error);
-      }
-      context = std::move(result.value());
+    sampling_priority = asSamplingPriority(static_cast<signed char>(priority));
+    if (sampling_priority == nullptr) {
+      return ot::make_unexpected(ot::span_context_corrupted_error);
     }
   }
-  return context;
-} catch (const std::bad_alloc &) {
-  return ot::make_unexpected(std::make_error_code(std::errc::not_enough_memory));
+  std::string origin;
+  if ((flags & compact_has_origin) && !readString(reader, origin)) {
+    return ot::make_unexpected(ot::span_context_corrupted_error);
+  }
+  uint64_t baggage_size;
+  if (!readVarint(reader, baggage_size)) {
+    return ot::make_unexpected(ot::span_context_corrupted_error);
+  }
+  std::unordered_map<std::string, std::string> baggage;
+  std::string key, value;
+  for (uint64_t i = 0; i < baggage_size; i++) {
+    if (!readString(reader, key) || !readString(reader, value)) {
+      return ot::make_unexpected(ot::span_context_corrupted_error);
+    }
+    baggage[key] = value;
+  }
+
+  auto context =
+      std::make_unique<SpanContext>(logger, parent_id, trace_id, origin, std::move(baggage));
+  context->propagated_sampling_priority_ = std::move(sampling_priority);
+  return std::unique_ptr<ot::SpanContext>(std::move(context));
 }
 
 ot::expected<std::unique_ptr<ot::SpanContext>> SpanContext::deserialize(
     std::shared_ptr<const Logger> logger, const ot::TextMapReader &reader,
-    const HeadersImpl &headers_impl) {
-  uint64_t trace_id, parent_id;
-  OptionalSamplingPriority sampling_priority = nullptr;
+    const std::set<PropagationStyle> &styles) try {
+  // What each style's headers hold, indexed by style.
+  struct StyleHeaders {
+    uint64_t trace_id = 0;
+    uint64_t parent_id = 0;
+    bool trace_id_set = false;
+    bool parent_id_set = false;
+    OptionalSamplingPriority sampling_priority = nullptr;
+  } style_headers[2];
+  unsigned enabled_styles = 0;
+  for (PropagationStyle style : styles) {
+    enabled_styles |= styleBit(style);
+  }
   std::string origin;
-  bool trace_id_set = false;
-  bool parent_id_set = false;
   bool origin_set = false;
   std::unordered_map<std::string, std::string> baggage;
-  auto result =
-      reader.ForeachKey([&](ot::string_view key, ot::string_view value) -> ot::expected<void> {
-        try {
-          if (equals_ignore_case(key, headers_impl.trace_id_header)) {
-            trace_id = parse_uint64(value, headers_impl.base);
-            trace_id_set = true;
-          } else if (equals_ignore_case(key, headers_impl.span_id_header)) {
-            parent_id = parse_uint64(value, headers_impl.base);
-            parent_id_set = true;
-          } else if (equals_ignore_case(key, headers_impl.sampling_priority_header)) {
-            sampling_priority = asSamplingPriority(std::stoi(value));
-            if (sampling_priority == nullptr) {
+
+  // Takes the value of a known header into every enabled style it's part of. Returns errors rather
+  // than throwing them, since it's called from inside the reader's ForeachKey.
+  auto extract = [&](const KnownHeader &header, ot::string_view value) -> ot::expected<void> {
+    try {
+      if (header.field == HeaderField::origin) {
+        origin = value;
+        origin_set = true;
+        return {};
+      }
+      for (PropagationStyle style : styles) {
+        if ((header.styles & styleBit(style)) == 0) {
+          continue;
+        }
+        StyleHeaders &extracted = style_headers[static_cast<size_t>(style)];
+        switch (header.field) {
+          case HeaderField::trace_id:
+            extracted.trace_id = parse_uint64(value, propagation_headers[style].base);
+            extracted.trace_id_set = true;
+            break;
+          case HeaderField::parent_id:
+            extracted.parent_id = parse_uint64(value, propagation_headers[style].base);
+            extracted.parent_id_set = true;
+            break;
+          case HeaderField::sampling_priority:
+            extracted.sampling_priority = asSamplingPriority(std::stoi(value));
+            if (extracted.sampling_priority == nullptr) {
               // The sampling_priority key was present, but the value makes no sense.
               std::cerr << "Invalid sampling_priority value in serialized SpanContext"
                         << std::endl;
               return ot::make_unexpected(ot::span_context_corrupted_error);
             }
-          } else if (headers_impl.origin_header != nullptr &&
-                     equals_ignore_case(key, headers_impl.origin_header)) {
-            origin = value;
-            origin_set = true;
-          } else if (has_prefix(key, baggage_prefix)) {
-            baggage.emplace(std::string{std::begin(key) + baggage_prefix.size(), std::end(key)},
-                            value);
-          }
-        } catch (const std::invalid_argument &ia) {
-          return ot::make_unexpected(ot::span_context_corrupted_error);
-        } catch (const std::out_of_range &oor) {
-          return ot::make_unexpected(ot::span_context_corrupted_error);
+            break;
+          case HeaderField::origin:
+            break;
         }
-        return {};
-      });
+      }
+      return {};
+    } catch (const std::invalid_argument &) {
+      return ot::make_unexpected(ot::span_context_corrupted_error);
+    } catch (const std::out_of_range &) {
+      return ot::make_unexpected(ot::span_context_corrupted_error);
+    } catch (const std::bad_alloc &) {
+      return ot::make_unexpected(std::make_error_code(std::errc::not_enough_memory));
+    }
+  };
+  auto extract_baggage = [&](ot::string_view key, ot::string_view value) {
+    if (has_prefix(key, baggage_prefix)) {
+      baggage.emplace(std::string{std::begin(key) + baggage_prefix.size(), std::end(key)}, value);
+    }
+  };
+
+  // HTTP header readers look keys up regardless of case, so if the reader can, the known headers
+  // are looked up directly, and only baggage needs every header. Otherwise each header is
+  // classified in the same pass.
+  bool looked_up = false;
+  ot::expected<void> result;
+  if (dynamic_cast<const ot::HTTPHeadersReader *>(&reader) != nullptr) {
+    looked_up = true;
+    for (const KnownHeader &header : known_headers) {
+      if ((header.styles & enabled_styles) == 0) {
+        continue;
+      }
+      auto value = reader.LookupKey({header.name, header.size});
+      if (!value) {
+        if (value.error() == ot::lookup_key_not_supported_error) {
+          looked_up = false;
+          break;
+        }
+        if (value.error() == ot::key_not_found_error) {
+          continue;
+        }
+        return ot::make_unexpected(value.error());
+      }
+      result = extract(header, *value);
+      if (!result) {
+        return ot::make_unexpected(result.error());
+      }
+    }
+  }
+  if (looked_up) {
+    result = reader.ForeachKey(
+        [&](ot::string_view key, ot::string_view value) -> ot::expected<void> {
+          extract_baggage(key, value);
+          return {};
+        });
+  } else {
+    result = reader.ForeachKey(
+        [&](ot::string_view key, ot::string_view value) -> ot::expected<void> {
+          const KnownHeader *header = findKnownHeader(key);
+          if (header == nullptr) {
+            extract_baggage(key, value);
+            return {};
+          }
+          if ((header->styles & enabled_styles) == 0) {
+            return {};
+          }
+          return extract(*header, value);
+        });
+  }
   if (!result) {  // "if unexpected", hence "return {}" from above is fine.
     return ot::make_unexpected(result.error());
   }
-  if (const auto result = enforce_tag_presence_policy(trace_id_set, parent_id_set, origin_set)) {
-    return std::move(*result);
+
+  std::unique_ptr<ot::SpanContext> context = nullptr;
+  for (PropagationStyle style : styles) {
+    StyleHeaders &extracted = style_headers[static_cast<size_t>(style)];
+    if (const auto result = enforce_tag_presence_policy(extracted.trace_id_set,
+                                                        extracted.parent_id_set, origin_set)) {
+      if (!*result) {
+        return std::move(*result);
+      }
+      continue;  // No context in this style.
+    }
+    auto style_baggage = baggage;
+    auto style_context = std::make_unique<SpanContext>(
+        logger, extracted.parent_id, extracted.trace_id, origin, std::move(style_baggage));
+    style_context->propagated_sampling_priority_ = std::move(extracted.sampling_priority);
+    if (context != nullptr && *style_context != *dynamic_cast<SpanContext *>(context.get())) {
+      std::cerr << "Attempt to deserialize SpanContext with conflicting Datadog and B3 headers"
+                << std::endl;
+      return ot::make_unexpected(ot::span_context_corrupted_error);
+    }
+    context = std::move(style_context);
   }
-  auto context =
-      std::make_unique<SpanContext>(logger, parent_id, trace_id, origin, std::move(baggage));
-  context->propagated_sampling_priority_ = std::move(sampling_priority);
-  return std::unique_ptr<ot::SpanContext>(std::move(context));
+  return context;
+} catch (const std::bad_alloc &) {
+  return ot::make_unexpected(std::make_error_code(std::errc::not_enough_memory));
 }
 
 }  // namespace opentracing
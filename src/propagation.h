@@ -4,7 +4,10 @@
 #include <datadog/opentracing.h>
 #include <opentracing/tracer.h>
 
-#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <set>
 #include <unordered_map>
 
@@ -44,11 +47,82 @@ enum class UserSamplingPriority : int {
   UserKeep = static_cast<int>(SamplingPriority::UserKeep),
 };
 
+// A SamplingPriority, or none. Held by value, so unlike the std::unique_ptr<SamplingPriority> it
+// replaces, making, copying and returning one doesn't allocate. It keeps that interface
+// (comparison with nullptr, *, reset and conversion to and from std::unique_ptr) so that code
+// written against it, like callers of DatadogSpan::getSamplingPriority(), still compiles.
 // Move to std::optional in C++17 when it has better compiler support.
-using OptionalSamplingPriority = std::unique_ptr<SamplingPriority>;
+class OptionalSamplingPriority {
+ public:
+  constexpr OptionalSamplingPriority() noexcept {}
+  constexpr OptionalSamplingPriority(std::nullptr_t) noexcept {}
+  constexpr OptionalSamplingPriority(SamplingPriority priority) noexcept
+      : value_(static_cast<int8_t>(priority)), has_value_(true) {}
+
+  constexpr bool has_value() const noexcept { return has_value_; }
+  constexpr explicit operator bool() const noexcept { return has_value_; }
+  // Undefined unless has_value().
+  constexpr SamplingPriority operator*() const noexcept {
+    return static_cast<SamplingPriority>(value_);
+  }
+
+  void reset() noexcept { *this = nullptr; }
+
+  // Compatibility with std::unique_ptr<SamplingPriority>.
+  OptionalSamplingPriority(const std::unique_ptr<SamplingPriority> &priority) noexcept
+      : OptionalSamplingPriority(priority == nullptr ? OptionalSamplingPriority{}
+                                                     : OptionalSamplingPriority{*priority}) {}
+  // Takes ownership of priority, as std::unique_ptr::reset() does.
+  void reset(SamplingPriority *priority) noexcept {
+    *this = std::unique_ptr<SamplingPriority>{priority};
+  }
+  operator std::unique_ptr<SamplingPriority>() const {
+    return has_value_ ? std::make_unique<SamplingPriority>(**this) : nullptr;
+  }
+
+  friend constexpr bool operator==(const OptionalSamplingPriority &a,
+                                   const OptionalSamplingPriority &b) noexcept {
+    return a.has_value_ == b.has_value_ && (!a.has_value_ || a.value_ == b.value_);
+  }
+  friend constexpr bool operator!=(const OptionalSamplingPriority &a,
+                                   const OptionalSamplingPriority &b) noexcept {
+    return !(a == b);
+  }
+  friend constexpr bool operator==(const OptionalSamplingPriority &a, std::nullptr_t) noexcept {
+    return !a.has_value_;
+  }
+  friend constexpr bool operator!=(const OptionalSamplingPriority &a, std::nullptr_t) noexcept {
+    return a.has_value_;
+  }
+  friend constexpr bool operator==(std::nullptr_t, const OptionalSamplingPriority &a) noexcept {
+    return !a.has_value_;
+  }
+  friend constexpr bool operator!=(std::nullptr_t, const OptionalSamplingPriority &a) noexcept {
+    return a.has_value_;
+  }
+
+ private:
+  int8_t value_ = 0;
+  bool has_value_ = false;
+};
 
 OptionalSamplingPriority asSamplingPriority(int i);
 
+// A trace's sampling priority, as its SpanBuffer last set it. The trace's Spans, and their
+// SpanContexts, share it with the buffer, so that they can read the priority without going
+// through (and locking) the buffer.
+class SharedSamplingPriority {
+ public:
+  // Only for the SpanBuffer to call, with the trace locked.
+  void set(OptionalSamplingPriority priority);
+  OptionalSamplingPriority get() const;
+
+ private:
+  // Not any SamplingPriority.
+  static constexpr int unset = static_cast<int>(SamplingPriority::MaximumValue) + 1;
+  std::atomic<int> priority_{unset};
+};
+
 class SpanContext : public ot::SpanContext {
  public:
   SpanContext(std::shared_ptr<const Logger> logger, uint64_t id, uint64_t trace_id,
@@ -77,23 +151,33 @@ class SpanContext : public ot::SpanContext {
 
   std::string baggageItem(ot::string_view key) const;
 
-  // Serializes the context into the given writer.
+  // Serializes the context into the given writer, as JSON.
   ot::expected<void> serialize(std::ostream &writer,
-                               const std::shared_ptr<SpanBuffer> pending_traces,
+                               const std::shared_ptr<SpanBuffer> &pending_traces,
                                bool prioritySamplingEnabled) const;
+  // Serializes the context into the given writer, in the compact binary encoding (see
+  // propagation.cpp).
+  ot::expected<void> serializeCompact(std::ostream &writer,
+                                      const std::shared_ptr<SpanBuffer> &pending_traces,
+                                      bool prioritySamplingEnabled) const;
   ot::expected<void> serialize(const ot::TextMapWriter &writer,
-                               const std::shared_ptr<SpanBuffer> pending_traces,
-                               std::set<PropagationStyle> styles,
+                               const std::shared_ptr<SpanBuffer> &pending_traces,
+                               const std::set<PropagationStyle> &styles,
                                bool prioritySamplingEnabled) const;
 
   SpanContext withId(uint64_t id) const;
 
-  // Returns a new context from the given reader.
+  // Gives the context its trace's SharedSamplingPriority, so that serializing it needn't ask the
+  // SpanBuffer for the sampling priority. Only for the context's Span to call, before the context
+  // is used elsewhere.
+  void setSharedSamplingPriority(std::shared_ptr<const SharedSamplingPriority> priority);
+
+  // Returns a new context from the given reader, in either JSON or the compact binary encoding.
   static ot::expected<std::unique_ptr<ot::SpanContext>> deserialize(
       std::shared_ptr<const Logger> tracer, std::istream &reader);
   static ot::expected<std::unique_ptr<ot::SpanContext>> deserialize(
       std::shared_ptr<const Logger> tracer, const ot::TextMapReader &reader,
-      std::set<PropagationStyle> styles);
+      const std::set<PropagationStyle> &styles);
 
   uint64_t id() const;
   uint64_t traceId() const;
@@ -105,11 +189,18 @@ class SpanContext : public ot::SpanContext {
   const std::string origin() const;
 
  private:
-  static ot::expected<std::unique_ptr<ot::SpanContext>> deserialize(
-      std::shared_ptr<const Logger> tracer, const ot::TextMapReader &reader,
-      const HeadersImpl &headers_impl);
+  using Baggage = std::unordered_map<std::string, std::string>;
+
+  // Loads baggage_.
+  std::shared_ptr<const Baggage> baggage() const;
+  // Returns the trace's sampling priority. Doesn't lock if the context is a Span's.
+  OptionalSamplingPriority samplingPriority(
+      const std::shared_ptr<SpanBuffer> &pending_traces) const;
+
+  static ot::expected<std::unique_ptr<ot::SpanContext>> deserializeCompact(
+      std::shared_ptr<const Logger> logger, std::istream &reader);
   ot::expected<void> serialize(const ot::TextMapWriter &writer,
-                               const std::shared_ptr<SpanBuffer> pending_traces,
+                               const std::shared_ptr<SpanBuffer> &pending_traces,
                                const HeadersImpl &headers_impl,
                                bool prioritySamplingEnabled) const;
 
@@ -131,14 +222,19 @@ class SpanContext : public ot::SpanContext {
   // make it more of a pain to do and less obvious what's happening.
   bool nginx_opentracing_compatibility_hack_ = false;
 
+  // These are only set on construction (or assignment, which like that of any value mustn't race
+  // with other uses), so they're read without locking.
   std::shared_ptr<const Logger> logger_;
   uint64_t id_;
   uint64_t trace_id_;
-  OptionalSamplingPriority propagated_sampling_priority_ = nullptr;
+  OptionalSamplingPriority propagated_sampling_priority_;
   std::string origin_;
+  // Null unless the context is a Span's.
+  std::shared_ptr<const SharedSamplingPriority> shared_sampling_priority_;
 
-  mutable std::mutex mutex_;
-  std::unordered_map<std::string, std::string> baggage_;
+  // Never modified, since contexts share it with the contexts of their children. Replaced
+  // instead, atomically (see baggage()).
+  std::shared_ptr<const Baggage> baggage_;
 };
 
 }  // namespace opentracing
@@ -44,9 +44,9 @@ SampleResult PrioritySampler::sample(const std::string& environment, const std::
   SampleResult result;
   result.priority_rate = applied_rate.rate;
   if (hashed_id >= applied_rate.max_hash) {
-    result.sampling_priority = std::make_unique<SamplingPriority>(SamplingPriority::SamplerDrop);
+    result.sampling_priority = SamplingPriority::SamplerDrop;
   } else {
-    result.sampling_priority = std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep);
+    result.sampling_priority = SamplingPriority::SamplerKeep;
   }
   return result;
 }
@@ -68,10 +68,17 @@ void PrioritySampler::configure(json config) {
 
 RulesSampler::RulesSampler() : sampling_limiter_(getRealTime, 100, 100.0, 1) {}
 
+RulesSampler::RulesSampler(const std::string& limiter_name)
+    : sampling_limiter_(getRealTime, 100, 100.0, 1, limiter_name) {}
+
 RulesSampler::RulesSampler(TimeProvider clock, long max_tokens, double refresh_rate,
                            long tokens_per_refresh)
     : sampling_limiter_(clock, max_tokens, refresh_rate, tokens_per_refresh) {}
 
+RulesSampler::RulesSampler(TimeProvider clock, long max_tokens, double refresh_rate,
+                           long tokens_per_refresh, const std::string& limiter_name)
+    : sampling_limiter_(clock, max_tokens, refresh_rate, tokens_per_refresh, limiter_name) {}
+
 void RulesSampler::addRule(RuleFunc f) { sampling_rules_.push_back(f); }
 
 SampleResult RulesSampler::sample(const std::string& environment, const std::string& service,
@@ -97,7 +104,7 @@ SampleResult RulesSampler::sample(const std::string& environment, const std::str
   auto max_hash = maxIdFromSampleRate(rule_result.rate);
   uint64_t hashed_id = trace_id * constant_rate_hash_factor;
   if (hashed_id >= max_hash) {
-    result.sampling_priority = std::make_unique<SamplingPriority>(SamplingPriority::UserDrop);
+    result.sampling_priority = SamplingPriority::UserDrop;
     return result;
   }
 
@@ -108,9 +115,9 @@ SampleResult RulesSampler::sample(const std::string& environment, const std::str
   auto limit_result = sampling_limiter_.allow();
   result.limiter_rate = limit_result.effective_rate;
   if (limit_result.allowed) {
-    result.sampling_priority = std::make_unique<SamplingPriority>(SamplingPriority::UserKeep);
+    result.sampling_priority = SamplingPriority::UserKeep;
   } else {
-    result.sampling_priority = std::make_unique<SamplingPriority>(SamplingPriority::UserDrop);
+    result.sampling_priority = SamplingPriority::UserDrop;
   }
   return result;
 }
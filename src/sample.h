@@ -62,7 +62,12 @@ using RuleFunc = std::function<RuleResult(const std::string&, const std::string&
 class RulesSampler {
  public:
   RulesSampler();
+  // Shares the limit on the traces kept by sampling rules with every RulesSampler on the host
+  // made with the same limiter_name. See Limiter. May throw runtime_error.
+  explicit RulesSampler(const std::string& limiter_name);
   RulesSampler(TimeProvider clock, long max_tokens, double refresh_rate, long tokens_per_refresh);
+  RulesSampler(TimeProvider clock, long max_tokens, double refresh_rate, long tokens_per_refresh,
+               const std::string& limiter_name);
   virtual ~RulesSampler() {}
   void addRule(RuleFunc f);
   virtual SampleResult sample(const std::string& environment, const std::string& service,
@@ -0,0 +1,187 @@
+#include "shared_memory.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+// Robust mutexes are POSIX 2008, which glibc has (without PTHREAD_MUTEX_ROBUST being a macro), but
+// macOS doesn't.
+#if defined(__GLIBC__) || defined(PTHREAD_MUTEX_ROBUST)
+#define DD_OPENTRACING_ROBUST_MUTEX
+#endif
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+// Each segment starts with a header, which says whether the segment has been initialized yet.
+const char magic[8] = {'D', 'D', 'S', 'H', 'M', 'E', 'M', '1'};
+struct Header {
+  char magic[8];
+  uint64_t size;
+  std::atomic<uint32_t> ready;
+};
+// Rounded up, so that what follows the header is on a cache line of its own.
+const size_t header_size = 64;
+static_assert(sizeof(Header) <= header_size, "SharedMemory header is too large");
+// How long to wait for another process to finish creating a segment.
+const auto creation_timeout = std::chrono::seconds(1);
+
+std::runtime_error sharedMemoryError(const std::string &message, const std::string &name) {
+  return std::runtime_error(message + " " + name + ": " + std::strerror(errno));
+}
+
+// Closes the file descriptor on destruction.
+struct FileDescriptor {
+  ~FileDescriptor() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  int fd;
+};
+}  // namespace
+
+SharedMemory::SharedMemory(const std::string &name, size_t size,
+                           std::function<void(void *)> initialize)
+    : name_(name), size_(size), mapping_size_(header_size + size) {
+  auto deadline = std::chrono::steady_clock::now() + creation_timeout;
+  bool created = false;
+  FileDescriptor file{-1};
+  while (file.fd < 0) {
+    file.fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (file.fd >= 0) {
+      created = true;
+    } else if (errno == EEXIST) {
+      file.fd = shm_open(name_.c_str(), O_RDWR, 0);
+      // If it's gone again, it was removed in between. Try again.
+      if (file.fd < 0 && (errno != ENOENT || std::chrono::steady_clock::now() > deadline)) {
+        throw sharedMemoryError("Unable to open shared memory", name_);
+      }
+    } else {
+      throw sharedMemoryError("Unable to create shared memory", name_);
+    }
+  }
+
+  if (created) {
+    // The segment reads as zeroes, and so as not ready, until it's initialized.
+    if (ftruncate(file.fd, static_cast<off_t>(mapping_size_)) != 0) {
+      auto error = sharedMemoryError("Unable to size shared memory", name_);
+      shm_unlink(name_.c_str());
+      throw error;
+    }
+  } else {
+    // The process that created the segment may not have sized it yet.
+    struct stat status;
+    while (true) {
+      if (fstat(file.fd, &status) != 0) {
+        throw sharedMemoryError("Unable to read shared memory", name_);
+      }
+      if (status.st_size != 0 || std::chrono::steady_clock::now() > deadline) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (static_cast<size_t>(status.st_size) != mapping_size_) {
+      throw std::runtime_error("Shared memory " + name_ + " is " +
+                               std::to_string(status.st_size) + " bytes, expected " +
+                               std::to_string(mapping_size_));
+    }
+  }
+
+  void *mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+  if (mapping == MAP_FAILED) {
+    auto error = sharedMemoryError("Unable to map shared memory", name_);
+    if (created) {
+      shm_unlink(name_.c_str());
+    }
+    throw error;
+  }
+  mapping_ = static_cast<char *>(mapping);
+  Header *header = reinterpret_cast<Header *>(mapping_);
+
+  if (created) {
+    try {
+      initialize(mapping_ + header_size);
+    } catch (...) {
+      munmap(mapping_, mapping_size_);
+      shm_unlink(name_.c_str());
+      throw;
+    }
+    std::memcpy(header->magic, magic, sizeof(magic));
+    header->size = size_;
+    header->ready.store(1, std::memory_order_release);
+    return;
+  }
+  while (header->ready.load(std::memory_order_acquire) == 0) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      munmap(mapping_, mapping_size_);
+      throw std::runtime_error("Shared memory " + name_ +
+                               " was never initialized, it may need removing");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || header->size != size_) {
+    munmap(mapping_, mapping_size_);
+    throw std::runtime_error("Shared memory " + name_ + " is not in the expected format");
+  }
+}
+
+SharedMemory::~SharedMemory() { munmap(mapping_, mapping_size_); }
+
+void *SharedMemory::data() const { return mapping_ + header_size; }
+
+size_t SharedMemory::size() const { return size_; }
+
+void SharedMemory::remove(const std::string &name) { shm_unlink(name.c_str()); }
+
+SharedMutex::SharedMutex() {
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#ifdef DD_OPENTRACING_ROBUST_MUTEX
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+  pthread_mutex_init(&mutex_, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+}
+
+SharedMutex::~SharedMutex() { pthread_mutex_destroy(&mutex_); }
+
+void SharedMutex::lock() {
+  int rcode = pthread_mutex_lock(&mutex_);
+#ifdef DD_OPENTRACING_ROBUST_MUTEX
+  if (rcode == EOWNERDEAD) {
+    pthread_mutex_consistent(&mutex_);
+    return;
+  }
+#endif
+  if (rcode != 0) {
+    throw std::system_error(rcode, std::system_category(), "Unable to lock shared mutex");
+  }
+}
+
+bool SharedMutex::try_lock() {
+  int rcode = pthread_mutex_trylock(&mutex_);
+#ifdef DD_OPENTRACING_ROBUST_MUTEX
+  if (rcode == EOWNERDEAD) {
+    pthread_mutex_consistent(&mutex_);
+    return true;
+  }
+#endif
+  return rcode == 0;
+}
+
+void SharedMutex::unlock() { pthread_mutex_unlock(&mutex_); }
+
+}  // namespace opentracing
+}  // namespace datadog
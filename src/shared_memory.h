@@ -0,0 +1,65 @@
+#ifndef DD_OPENTRACING_SHARED_MEMORY_H
+#define DD_OPENTRACING_SHARED_MEMORY_H
+
+#include <pthread.h>
+
+#include <functional>
+#include <string>
+
+namespace datadog {
+namespace opentracing {
+
+// A named POSIX shared memory segment, mapped into this process. Every process on the host that
+// opens the same name shares the same memory. The segment outlives them all, until it's removed.
+// Processes sharing a segment must run as the same user.
+class SharedMemory {
+ public:
+  // Opens the segment with the given name (like "/datadog-traces"), creating it if need be. Only
+  // the process that creates it calls initialize, with the segment's memory, and the others wait
+  // for it to finish. May throw runtime_error, including if the segment exists but isn't of the
+  // given size.
+  SharedMemory(const std::string &name, size_t size, std::function<void(void *)> initialize);
+  // Unmaps the segment, but doesn't remove it.
+  ~SharedMemory();
+
+  SharedMemory(const SharedMemory &) = delete;
+  SharedMemory &operator=(const SharedMemory &) = delete;
+
+  void *data() const;
+  size_t size() const;
+
+  // Removes the segment with the given name. Processes that have it open keep using it, but the
+  // next to open the name get a new one.
+  static void remove(const std::string &name);
+
+ private:
+  const std::string name_;
+  const size_t size_;
+  // The whole mapping, which starts with a header.
+  char *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+};
+
+// A mutex that can live in shared memory, and be locked by any process that shares it. If a
+// process dies holding it, the next to lock it gets it anyway: what it protects must be kept
+// consistent at every step, since a process can die at any of them. Initialized in place.
+class SharedMutex {
+ public:
+  SharedMutex();
+  ~SharedMutex();
+
+  SharedMutex(const SharedMutex &) = delete;
+  SharedMutex &operator=(const SharedMutex &) = delete;
+
+  void lock();
+  bool try_lock();
+  void unlock();
+
+ private:
+  pthread_mutex_t mutex_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_SHARED_MEMORY_H
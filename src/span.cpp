@@ -3,18 +3,22 @@
 #include <datadog/tags.h>
 #include <opentracing/ext/tags.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <nlohmann/json.hpp>
-#include <regex>
 #include <string>
 
 #include "bool.h"
+#include "obfuscation.h"
 #include "sample.h"
 #include "span_buffer.h"
+#include "telemetry.h"
 #include "tracer.h"
+#include "url_normalizer.h"
 
 namespace tags = datadog::tags;
-using json = nlohmann::json;
 
 namespace datadog {
 namespace opentracing {
@@ -64,7 +68,8 @@ Span::Span(std::shared_ptr<const Logger> logger, std::shared_ptr<const Tracer> t
            std::shared_ptr<SpanBuffer> buffer, TimeProvider get_time, uint64_t span_id,
            uint64_t trace_id, uint64_t parent_id, SpanContext context, TimePoint start_time,
            std::string span_service, std::string span_type, std::string span_name,
-           std::string resource, std::string operation_name_override, bool legacy_obfuscation)
+           std::string resource, std::string operation_name_override, bool legacy_obfuscation,
+           std::shared_ptr<const UrlNormalizer> url_normalizer)
     : logger_(std::move(logger)),
       tracer_(std::move(tracer)),
       buffer_(std::move(buffer)),
@@ -73,6 +78,7 @@ Span::Span(std::shared_ptr<const Logger> logger, std::shared_ptr<const Tracer> t
       start_time_(start_time),
       operation_name_override_(operation_name_override),
       legacy_obfuscation_(legacy_obfuscation),
+      url_normalizer_(std::move(url_normalizer)),
       span_(makeSpanData(span_type, span_service, resource, span_name, trace_id, span_id,
                          parent_id,
                          std::chrono::duration_cast<std::chrono::nanoseconds>(
@@ -84,7 +90,9 @@ Span::Span(std::shared_ptr<const Logger> logger, std::shared_ptr<const Tracer> t
     span_->meta[tags::operation_name] = span_->name;
     span_->name = operation_name_override;
   }
-  buffer_->registerSpan(context_);
+  sampling_priority_ = buffer_->registerSpan(context_);
+  context_.setSharedSamplingPriority(sampling_priority_);
+  telemetry().spans_created.add();
 }
 
 Span::~Span() {
@@ -93,31 +101,24 @@ Span::~Span() {
   }
 }
 
-namespace {
-// Matches path segments with numbers (except things that look like versions).
-// Similar to, but not the same as,
-// https://github.com/datadog/dd-trace-java/blob/master/dd-trace-ot/src/main/java/datadog/opentracing/decorators/URLAsResourceName.java#L14-L16
-std::regex &PATH_MIXED_ALPHANUMERICS() {
-  // Don't statically initialize a complex object.
-  // Thread safe as of C++11, as long as it's not reentrant.
-  static std::regex r{
-      "(\\/)(?:(?:([^?\\/&]*)(?:\\?[^\\/]+))|(?:(?![vV]\\d{1,2}\\/)[^\\/"
-      "\\d\\?]*[\\d-]+[^\\/]*))"};
-  return r;
-}
-}  // namespace
-
 // Imperfectly audits the data in a Span, removing some things that could cause information leaks
 // or cardinality issues.
 // If you want to add any more steps to this function, we should use a more
 // sophisticated architecture. For now, YAGNI.
-void audit(bool legacy_obfuscation, SpanData *span) {
+void audit(bool legacy_obfuscation, const UrlNormalizer *url_normalizer, SpanData *span) {
   auto http_tag = span->meta.find(ot::ext::http_url);
+  // Only the resources of HTTP spans are URLs. Others, like SQL, are left as they are.
+  if (url_normalizer != nullptr &&
+      (http_tag != span->meta.end() || span->type == "http" || span->type == "web")) {
+    span->resource = url_normalizer->normalize(span->resource);
+  }
   if (http_tag != span->meta.end()) {
-    if (legacy_obfuscation) {
+    if (url_normalizer != nullptr) {
+      http_tag->second = url_normalizer->normalize(http_tag->second);
+    } else if (legacy_obfuscation) {
       // Heavy-handed obfuscation that replaces hostname, runs of alphanumerics, fragments and
       // parameters.
-      http_tag->second = std::regex_replace(http_tag->second, PATH_MIXED_ALPHANUMERICS(), "$1$2?");
+      legacyObfuscateUrl(http_tag->second);
     } else {
       // Just trim the parameter portion of the URL.
       http_tag->second = http_tag->second.substr(0, http_tag->second.find_first_of('?'));
@@ -135,69 +136,8 @@ void Span::FinishWithOptions(
   auto end_time = get_time_();
   span_->duration =
       std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time_).count();
-  // Apply special tags.
-  // If we add any more cases; then abstract this. For now, KISS.
-  auto tag = span_->meta.find(tags::span_type);
-  if (tag != span_->meta.end()) {
-    span_->type = tag->second;
-    span_->meta.erase(tag);
-  }
-  tag = span_->meta.find(tags::resource_name);
-  if (tag != span_->meta.end()) {
-    span_->resource = tag->second;
-    span_->meta.erase(tag);
-  }
-  tag = span_->meta.find(tags::service_name);
-  if (tag != span_->meta.end()) {
-    span_->service = tag->second;
-    span_->meta.erase(tag);
-  }
-  tag = span_->meta.find(::ot::ext::error);
-  if (tag != span_->meta.end()) {
-    // tag->second is the JSON-serialized value of the variadic type given to SetTag.
-    // Errors can be a flag or a detailed message.
-    // Empty or false-y values indicate no error.
-    // Any other value will mark the span to indicate an error occured.
-    if (tag->second == "" || !stob(tag->second, true)) {
-      span_->error = 0;
-    } else {
-      span_->error = 1;
-    }
-    // Don't erase the tag, in case it is populated with interesting information.
-  }
-  tag = span_->meta.find(tags::analytics_event);
-  if (tag != span_->meta.end()) {
-    // tag->second is the JSON-serialized value of the variadic type given to SetTag.
-    // An empty value means it was set, but a sample rate of zero is applied.
-    // A bool value indicates a rate of 0.0 for false, or 1.0 for true.
-    // A double value between 0.0 and 1.0 (inclusive) is applied as-is.
-    // Other values are ignored.
-    if (tag->second.empty()) {
-      span_->metrics[event_sample_rate_metric] = 0.0;
-    } else if (isbool(tag->second)) {
-      if (stob(tag->second, false)) {
-        span_->metrics[event_sample_rate_metric] = 1.0;
-      } else {
-        span_->metrics[event_sample_rate_metric] = 0.0;
-      }
-    } else {
-      // Check if the value is a double between 0.0 and 1.0 (inclusive).
-      try {
-        double value = std::stod(tag->second);
-        if (value >= 0.0 && value <= 1.0) {
-          span_->metrics[event_sample_rate_metric] = value;
-        }
-      } catch (const std::invalid_argument &ia) {
-        // Ignore invalid value.
-      } catch (const std::out_of_range &oor) {
-        // Ignore values not in range.
-      }
-    }
-
-    span_->meta.erase(tag);
-  }
   // Audit and finish span.
-  audit(legacy_obfuscation_, span_.get());
+  audit(legacy_obfuscation_, url_normalizer_.get(), span_.get());
   buffer_->finishSpan(std::move(span_));
   // According to the OT lifecycle, no more methods should be called on this Span. But just in case
   // let's make sure that span_ isn't nullptr. Fine line between defensive programming and voodoo.
@@ -213,115 +153,200 @@ void Span::SetOperationName(ot::string_view operation_name) noexcept {
   } else {
     span_->name = operation_name;
   }
-  span_->resource = operation_name;
+  // A resource.name tag takes precedence, whenever it was set.
+  if (!resource_name_tagged_) {
+    span_->resource = operation_name;
+  }
 }
 
 namespace {
+
+// Appends the specified `value` to `out` as a JSON string, escaped as nlohmann::json's dump()
+// does. Unlike dump(), bytes that aren't valid UTF-8 are copied as they are, rather than thrown
+// about.
+void write_json_string(std::string &out, const char *value, size_t size) {
+  static const char hex_digits[] = "0123456789abcdef";
+  out += '"';
+  size_t unescaped = 0;  // The start of the run of bytes not yet appended.
+  for (size_t i = 0; i < size; i++) {
+    const char *escape;
+    switch (value[i]) {
+      case '"':
+        escape = "\\\"";
+        break;
+      case '\\':
+        escape = "\\\\";
+        break;
+      case '\b':
+        escape = "\\b";
+        break;
+      case '\f':
+        escape = "\\f";
+        break;
+      case '\n':
+        escape = "\\n";
+        break;
+      case '\r':
+        escape = "\\r";
+        break;
+      case '\t':
+        escape = "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(value[i]) >= 0x20) {
+          continue;
+        }
+        escape = nullptr;
+    }
+    out.append(value + unescaped, i - unescaped);
+    unescaped = i + 1;
+    if (escape != nullptr) {
+      out += escape;
+    } else {
+      // Any other control character.
+      out += "\\u00";
+      out += hex_digits[value[i] >> 4];
+      out += hex_digits[value[i] & 0xF];
+    }
+  }
+  out.append(value + unescaped, size - unescaped);
+  out += '"';
+}
+
+// Appends the specified `value` to `out` as a JSON number, the shortest that round-trips, as
+// nlohmann::json's dump() does (and with the same code).
+void write_json_number(std::string &out, double value) {
+  if (!std::isfinite(value)) {
+    out += "null";
+    return;
+  }
+  char buffer[64];
+  char *end = nlohmann::detail::to_chars(buffer, buffer + sizeof(buffer), value);
+  out.append(buffer, end);
+}
+
 // Visits and serializes an arbitrarily-nested variant type. Serialisation of value types is to
 // string while any composite types are expressed in JSON. eg. string("fred") -> "fred"
 // vector<string>{"felicity"} -> "[\"felicity\"]"
+//
+// Composite types are written straight into the result, as nlohmann::json would dump() them (with
+// the keys of a map sorted, and an empty list or map as null), without building a json value.
 struct VariantVisitor {
   // Populated with the final result.
   std::string &result;
   VariantVisitor(std::string &result_) : result(result_) {}
 
  private:
-  // Only set if VariantVisitor is recursing. Unfortunately we only really need an explicit
-  // distinction (and all the conditionals below) to avoid the case of a simple string being
-  // serialized to "\"string\"" - which is valid JSON but very silly never-the-less.
-  json *json_result = nullptr;
-  VariantVisitor(std::string &result_, json *json_result_)
-      : result(result_), json_result(json_result_) {}
+  // Only set if VariantVisitor is recursing, in which case values are appended to the result as
+  // JSON. Unfortunately we only really need an explicit distinction (and all the conditionals
+  // below) to avoid the case of a simple string being serialized to "\"string\"" - which is valid
+  // JSON but very silly never-the-less.
+  bool nested = false;
+  VariantVisitor(std::string &result_, bool nested_) : result(result_), nested(nested_) {}
 
  public:
   void operator()(bool value) const {
-    if (json_result != nullptr) {
-      *json_result = value;
+    if (nested) {
+      result += value ? "true" : "false";
     } else {
       result = value ? "true" : "false";
     }
   }
 
   void operator()(double value) const {
-    if (json_result != nullptr) {
-      *json_result = value;
+    if (nested) {
+      write_json_number(result, value);
     } else {
       result = std::to_string(value);
     }
   }
 
   void operator()(int64_t value) const {
-    if (json_result != nullptr) {
-      *json_result = value;
+    if (nested) {
+      result += std::to_string(value);
     } else {
       result = std::to_string(value);
     }
   }
 
   void operator()(uint64_t value) const {
-    if (json_result != nullptr) {
-      *json_result = value;
+    if (nested) {
+      result += std::to_string(value);
     } else {
       result = std::to_string(value);
     }
   }
 
   void operator()(const std::string &value) const {
-    if (json_result != nullptr) {
-      *json_result = value;
+    if (nested) {
+      write_json_string(result, value.data(), value.size());
     } else {
       result = value;
     }
   }
 
   void operator()(std::nullptr_t) const {
-    if (json_result != nullptr) {
-      *json_result = "nullptr";
+    if (nested) {
+      result += "\"nullptr\"";
     } else {
       result = "nullptr";
     }
   }
 
   void operator()(const char *value) const {
-    if (json_result != nullptr) {
-      *json_result = value;
+    if (nested) {
+      write_json_string(result, value, std::strlen(value));
     } else {
       result = std::string(value);
     }
   }
 
   void operator()(const std::vector<ot::Value> &values) const {
-    json list;
-    for (auto value : values) {
-      json inner;
-      std::string r;
-      apply_visitor(VariantVisitor{r, &inner}, value);
-      list.push_back(inner);
+    if (!nested) {
+      // We're a root object.
+      result.clear();
     }
-    if (json_result != nullptr) {
-      // We're a list in a dict/list.
-      *json_result = list;
-    } else {
-      // We're a root object, so dump the string.
-      result = list.dump();
+    if (values.empty()) {
+      result += "null";
+      return;
     }
+    result += '[';
+    for (const auto &value : values) {
+      if (&value != &values.front()) {
+        result += ',';
+      }
+      apply_visitor(VariantVisitor{result, true}, value);
+    }
+    result += ']';
   }
 
   void operator()(const std::unordered_map<std::string, ot::Value> &value) const {
-    json dict;
-    for (auto pair : value) {
-      json inner;
-      std::string r;
-      apply_visitor(VariantVisitor{r, &inner}, pair.second);
-      dict[pair.first] = inner;
+    if (!nested) {
+      // We're a root object.
+      result.clear();
     }
-    if (json_result != nullptr) {
-      // We're a dict in a dict/list.
-      *json_result = dict;
-    } else {
-      // We're a root object, so dump the string.
-      result = dict.dump();
+    if (value.empty()) {
+      result += "null";
+      return;
+    }
+    std::vector<const std::pair<const std::string, ot::Value> *> pairs;
+    pairs.reserve(value.size());
+    for (const auto &pair : value) {
+      pairs.push_back(&pair);
+    }
+    std::sort(pairs.begin(), pairs.end(),
+              [](const std::pair<const std::string, ot::Value> *a,
+                 const std::pair<const std::string, ot::Value> *b) { return a->first < b->first; });
+    result += '{';
+    for (const auto *pair : pairs) {
+      if (pair != pairs.front()) {
+        result += ',';
+      }
+      write_json_string(result, pair->first.data(), pair->first.size());
+      result += ':';
+      apply_visitor(VariantVisitor{result, true}, pair->second);
     }
+    result += '}';
   }
 };
 }  // namespace
@@ -337,31 +362,188 @@ std::string normalizeTagKey(std::string tag) {
   return tag;
 }
 
+// Tags that mean more to a Span than their value.
+enum class SpecialTag {
+  none,
+  span_type,
+  resource_name,
+  service_name,
+  error,
+  analytics_event,
+  sampling_priority,
+  manual_keep,
+  manual_drop,
+};
+
+namespace {
+
+// Returns which special tag, if any, the specified normalized tag `key` is. The special tags'
+// names all have different lengths, except for manual.keep and manual.drop, so the length (and
+// for those two, one character) picks the only possible match, and one comparison confirms it.
+SpecialTag classify_tag(const std::string &key) {
+  SpecialTag candidate = SpecialTag::none;
+  ot::string_view name;
+  switch (key.size()) {
+    case 5:
+      candidate = SpecialTag::error;
+      name = ::ot::ext::error;
+      break;
+    case 9:
+      candidate = SpecialTag::span_type;
+      name = tags::span_type;
+      break;
+    case 11:
+      if (key[7] == 'k') {
+        candidate = SpecialTag::manual_keep;
+        name = tags::manual_keep;
+      } else {
+        candidate = SpecialTag::manual_drop;
+        name = tags::manual_drop;
+      }
+      break;
+    case 12:
+      candidate = SpecialTag::service_name;
+      name = tags::service_name;
+      break;
+    case 13:
+      candidate = SpecialTag::resource_name;
+      name = tags::resource_name;
+      break;
+    case 15:
+      candidate = SpecialTag::analytics_event;
+      name = tags::analytics_event;
+      break;
+    case 17:
+      candidate = SpecialTag::sampling_priority;
+      name = ::ot::ext::sampling_priority;
+      break;
+    default:
+      return SpecialTag::none;
+  }
+  return key == name ? candidate : SpecialTag::none;
+}
+
+// Applies the specified analytics.event tag `value`, serialized by VariantVisitor, to the
+// specified `span`.
+void set_analytics_event(SpanData &span, const std::string &value) {
+  // An empty value means it was set, but a sample rate of zero is applied.
+  // A bool value indicates a rate of 0.0 for false, or 1.0 for true.
+  // A double value between 0.0 and 1.0 (inclusive) is applied as-is.
+  // Other values are ignored, and undo any earlier value.
+  if (value.empty()) {
+    span.metrics[event_sample_rate_metric] = 0.0;
+    return;
+  }
+  if (isbool(value)) {
+    span.metrics[event_sample_rate_metric] = stob(value, false) ? 1.0 : 0.0;
+    return;
+  }
+  // Check if the value is a double between 0.0 and 1.0 (inclusive).
+  try {
+    double rate = std::stod(value);
+    if (rate >= 0.0 && rate <= 1.0) {
+      span.metrics[event_sample_rate_metric] = rate;
+      return;
+    }
+  } catch (const std::invalid_argument &ia) {
+    // Ignore invalid value.
+  } catch (const std::out_of_range &oor) {
+    // Ignore values not in range.
+  }
+  span.metrics.erase(event_sample_rate_metric);
+}
+
+}  // namespace
+
+TagKey::TagKey(ot::string_view key) : name_(normalizeTagKey(key)), special_(classify_tag(name_)) {}
+
 void Span::SetTag(ot::string_view key, const ot::Value &value) noexcept {
-  std::string k = normalizeTagKey(key);
+  SetTag(TagKey{key}, value);
+}
+
+void Span::SetTag(const TagKey &key, const ot::Value &value) noexcept {
   std::string result;
   apply_visitor(VariantVisitor{result}, value);
   {
     std::lock_guard<std::mutex> lock_guard{mutex_};
-    span_->meta[k] = result;
+    applyTag(key, result);
+  }
+  applySamplingTag(key.special_, result);
+}
+
+void Span::SetTags(
+    std::initializer_list<std::pair<const TagKey &, ot::Value>> tags) noexcept try {
+  // Serialize the values before locking, then apply them all under one lock.
+  std::vector<std::string> results(tags.size());
+  auto result = results.begin();
+  for (auto &tag : tags) {
+    apply_visitor(VariantVisitor{*result++}, tag.second);
+  }
+  {
+    std::lock_guard<std::mutex> lock_guard{mutex_};
+    result = results.begin();
+    for (auto &tag : tags) {
+      applyTag(tag.first, *result++);
+    }
+  }
+  result = results.begin();
+  for (auto &tag : tags) {
+    applySamplingTag(tag.first.special_, *result++);
   }
+} catch (const std::bad_alloc &) {
+  // At least don't crash.
+}
 
-  // Normally special tags are processed at Span Finish, but this cannot be done for
-  // sampling tags because if no sampling is set before the Span Finishes then one is
-  // assigned immutably.
+void Span::applyTag(const TagKey &key, std::string &value) {
+  // The Datadog special tags aren't kept, they just set the Span's fields.
+  switch (key.special_) {
+    case SpecialTag::span_type:
+      span_->type = std::move(value);
+      return;
+    case SpecialTag::resource_name:
+      span_->resource = std::move(value);
+      resource_name_tagged_ = true;
+      return;
+    case SpecialTag::service_name:
+      span_->service = std::move(value);
+      return;
+    case SpecialTag::analytics_event:
+      set_analytics_event(*span_, value);
+      return;
+    case SpecialTag::error:
+      // Errors can be a flag or a detailed message.
+      // Empty or false-y values indicate no error.
+      // Any other value will mark the span to indicate an error occured.
+      // The tag is kept, in case it is populated with interesting information.
+      span_->error = value == "" || !stob(value, true) ? 0 : 1;
+      break;
+    case SpecialTag::sampling_priority:
+    case SpecialTag::manual_keep:
+    case SpecialTag::manual_drop:
+      // Kept, and also applied by applySamplingTag.
+      span_->meta[key.name_] = value;
+      return;
+    default:
+      break;
+  }
+  span_->meta[key.name_] = std::move(value);
+}
+
+void Span::applySamplingTag(SpecialTag special, const std::string &value) {
+  // The sampling tags can't wait for the Span to finish, because if no sampling priority is set
+  // before the Span finishes then one is assigned immutably.
   // The sampling tags are "sampling.priority", "manual.keep" and "manual.drop".
-  // Doesn't need to be in the same mutex lock as above.
-  if (k == ::ot::ext::sampling_priority) {
+  // Doesn't need to be in the same mutex lock as applyTag.
+  if (special == SpecialTag::sampling_priority) {
     // https://github.com/opentracing/specification/blob/master/semantic_conventions.md#span-tags-table
     // "sampling.priority"
     try {
-      std::unique_ptr<UserSamplingPriority> sampling_priority = nullptr;
-      if (result != "") {
-        sampling_priority = std::make_unique<UserSamplingPriority>(
-            std::stoi(result) == 0 ? UserSamplingPriority::UserDrop
-                                   : UserSamplingPriority::UserKeep);
+      OptionalSamplingPriority sampling_priority = nullptr;
+      if (value != "") {
+        sampling_priority =
+            std::stoi(value) == 0 ? SamplingPriority::UserDrop : SamplingPriority::UserKeep;
       }
-      setSamplingPriority(std::move(sampling_priority));
+      setUserSamplingPriority(sampling_priority);
     } catch (const std::invalid_argument &ia) {
       logger_->Log(LogLevel::debug, span_->trace_id, span_->span_id,
                    "unable to parse sampling priority tag");
@@ -369,10 +551,10 @@ void Span::SetTag(ot::string_view key, const ot::Value &value) noexcept {
       logger_->Log(LogLevel::debug, span_->trace_id, span_->span_id,
                    "unable to parse sampling priority tag");
     }
-  } else if (k == tags::manual_keep) {
-    setSamplingPriority(std::make_unique<UserSamplingPriority>(UserSamplingPriority::UserKeep));
-  } else if (k == tags::manual_drop) {
-    setSamplingPriority(std::make_unique<UserSamplingPriority>(UserSamplingPriority::UserDrop));
+  } else if (special == SpecialTag::manual_keep) {
+    setUserSamplingPriority(SamplingPriority::UserKeep);
+  } else if (special == SpecialTag::manual_drop) {
+    setUserSamplingPriority(SamplingPriority::UserDrop);
   }
 }
 
@@ -396,20 +578,33 @@ void Span::Log(ot::SystemTime /* timestamp */,
 
 OptionalSamplingPriority Span::setSamplingPriority(
     std::unique_ptr<UserSamplingPriority> user_priority) {
-  std::lock_guard<std::mutex> lock_guard{mutex_};
   OptionalSamplingPriority priority(nullptr);
   if (user_priority != nullptr) {
     priority = asSamplingPriority(static_cast<int>(*user_priority));
   }
-  return buffer_->setSamplingPriority(context_.traceId(), std::move(priority));
+  return setUserSamplingPriority(priority);
+}
+
+OptionalSamplingPriority Span::setUserSamplingPriority(OptionalSamplingPriority priority) {
+  std::lock_guard<std::mutex> lock_guard{mutex_};
+  return buffer_->setSamplingPriority(context_.traceId(), priority);
 }
 
 OptionalSamplingPriority Span::getSamplingPriority() const {
+  OptionalSamplingPriority priority = sampling_priority_->get();
+  if (priority != nullptr) {
+    return priority;
+  }
   std::lock_guard<std::mutex> lock_guard{mutex_};
   return buffer_->getSamplingPriority(context_.traceId());
 }
 
 const ot::SpanContext &Span::context() const noexcept {
+  // Once there's a sampling priority there's nothing to assign, so no need to go through the
+  // buffer, which nginx-opentracing would otherwise do several times a request.
+  if (sampling_priority_->get() != nullptr) {
+    return context_;
+  }
   std::lock_guard<std::mutex> lock_guard{mutex_};
   // First apply sampling. This concern sits more reasonably upon the destructor/Finish method - to
   // ensure that users have every chance to apply their own SamplingPriority before one is decided.
@@ -14,6 +14,7 @@ namespace opentracing {
 
 class Tracer;
 class SpanBuffer;
+class UrlNormalizer;
 typedef std::function<uint64_t()> IdProvider;  // See tracer.h
 
 // Contains data that describes a Span.
@@ -59,6 +60,26 @@ struct SpanData {
                      trace_id, parent_id, error)
 };
 
+// Which of the tags that mean more to a Span than their value a tag is, if any. See span.cpp.
+enum class SpecialTag;
+
+// A tag key that's normalized, and checked for special meaning, once. A call site that sets the
+// same tags on every span can keep its TagKeys and pass them to DatadogSpan::SetTag or SetTags,
+// rather than have each call to SetTag(ot::string_view, ...) redo that work.
+class TagKey {
+ public:
+  explicit TagKey(ot::string_view key);
+
+  // The normalized key.
+  const std::string &name() const { return name_; }
+
+ private:
+  friend class Span;
+
+  std::string name_;
+  SpecialTag special_;
+};
+
 // A common interface for Datadog-specific Span operations.
 class DatadogSpan : public ot::Span {
  public:
@@ -83,6 +104,11 @@ class DatadogSpan : public ot::Span {
 
   // Datadog methods.
 
+  // As SetTag(ot::string_view, const ot::Value &), with a key that's already normalized.
+  virtual void SetTag(const TagKey &key, const ot::Value &value) noexcept = 0;
+  // Sets each of the given tags, in order, as SetTag does, but all at once.
+  virtual void SetTags(
+      std::initializer_list<std::pair<const TagKey &, ot::Value>> tags) noexcept = 0;
   // Sets the SamplingPriority. If priority is null, then unsets SamplingPriority. Returns the
   // value of the SamplingPriority; this may not be the same as the given parameter if this trace
   // has propagated from a remote origin and already has a SamplingPriority.
@@ -101,7 +127,8 @@ class Span : public DatadogSpan {
        std::shared_ptr<SpanBuffer> buffer, TimeProvider get_time, uint64_t span_id,
        uint64_t trace_id, uint64_t parent_id, SpanContext context, TimePoint start_time,
        std::string span_service, std::string span_type, std::string span_name,
-       std::string resource, std::string operation_name_override, bool legacy_obfuscation = false);
+       std::string resource, std::string operation_name_override, bool legacy_obfuscation = false,
+       std::shared_ptr<const UrlNormalizer> url_normalizer = nullptr);
 
   Span() = delete;
   ~Span() override;
@@ -112,6 +139,8 @@ class Span : public DatadogSpan {
   void SetOperationName(ot::string_view name) noexcept override;
 
   void SetTag(ot::string_view key, const ot::Value &value) noexcept override;
+  void SetTag(const TagKey &key, const ot::Value &value) noexcept override;
+  void SetTags(std::initializer_list<std::pair<const TagKey &, ot::Value>> tags) noexcept override;
 
   void SetBaggageItem(ot::string_view restricted_key, ot::string_view value) noexcept override;
 
@@ -137,6 +166,12 @@ class Span : public DatadogSpan {
   OptionalSamplingPriority getSamplingPriority() const override;
 
  private:
+  // Applies a tag, with its value serialized by VariantVisitor. mutex_ must be locked. The value
+  // may be moved from, except for the sampling tags, which applySamplingTag then applies unlocked.
+  void applyTag(const TagKey &key, std::string &value);
+  void applySamplingTag(SpecialTag special, const std::string &value);
+  // As setSamplingPriority(), without the UserSamplingPriority allocated.
+  OptionalSamplingPriority setUserSamplingPriority(OptionalSamplingPriority priority);
   OptionalSamplingPriority assignSamplingPriority()
       const;  // Sooo not const. See definition of method Span::context.
 
@@ -149,9 +184,15 @@ class Span : public DatadogSpan {
   std::shared_ptr<SpanBuffer> buffer_;
   TimeProvider get_time_;
   SpanContext context_;
+  // Read without locking.
+  std::shared_ptr<const SharedSamplingPriority> sampling_priority_;
   TimePoint start_time_;
   std::string operation_name_override_;
   bool legacy_obfuscation_ = false;
+  std::shared_ptr<const UrlNormalizer> url_normalizer_;
+  // Whether a resource.name tag has been set, so that SetOperationName doesn't change the resource.
+  // Locked by mutex_.
+  bool resource_name_tagged_ = false;
 
   // Set in constructor initializer, depends on previous constructor initializer-set members:
   std::unique_ptr<SpanData> span_;
@@ -4,6 +4,7 @@
 
 #include "sample.h"
 #include "span.h"
+#include "telemetry.h"
 #include "writer.h"
 
 namespace datadog {
@@ -86,90 +87,136 @@ WritingSpanBuffer::WritingSpanBuffer(std::shared_ptr<const Logger> logger,
                                      WritingSpanBufferOptions options)
     : logger_(logger), writer_(writer), sampler_(sampler), options_(options) {}
 
-void WritingSpanBuffer::registerSpan(const SpanContext& context) {
-  std::lock_guard<std::mutex> lock_guard{mutex_};
+WritingSpanBuffer::~WritingSpanBuffer() {
+  // Traces still pending are never going to be finished.
+  telemetry().pending_traces.fetch_sub(static_cast<int64_t>(traces_.size()),
+                                       std::memory_order_relaxed);
+}
+
+std::shared_ptr<const SharedSamplingPriority> WritingSpanBuffer::registerSpan(
+    const SpanContext& context) {
   uint64_t trace_id = context.traceId();
-  auto trace = traces_.find(trace_id);
-  if (trace == traces_.end() || trace->second.all_spans.empty()) {
-    traces_.emplace(std::make_pair(trace_id, PendingTrace{logger_}));
-    trace = traces_.find(trace_id);
-    OptionalSamplingPriority p = context.getPropagatedSamplingPriority();
-    trace->second.sampling_priority_locked = p != nullptr;
-    trace->second.sampling_priority = std::move(p);
-    if (!context.origin().empty()) {
-      trace->second.origin = context.origin();
+  // Made without holding mutex_, in case the trace isn't buffered yet.
+  std::shared_ptr<PendingTrace> new_trace;
+  while (true) {
+    auto trace = findTrace(trace_id);
+    if (trace == nullptr) {
+      if (new_trace == nullptr) {
+        new_trace = std::make_shared<PendingTrace>(logger_);
+      }
+      std::lock_guard<std::mutex> lock_guard{mutex_};
+      // Unless another Span of the trace has added it meanwhile.
+      auto inserted = traces_.emplace(trace_id, new_trace);
+      if (inserted.second) {
+        telemetry().pending_traces.fetch_add(1, std::memory_order_relaxed);
+        new_trace = nullptr;
+      }
+      trace = inserted.first->second;
+    }
+    {
+      std::lock_guard<std::mutex> trace_lock{trace->mutex};
+      if (!trace->finished) {
+        if (trace->all_spans.empty()) {
+          OptionalSamplingPriority p = context.getPropagatedSamplingPriority();
+          trace->sampling_priority_locked = p != nullptr;
+          trace->shared_sampling_priority->set(p);
+          trace->sampling_priority = p;
+          if (!context.origin().empty()) {
+            trace->origin = context.origin();
+          }
+          trace->hostname = options_.hostname;
+          trace->analytics_rate = options_.analytics_rate;
+        }
+        trace->all_spans.insert(context.id());
+        return trace->shared_sampling_priority;
+      }
+    }
+    // A finished trace is on its way to the writer, so this Span belongs to a new one. Take the
+    // finished one out of traces_ (unless that's been done already), and try again.
+    std::lock_guard<std::mutex> lock_guard{mutex_};
+    auto trace_iter = traces_.find(trace_id);
+    if (trace_iter != traces_.end() && trace_iter->second == trace) {
+      traces_.erase(trace_iter);
     }
-    trace->second.hostname = options_.hostname;
-    trace->second.analytics_rate = options_.analytics_rate;
   }
-  trace->second.all_spans.insert(context.id());
 }
 
 void WritingSpanBuffer::finishSpan(std::unique_ptr<SpanData> span) {
-  std::lock_guard<std::mutex> lock_guard{mutex_};
-  auto trace_iter = traces_.find(span->traceId());
-  if (trace_iter == traces_.end()) {
+  uint64_t trace_id = span->traceId();
+  auto trace = findTrace(trace_id);
+  if (trace == nullptr) {
     std::cerr << "Missing trace for finished span" << std::endl;
     return;
   }
-  auto& trace = trace_iter->second;
-  if (trace.all_spans.find(span->spanId()) == trace.all_spans.end()) {
-    std::cerr << "A Span that was not registered was submitted to WritingSpanBuffer" << std::endl;
-    return;
-  }
-  uint64_t trace_id = span->traceId();
-  trace.finished_spans->push_back(std::move(span));
-  if (trace.finished_spans->size() == trace.all_spans.size()) {
-    assignSamplingPriorityImpl(trace.finished_spans->back().get());
-    trace.finish();
-    unbufferAndWriteTrace(trace_id);
+  {
+    std::lock_guard<std::mutex> trace_lock{trace->mutex};
+    if (trace->all_spans.find(span->spanId()) == trace->all_spans.end()) {
+      std::cerr << "A Span that was not registered was submitted to WritingSpanBuffer"
+                << std::endl;
+      return;
+    }
+    trace->finished_spans->push_back(std::move(span));
+    if (trace->finished_spans->size() != trace->all_spans.size()) {
+      return;
+    }
+    assignSamplingPriorityImpl(*trace, trace->finished_spans->back().get());
+    trace->finish();
+    trace->finished = true;
   }
+  unbufferAndWriteTrace(trace_id, trace);
 }
 
-void WritingSpanBuffer::unbufferAndWriteTrace(uint64_t trace_id) {
-  auto trace_iter = traces_.find(trace_id);
-  if (trace_iter == traces_.end()) {
-    return;
+void WritingSpanBuffer::unbufferAndWriteTrace(uint64_t trace_id,
+                                              const std::shared_ptr<PendingTrace>& trace) {
+  {
+    std::lock_guard<std::mutex> lock_guard{mutex_};
+    auto trace_iter = traces_.find(trace_id);
+    // Unless a new Span in the same trace has already replaced it.
+    if (trace_iter != traces_.end() && trace_iter->second == trace) {
+      traces_.erase(trace_iter);
+    }
   }
-  auto& trace = trace_iter->second;
+  telemetry().pending_traces.fetch_sub(1, std::memory_order_relaxed);
+  // Nothing else touches a finished trace's spans, so they can be written without its lock.
   if (options_.enabled) {
-    writer_->write(std::move(trace.finished_spans));
+    writer_->write(std::move(trace->finished_spans));
   }
-  traces_.erase(trace_iter);
 }
 
 void WritingSpanBuffer::flush(std::chrono::milliseconds timeout) { writer_->flush(timeout); }
 
-OptionalSamplingPriority WritingSpanBuffer::getSamplingPriority(uint64_t trace_id) const {
+std::shared_ptr<PendingTrace> WritingSpanBuffer::findTrace(uint64_t trace_id) const {
   std::lock_guard<std::mutex> lock_guard{mutex_};
-  return getSamplingPriorityImpl(trace_id);
-}
-OptionalSamplingPriority WritingSpanBuffer::getSamplingPriorityImpl(uint64_t trace_id) const {
   auto trace = traces_.find(trace_id);
   if (trace == traces_.end()) {
-    logger_->Trace(trace_id, "cannot get sampling priority, trace not found");
     return nullptr;
   }
-  if (trace->second.sampling_priority == nullptr) {
+  return trace->second;
+}
+
+OptionalSamplingPriority WritingSpanBuffer::getSamplingPriority(uint64_t trace_id) const {
+  auto trace = findTrace(trace_id);
+  if (trace == nullptr) {
+    logger_->Trace(trace_id, "cannot get sampling priority, trace not found");
     return nullptr;
   }
-  return std::make_unique<SamplingPriority>(*trace->second.sampling_priority);
+  std::lock_guard<std::mutex> trace_lock{trace->mutex};
+  return trace->sampling_priority;
 }
 
 OptionalSamplingPriority WritingSpanBuffer::setSamplingPriority(
     uint64_t trace_id, OptionalSamplingPriority priority) {
-  std::lock_guard<std::mutex> lock_guard{mutex_};
-  return setSamplingPriorityImpl(trace_id, std::move(priority));
-}
-
-OptionalSamplingPriority WritingSpanBuffer::setSamplingPriorityImpl(
-    uint64_t trace_id, OptionalSamplingPriority priority) {
-  auto trace_entry = traces_.find(trace_id);
-  if (trace_entry == traces_.end()) {
+  auto trace = findTrace(trace_id);
+  if (trace == nullptr) {
     logger_->Trace(trace_id, "cannot set sampling priority, trace not found");
     return nullptr;
   }
-  PendingTrace& trace = trace_entry->second;
+  std::lock_guard<std::mutex> trace_lock{trace->mutex};
+  return setSamplingPriorityImpl(trace_id, *trace, priority);
+}
+
+OptionalSamplingPriority WritingSpanBuffer::setSamplingPriorityImpl(
+    uint64_t trace_id, PendingTrace& trace, OptionalSamplingPriority priority) {
   if (trace.sampling_priority_locked) {
     if (priority == nullptr || *priority == SamplingPriority::UserKeep ||
         *priority == SamplingPriority::UserDrop) {
@@ -177,49 +224,40 @@ OptionalSamplingPriority WritingSpanBuffer::setSamplingPriorityImpl(
       // the same outcome) if the Sampler itself is trying to assignSamplingPriority.
       logger_->Trace(trace_id, "sampling priority already set and cannot be reassigned");
     }
-    return getSamplingPriorityImpl(trace_id);
-  }
-  if (priority == nullptr) {
-    trace.sampling_priority.reset(nullptr);
-  } else {
-    trace.sampling_priority.reset(new SamplingPriority(*priority));
-    if (*priority == SamplingPriority::SamplerDrop || *priority == SamplingPriority::SamplerKeep) {
-      // This is an automatically-assigned sampling priority.
-      trace.sampling_priority_locked = true;
-    }
+    return trace.sampling_priority;
+  }
+  trace.sampling_priority = priority;
+  if (priority == SamplingPriority::SamplerDrop || priority == SamplingPriority::SamplerKeep) {
+    // This is an automatically-assigned sampling priority.
+    trace.sampling_priority_locked = true;
   }
-  return getSamplingPriorityImpl(trace_id);
+  trace.shared_sampling_priority->set(priority);
+  return trace.sampling_priority;
 }
 
 OptionalSamplingPriority WritingSpanBuffer::assignSamplingPriority(const SpanData* span) {
-  std::lock_guard<std::mutex> lock{mutex_};
-  return assignSamplingPriorityImpl(span);
-}
-
-OptionalSamplingPriority WritingSpanBuffer::assignSamplingPriorityImpl(const SpanData* span) {
-  bool sampling_priority_unset = getSamplingPriorityImpl(span->trace_id) == nullptr;
-  if (sampling_priority_unset) {
-    auto sampler_result = sampler_->sample(span->env(), span->service, span->name, span->trace_id);
-    setSamplingPriorityImpl(span->trace_id, std::move(sampler_result.sampling_priority));
-    setSamplerResult(span->trace_id, sampler_result);
+  auto trace = findTrace(span->trace_id);
+  if (trace == nullptr) {
+    logger_->Trace(span->trace_id, "cannot assign sampling priority, trace not found");
+    return nullptr;
   }
-  return getSamplingPriorityImpl(span->trace_id);
+  std::lock_guard<std::mutex> trace_lock{trace->mutex};
+  return assignSamplingPriorityImpl(*trace, span);
 }
 
-void WritingSpanBuffer::setSamplerResult(uint64_t trace_id, SampleResult& sample_result) {
-  auto trace_entry = traces_.find(trace_id);
-  if (trace_entry == traces_.end()) {
-    logger_->Trace(trace_id, "cannot assign rules sampler result, trace not found");
-    return;
-  }
-  PendingTrace& trace = trace_entry->second;
-  trace.sample_result.rule_rate = sample_result.rule_rate;
-  trace.sample_result.limiter_rate = sample_result.limiter_rate;
-  trace.sample_result.priority_rate = sample_result.priority_rate;
-  if (sample_result.sampling_priority != nullptr) {
-    trace.sample_result.sampling_priority =
-        std::make_unique<SamplingPriority>(*sample_result.sampling_priority);
+OptionalSamplingPriority WritingSpanBuffer::assignSamplingPriorityImpl(PendingTrace& trace,
+                                                                       const SpanData* span) {
+  if (trace.sampling_priority == nullptr) {
+    auto sampler_result = sampler_->sample(span->env(), span->service, span->name, span->trace_id);
+    setSamplingPriorityImpl(span->trace_id, trace, sampler_result.sampling_priority);
+    trace.sample_result.rule_rate = sampler_result.rule_rate;
+    trace.sample_result.limiter_rate = sampler_result.limiter_rate;
+    trace.sample_result.priority_rate = sampler_result.priority_rate;
+    if (sampler_result.sampling_priority != nullptr) {
+      trace.sample_result.sampling_priority = sampler_result.sampling_priority;
+    }
   }
+  return trace.sampling_priority;
 }
 
 }  // namespace opentracing
@@ -18,30 +18,39 @@ class Writer;
 class SpanContext;
 using Trace = std::unique_ptr<std::vector<std::unique_ptr<SpanData>>>;
 
+// A trace whose Spans have not all finished. Its fields are locked by its own mutex, not by the
+// SpanBuffer's.
 struct PendingTrace {
   PendingTrace(std::shared_ptr<const Logger> logger)
       : logger(logger),
         finished_spans(Trace{new std::vector<std::unique_ptr<SpanData>>()}),
         all_spans() {}
   // This constructor is only used in propagation tests.
-  PendingTrace(std::shared_ptr<const Logger> logger,
-               std::unique_ptr<SamplingPriority> sampling_priority)
+  PendingTrace(std::shared_ptr<const Logger> logger, OptionalSamplingPriority sampling_priority)
       : logger(logger),
         finished_spans(Trace{new std::vector<std::unique_ptr<SpanData>>()}),
         all_spans(),
-        sampling_priority(std::move(sampling_priority)) {}
+        sampling_priority(sampling_priority) {
+    shared_sampling_priority->set(sampling_priority);
+  }
 
   void finish();
 
+  std::mutex mutex;
   std::shared_ptr<const Logger> logger;
   Trace finished_spans;
   std::unordered_set<uint64_t> all_spans;
   OptionalSamplingPriority sampling_priority;
   bool sampling_priority_locked = false;
+  // Kept the same as sampling_priority, and shared with the trace's Spans.
+  std::shared_ptr<SharedSamplingPriority> shared_sampling_priority =
+      std::make_shared<SharedSamplingPriority>();
   std::string origin;
   std::string hostname;
   double analytics_rate;
   SampleResult sample_result;
+  // Set once every Span has finished. A Span registered after that starts a new PendingTrace.
+  bool finished = false;
 };
 
 // Keeps track of Spans until there is a complete trace.
@@ -49,7 +58,9 @@ class SpanBuffer {
  public:
   SpanBuffer() {}
   virtual ~SpanBuffer() {}
-  virtual void registerSpan(const SpanContext& context) = 0;
+  // Returns the trace's sampling priority, for the Span to read without locking.
+  virtual std::shared_ptr<const SharedSamplingPriority> registerSpan(
+      const SpanContext& context) = 0;
   virtual void finishSpan(std::unique_ptr<SpanData> span) = 0;
   virtual OptionalSamplingPriority getSamplingPriority(uint64_t trace_id) const = 0;
   virtual OptionalSamplingPriority setSamplingPriority(uint64_t trace_id,
@@ -69,8 +80,9 @@ class WritingSpanBuffer : public SpanBuffer {
  public:
   WritingSpanBuffer(std::shared_ptr<const Logger> logger, std::shared_ptr<Writer> writer,
                     std::shared_ptr<RulesSampler> sampler, WritingSpanBufferOptions options);
+  ~WritingSpanBuffer() override;
 
-  void registerSpan(const SpanContext& context) override;
+  std::shared_ptr<const SharedSamplingPriority> registerSpan(const SpanContext& context) override;
   void finishSpan(std::unique_ptr<SpanData> span) override;
 
   OptionalSamplingPriority getSamplingPriority(uint64_t trace_id) const override;
@@ -82,24 +94,27 @@ class WritingSpanBuffer : public SpanBuffer {
   void flush(std::chrono::milliseconds timeout) override;
 
  private:
-  // These xImpl methods exist so we can avoid using reentrant locks.
-  OptionalSamplingPriority getSamplingPriorityImpl(uint64_t trace_id) const;
-  OptionalSamplingPriority setSamplingPriorityImpl(uint64_t trace_id,
+  // Returns the trace with the given ID, or nullptr. The caller locks the trace to use it.
+  std::shared_ptr<PendingTrace> findTrace(uint64_t trace_id) const;
+  // These xImpl methods take a trace that the caller has locked.
+  OptionalSamplingPriority setSamplingPriorityImpl(uint64_t trace_id, PendingTrace& trace,
                                                    OptionalSamplingPriority priority);
-  OptionalSamplingPriority assignSamplingPriorityImpl(const SpanData* span);
-  void setSamplerResult(uint64_t trace_id, SampleResult& sample_result);
+  OptionalSamplingPriority assignSamplingPriorityImpl(PendingTrace& trace, const SpanData* span);
 
   std::shared_ptr<const Logger> logger_;
   std::shared_ptr<Writer> writer_;
+  // Locks traces_ itself, for inserting, finding and erasing traces; not the traces in it. Never
+  // acquired while holding a PendingTrace's mutex.
   mutable std::mutex mutex_;
   std::shared_ptr<RulesSampler> sampler_;
 
  protected:
-  // Exists to make it easy for a subclass (ie, our testing mock) to override on-trace-finish
-  // behaviour.
-  virtual void unbufferAndWriteTrace(uint64_t trace_id);
+  // Called, without any lock held, once every Span of the given trace has finished. Exists to
+  // make it easy for a subclass (ie, our testing mock) to override on-trace-finish behaviour.
+  virtual void unbufferAndWriteTrace(uint64_t trace_id,
+                                     const std::shared_ptr<PendingTrace>& trace);
 
-  std::unordered_map<uint64_t, PendingTrace> traces_;
+  std::unordered_map<uint64_t, std::shared_ptr<PendingTrace>> traces_;
   WritingSpanBufferOptions options_;
 };
 
@@ -0,0 +1,398 @@
+#include "spool.h"
+
+#ifndef _MSC_VER
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "span.h"
+
+namespace datadog {
+namespace opentracing {
+
+#ifdef _MSC_VER
+// When compiling with MSVC, there are no memory-mapped segment files to spool to.
+struct Spool::Segment {};
+
+Spool::Spool(SpoolOptions options)
+    : options_(options), errors_(options.logger, options.log_period) {
+  throw std::runtime_error("Spooling traces is not supported on this platform");
+}
+
+Spool::~Spool() {}
+
+bool Spool::push(const EncodedPayload & /* payload (unused) */) { return false; }
+
+bool Spool::peek(EncodedPayload & /* payload (unused) */) { return false; }
+
+void Spool::pop() {}
+
+bool Spool::empty() { return true; }
+
+size_t Spool::bytes() const { return bytes_; }
+#else
+namespace {
+// Each segment starts with a header of the magic number, then the offset of the first record that
+// hasn't been read yet.
+const char magic[8] = {'D', 'D', 'S', 'P', 'O', 'O', 'L', '1'};
+const size_t header_size = sizeof(magic) + sizeof(uint64_t);
+// Each record is its length (not counting the length itself), when it was written, the number of
+// traces, the size of the headers, the headers (as key\0value\0 pairs) and then the body. The
+// length is written last, so a record that was cut short (by a crash, say) reads as a length of
+// zero, which marks the end of the segment.
+const size_t record_prefix_size =
+    sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint32_t) + sizeof(uint32_t);
+const std::string segment_prefix = "segment-";
+const std::string segment_suffix = ".spool";
+
+template <class T>
+T load(const char *data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+template <class T>
+void store(char *data, T value) {
+  std::memcpy(data, &value, sizeof(T));
+}
+
+int64_t nowMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string segmentName(uint64_t sequence) {
+  // Zero-padded so that the segments list in the order they were made.
+  std::string number = std::to_string(sequence);
+  return segment_prefix + std::string(20 - number.size(), '0') + number + segment_suffix;
+}
+
+// Returns true, and the sequence number, if name is the name of a segment file.
+bool parseSegmentName(const std::string &name, uint64_t &sequence) {
+  if (name.size() <= segment_prefix.size() + segment_suffix.size() ||
+      name.compare(0, segment_prefix.size(), segment_prefix) != 0 ||
+      name.compare(name.size() - segment_suffix.size(), segment_suffix.size(), segment_suffix) !=
+          0) {
+    return false;
+  }
+  std::string number = name.substr(segment_prefix.size(),
+                                   name.size() - segment_prefix.size() - segment_suffix.size());
+  if (number.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  sequence = std::stoull(number);
+  return true;
+}
+
+std::runtime_error spoolError(const std::string &message, const std::string &path) {
+  return std::runtime_error(message + " " + path + ": " + std::strerror(errno));
+}
+}  // namespace
+
+// A memory-mapped segment file.
+struct Spool::Segment {
+  ~Segment() {
+    if (data != nullptr) {
+      munmap(data, size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  uint64_t readOffset() const { return load<uint64_t>(data + sizeof(magic)); }
+  void setReadOffset(uint64_t offset) { store(data + sizeof(magic), offset); }
+  bool fullyRead() const { return readOffset() >= write_offset; }
+
+  std::string path;
+  int fd = -1;
+  char *data = nullptr;
+  size_t size = 0;
+  // Where the next record goes.
+  size_t write_offset = header_size;
+};
+
+Spool::Spool(SpoolOptions options)
+    : options_(options), errors_(options.logger, options.log_period) {
+  if (mkdir(options_.directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw spoolError("Unable to create spool directory", options_.directory);
+  }
+  // Held for as long as the Spool is open, so that no other Spool (in this process or another)
+  // reads and writes the same segments.
+  lock_fd_ = open(options_.directory.c_str(), O_RDONLY | O_CLOEXEC);
+  if (lock_fd_ < 0) {
+    throw spoolError("Unable to open spool directory", options_.directory);
+  }
+  if (flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+    auto error = spoolError("Unable to lock spool directory", options_.directory);
+    close(lock_fd_);
+    throw error;
+  }
+  DIR *dir = opendir(options_.directory.c_str());
+  if (dir == nullptr) {
+    auto error = spoolError("Unable to open spool directory", options_.directory);
+    close(lock_fd_);
+    throw error;
+  }
+  std::vector<uint64_t> sequences;
+  while (dirent *entry = readdir(dir)) {
+    uint64_t sequence;
+    if (parseSegmentName(entry->d_name, sequence)) {
+      sequences.push_back(sequence);
+    }
+  }
+  closedir(dir);
+  std::sort(sequences.begin(), sequences.end());
+
+  // Recover whatever a previous Spool left behind.
+  for (uint64_t sequence : sequences) {
+    std::unique_ptr<Segment> segment;
+    try {
+      segment = openSegment(sequence, 0, false);
+    } catch (const std::runtime_error &error) {
+      errors_.Log(LogLevel::error, error.what());
+      continue;
+    }
+    if (segment->size < header_size || std::memcmp(segment->data, magic, sizeof(magic)) != 0) {
+      errors_.Log(LogLevel::error,
+                  "Discarding spool segment " + segment->path + ": not a spool segment");
+      unlink(segment->path.c_str());
+      continue;
+    }
+    // Find the end of the records.
+    size_t offset = header_size;
+    while (offset + sizeof(uint32_t) <= segment->size) {
+      uint32_t length = load<uint32_t>(segment->data + offset);
+      if (length == 0 || length > segment->size - offset - sizeof(uint32_t)) {
+        break;
+      }
+      offset += sizeof(uint32_t) + length;
+    }
+    segment->write_offset = offset;
+    if (segment->readOffset() > offset) {
+      segment->setReadOffset(offset);
+    }
+    bytes_ += segment->size;
+    next_sequence_ = sequence + 1;
+    segments_.push_back(std::move(segment));
+  }
+  removeReadSegments();
+}
+
+Spool::~Spool() {
+  segments_.clear();
+  close(lock_fd_);  // Releases the lock.
+}
+
+std::unique_ptr<Spool::Segment> Spool::openSegment(uint64_t sequence, size_t size, bool create) {
+  std::unique_ptr<Segment> segment{new Segment{}};
+  segment->path = options_.directory + "/" + segmentName(sequence);
+  segment->fd = open(segment->path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+  if (segment->fd < 0) {
+    throw spoolError("Unable to open spool segment", segment->path);
+  }
+  if (create) {
+    // The file reads as zeroes until written to, so it's a valid (empty) segment straight away.
+    if (ftruncate(segment->fd, static_cast<off_t>(size)) != 0) {
+      auto error = spoolError("Unable to size spool segment", segment->path);
+      unlink(segment->path.c_str());
+      throw error;
+    }
+  } else {
+    struct stat status;
+    if (fstat(segment->fd, &status) != 0) {
+      throw spoolError("Unable to read spool segment", segment->path);
+    }
+    size = static_cast<size_t>(status.st_size);
+  }
+  segment->size = size;
+  if (size == 0) {
+    return segment;
+  }
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+  if (data == MAP_FAILED) {
+    auto error = spoolError("Unable to map spool segment", segment->path);
+    if (create) {
+      unlink(segment->path.c_str());
+    }
+    throw error;
+  }
+  segment->data = static_cast<char *>(data);
+  if (create) {
+    std::memcpy(segment->data, magic, sizeof(magic));
+    segment->setReadOffset(header_size);
+  }
+  return segment;
+}
+
+bool Spool::push(const EncodedPayload &payload) {
+  size_t headers_size = 0;
+  for (auto &header : payload.headers) {
+    headers_size += header.first.size() + header.second.size() + 2;
+  }
+  size_t record_size = record_prefix_size + headers_size + payload.body.size();
+  if (record_size - sizeof(uint32_t) > UINT32_MAX) {
+    return false;
+  }
+  if (segments_.empty() || segments_.back()->write_offset + record_size > segments_.back()->size) {
+    size_t segment_size = std::max(options_.segment_bytes, header_size + record_size);
+    if (segment_size > options_.max_bytes) {
+      return false;
+    }
+    // Make room by discarding the oldest payloads.
+    while (!segments_.empty() && bytes_ + segment_size > options_.max_bytes) {
+      removeOldestSegment();
+    }
+    try {
+      segments_.push_back(openSegment(next_sequence_++, segment_size, true));
+    } catch (const std::runtime_error &error) {
+      errors_.Log(LogLevel::error, error.what());
+      return false;
+    }
+    bytes_ += segment_size;
+  }
+
+  Segment &segment = *segments_.back();
+  char *record = segment.data + segment.write_offset;
+  char *position = record + sizeof(uint32_t);
+  store(position, static_cast<int64_t>(nowMillis()));
+  position += sizeof(int64_t);
+  store(position, static_cast<uint32_t>(payload.num_traces));
+  position += sizeof(uint32_t);
+  store(position, static_cast<uint32_t>(headers_size));
+  position += sizeof(uint32_t);
+  for (auto &header : payload.headers) {
+    std::memcpy(position, header.first.c_str(), header.first.size() + 1);
+    position += header.first.size() + 1;
+    std::memcpy(position, header.second.c_str(), header.second.size() + 1);
+    position += header.second.size() + 1;
+  }
+  std::memcpy(position, payload.body.data(), payload.body.size());
+  // Last, so that the record is only there once it's complete.
+  store(record, static_cast<uint32_t>(record_size - sizeof(uint32_t)));
+  segment.write_offset += record_size;
+  return true;
+}
+
+bool Spool::peek(EncodedPayload &payload) {
+  int64_t oldest_allowed = nowMillis() - options_.max_age.count();
+  while (true) {
+    removeReadSegments();
+    if (segments_.empty()) {
+      return false;
+    }
+    Segment &segment = *segments_.front();
+    // The segment is only as trustworthy as the disk it's on, so every size in the record is
+    // checked before it's used. If a record doesn't add up, neither can the rest of the segment.
+    auto discard = [&](const char *reason) {
+      errors_.Log(LogLevel::error, "Discarding spool segment " + segment.path + ": " + reason);
+      removeOldestSegment();
+    };
+    uint64_t read_offset = segment.readOffset();
+    if (read_offset + record_prefix_size > segment.write_offset) {
+      discard("record out of bounds");
+      continue;
+    }
+    const char *record = segment.data + read_offset;
+    uint32_t length = load<uint32_t>(record);
+    if (length < record_prefix_size - sizeof(uint32_t) ||
+        length > segment.write_offset - read_offset - sizeof(uint32_t)) {
+      discard("bad record length");
+      continue;
+    }
+    const char *position = record + sizeof(uint32_t);
+    const char *end = position + length;
+    int64_t written_at = load<int64_t>(position);
+    if (written_at < oldest_allowed) {
+      segment.setReadOffset(read_offset + sizeof(uint32_t) + length);
+      continue;
+    }
+    position += sizeof(int64_t);
+    payload.num_traces = load<uint32_t>(position);
+    position += sizeof(uint32_t);
+    uint32_t headers_size = load<uint32_t>(position);
+    position += sizeof(uint32_t);
+    if (headers_size > static_cast<size_t>(end - position)) {
+      discard("bad record headers size");
+      continue;
+    }
+    const char *headers_end = position + headers_size;
+    payload.headers.clear();
+    bool headers_valid = true;
+    while (position < headers_end) {
+      auto key_end =
+          static_cast<const char *>(std::memchr(position, '\0', headers_end - position));
+      if (key_end == nullptr) {
+        headers_valid = false;
+        break;
+      }
+      auto value_end =
+          static_cast<const char *>(std::memchr(key_end + 1, '\0', headers_end - key_end - 1));
+      if (value_end == nullptr) {
+        headers_valid = false;
+        break;
+      }
+      payload.headers[std::string(position, key_end)] = std::string(key_end + 1, value_end);
+      position = value_end + 1;
+    }
+    if (!headers_valid) {
+      discard("bad record headers");
+      continue;
+    }
+    payload.body.assign(headers_end, end);
+    return true;
+  }
+}
+
+void Spool::pop() {
+  removeReadSegments();
+  if (segments_.empty()) {
+    return;
+  }
+  Segment &segment = *segments_.front();
+  uint32_t length = load<uint32_t>(segment.data + segment.readOffset());
+  // Never past the end, in case this record wasn't checked by peek() first.
+  segment.setReadOffset(std::min<uint64_t>(segment.readOffset() + sizeof(uint32_t) + length,
+                                           segment.write_offset));
+  removeReadSegments();
+}
+
+bool Spool::empty() {
+  removeReadSegments();
+  return segments_.empty();
+}
+
+size_t Spool::bytes() const { return bytes_; }
+
+void Spool::removeOldestSegment() {
+  Segment &segment = *segments_.front();
+  if (unlink(segment.path.c_str()) != 0) {
+    errors_.Log(LogLevel::error,
+                spoolError("Unable to remove spool segment", segment.path).what());
+  }
+  bytes_ -= segment.size;
+  segments_.pop_front();
+}
+
+void Spool::removeReadSegments() {
+  while (!segments_.empty() && segments_.front()->fullyRead()) {
+    removeOldestSegment();
+  }
+}
+
+#endif
+
+}  // namespace opentracing
+}  // namespace datadog
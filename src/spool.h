@@ -0,0 +1,81 @@
+#ifndef DD_OPENTRACING_SPOOL_H
+#define DD_OPENTRACING_SPOOL_H
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "encoder.h"
+#include "logger.h"
+
+namespace datadog {
+namespace opentracing {
+
+struct SpoolOptions {
+  // The directory to keep the spool in, created if need be. Each writer needs a directory of its
+  // own: the Spool locks it, and opening a second Spool on it (in any process) fails. If empty,
+  // there's no spool.
+  std::string directory;
+  // The most disk space the spool may use. The oldest payloads are discarded to stay under it.
+  size_t max_bytes = 64 * 1024 * 1024;
+  // The size of each segment file. Payloads larger than this get a segment to themselves.
+  size_t segment_bytes = 4 * 1024 * 1024;
+  // Payloads older than this are discarded rather than replayed.
+  std::chrono::milliseconds max_age = std::chrono::minutes(10);
+  // Where problems with the spool's files are logged, at most once per log_period. If nullptr,
+  // they go to std::cerr. An AgentWriter sets these to its own logger and log_period.
+  std::shared_ptr<const Logger> logger;
+  std::chrono::milliseconds log_period = std::chrono::seconds(60);
+};
+
+// An on-disk queue of EncodedPayloads, kept for when the agent can't take them. Payloads are
+// appended to memory-mapped segment files, and read back oldest-first. What's been read is
+// recorded in the segment too, so a new Spool over the same directory (say, after a restart)
+// picks up where the last one left off. Not thread-safe.
+class Spool {
+ public:
+  // Opens the spool in options.directory, recovering any payloads already there. May throw
+  // runtime_error, and always does when compiled with MSVC.
+  Spool(SpoolOptions options);
+  ~Spool();
+
+  Spool(const Spool &) = delete;
+  Spool &operator=(const Spool &) = delete;
+
+  // Appends the payload. Returns false if it couldn't be written.
+  bool push(const EncodedPayload &payload);
+  // Reads the oldest payload into payload, discarding any that are too old first, and any segment
+  // with a record that's corrupt. Returns false if there are none.
+  bool peek(EncodedPayload &payload);
+  // Discards the oldest payload, once it's been dealt with.
+  void pop();
+  bool empty();
+  // The disk space used by the spool.
+  size_t bytes() const;
+
+ private:
+  struct Segment;
+
+  // Maps the segment file with the given sequence number. If create, the file is made with the
+  // given size, otherwise it must already exist. May throw runtime_error.
+  std::unique_ptr<Segment> openSegment(uint64_t sequence, size_t size, bool create);
+  void removeOldestSegment();
+  // Removes segments at the front that have been read completely. Segments aren't reused, push()
+  // starts a new one when need be.
+  void removeReadSegments();
+
+  const SpoolOptions options_;
+  RateLimitedLogger errors_;
+  // Oldest first.
+  std::deque<std::unique_ptr<Segment>> segments_;
+  size_t bytes_ = 0;
+  uint64_t next_sequence_ = 0;
+  // An open descriptor of the directory, holding the lock on it.
+  int lock_fd_ = -1;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_SPOOL_H
@@ -0,0 +1,434 @@
+#include "telemetry.h"
+
+#include <errno.h>
+#ifndef _MSC_VER
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <set>
+#include <stdexcept>
+
+#if !defined(_MSC_VER) && !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0  // Platforms without it have SO_NOSIGPIPE instead.
+#endif
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+// The most a DogStatsD datagram should hold, so that it isn't fragmented.
+const size_t max_datagram_size = 1432;
+const std::string metric_prefix = "datadog.tracer.";
+
+// The Counter shard that the calling thread adds to.
+size_t threadShard() {
+  static std::atomic<size_t> next_shard{0};
+  thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) %
+                              Counter::num_shards;
+  return shard;
+}
+
+#ifndef _MSC_VER
+// The DogStatsdReporters in the process, for the fork handlers. Never destroyed, see AgentWriter.
+struct ForkRegistry {
+  std::mutex mutex;
+  std::set<DogStatsdReporter *> reporters;
+};
+
+ForkRegistry &forkRegistry() {
+  static ForkRegistry *registry = new ForkRegistry{};
+  return *registry;
+}
+#endif
+
+int mostSignificantBit(uint64_t value) {
+  int bit = 0;
+  while (value >>= 1) {
+    bit++;
+  }
+  return bit;
+}
+
+// Sets the percentiles of summary from the given bucket counts, which add up to summary.count.
+// None is more than summary.max.
+void setPercentiles(const std::vector<uint64_t> &buckets, LatencySummary &summary) {
+  auto percentile = [&](double p) -> uint64_t {
+    auto rank = static_cast<uint64_t>(std::ceil(p * static_cast<double>(summary.count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::min(LatencyHistogram::bucketMax(i), summary.max);
+      }
+    }
+    return summary.max;
+  };
+  summary.p50 = percentile(0.5);
+  summary.p90 = percentile(0.9);
+  summary.p99 = percentile(0.99);
+}
+}  // namespace
+
+const size_t Counter::num_shards;
+const size_t LatencyHistogram::sub_buckets;
+const size_t LatencyHistogram::num_buckets;
+
+void Counter::add(uint64_t n) noexcept {
+  shards_[threadShard()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t Counter::value() const noexcept {
+  uint64_t total = 0;
+  for (auto &shard : shards_) {
+    total += shard.value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+LatencyHistogram::LatencyHistogram() {
+  for (auto &bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value) {
+  if (value < 2 * sub_buckets) {
+    return static_cast<size_t>(value);
+  }
+  // Values too large for the last bucket go in it anyway.
+  const uint64_t largest = bucketMax(num_buckets - 1);
+  value = std::min(value, largest);
+  int shift = mostSignificantBit(value) - mostSignificantBit(sub_buckets);
+  return static_cast<size_t>(shift) * sub_buckets + static_cast<size_t>(value >> shift);
+}
+
+uint64_t LatencyHistogram::bucketMax(size_t index) {
+  if (index < 2 * sub_buckets) {
+    return index;
+  }
+  size_t shift = index / sub_buckets - 1;
+  uint64_t sub_bucket = index - shift * sub_buckets;
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration duration) noexcept {
+  auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  recordMicroseconds(microseconds < 0 ? 0 : static_cast<uint64_t>(microseconds));
+}
+
+void LatencyHistogram::recordMicroseconds(uint64_t value) noexcept {
+  buckets_[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+LatencySummary LatencyHistogram::summary() const {
+  // Take a copy first, so that the percentiles are consistent with each other even if values are
+  // recorded meanwhile.
+  std::vector<uint64_t> buckets = bucketCounts();
+  LatencySummary summary;
+  for (uint64_t count : buckets) {
+    summary.count += count;
+  }
+  if (summary.count == 0) {
+    return summary;
+  }
+  summary.max = max_.load(std::memory_order_relaxed);
+  summary.mean = static_cast<double>(sum_.load(std::memory_order_relaxed)) /
+                 static_cast<double>(count_.load(std::memory_order_relaxed));
+  setPercentiles(buckets, summary);
+  return summary;
+}
+
+std::vector<uint64_t> LatencyHistogram::bucketCounts() const {
+  std::vector<uint64_t> buckets(num_buckets);
+  for (size_t i = 0; i < num_buckets; i++) {
+    buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+  return buckets;
+}
+
+LatencySummary LatencyHistogram::summary(const std::vector<uint64_t> &since,
+                                         const std::vector<uint64_t> &until) {
+  std::vector<uint64_t> buckets(num_buckets);
+  double sum = 0;
+  LatencySummary summary;
+  for (size_t i = 0; i < num_buckets; i++) {
+    buckets[i] = until[i] - since[i];
+    if (buckets[i] > 0) {
+      summary.count += buckets[i];
+      summary.max = bucketMax(i);
+      sum += static_cast<double>(buckets[i]) * static_cast<double>(summary.max);
+    }
+  }
+  if (summary.count == 0) {
+    return summary;
+  }
+  summary.mean = sum / static_cast<double>(summary.count);
+  setPercentiles(buckets, summary);
+  return summary;
+}
+
+TelemetrySnapshot Telemetry::snapshot() const {
+  TelemetrySnapshot snapshot;
+  snapshot.spans_created = spans_created.value();
+  snapshot.traces_written = traces_written.value();
+  snapshot.traces_dropped = traces_dropped.value();
+  snapshot.traces_sent = traces_sent.value();
+  snapshot.payloads_sent = payloads_sent.value();
+  snapshot.payload_bytes = payload_bytes.value();
+  snapshot.requests_failed = requests_failed.value();
+  snapshot.retries = retries.value();
+  snapshot.pending_traces = pending_traces.load(std::memory_order_relaxed);
+  snapshot.encode_time = encode_time.summary();
+  snapshot.request_latency = request_latency.summary();
+  return snapshot;
+}
+
+Telemetry &telemetry() {
+  static Telemetry telemetry;
+  return telemetry;
+}
+
+TelemetrySnapshot getTelemetry() { return telemetry().snapshot(); }
+
+#ifdef _MSC_VER
+// When compiling with MSVC, the DogStatsD socket and fork handling aren't available.
+DogStatsdReporter::DogStatsdReporter(const std::string &url, std::chrono::milliseconds period,
+                                     std::vector<std::string> /* tags (unused) */)
+    : period_(period) {
+  throw std::runtime_error("Reporting to DogStatsD is not supported on this platform: " + url);
+}
+
+DogStatsdReporter::~DogStatsdReporter() {}
+
+void DogStatsdReporter::report() {}
+#else
+DogStatsdReporter::DogStatsdReporter(const std::string &url, std::chrono::milliseconds period,
+                                     std::vector<std::string> tags)
+    : period_(period) {
+  for (auto &tag : tags) {
+    tags_ += (tags_.empty() ? "" : ",") + tag;
+  }
+  const std::string udp_scheme = "udp://";
+  const std::string unix_scheme = "unix://";
+  if (url.compare(0, udp_scheme.size(), udp_scheme) == 0) {
+    std::string address = url.substr(udp_scheme.size());
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos) {
+      throw std::runtime_error("DogStatsD URL has no port: " + url);
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *addresses = nullptr;
+    int rcode = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (rcode != 0) {
+      throw std::runtime_error("Unable to resolve " + host + ": " + gai_strerror(rcode));
+    }
+    for (addrinfo *address = addresses; address != nullptr; address = address->ai_next) {
+      fd_ = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if (fd_ >= 0 && connect(fd_, address->ai_addr, address->ai_addrlen) == 0) {
+        break;
+      }
+      if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+      }
+    }
+    freeaddrinfo(addresses);
+  } else if (url.compare(0, unix_scheme.size(), unix_scheme) == 0) {
+    std::string path = url.substr(unix_scheme.size());
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error("DogStatsD socket path is too long: " + path);
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    fd_ = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd_ >= 0 && connect(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  } else {
+    throw std::runtime_error("Unsupported DogStatsD URL: " + url);
+  }
+  if (fd_ < 0) {
+    throw std::runtime_error("Unable to connect to DogStatsD at " + url + ": " +
+                             std::strerror(errno));
+  }
+  last_ = getTelemetry();
+  last_encode_time_ = telemetry().encode_time.bucketCounts();
+  last_request_latency_ = telemetry().request_latency.bucketCounts();
+  static std::once_flag fork_handlers;
+  std::call_once(fork_handlers,
+                 []() { pthread_atfork(prepareFork, afterForkInParent, afterForkInChild); });
+  // Registered along with starting the thread, so that a fork can't come between the two.
+  ForkRegistry &registry = forkRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  startReporting();
+  registry.reporters.insert(this);
+}
+
+DogStatsdReporter::~DogStatsdReporter() {
+  {
+    // Waits for any fork in progress to finish first.
+    ForkRegistry &registry = forkRegistry();
+    std::unique_lock<std::mutex> lock(registry.mutex);
+    registry.reporters.erase(this);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  thread_.join();
+  close(fd_);
+}
+
+void DogStatsdReporter::startReporting() {
+  thread_ = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!condition_.wait_for(lock, period_, [this]() { return stop_ || forking_; })) {
+      lock.unlock();
+      report();
+      lock.lock();
+    }
+  });
+}
+
+void DogStatsdReporter::prepareFork() {
+  ForkRegistry &registry = forkRegistry();
+  registry.mutex.lock();
+  for (DogStatsdReporter *reporter : registry.reporters) {
+    reporter->pauseForFork();
+  }
+}
+
+void DogStatsdReporter::afterForkInParent() {
+  ForkRegistry &registry = forkRegistry();
+  for (DogStatsdReporter *reporter : registry.reporters) {
+    reporter->resumeAfterFork(false);
+  }
+  registry.mutex.unlock();
+}
+
+void DogStatsdReporter::afterForkInChild() {
+  ForkRegistry &registry = forkRegistry();
+  for (DogStatsdReporter *reporter : registry.reporters) {
+    reporter->resumeAfterFork(true);
+  }
+  registry.mutex.unlock();
+}
+
+void DogStatsdReporter::pauseForFork() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    forking_ = true;
+  }
+  condition_.notify_all();
+  thread_.join();
+  // Held until after the fork, see AgentWriter::pauseForFork().
+  mutex_.lock();
+}
+
+void DogStatsdReporter::resumeAfterFork(bool in_child) {
+  forking_ = false;
+  if (in_child) {
+    // See AgentWriter::resumeAfterFork().
+    new (&mutex_) std::mutex{};
+    new (&condition_) std::condition_variable{};
+    // The child inherits the parent's counts, which are the parent's to report.
+    last_ = getTelemetry();
+    last_encode_time_ = telemetry().encode_time.bucketCounts();
+    last_request_latency_ = telemetry().request_latency.bucketCounts();
+  } else {
+    mutex_.unlock();
+  }
+  startReporting();
+}
+
+void DogStatsdReporter::report() {
+  TelemetrySnapshot current = getTelemetry();
+  std::vector<uint64_t> encode_time = telemetry().encode_time.bucketCounts();
+  std::vector<uint64_t> request_latency = telemetry().request_latency.bucketCounts();
+  // Percentiles since the process started would hardly move once it's been running a while.
+  TelemetrySnapshot reported = current;
+  reported.encode_time = LatencyHistogram::summary(last_encode_time_, encode_time);
+  reported.request_latency = LatencyHistogram::summary(last_request_latency_, request_latency);
+  for (auto &datagram : format(last_, reported, tags_)) {
+    // DogStatsD is best-effort. If it isn't listening, or can't keep up, the report is lost.
+    send(fd_, datagram.data(), datagram.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  last_ = current;
+  last_encode_time_ = std::move(encode_time);
+  last_request_latency_ = std::move(request_latency);
+}
+#endif
+
+std::vector<std::string> DogStatsdReporter::format(const TelemetrySnapshot &last,
+                                                   const TelemetrySnapshot &current,
+                                                   const std::string &tags) {
+  std::vector<std::string> lines;
+  auto metric = [&](const std::string &name, const std::string &value, const char *type) {
+    lines.push_back(metric_prefix + name + ":" + value + "|" + type +
+                    (tags.empty() ? "" : "|#" + tags));
+  };
+  auto count = [&](const std::string &name, uint64_t last_value, uint64_t current_value) {
+    if (current_value > last_value) {
+      metric(name, std::to_string(current_value - last_value), "c");
+    }
+  };
+  auto latency = [&](const std::string &name, const LatencySummary &summary) {
+    if (summary.count == 0) {
+      return;
+    }
+    metric(name + ".p50", std::to_string(summary.p50), "g");
+    metric(name + ".p99", std::to_string(summary.p99), "g");
+    metric(name + ".max", std::to_string(summary.max), "g");
+  };
+  count("spans_created", last.spans_created, current.spans_created);
+  count("traces_written", last.traces_written, current.traces_written);
+  count("traces_dropped", last.traces_dropped, current.traces_dropped);
+  count("traces_sent", last.traces_sent, current.traces_sent);
+  count("payloads_sent", last.payloads_sent, current.payloads_sent);
+  count("payload_bytes", last.payload_bytes, current.payload_bytes);
+  count("requests_failed", last.requests_failed, current.requests_failed);
+  count("retries", last.retries, current.retries);
+  metric("pending_traces", std::to_string(current.pending_traces), "g");
+  latency("encode_time_us", current.encode_time);
+  latency("request_latency_us", current.request_latency);
+
+  // As many metrics to a datagram as fit, one per line.
+  std::vector<std::string> datagrams;
+  std::string datagram;
+  for (auto &line : lines) {
+    if (!datagram.empty() && datagram.size() + 1 + line.size() > max_datagram_size) {
+      datagrams.push_back(datagram);
+      datagram.clear();
+    }
+    datagram += (datagram.empty() ? "" : "\n") + line;
+  }
+  if (!datagram.empty()) {
+    datagrams.push_back(datagram);
+  }
+  return datagrams;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,156 @@
+#ifndef DD_OPENTRACING_TELEMETRY_H
+#define DD_OPENTRACING_TELEMETRY_H
+
+#include <datadog/opentracing.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace datadog {
+namespace opentracing {
+
+// A count that any number of threads can add to without contending with each other. Each thread
+// adds to a shard of its own (threads share shards only once there are more threads than
+// shards), and the shards are summed when the count is read.
+class Counter {
+ public:
+  Counter() = default;
+  Counter(const Counter &) = delete;
+  Counter &operator=(const Counter &) = delete;
+
+  void add(uint64_t n = 1) noexcept;
+  uint64_t value() const noexcept;
+
+  static const size_t num_shards = 16;
+
+ private:
+  // Each on a cache line of its own. Counters are only ever in static storage or on the stack,
+  // since operator new needn't honour the alignment before C++17.
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  Shard shards_[num_shards];
+};
+
+// A histogram of durations, in microseconds, with HDR-style buckets: values below 64 get a bucket
+// each, and each power of two above that is split into 32 buckets. So the bucket a value falls in
+// is within about 3% of it, and the whole histogram is a fixed 8KB. Recording is lock-free.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+  void record(std::chrono::steady_clock::duration duration) noexcept;
+  void recordMicroseconds(uint64_t value) noexcept;
+  // Summarizes every value recorded so far.
+  LatencySummary summary() const;
+
+  // The number of values recorded in each bucket so far.
+  std::vector<uint64_t> bucketCounts() const;
+  // Summarizes the values recorded between the two calls to bucketCounts() that returned since and
+  // until. Only their buckets are known, so the mean and max are of the buckets' largest values.
+  static LatencySummary summary(const std::vector<uint64_t> &since,
+                                const std::vector<uint64_t> &until);
+
+  // Exposed for testing.
+  static size_t bucketIndex(uint64_t value);
+  // The largest value that falls in the given bucket.
+  static uint64_t bucketMax(size_t index);
+
+  static const size_t sub_buckets = 32;
+  static const size_t num_buckets = 1024;
+
+ private:
+  std::atomic<uint64_t> buckets_[num_buckets];
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+// The tracer's telemetry, shared by all the tracers in the process.
+struct Telemetry {
+  Counter spans_created;
+  Counter traces_written;
+  Counter traces_dropped;
+  Counter traces_sent;
+  Counter payloads_sent;
+  Counter payload_bytes;
+  Counter requests_failed;
+  Counter retries;
+  std::atomic<int64_t> pending_traces{0};
+  LatencyHistogram encode_time;
+  LatencyHistogram request_latency;
+
+  TelemetrySnapshot snapshot() const;
+};
+
+// Returns the process's Telemetry.
+Telemetry &telemetry();
+
+// Sends telemetry to DogStatsD every period, from a thread of its own: counts as the change since
+// the last report, and the pending trace count and the latencies recorded since the last report
+// as gauges. Metrics are named datadog.tracer.<name>, and tagged with the given tags. Stops on
+// destruction.
+//
+// Like AgentWriter, it keeps working across fork(): the thread is stopped before the fork and
+// started again after it, and a child process reports only what happens in it after the fork.
+class DogStatsdReporter {
+ public:
+  // The url is udp://host:port or unix:///path/to/socket. May throw runtime_error, and always
+  // does when compiled with MSVC.
+  DogStatsdReporter(const std::string &url, std::chrono::milliseconds period,
+                    std::vector<std::string> tags);
+  ~DogStatsdReporter();
+
+  DogStatsdReporter(const DogStatsdReporter &) = delete;
+  DogStatsdReporter &operator=(const DogStatsdReporter &) = delete;
+
+  // Sends a report now. Called by the reporting thread, exposed for testing.
+  void report();
+
+  // Returns the DogStatsD datagrams that report the change in counts from last to current, and
+  // current's pending traces and latencies. report() passes latencies of just the values recorded
+  // since the last report.
+  static std::vector<std::string> format(const TelemetrySnapshot &last,
+                                         const TelemetrySnapshot &current,
+                                         const std::string &tags);
+
+ private:
+  // Starts thread_, which reports every period_ until stopped or paused.
+  void startReporting();
+
+  // The pthread_atfork handlers, for every DogStatsdReporter in the process. See AgentWriter.
+  static void prepareFork();
+  static void afterForkInParent();
+  static void afterForkInChild();
+  // Stops thread_ and locks mutex_ until after the fork.
+  void pauseForFork();
+  // Starts thread_ again, in the parent or the child.
+  void resumeAfterFork(bool in_child);
+
+  const std::chrono::milliseconds period_;
+  std::string tags_;
+  int fd_ = -1;
+  TelemetrySnapshot last_;
+  // The latency histograms' buckets as of the last report.
+  std::vector<uint64_t> last_encode_time_;
+  std::vector<uint64_t> last_request_latency_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_ = false;
+  // Stops thread_ so that the process can fork. Locked by mutex_.
+  bool forking_ = false;
+  std::thread thread_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_TELEMETRY_H
@@ -0,0 +1,149 @@
+#include "trace_ring.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+// A record's length, in place of a record that didn't fit before the end of the ring.
+const uint32_t skip_to_start = UINT32_MAX;
+
+template <class T>
+T load(const char *data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+template <class T>
+void store(char *data, T value) {
+  std::memcpy(data, &value, sizeof(T));
+}
+}  // namespace
+
+struct TraceRing::Shared {
+  // Held by the collector.
+  SharedMutex collector;
+  // Locks everything below.
+  SharedMutex mutex;
+  // Where the next record is read from, and written to. They only ever increase (wrapping around
+  // the ring's capacity is left to reads and writes), so tail - head is the bytes in use. Each is
+  // only changed once a record has been read or written.
+  uint64_t head = 0;
+  uint64_t tail = 0;
+  // Also read without locking.
+  std::atomic<uint64_t> pushed{0};
+  std::atomic<uint64_t> popped{0};
+  uint64_t sampling_rates_version = 0;
+  uint32_t sampling_rates_size = 0;
+  char sampling_rates[TraceRing::max_sampling_rates_size];
+};
+
+const size_t TraceRing::max_sampling_rates_size;
+
+TraceRing::TraceRing(const std::string &name, size_t capacity)
+    : capacity_(capacity),
+      memory_(new SharedMemory{name, sizeof(Shared) + capacity,
+                               [](void *data) { new (data) Shared{}; }}),
+      shared_(static_cast<Shared *>(memory_->data())),
+      data_(static_cast<char *>(memory_->data()) + sizeof(Shared)) {}
+
+TraceRing::~TraceRing() {}
+
+bool TraceRing::push(const std::string &encoded_trace) {
+  size_t record_size = sizeof(uint32_t) + encoded_trace.size();
+  if (record_size > capacity_ || encoded_trace.size() >= skip_to_start) {
+    return false;
+  }
+  std::lock_guard<SharedMutex> lock(shared_->mutex);
+  uint64_t tail = shared_->tail;
+  size_t offset = tail % capacity_;
+  size_t padding = record_size > capacity_ - offset ? capacity_ - offset : 0;
+  if (padding > 0 && shared_->head == tail) {
+    // The ring is empty, so start again from the beginning rather than skip to it. Marked as a
+    // skip first, so that the ring is consistent in between the two stores.
+    if (padding >= sizeof(uint32_t)) {
+      store(data_ + offset, skip_to_start);
+    }
+    tail += padding;
+    shared_->tail = tail;
+    shared_->head = tail;
+    offset = 0;
+    padding = 0;
+  }
+  if (tail + padding + record_size - shared_->head > capacity_) {
+    return false;
+  }
+  if (padding > 0) {
+    // Too short to hold a length at all means the same thing.
+    if (padding >= sizeof(uint32_t)) {
+      store(data_ + offset, skip_to_start);
+    }
+    offset = 0;
+  }
+  store(data_ + offset, static_cast<uint32_t>(encoded_trace.size()));
+  std::memcpy(data_ + offset + sizeof(uint32_t), encoded_trace.data(), encoded_trace.size());
+  shared_->tail = tail + padding + record_size;
+  shared_->pushed.fetch_add(1);
+  return true;
+}
+
+size_t TraceRing::pop(std::vector<std::string> &traces, size_t max_traces) {
+  std::lock_guard<SharedMutex> lock(shared_->mutex);
+  size_t popped = 0;
+  while (popped < max_traces && shared_->head != shared_->tail) {
+    size_t offset = shared_->head % capacity_;
+    if (capacity_ - offset < sizeof(uint32_t) || load<uint32_t>(data_ + offset) == skip_to_start) {
+      shared_->head += capacity_ - offset;
+      continue;
+    }
+    uint32_t length = load<uint32_t>(data_ + offset);
+    // Consumed before it's copied, so that a trace there isn't memory for is dropped rather than
+    // left to fail again.
+    shared_->head += sizeof(uint32_t) + length;
+    popped++;
+    try {
+      traces.emplace_back(data_ + offset + sizeof(uint32_t), length);
+    } catch (const std::bad_alloc &) {
+      shared_->popped.fetch_add(popped);
+      throw;
+    }
+  }
+  shared_->popped.fetch_add(popped);
+  return popped;
+}
+
+uint64_t TraceRing::pushed() const { return shared_->pushed.load(); }
+
+uint64_t TraceRing::popped() const { return shared_->popped.load(); }
+
+bool TraceRing::tryCollect() { return shared_->collector.try_lock(); }
+
+void TraceRing::stopCollecting() { shared_->collector.unlock(); }
+
+void TraceRing::setSamplingRates(const std::string &rates) {
+  if (rates.size() > max_sampling_rates_size) {
+    return;
+  }
+  std::lock_guard<SharedMutex> lock(shared_->mutex);
+  std::memcpy(shared_->sampling_rates, rates.data(), rates.size());
+  shared_->sampling_rates_size = static_cast<uint32_t>(rates.size());
+  shared_->sampling_rates_version++;
+}
+
+bool TraceRing::samplingRates(uint64_t &version, std::string &rates) const {
+  std::lock_guard<SharedMutex> lock(shared_->mutex);
+  if (shared_->sampling_rates_version == version) {
+    return false;
+  }
+  rates.assign(shared_->sampling_rates, shared_->sampling_rates_size);
+  version = shared_->sampling_rates_version;
+  return true;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
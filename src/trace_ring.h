@@ -0,0 +1,69 @@
+#ifndef DD_OPENTRACING_TRACE_RING_H
+#define DD_OPENTRACING_TRACE_RING_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "shared_memory.h"
+
+namespace datadog {
+namespace opentracing {
+
+// A queue of encoded traces in shared memory, that any number of processes on the host push to,
+// and one of them, the collector, pops from. It's a ring of length-prefixed records. A record
+// that doesn't fit before the end of the ring skips to the start.
+//
+// Also holds what else the processes share: which of them is the collector, and the sampling
+// rates the agent last gave it.
+//
+// Each record is written in full before the ring's tail moves past it, and read in full before
+// its head does, so a process that dies partway through leaves the ring as it was. Thread-safe.
+class TraceRing {
+ public:
+  // Opens the ring in the named shared memory, creating it with room for capacity bytes of
+  // records if need be. May throw runtime_error.
+  TraceRing(const std::string &name, size_t capacity);
+  ~TraceRing();
+
+  TraceRing(const TraceRing &) = delete;
+  TraceRing &operator=(const TraceRing &) = delete;
+
+  // Appends the encoded trace. Returns false if there isn't room for it.
+  bool push(const std::string &encoded_trace);
+  // Pops up to max_traces of the oldest traces, appending them to traces. Returns how many it
+  // popped. If copying a trace throws std::bad_alloc, it and those appended before it have still
+  // been popped.
+  size_t pop(std::vector<std::string> &traces, size_t max_traces);
+  // How many traces have been pushed to, and popped from, the ring since it was created.
+  uint64_t pushed() const;
+  uint64_t popped() const;
+
+  // Returns true if the calling thread is now the collector, because there wasn't one. The
+  // collector stays so until the same thread calls stopCollecting(), or its process dies.
+  bool tryCollect();
+  void stopCollecting();
+
+  // Sets the agent's sampling rates (as the JSON it sent them in), for the other processes.
+  void setSamplingRates(const std::string &rates);
+  // If the sampling rates have been set since the given version, sets rates to them, updates
+  // version, and returns true. Otherwise returns false.
+  bool samplingRates(uint64_t &version, std::string &rates) const;
+
+  // The largest JSON that setSamplingRates() takes. Rates larger than this aren't shared.
+  static const size_t max_sampling_rates_size = 16 * 1024;
+
+ private:
+  struct Shared;
+
+  const size_t capacity_;
+  std::unique_ptr<SharedMemory> memory_;
+  Shared *shared_;
+  // The records, right after shared_.
+  char *data_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_TRACE_RING_H
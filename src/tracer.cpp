@@ -16,6 +16,7 @@
 
 #include "bool.h"
 #include "tracer.h"
+#include "url_normalizer.h"
 
 namespace ot = opentracing;
 namespace tags = datadog::tags;
@@ -131,6 +132,9 @@ void startupLog(TracerOptions &options) {
   j["analytics_enabled"] = options.analytics_enabled;
   j["analytics_sample_rate"] = options.analytics_rate;
   j["sampling_rules"] = options.sampling_rules;
+  if (!options.url_normalization_rules.empty()) {
+    j["url_normalization_rules"] = options.url_normalization_rules;
+  }
   if (!options.tags.empty()) {
     j["tags"] = options.tags;
   }
@@ -249,6 +253,59 @@ void Tracer::configureRulesSampler(std::shared_ptr<RulesSampler> sampler) noexce
       std::string("rules sampler: unable to parse JSON config for rules sampler: ", error.what()));
 }
 
+void Tracer::configureUrlNormalizer() noexcept try {
+  if (opts_.url_normalization_rules.empty()) {
+    return;
+  }
+  auto log_invalid_json = [&](const std::string &description, json &object) {
+    logger_->Log(LogLevel::info, description + ": " + object.dump());
+  };
+  json config = json::parse(opts_.url_normalization_rules);
+  if (!config.is_object()) {
+    log_invalid_json("url normalizer: rules must be an object", config);
+    return;
+  }
+  UrlNormalizerRules rules;
+  if (config.contains("segments") && config.at("segments").is_array()) {
+    for (auto &segment : config.at("segments")) {
+      if (segment == "integer") {
+        rules.integers = true;
+      } else if (segment == "uuid") {
+        rules.uuids = true;
+      } else if (segment == "hex") {
+        rules.hex = true;
+      } else {
+        log_invalid_json("url normalizer: unknown kind of segment", segment);
+      }
+    }
+  }
+  if (config.contains("routes") && config.at("routes").is_array()) {
+    for (auto &route : config.at("routes")) {
+      if (!route.is_string() || route.get<std::string>().substr(0, 1) != "/") {
+        log_invalid_json("url normalizer: route must be a string starting with '/'", route);
+        continue;
+      }
+      rules.routes.push_back(route.get<std::string>());
+    }
+  }
+  if (config.contains("cache_size")) {
+    if (config.at("cache_size").is_number_unsigned()) {
+      rules.cache_size = config.at("cache_size").get<size_t>();
+    } else {
+      log_invalid_json("url normalizer: invalid value for 'cache_size'", config.at("cache_size"));
+    }
+  }
+  url_normalizer_ = std::make_shared<const UrlNormalizer>(rules);
+} catch (const json::parse_error &error) {
+  logger_->Log(LogLevel::error,
+               std::string("url normalizer: unable to parse JSON rules: ") + error.what());
+} catch (const json::exception &error) {
+  logger_->Log(LogLevel::error, std::string("url normalizer: invalid rules: ") + error.what());
+} catch (const std::exception &error) {
+  logger_->Log(LogLevel::error,
+               std::string("url normalizer: unable to use rules: ") + error.what());
+}
+
 Tracer::Tracer(TracerOptions options, std::shared_ptr<SpanBuffer> buffer, TimeProvider get_time,
                IdProvider get_id)
     : opts_(options),
@@ -269,7 +326,19 @@ Tracer::Tracer(TracerOptions options, std::shared_ptr<Writer> writer,
     logger_ = std::make_shared<StandardLogger>(opts_.log_func);
   }
   configureRulesSampler(sampler);
+  configureUrlNormalizer();
   startupLog(options);
+  if (!opts_.telemetry_dogstatsd_url.empty()) {
+    try {
+      telemetry_reporter_ = std::make_unique<DogStatsdReporter>(
+          opts_.telemetry_dogstatsd_url, std::chrono::seconds(10),
+          std::vector<std::string>{"lang:cpp", "service:" + opts_.service,
+                                   "tracer_version:" + datadog::version::tracer_version});
+    } catch (const std::runtime_error &error) {
+      logger_->Log(LogLevel::error,
+                   std::string("Unable to send telemetry to DogStatsD: ") + error.what());
+    }
+  }
   buffer_ = std::make_shared<WritingSpanBuffer>(
       logger_, writer, sampler,
       WritingSpanBufferOptions{isEnabled(), reportingHostname(options), analyticsRate(options)});
@@ -303,7 +372,8 @@ std::unique_ptr<ot::Span> Tracer::StartSpanWithOptions(ot::string_view operation
   auto span = std::make_unique<Span>(logger_, shared_from_this(), buffer_, get_time_, span_id,
                                      trace_id, parent_id, std::move(span_context), get_time_(),
                                      opts_.service, opts_.type, operation_name, operation_name,
-                                     opts_.operation_name_override, legacy_obfuscation_);
+                                     opts_.operation_name_override, legacy_obfuscation_,
+                                     url_normalizer_);
 
   if (!opts_.environment.empty()) {
     span->SetTag(datadog::tags::environment, opts_.environment);
@@ -333,6 +403,9 @@ ot::expected<void> Tracer::Inject(const ot::SpanContext &sc, std::ostream &write
   if (span_context == nullptr) {
     return ot::make_unexpected(ot::invalid_span_context_error);
   }
+  if (opts_.inject_binary_compact) {
+    return span_context->serializeCompact(writer, buffer_, opts_.priority_sampling);
+  }
   return span_context->serialize(writer, buffer_, opts_.priority_sampling);
 }
 
@@ -14,6 +14,7 @@
 #include "sample.h"
 #include "span.h"
 #include "span_buffer.h"
+#include "telemetry.h"
 #include "writer.h"
 
 namespace ot = opentracing;
@@ -22,6 +23,7 @@ namespace datadog {
 namespace opentracing {
 
 class SpanBuffer;
+class UrlNormalizer;
 
 // The interface for providing IDs to spans and traces.
 typedef std::function<uint64_t()> IdProvider;
@@ -72,6 +74,7 @@ class Tracer : public ot::Tracer, public std::enable_shared_from_this<Tracer> {
 
  private:
   void configureRulesSampler(std::shared_ptr<RulesSampler> sampler) noexcept;
+  void configureUrlNormalizer() noexcept;
 
   std::shared_ptr<const Logger> logger_;
   const TracerOptions opts_;
@@ -80,6 +83,10 @@ class Tracer : public ot::Tracer, public std::enable_shared_from_this<Tracer> {
   TimeProvider get_time_;
   IdProvider get_id_;
   bool legacy_obfuscation_ = false;
+  // Set if TracerOptions::url_normalization_rules is.
+  std::shared_ptr<const UrlNormalizer> url_normalizer_;
+  // Sends telemetry to DogStatsD, if TracerOptions::telemetry_dogstatsd_url is set.
+  std::unique_ptr<DogStatsdReporter> telemetry_reporter_;
 };
 
 }  // namespace opentracing
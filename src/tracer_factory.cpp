@@ -51,6 +51,33 @@ ot::expected<TracerOptions> optionsFromConfig(const char *configuration,
     if (config.find("sampling_rules") != config.end()) {
       options.sampling_rules = config.at("sampling_rules").dump();
     }
+    if (config.find("url_normalization_rules") != config.end()) {
+      options.url_normalization_rules = config.at("url_normalization_rules").dump();
+    }
+    if (config.find("agent_max_concurrent_requests") != config.end()) {
+      config.at("agent_max_concurrent_requests").get_to(options.agent_max_concurrent_requests);
+    }
+    if (config.find("agent_native_transport") != config.end()) {
+      config.at("agent_native_transport").get_to(options.agent_native_transport);
+    }
+    if (config.find("agent_spool_directory") != config.end()) {
+      config.at("agent_spool_directory").get_to(options.agent_spool_directory);
+    }
+    if (config.find("agent_max_consecutive_failures") != config.end()) {
+      config.at("agent_max_consecutive_failures").get_to(options.agent_max_consecutive_failures);
+    }
+    if (config.find("agent_collector_name") != config.end()) {
+      config.at("agent_collector_name").get_to(options.agent_collector_name);
+    }
+    if (config.find("sampling_limiter_name") != config.end()) {
+      config.at("sampling_limiter_name").get_to(options.sampling_limiter_name);
+    }
+    if (config.find("telemetry_dogstatsd_url") != config.end()) {
+      config.at("telemetry_dogstatsd_url").get_to(options.telemetry_dogstatsd_url);
+    }
+    if (config.find("propagation_inject_binary_compact") != config.end()) {
+      config.at("propagation_inject_binary_compact").get_to(options.inject_binary_compact);
+    }
     if (config.find("operation_name_override") != config.end()) {
       config.at("operation_name_override").get_to(options.operation_name_override);
     }
@@ -5,6 +5,9 @@
 #include <opentracing/tracer_factory.h>
 
 #include "agent_writer.h"
+#ifndef _MSC_VER
+#include "collector_writer.h"
+#endif
 #include "tracer.h"
 #include "tracer_options.h"
 
@@ -39,6 +42,26 @@ class TracerFactory : public ot::TracerFactory {
   // "propagation_style_inject": A list of strings, each string is one of "Datadog", "B3". Defaults
   //     to ["Datadog"]. The type of headers to use to receive distributed traces. Can also be set
   //     by the environment variable DD_PROPAGATION_STYLE_INJECT.
+  // "propagation_inject_binary_compact": A boolean, defaults to false. See
+  //     TracerOptions::inject_binary_compact. Can also be set by the environment variable
+  //     DD_PROPAGATION_INJECT_BINARY_COMPACT.
+  // "url_normalization_rules": A JSON object. See TracerOptions::url_normalization_rules. Can
+  //     also be set by the environment variable DD_TRACE_URL_NORMALIZATION_RULES.
+  // "agent_max_concurrent_requests": A number, defaults to 1. Can also be set by the environment
+  //     variable DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS.
+  // "agent_native_transport": A boolean, defaults to false. Can also be set by the environment
+  //     variable DD_TRACE_AGENT_NATIVE_TRANSPORT.
+  // "agent_spool_directory": A string, defaults to "" (no spool). Can also be set by the
+  //     environment variable DD_TRACE_AGENT_SPOOL_DIRECTORY.
+  // "agent_max_consecutive_failures": A number, defaults to 5. Can also be set by the environment
+  //     variable DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES.
+  // "agent_collector_name": A string, defaults to "". Can also be set by the environment variable
+  //     DD_TRACE_AGENT_COLLECTOR_NAME.
+  // "sampling_limiter_name": A string, defaults to "". Can also be set by the environment
+  //     variable DD_TRACE_SAMPLING_LIMITER_NAME.
+  // "telemetry_dogstatsd_url": A string, defaults to "". Can also be set by the environment
+  //     variable DD_TRACE_TELEMETRY_DOGSTATSD_URL.
+  // See TracerOptions for what each of the agent_ options, and the others, do.
   //
   // Extra keys will be ignored.
   ot::expected<std::shared_ptr<ot::Tracer>> MakeTracer(const char *configuration,
@@ -55,10 +78,32 @@ ot::expected<std::shared_ptr<ot::Tracer>> TracerFactory<TracerImpl>::MakeTracer(
   }
   TracerOptions options = maybe_options.value();
 
-  auto sampler = std::make_shared<RulesSampler>();
-  auto writer = std::shared_ptr<Writer>{
-      new AgentWriter(options.agent_host, options.agent_port, options.agent_url,
-                      std::chrono::milliseconds(llabs(options.write_period_ms)), sampler)};
+  auto sampler = options.sampling_limiter_name.empty()
+                     ? std::make_shared<RulesSampler>()
+                     : std::make_shared<RulesSampler>(options.sampling_limiter_name);
+  AgentWriterOptions writer_options;
+  writer_options.write_period = std::chrono::milliseconds(llabs(options.write_period_ms));
+  writer_options.max_concurrent_requests = options.agent_max_concurrent_requests;
+  writer_options.native_transport = options.agent_native_transport;
+  writer_options.spool.directory = options.agent_spool_directory;
+  writer_options.max_consecutive_failures = options.agent_max_consecutive_failures;
+  writer_options.logger = std::make_shared<StandardLogger>(options.log_func);
+  std::shared_ptr<Writer> writer;
+  if (options.agent_collector_name.empty()) {
+    writer.reset(new AgentWriter(options.agent_host, options.agent_port, options.agent_url,
+                                 writer_options, sampler));
+  } else {
+#ifdef _MSC_VER
+    // Rejected by applyTracerOptionsFromEnvironment().
+    throw std::runtime_error("agent_collector_name is not supported on this platform");
+#else
+    CollectorWriterOptions collector_options;
+    collector_options.name = options.agent_collector_name;
+    collector_options.agent_writer = writer_options;
+    writer.reset(new CollectorWriter(options.agent_host, options.agent_port, options.agent_url,
+                                     collector_options, sampler));
+#endif
+  }
 
   return std::shared_ptr<ot::Tracer>{new TracerImpl{options, writer, sampler}};
 } catch (const std::bad_alloc &) {
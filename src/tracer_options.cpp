@@ -3,6 +3,7 @@
 #include <datadog/tags.h>
 #include <opentracing/ext/tags.h>
 
+#include <limits>
 #include <regex>
 
 #include "bool.h"
@@ -85,6 +86,24 @@ std::vector<std::string> tokenize_propagation_style(const std::string &input) {
   return result;
 }
 
+// Parses a count of something, such as requests, which is all decimal digits. Returns false if the
+// text isn't one, or is out of range.
+bool parse_count(const std::string &text, size_t &count) {
+  if (text.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  try {
+    unsigned long long value = std::stoull(text);
+    if (value > std::numeric_limits<size_t>::max()) {
+      return false;
+    }
+    count = static_cast<size_t>(value);
+  } catch (const std::out_of_range &) {
+    return false;
+  }
+  return true;
+}
+
 }  // namespace
 
 ot::expected<TracerOptions, const char *> applyTracerOptionsFromEnvironment(
@@ -144,11 +163,61 @@ ot::expected<TracerOptions, const char *> applyTracerOptionsFromEnvironment(
     opts.sampling_rules = sampling_rules;
   }
 
+  auto url_normalization_rules = std::getenv("DD_TRACE_URL_NORMALIZATION_RULES");
+  if (url_normalization_rules != nullptr && std::strlen(url_normalization_rules) > 0) {
+    opts.url_normalization_rules = url_normalization_rules;
+  }
+
   auto trace_agent_url = std::getenv("DD_TRACE_AGENT_URL");
   if (trace_agent_url != nullptr && std::strlen(trace_agent_url) > 0) {
     opts.agent_url = trace_agent_url;
   }
 
+  auto max_concurrent_requests = std::getenv("DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS");
+  if (max_concurrent_requests != nullptr && std::strlen(max_concurrent_requests) > 0) {
+    if (!parse_count(max_concurrent_requests, opts.agent_max_concurrent_requests) ||
+        opts.agent_max_concurrent_requests == 0) {
+      return ot::make_unexpected("Value for DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS is invalid");
+    }
+  }
+
+  auto native_transport = std::getenv("DD_TRACE_AGENT_NATIVE_TRANSPORT");
+  if (native_transport != nullptr) {
+    auto value = std::string(native_transport);
+    if (value.empty() || isbool(value)) {
+      opts.agent_native_transport = stob(value, false);
+    } else {
+      return ot::make_unexpected("Value for DD_TRACE_AGENT_NATIVE_TRANSPORT is invalid");
+    }
+  }
+
+  auto spool_directory = std::getenv("DD_TRACE_AGENT_SPOOL_DIRECTORY");
+  if (spool_directory != nullptr && std::strlen(spool_directory) > 0) {
+    opts.agent_spool_directory = spool_directory;
+  }
+
+  auto max_consecutive_failures = std::getenv("DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES");
+  if (max_consecutive_failures != nullptr && std::strlen(max_consecutive_failures) > 0) {
+    if (!parse_count(max_consecutive_failures, opts.agent_max_consecutive_failures)) {
+      return ot::make_unexpected("Value for DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES is invalid");
+    }
+  }
+
+  auto collector_name = std::getenv("DD_TRACE_AGENT_COLLECTOR_NAME");
+  if (collector_name != nullptr && std::strlen(collector_name) > 0) {
+    opts.agent_collector_name = collector_name;
+  }
+
+  auto sampling_limiter_name = std::getenv("DD_TRACE_SAMPLING_LIMITER_NAME");
+  if (sampling_limiter_name != nullptr && std::strlen(sampling_limiter_name) > 0) {
+    opts.sampling_limiter_name = sampling_limiter_name;
+  }
+
+  auto telemetry_dogstatsd_url = std::getenv("DD_TRACE_TELEMETRY_DOGSTATSD_URL");
+  if (telemetry_dogstatsd_url != nullptr && std::strlen(telemetry_dogstatsd_url) > 0) {
+    opts.telemetry_dogstatsd_url = telemetry_dogstatsd_url;
+  }
+
   auto extract = std::getenv("DD_PROPAGATION_STYLE_EXTRACT");
   if (extract != nullptr && std::strlen(extract) > 0) {
     auto style_maybe = asPropagationStyle(tokenize_propagation_style(extract));
@@ -167,6 +236,16 @@ ot::expected<TracerOptions, const char *> applyTracerOptionsFromEnvironment(
     opts.inject = style_maybe.value();
   }
 
+  auto inject_binary_compact = std::getenv("DD_PROPAGATION_INJECT_BINARY_COMPACT");
+  if (inject_binary_compact != nullptr) {
+    auto value = std::string(inject_binary_compact);
+    if (value.empty() || isbool(value)) {
+      opts.inject_binary_compact = stob(value, false);
+    } else {
+      return ot::make_unexpected("Value for DD_PROPAGATION_INJECT_BINARY_COMPACT is invalid");
+    }
+  }
+
   auto report_hostname = std::getenv("DD_TRACE_REPORT_HOSTNAME");
   if (report_hostname != nullptr) {
     auto value = std::string(report_hostname);
@@ -208,6 +287,16 @@ ot::expected<TracerOptions, const char *> applyTracerOptionsFromEnvironment(
       return ot::make_unexpected("Value for DD_TRACE_ANALYTICS_SAMPLE_RATE is invalid");
     }
   }
+
+#ifdef _MSC_VER
+  // Both need POSIX shared memory, which MSVC builds don't have.
+  if (!opts.agent_collector_name.empty()) {
+    return ot::make_unexpected("agent_collector_name is not supported on this platform");
+  }
+  if (!opts.sampling_limiter_name.empty()) {
+    return ot::make_unexpected("sampling_limiter_name is not supported on this platform");
+  }
+#endif
   return opts;
 }
 
@@ -1,103 +1,186 @@
 #include "transport.h"
 
-#include <cstring>
-#include <iostream>
 #include <stdexcept>
 
 namespace datadog {
 namespace opentracing {
 
-size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
-  CurlHandle* handle = static_cast<CurlHandle*>(userdata);
-  handle->response_buffer_.write(ptr, size * nmemb);
-
-  if (!handle->response_buffer_) {
-    std::cerr << "Unable to write to response buffer" << std::endl;
-    return -1;
+const char* handleResultString(HandleResult result) {
+  switch (result) {
+    case HandleResult::ok:
+      return "No error";
+    case HandleResult::unsupported_protocol:
+      return "Unsupported protocol";
+    case HandleResult::url_malformat:
+      return "URL using bad/illegal format or missing URL";
+    case HandleResult::couldnt_connect:
+      return "Couldn't connect to server";
+    case HandleResult::out_of_memory:
+      return "Out of memory";
+    case HandleResult::operation_timedout:
+      return "Timeout was reached";
+    case HandleResult::send_error:
+      return "Failed sending data to the peer";
+    case HandleResult::recv_error:
+      return "Failure when receiving data from the peer";
+    case HandleResult::weird_server_reply:
+      return "Weird server reply";
+    case HandleResult::http_returned_error:
+      return "HTTP response code said error";
+    case HandleResult::unknown_option:
+      return "An unknown option was passed in to libcurl";
+    case HandleResult::failed:
+    default:
+      return "Unknown error";
   }
-  return size * nmemb;
 }
 
-CurlHandle::CurlHandle() {
-  curl_global_init(CURL_GLOBAL_ALL);
-  handle_ = curl_easy_init();
-  // Set the error buffer.
-  auto rcode = curl_easy_setopt(handle_, CURLOPT_ERRORBUFFER, curl_error_buffer_);
-  if (rcode != CURLE_OK) {
-    tearDownHandle();
-    throw std::runtime_error(std::string("Unable to set curl error buffer: ") +
-                             curl_easy_strerror(rcode));
-  }
-  rcode = curl_easy_setopt(handle_, CURLOPT_POST, 1);
-  if (rcode != CURLE_OK) {
-    tearDownHandle();
-    throw std::runtime_error(std::string("Unable to set curl POST option ") +
-                             curl_easy_strerror(rcode));
+void Handle::post(const std::map<std::string, std::string>& headers, const std::string& body,
+                  Callback callback) {
+  setHeaders(headers);
+
+  // We have to set the size manually, because msgpack uses null characters.
+  HandleResult result = setopt(HandleOption::post_field_size, body.size());
+  if (result != HandleResult::ok) {
+    callback(result,
+             std::string("Error setting agent request size: ") + handleResultString(result), "");
+    return;
   }
-  // Don't write responses to stdout.
-  rcode = curl_easy_setopt(handle_, CURLOPT_WRITEFUNCTION, write_callback);
-  if (rcode != CURLE_OK) {
-    tearDownHandle();
-    throw std::runtime_error(std::string("Unable to set curl write callback: ") +
-                             curl_easy_strerror(rcode));
+
+  result = setopt(HandleOption::post_fields, body.data());
+  if (result != HandleResult::ok) {
+    callback(result,
+             std::string("Error setting agent request body: ") + handleResultString(result), "");
+    return;
   }
-  rcode = curl_easy_setopt(handle_, CURLOPT_WRITEDATA, static_cast<void*>(this));
-  if (rcode != CURLE_OK) {
-    tearDownHandle();
-    throw std::runtime_error(std::string("Unable to set curl write callback userdata: ") +
-                             curl_easy_strerror(rcode));
+
+  result = perform();
+  if (result != HandleResult::ok) {
+    callback(result,
+             std::string("Error sending traces to agent: ") + handleResultString(result) + "\n" +
+                 getError(),
+             "");
+    return;
   }
+  callback(HandleResult::ok, "", getResponse());
 }
 
-CurlHandle::~CurlHandle() { tearDownHandle(); }
+#ifndef _MSC_VER
+NativeHandle::NativeHandle() {}
 
-void CurlHandle::tearDownHandle() {
-  curl_easy_cleanup(handle_);
-  curl_global_cleanup();
-}
+NativeHandle::~NativeHandle() {}
 
-CURLcode CurlHandle::setopt(CURLoption key, const char* value) {
-  return curl_easy_setopt(handle_, key, value);
+HandleResult NativeHandle::setopt(HandleOption key, const char* value) {
+  switch (key) {
+    case HandleOption::url: {
+      // http://host[:port][/path]
+      const std::string http_scheme = "http://";
+      std::string url = value;
+      if (url.substr(0, http_scheme.size()) != http_scheme) {
+        return HandleResult::unsupported_protocol;
+      }
+      url = url.substr(http_scheme.size());
+      size_t path_start = std::min(url.find('/'), url.size());
+      std::string authority = url.substr(0, path_start);
+      path_ = path_start < url.size() ? url.substr(path_start) : "/";
+      size_t port_start = authority.rfind(':');
+      bool has_port =
+          port_start != std::string::npos && authority.find(']', port_start) == std::string::npos;
+      if (has_port) {
+        try {
+          port_ = std::stoul(authority.substr(port_start + 1));
+        } catch (const std::logic_error&) {
+          return HandleResult::url_malformat;
+        }
+        authority = authority.substr(0, port_start);
+      } else {
+        port_ = 80;
+      }
+      if (authority.size() > 1 && authority.front() == '[' && authority.back() == ']') {
+        authority = authority.substr(1, authority.size() - 2);  // IPv6 address.
+      }
+      if (authority.empty()) {
+        return HandleResult::url_malformat;
+      }
+      host_ = authority;
+      break;
+    }
+    case HandleOption::unix_socket_path:
+      unix_socket_ = value;
+      break;
+    case HandleOption::post_fields:
+      post_fields_ = value;
+      return HandleResult::ok;  // Doesn't affect the connection.
+    default:
+      return HandleResult::unknown_option;
+  }
+  connection_ = nullptr;
+  return HandleResult::ok;
 }
 
-CURLcode CurlHandle::setopt(CURLoption key, long value) {
-  return curl_easy_setopt(handle_, key, value);
+HandleResult NativeHandle::setopt(HandleOption key, long value) {
+  switch (key) {
+    case HandleOption::timeout_ms:
+      timeout_ = std::chrono::milliseconds(value);
+      connection_ = nullptr;
+      return HandleResult::ok;
+    case HandleOption::post_field_size:
+      post_field_size_ = static_cast<size_t>(value);
+      return HandleResult::ok;
+    default:
+      return HandleResult::unknown_option;
+  }
 }
 
-CURLcode CurlHandle::setopt(CURLoption key, size_t value) {
-  return curl_easy_setopt(handle_, key, value);
+HandleResult NativeHandle::setopt(HandleOption key, size_t value) {
+  return setopt(key, static_cast<long>(value));
 }
 
-void CurlHandle::setHeaders(std::map<std::string, std::string> headers) {
+void NativeHandle::setHeaders(std::map<std::string, std::string> headers) {
   for (auto& header : headers) {
     headers_[header.first] = header.second;  // Overwrite.
   }
 }
 
-CURLcode CurlHandle::perform() {
-  // Clear response buffer.
-  response_buffer_.clear();
-  response_buffer_.str(std::string{});
-  // TODO[willgittoes-dd]: Find a way to not copy these strings each time, without unreasonable
-  // coupling to libcurl internals.
-  struct curl_slist* http_headers = nullptr;
-  for (auto& pair : headers_) {
-    std::string header = pair.first + ": " + pair.second;
-    http_headers = curl_slist_append(http_headers, header.c_str());
+HandleResult NativeHandle::perform() {
+  response_.clear();
+  if (connection_ == nullptr) {
+    if (host_.empty()) {
+      error_ = "No agent URL set";
+      return HandleResult::url_malformat;
+    }
+    // Like curl, no timeout means waiting forever (or as near as makes no difference).
+    auto timeout = timeout_.count() > 0 ? timeout_ : std::chrono::hours(24 * 365);
+    connection_.reset(new HttpConnection{unix_socket_, host_, port_, path_, timeout});
   }
-  CURLcode rcode = curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, http_headers);
-  if (rcode != CURLE_OK) {
-    std::strncpy(curl_error_buffer_, "Unable to write headers", CURL_ERROR_SIZE - 1);
-    curl_slist_free_all(http_headers);
-    return rcode;
+  auto result = connection_->post(headers_, post_fields_, post_field_size_);
+  error_ = connection_->error();
+  switch (result) {
+    case HttpConnection::Result::ok:
+      if (connection_->status() < 200 || connection_->status() >= 300) {
+        error_ = "Agent responded with " + connection_->statusLine();
+        return HandleResult::http_returned_error;
+      }
+      response_ = connection_->response();
+      return HandleResult::ok;
+    case HttpConnection::Result::connect_error:
+      return HandleResult::couldnt_connect;
+    case HttpConnection::Result::send_error:
+      return HandleResult::send_error;
+    case HttpConnection::Result::timed_out:
+      return HandleResult::operation_timedout;
+    case HttpConnection::Result::bad_response:
+      return HandleResult::weird_server_reply;
+    case HttpConnection::Result::receive_error:
+    case HttpConnection::Result::connection_closed:
+    default:
+      return HandleResult::recv_error;
   }
-  rcode = curl_easy_perform(handle_);
-  curl_slist_free_all(http_headers);
-  return rcode;
 }
 
-std::string CurlHandle::getError() { return std::string(curl_error_buffer_); }
-std::string CurlHandle::getResponse() { return response_buffer_.str(); }
+std::string NativeHandle::getError() { return error_; }
+std::string NativeHandle::getResponse() { return response_; }
+#endif
 
 }  // namespace opentracing
 }  // namespace datadog
@@ -1,57 +1,114 @@
 #ifndef DD_OPENTRACING_TRANSPORT_H
 #define DD_OPENTRACING_TRANSPORT_H
 
-#include <curl/curl.h>
-
+#include <chrono>
+#include <functional>
 #include <map>
-#include <sstream>
+#include <memory>
 #include <string>
 
+#ifndef _MSC_VER
+#include "http_connection.h"
+#endif
+
 namespace datadog {
 namespace opentracing {
 
-// An interface to a CURL handle. This interface exists to make testing Recorder easier.
+// The options that can be set on a Handle. Each is the libcurl option of the same name.
+enum class HandleOption { url, unix_socket_path, timeout_ms, post_fields, post_field_size };
+
+// The outcome of a Handle operation. Each is the libcurl error code of the same name, except
+// failed, which stands for any other error. A request whose response has a status other than 2xx
+// fails with http_returned_error.
+enum class HandleResult {
+  ok,
+  failed,
+  unsupported_protocol,
+  url_malformat,
+  couldnt_connect,
+  out_of_memory,
+  operation_timedout,
+  send_error,
+  recv_error,
+  weird_server_reply,
+  http_returned_error,
+  unknown_option,
+};
+
+// Describes the given result, in the same words as curl_easy_strerror().
+const char* handleResultString(HandleResult result);
+
+// An interface to an HTTP client, modelled on a CURL handle. This interface exists to make
+// testing AgentWriter easier, and so that it doesn't depend on libcurl: the Handles that use it
+// are in curl_transport.h.
 class Handle {
  public:
+  // Called when a request made by post() completes. If result is HandleResult::ok then response
+  // is the body of the response, otherwise error describes what went wrong: for
+  // HandleResult::http_returned_error, the status the agent responded with.
+  using Callback = std::function<void(HandleResult result, const std::string& error,
+                                      const std::string& response)>;
+
   Handle() {}
   virtual ~Handle() {}
-  virtual CURLcode setopt(CURLoption key, const char* value) = 0;
-  virtual CURLcode setopt(CURLoption key, long value) = 0;
-  virtual CURLcode setopt(CURLoption key, size_t value) = 0;
+  virtual HandleResult setopt(HandleOption key, const char* value) = 0;
+  virtual HandleResult setopt(HandleOption key, long value) = 0;
+  virtual HandleResult setopt(HandleOption key, size_t value) = 0;
   virtual void setHeaders(std::map<std::string, std::string> headers) = 0;
-  virtual CURLcode perform() = 0;
+  virtual HandleResult perform() = 0;
   virtual std::string getError() = 0;
   virtual std::string getResponse() = 0;
+
+  // Asynchronous interface. By default a Handle can only make one request at a time, and post()
+  // makes it with perform(), calling callback before it returns. Handles that can have several
+  // requests in flight at once override all of these.
+
+  // POSTs the given body, calling callback when the request completes. The body must stay alive
+  // until then.
+  virtual void post(const std::map<std::string, std::string>& headers, const std::string& body,
+                    Callback callback);
+  // The most requests that should be in flight at once.
+  virtual size_t maxInFlight() { return 1; }
+  // The number of requests made by post() that haven't completed yet.
+  virtual size_t inFlight() { return 0; }
+  // Progresses requests that are in flight, calling the callbacks of any that complete. Waits up
+  // to timeout for something to happen, or until wakeUp() is called.
+  virtual void run(std::chrono::milliseconds /* timeout (unused) */) {}
+  // Makes a call to run() on another thread return early. Thread-safe.
+  virtual void wakeUp() {}
 };
 
-// A Handle that uses real curl to really send things. Not thread-safe.
-class CurlHandle : public Handle {
+#ifndef _MSC_VER
+// A Handle that speaks HTTP/1.1 to the agent itself, rather than using libcurl, over a persistent
+// unix domain socket or TCP connection. Supports the options that AgentWriter sets, but not https.
+// Not thread-safe, and not available when compiling with MSVC.
+class NativeHandle : public Handle {
  public:
-  // May throw runtime_error.
-  CurlHandle();
-  ~CurlHandle() override;
-  CURLcode setopt(CURLoption key, const char* value) override;
-  CURLcode setopt(CURLoption key, long value) override;
-  CURLcode setopt(CURLoption key, size_t value) override;
+  NativeHandle();
+  ~NativeHandle() override;
+  HandleResult setopt(HandleOption key, const char* value) override;
+  HandleResult setopt(HandleOption key, long value) override;
+  HandleResult setopt(HandleOption key, size_t value) override;
   void setHeaders(std::map<std::string, std::string> headers) override;
-  CURLcode perform() override;
+  HandleResult perform() override;
   std::string getError() override;
   std::string getResponse() override;
 
  private:
-  // For things that need cleaning up if the constructor fails as well as on destruction.
-  void tearDownHandle();
-
-  CURL* handle_;
-  // Not unordered, just so that the headers are always in the same order. Makes testing just a bit
-  // easier, and the number of headers is so low that the log(n) insert doesn't matter.
+  // The connection is made on the first perform(), and remade if the options change.
+  std::unique_ptr<HttpConnection> connection_;
+  std::string unix_socket_;
+  std::string host_;
+  uint32_t port_ = 80;
+  std::string path_ = "/";
+  std::chrono::milliseconds timeout_{0};
+  const char* post_fields_ = nullptr;
+  size_t post_field_size_ = 0;
   std::map<std::string, std::string> headers_;
-  char curl_error_buffer_[CURL_ERROR_SIZE];
-  std::stringstream response_buffer_;  // So much more humane than a fixed sized buffer.
-
-  // Called with the response from perform().
-  friend size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata);
+  std::string error_;
+  std::string response_;
 };
+#endif
 
 }  // namespace opentracing
 }  // namespace datadog
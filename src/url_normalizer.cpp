@@ -0,0 +1,242 @@
+#include "url_normalizer.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+bool is_hex_digit(char c) {
+  return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+bool is_integer(const std::string& input, size_t begin, size_t end) {
+  return begin < end && std::all_of(input.begin() + begin, input.begin() + end, is_digit);
+}
+
+bool is_uuid(const std::string& input, size_t begin, size_t end) {
+  if (end - begin != 36) {
+    return false;
+  }
+  for (size_t i = 0; i < 36; i++) {
+    char c = input[begin + i];
+    bool valid = (i == 8 || i == 13 || i == 18 || i == 23) ? c == '-' : is_hex_digit(c);
+    if (!valid) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool is_hex(const std::string& input, size_t begin, size_t end) {
+  return end - begin >= 8 &&
+         std::all_of(input.begin() + begin, input.begin() + end, is_hex_digit) &&
+         std::any_of(input.begin() + begin, input.begin() + end, is_digit);
+}
+
+// Returns whether the input looks like a URL, "scheme://..." or "/path", optionally after an HTTP
+// method, as in "GET /users/1".
+bool looks_like_url(const std::string& input) {
+  size_t begin = 0;
+  while (begin < input.size() && input[begin] >= 'A' && input[begin] <= 'Z') {
+    begin++;
+  }
+  begin = begin > 0 && begin < input.size() && input[begin] == ' ' ? begin + 1 : 0;
+  if (begin < input.size() && input[begin] == '/') {
+    return true;
+  }
+  size_t scheme = input.find("://", begin);
+  return scheme != std::string::npos && scheme > begin && is_alpha(input[begin]) &&
+         std::all_of(input.begin() + begin + 1, input.begin() + scheme, [](char c) {
+           return is_alpha(c) || is_digit(c) || c == '+' || c == '-' || c == '.';
+         });
+}
+
+// Returns the end of the path segment starting at the specified `begin` of the specified
+// `input`: the next '/', or the end of the input.
+size_t segment_end(const std::string& input, size_t begin) {
+  return std::min(input.find('/', begin), input.size());
+}
+
+// A node of the trie that the routes are first put in. It's an NFA, since a segment can both
+// match a literal and a "{...}".
+struct RouteNode {
+  std::map<std::string, size_t> on_segment;
+  size_t on_any_segment = static_cast<size_t>(-1);
+  size_t route = static_cast<size_t>(-1);
+};
+
+}  // namespace
+
+const size_t UrlNormalizer::none;
+
+UrlNormalizer::UrlNormalizer(const UrlNormalizerRules& rules)
+    : rules_(rules), cache_size_(rules.cache_size) {
+  std::vector<std::vector<std::string>> routes;
+  for (auto& route : rules_.routes) {
+    if (route.empty() || route[0] != '/') {
+      throw std::invalid_argument("URL normalization route must start with '/': " + route);
+    }
+    routes.emplace_back();
+    for (size_t begin = 1; begin <= route.size();) {
+      size_t end = segment_end(route, begin);
+      routes.back().push_back(route.substr(begin, end - begin));
+      begin = end + 1;
+    }
+  }
+  compile(routes);
+}
+
+void UrlNormalizer::compile(const std::vector<std::vector<std::string>>& routes) {
+  std::vector<RouteNode> nodes(1);
+  for (size_t r = 0; r < routes.size(); r++) {
+    size_t node = 0;
+    for (auto& segment : routes[r]) {
+      bool any = segment.size() >= 2 && segment.front() == '{' && segment.back() == '}';
+      size_t next = any ? nodes[node].on_any_segment : none;
+      if (!any) {
+        auto found = nodes[node].on_segment.find(segment);
+        if (found != nodes[node].on_segment.end()) {
+          next = found->second;
+        }
+      }
+      if (next == none) {
+        next = nodes.size();
+        if (any) {
+          nodes[node].on_any_segment = next;
+        } else {
+          nodes[node].on_segment[segment] = next;
+        }
+        nodes.emplace_back();
+      }
+      node = next;
+    }
+    nodes[node].route = std::min(nodes[node].route, r);
+  }
+
+  // Subset construction: each State stands for the set of nodes that a path could have reached.
+  std::map<std::vector<size_t>, size_t> state_of;
+  std::vector<std::vector<size_t>> node_sets;
+  auto state_for = [&](std::vector<size_t> node_set) {
+    std::sort(node_set.begin(), node_set.end());
+    node_set.erase(std::unique(node_set.begin(), node_set.end()), node_set.end());
+    auto found = state_of.find(node_set);
+    if (found != state_of.end()) {
+      return found->second;
+    }
+    size_t state = node_sets.size();
+    state_of.emplace(node_set, state);
+    node_sets.push_back(std::move(node_set));
+    return state;
+  };
+  state_for({0});
+  for (size_t s = 0; s < node_sets.size(); s++) {
+    std::vector<size_t> on_any_segment;
+    std::map<std::string, std::vector<size_t>> on_segment;
+    size_t route = none;
+    for (size_t node : node_sets[s]) {
+      if (nodes[node].on_any_segment != none) {
+        on_any_segment.push_back(nodes[node].on_any_segment);
+      }
+      for (auto& transition : nodes[node].on_segment) {
+        on_segment[transition.first].push_back(transition.second);
+      }
+      route = std::min(route, nodes[node].route);
+    }
+    State state;
+    state.route = route;
+    state.on_other_segment = on_any_segment.empty() ? none : state_for(on_any_segment);
+    for (auto& transition : on_segment) {
+      // A literal segment can also be matched by a "{...}".
+      auto node_set = transition.second;
+      node_set.insert(node_set.end(), on_any_segment.begin(), on_any_segment.end());
+      state.on_segment[transition.first] = state_for(node_set);
+    }
+    states_.push_back(std::move(state));
+  }
+}
+
+std::string UrlNormalizer::normalize(const std::string& input) const {
+  if (!looks_like_url(input)) {
+    return input;
+  }
+  std::string key = input.substr(0, input.find('?'));
+  if (cache_size_ == 0) {
+    return normalizeUncached(key);
+  }
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto cached = cache_index_.find(key);
+    if (cached != cache_index_.end()) {
+      cache_.splice(cache_.begin(), cache_, cached->second);
+      return cached->second->second;
+    }
+  }
+  std::string result = normalizeUncached(key);
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (cache_index_.find(key) == cache_index_.end()) {
+    cache_.emplace_front(key, result);
+    cache_index_.emplace(std::move(key), cache_.begin());
+    if (cache_.size() > cache_size_) {
+      cache_index_.erase(cache_.back().first);
+      cache_.pop_back();
+    }
+  }
+  return result;
+}
+
+std::string UrlNormalizer::normalizeUncached(const std::string& input) const {
+  size_t scheme = input.find("://");
+  size_t path = input.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+  if (path == std::string::npos) {
+    return input;
+  }
+  std::string result = input.substr(0, path);
+  size_t route = matchRoute(input, path);
+  if (route != none) {
+    return result + rules_.routes[route];
+  }
+  for (size_t begin = path + 1; begin <= input.size();) {
+    size_t end = segment_end(input, begin);
+    result += '/';
+    if (replaceSegment(input, begin, end)) {
+      result += '?';
+    } else {
+      result.append(input, begin, end - begin);
+    }
+    begin = end + 1;
+  }
+  return result;
+}
+
+size_t UrlNormalizer::matchRoute(const std::string& input, size_t path) const {
+  size_t state = 0;
+  std::string segment;
+  for (size_t begin = path + 1; begin <= input.size();) {
+    size_t end = segment_end(input, begin);
+    segment.assign(input, begin, end - begin);
+    auto next = states_[state].on_segment.find(segment);
+    state = next != states_[state].on_segment.end() ? next->second
+                                                    : states_[state].on_other_segment;
+    if (state == none) {
+      return none;
+    }
+    begin = end + 1;
+  }
+  return states_[state].route;
+}
+
+bool UrlNormalizer::replaceSegment(const std::string& input, size_t begin, size_t end) const {
+  return (rules_.integers && is_integer(input, begin, end)) ||
+         (rules_.uuids && is_uuid(input, begin, end)) || (rules_.hex && is_hex(input, begin, end));
+}
+
+}  // namespace opentracing
+}  // namespace datadog
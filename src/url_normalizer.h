@@ -0,0 +1,77 @@
+#ifndef DD_OPENTRACING_URL_NORMALIZER_H
+#define DD_OPENTRACING_URL_NORMALIZER_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace datadog {
+namespace opentracing {
+
+struct UrlNormalizerRules {
+  // Which path segments to replace with "?", when no route matches.
+  // Segments of only decimal digits.
+  bool integers = false;
+  // Segments like "01234567-89ab-cdef-0123-456789abcdef".
+  bool uuids = false;
+  // Segments of at least 8 hexadecimal digits, at least one of them a decimal digit.
+  bool hex = false;
+  // Route templates, like "/users/{id}/orders/{id}". A "{...}" segment matches any one segment,
+  // and other segments match themselves. A path that matches a route is replaced by the route.
+  // If it matches more than one, the first of them listed wins.
+  std::vector<std::string> routes;
+  // How many normalized URLs and resources to remember. 0 remembers none.
+  size_t cache_size = 1000;
+};
+
+// Normalizes the http.url tag and resource names, to keep their cardinality down. Drops the
+// query string, then normalizes the path: from the first '/' (after the "://" of a URL's scheme,
+// if any) up to the query string. Only inputs that look like URLs are normalized: "scheme://..."
+// or "/path", optionally after an HTTP method as in "GET /path". Others, such as SQL statements,
+// are returned as they are.
+//
+// The routes are compiled into a DFA over path segments when the UrlNormalizer is made, so a path
+// is matched against all of them in one pass. Recent results are kept in an LRU cache, so a
+// repeated input costs one hash lookup. Thread safe.
+class UrlNormalizer {
+ public:
+  // Throws std::invalid_argument for a route that doesn't start with '/'.
+  UrlNormalizer(const UrlNormalizerRules& rules);
+
+  std::string normalize(const std::string& input) const;
+
+ private:
+  // A DFA state. The states are indexed in states_, and the start state is the first.
+  struct State {
+    std::unordered_map<std::string, size_t> on_segment;
+    // The state for any segment not in on_segment, or none.
+    size_t on_other_segment;
+    // The index, in rules_.routes, of the route matched by ending here, or none.
+    size_t route;
+  };
+  static const size_t none = static_cast<size_t>(-1);
+
+  void compile(const std::vector<std::vector<std::string>>& routes);
+  // Normalizes an input whose query string has been dropped.
+  std::string normalizeUncached(const std::string& input) const;
+  // Returns the index of the route that the path starting at the given index matches, or none.
+  size_t matchRoute(const std::string& input, size_t path) const;
+  bool replaceSegment(const std::string& input, size_t begin, size_t end) const;
+
+  const UrlNormalizerRules rules_;
+  std::vector<State> states_;
+
+  const size_t cache_size_;
+  mutable std::mutex mutex_;
+  // Most recently used first. Locked by mutex_.
+  mutable std::list<std::pair<std::string, std::string>> cache_;
+  mutable std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator>
+      cache_index_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_URL_NORMALIZER_H
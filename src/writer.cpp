@@ -11,6 +11,11 @@ namespace opentracing {
 Writer::Writer(std::shared_ptr<RulesSampler> sampler)
     : trace_encoder_(std::make_shared<AgentHttpEncoder>(sampler)) {}
 
+Writer::Writer(std::shared_ptr<RulesSampler> sampler, size_t max_payload_bytes,
+               size_t max_traces_per_payload)
+    : trace_encoder_(std::make_shared<AgentHttpEncoder>(sampler, max_payload_bytes,
+                                                        max_traces_per_payload)) {}
+
 void ExternalWriter::write(Trace trace) { trace_encoder_->addTrace(std::move(trace)); }
 
 }  // namespace opentracing
@@ -22,6 +22,9 @@ using Trace = std::unique_ptr<std::vector<std::unique_ptr<SpanData>>>;
 class Writer {
  public:
   Writer(std::shared_ptr<RulesSampler> sampler);
+  // Creates a Writer whose encoder limits the size of each payload. See AgentHttpEncoder.
+  Writer(std::shared_ptr<RulesSampler> sampler, size_t max_payload_bytes,
+         size_t max_traces_per_payload);
 
   virtual ~Writer() {}
 
@@ -1,10 +1,15 @@
 #include "../src/agent_writer.h"
 
 #include <datadog/version.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <catch2/catch.hpp>
 #include <ctime>
+#include <functional>
+#include <thread>
 
+#include "../src/telemetry.h"
 #include "mocks.h"
 using namespace datadog::opentracing;
 
@@ -16,6 +21,17 @@ Trace make_trace(std::initializer_list<TestSpanData> spans) {
   return trace;
 }
 
+namespace {
+// Waits up to 10 seconds for the condition to be true.
+bool eventually(std::function<bool()> condition) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!condition() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return condition();
+}
+}  // namespace
+
 TEST_CASE("writer") {
   SECTION("initializes handle correctly") {
     std::atomic<bool> handle_destructed{false};
@@ -26,27 +42,30 @@ TEST_CASE("writer") {
       std::string host;
       uint32_t port;
       std::string url;
-      std::unordered_map<CURLoption, std::string, EnumClassHash> expected_opts;
+      std::unordered_map<HandleOption, std::string, EnumClassHash> expected_opts;
     };
     auto test_case = GENERATE(values<InitializationTestCase>({
-        {"hostname", 1234, "", {{CURLOPT_URL, "http://hostname:1234/v0.4/traces"}}},
+        {"hostname", 1234, "", {{HandleOption::url, "http://hostname:1234/v0.4/traces"}}},
         {"hostname",
          1234,
          "http://override:5678",
-         {{CURLOPT_URL, "http://override:5678/v0.4/traces"}}},
-        {"", 0, "https://localhost:8126", {{CURLOPT_URL, "https://localhost:8126/v0.4/traces"}}},
+         {{HandleOption::url, "http://override:5678/v0.4/traces"}}},
+        {"",
+         0,
+         "https://localhost:8126",
+         {{HandleOption::url, "https://localhost:8126/v0.4/traces"}}},
         {"localhost",
          8126,
          "unix:///path/to/trace-agent.socket",
-         {{CURLOPT_UNIX_SOCKET_PATH, "/path/to/trace-agent.socket"},
-          {CURLOPT_URL, "http://localhost:8126/v0.4/traces"}}},
+         {{HandleOption::unix_socket_path, "/path/to/trace-agent.socket"},
+          {HandleOption::url, "http://localhost:8126/v0.4/traces"}}},
         {"localhost",
          8126,
          "/path/to/trace-agent.socket",
-         {{CURLOPT_UNIX_SOCKET_PATH, "/path/to/trace-agent.socket"},
-          {CURLOPT_URL, "http://localhost:8126/v0.4/traces"}}},
+         {{HandleOption::unix_socket_path, "/path/to/trace-agent.socket"},
+          {HandleOption::url, "http://localhost:8126/v0.4/traces"}}},
     }));
-    test_case.expected_opts[CURLOPT_TIMEOUT_MS] = "2000";
+    test_case.expected_opts[HandleOption::timeout_ms] = "2000";
 
     AgentWriter writer{std::move(handle_ptr), std::chrono::seconds(1), 100,           {},
                        test_case.host,        test_case.port,          test_case.url, sampler};
@@ -108,11 +127,11 @@ TEST_CASE("writer") {
     REQUIRE((*traces)[0][0].duration == 420);
     // Check general Curl connection config.
     // Remove postdata first, since it's ugly to print and we just tested it above.
-    handle->options.erase(CURLOPT_POSTFIELDS);
-    REQUIRE(handle->options == std::unordered_map<CURLoption, std::string, EnumClassHash>{
-                                   {CURLOPT_URL, "http://hostname:6319/v0.4/traces"},
-                                   {CURLOPT_TIMEOUT_MS, "2000"},
-                                   {CURLOPT_POSTFIELDSIZE, "135"}});
+    handle->options.erase(HandleOption::post_fields);
+    REQUIRE(handle->options == std::unordered_map<HandleOption, std::string, EnumClassHash>{
+                                   {HandleOption::url, "http://hostname:6319/v0.4/traces"},
+                                   {HandleOption::timeout_ms, "2000"},
+                                   {HandleOption::post_field_size, "135"}});
     REQUIRE(handle->headers ==
             std::map<std::string, std::string>{
                 {"Content-Type", "application/msgpack"},
@@ -183,18 +202,19 @@ TEST_CASE("writer") {
     writer.flush(std::chrono::seconds(10));
     auto traces = handle->getTraces();
     REQUIRE(traces->size() == 25);
+    REQUIRE(writer.droppedTraces() == 5);
   }
 
   SECTION("bad handle causes constructor to fail") {
     std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
-    handle_ptr->rcode = CURLE_OPERATION_TIMEDOUT;
+    handle_ptr->rcode = HandleResult::operation_timedout;
     REQUIRE_THROWS(AgentWriter{std::move(handle_ptr), only_send_traces_when_we_flush,
                                max_queued_traces, disable_retry, "hostname", 6319, "",
                                std::make_shared<RulesSampler>()});
   }
 
   SECTION("handle failure during post") {
-    handle->rcode = CURLE_OPERATION_TIMEDOUT;
+    handle->rcode = HandleResult::operation_timedout;
     writer.write(make_trace(
         {TestSpanData{"web", "service", "service.name", "resource", 1, 1, 0, 69, 420, 0}}));
     // Redirect stderr so the test logs don't look like a failure.
@@ -204,12 +224,12 @@ TEST_CASE("writer") {
     REQUIRE(error_message.str() == "Error setting agent request size: Timeout was reached\n");
     std::cerr.rdbuf(stderr);  // Restore stderr.
     // Dropped all spans.
-    handle->rcode = CURLE_OK;
+    handle->rcode = HandleResult::ok;
     REQUIRE(handle->getTraces()->size() == 0);
   }
 
   SECTION("handle failure during perform") {
-    handle->perform_result = {CURLE_OPERATION_TIMEDOUT};
+    handle->perform_result = {HandleResult::operation_timedout};
     handle->error = "error from libcurl";
     writer.write(make_trace(
         {TestSpanData{"web", "service", "service.name", "resource", 1, 1, 0, 69, 420, 0}}));
@@ -223,7 +243,7 @@ TEST_CASE("writer") {
 
   SECTION("responses are not sent to sampler if the conenction fails") {
     handle->response = "{\"rate_by_service\": {\"service:nginx,env:\": 0.5}}";
-    handle->perform_result = {CURLE_OPERATION_TIMEDOUT};
+    handle->perform_result = {HandleResult::operation_timedout};
     writer.write(make_trace(
         {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
     writer.flush(std::chrono::seconds(10));
@@ -349,13 +369,13 @@ TEST_CASE("writer") {
         {TestSpanData{"web", "service", "service.name", "resource", 1, 1, 0, 69, 420, 0}}));
 
     SECTION("will retry") {
-      handle->perform_result = {CURLE_OPERATION_TIMEDOUT, CURLE_OK};
+      handle->perform_result = {HandleResult::operation_timedout, HandleResult::ok};
       writer.flush(std::chrono::seconds(10));
       REQUIRE(handle->perform_call_count == 2);
     }
 
     SECTION("will eventually give up") {
-      handle->perform_result = {CURLE_OPERATION_TIMEDOUT};
+      handle->perform_result = {HandleResult::operation_timedout};
       writer.flush(std::chrono::seconds(10));
       REQUIRE(handle->perform_call_count == 3);  // Once originally, and two retries.
     }
@@ -385,6 +405,249 @@ TEST_CASE("writer") {
   }
 }
 
+TEST_CASE("payload limits") {
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.retry_periods = {};
+  handle->response = "{}";
+
+  SECTION("large batches are split by trace count") {
+    options.max_traces_per_payload = 10;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    for (uint64_t i = 1; i <= 25; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    writer.flush(std::chrono::seconds(10));
+
+    auto requests = handle->getTracesPerRequest();
+    REQUIRE(requests.size() == 3);
+    REQUIRE(requests[0].size() == 10);
+    REQUIRE(requests[1].size() == 10);
+    REQUIRE(requests[2].size() == 5);
+    REQUIRE(handle->requests[0].headers["X-Datadog-Trace-Count"] == "10");
+    REQUIRE(handle->requests[2].headers["X-Datadog-Trace-Count"] == "5");
+    uint64_t expected_trace_id = 1;
+    for (auto& request : requests) {
+      for (auto& trace : request) {
+        REQUIRE(trace[0].trace_id == expected_trace_id++);
+      }
+    }
+  }
+
+  SECTION("large batches are split by size") {
+    // Each of these traces is 134 bytes when encoded, so only two fit in each payload.
+    options.max_payload_bytes = 300;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    for (uint64_t i = 1; i <= 5; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    writer.flush(std::chrono::seconds(10));
+
+    auto requests = handle->getTracesPerRequest();
+    REQUIRE(requests.size() == 3);
+    REQUIRE(requests[0].size() == 2);
+    REQUIRE(requests[1].size() == 2);
+    REQUIRE(requests[2].size() == 1);
+    for (auto& request : handle->requests) {
+      REQUIRE(request.body.size() <= options.max_payload_bytes);
+    }
+  }
+
+  SECTION("traces too large for any payload are dropped") {
+    options.max_payload_bytes = 300;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0},
+         TestSpanData{"web", "service", "resource", "service.name", 1, 2, 1, 69, 420, 0},
+         TestSpanData{"web", "service", "resource", "service.name", 1, 3, 1, 69, 420, 0}}));
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 2, 1, 0, 69, 420, 0}}));
+    writer.flush(std::chrono::seconds(10));
+    std::cerr.rdbuf(stderr);  // Restore stderr.
+
+    auto requests = handle->getTracesPerRequest();
+    REQUIRE(requests.size() == 1);
+    REQUIRE(requests[0].size() == 1);
+    REQUIRE(requests[0][0][0].trace_id == 2);
+    REQUIRE(writer.droppedTraces() == 1);
+    REQUIRE(error_message.str() ==
+            "Dropping 1 traces, which are too large to fit in a payload\n");
+  }
+
+  SECTION("a trace limit of zero is taken as one") {
+    options.max_traces_per_payload = 0;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    for (uint64_t i = 1; i <= 3; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    writer.flush(std::chrono::seconds(10));
+
+    auto requests = handle->getTracesPerRequest();
+    REQUIRE(requests.size() == 3);
+    for (auto& request : requests) {
+      REQUIRE(request.size() == 1);
+    }
+  }
+
+  SECTION("payloads are retried independently") {
+    options.max_traces_per_payload = 1;
+    options.retry_periods = {std::chrono::milliseconds(100)};
+    // The second payload fails once, the others succeed.
+    handle->perform_result = {HandleResult::ok, HandleResult::operation_timedout, HandleResult::ok,
+                              HandleResult::ok};
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    for (uint64_t i = 1; i <= 3; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    writer.flush(std::chrono::seconds(10));
+    std::cerr.rdbuf(stderr);  // Restore stderr.
+
+    auto requests = handle->getTracesPerRequest();
+    REQUIRE(requests.size() == 4);
+    std::vector<uint64_t> trace_ids;
+    for (auto& request : requests) {
+      REQUIRE(request.size() == 1);
+      trace_ids.push_back(request[0][0].trace_id);
+    }
+    // The retry is scheduled for later, rather than holding up the third payload.
+    REQUIRE(trace_ids == std::vector<uint64_t>{1, 2, 3, 2});
+  }
+}
+
+TEST_CASE("pipelining") {
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.retry_periods = {};
+  handle->response = "{}";
+  // Flushes can't complete while the agent is stalled, so don't wait long for them.
+  const auto stalled_flush_timeout = std::chrono::milliseconds(250);
+
+  SECTION("a stalled agent doesn't stop traces being encoded") {
+    options.max_queued_traces = 5;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    handle->blockPerform();
+    uint64_t trace_id = 1;
+    for (int batch = 0; batch < 3; batch++) {
+      for (int i = 0; i < 5; i++) {
+        writer.write(make_trace({TestSpanData{"web", "service", "resource", "service.name",
+                                              trace_id++, 1, 0, 69, 420, 0}}));
+      }
+      writer.flush(stalled_flush_timeout);
+    }
+    handle->unblockPerform();
+    writer.flush(std::chrono::seconds(10));
+
+    auto requests = handle->getTracesPerRequest();
+    REQUIRE(requests.size() == 3);
+    size_t num_traces = 0;
+    for (auto& request : requests) {
+      num_traces += request.size();
+    }
+    REQUIRE(num_traces == 15);
+  }
+
+  SECTION("the oldest payloads are dropped when the agent can't keep up") {
+    options.max_queued_payloads = 1;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    handle->blockPerform();
+    // The first payload is being sent, the second waits in the queue until the third replaces it.
+    for (uint64_t i = 1; i <= 3; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+      writer.flush(stalled_flush_timeout);
+    }
+    handle->unblockPerform();
+    writer.flush(std::chrono::seconds(10));
+    std::cerr.rdbuf(stderr);  // Restore stderr.
+
+    auto requests = handle->getTracesPerRequest();
+    REQUIRE(requests.size() == 2);
+    REQUIRE(requests[0][0][0].trace_id == 1);
+    REQUIRE(requests[1][0][0].trace_id == 3);
+    REQUIRE(writer.droppedTraces() == 1);
+    REQUIRE(error_message.str() ==
+            "Dropping 1 traces, the agent is not accepting them fast enough\n");
+  }
+}
+
+TEST_CASE("flush triggers") {
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.retry_periods = {};
+  handle->response = "{}";
+  // Waits (for a while) until the handle has been sent the given number of traces, without
+  // calling flush().
+  auto wait_for_traces = [&](size_t expected) -> size_t {
+    size_t num_traces = 0;
+    auto deadline = steady_clock::now() + std::chrono::seconds(10);
+    while (num_traces < expected && steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      num_traces = 0;
+      for (auto& request : handle->getTracesPerRequest()) {
+        num_traces += request.size();
+      }
+    }
+    return num_traces;
+  };
+
+  SECTION("enough queued traces trigger a flush") {
+    options.flush_queued_traces = 3;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    for (uint64_t i = 1; i <= 3; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    REQUIRE(wait_for_traces(3) == 3);
+  }
+
+  SECTION("enough queued bytes trigger a flush") {
+    options.flush_queued_bytes = 1000;
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", std::string(1000, 'r'), "service.name", 1, 1, 0, 69, 420,
+                      0}}));
+    REQUIRE(wait_for_traces(1) == 1);
+  }
+
+  SECTION("traces are sent once the oldest has waited for the write period") {
+    options.write_period = std::chrono::milliseconds(100);
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    // Sleep through several write periods with nothing to do first.
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    auto start = steady_clock::now();
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+    REQUIRE(wait_for_traces(1) == 1);
+    REQUIRE(steady_clock::now() - start >= std::chrono::milliseconds(100));
+  }
+}
+
 TEST_CASE("flush") {
   std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
   MockHandle* handle = handle_ptr.get();
@@ -409,7 +672,7 @@ TEST_CASE("flush") {
     // MockHandle doesn't actually block/wait, but we can make the AgentWriter wait for 60
     // seconds (see retry_periods above) to retry. We make sure that flush() times out before
     // that.
-    handle->perform_result = {CURLE_OPERATION_TIMEDOUT};
+    handle->perform_result = {HandleResult::operation_timedout};
     steady_clock::time_point start = steady_clock::now();
     writer.flush(std::chrono::milliseconds(250));
     steady_clock::duration wait_time = steady_clock::now() - start;
@@ -420,3 +683,387 @@ TEST_CASE("flush") {
 
   std::cerr.rdbuf(stderr);  // Restore stderr.
 }
+
+TEST_CASE("spool") {
+  TemporaryDirectory directory;
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.retry_periods = {};
+  options.spool.directory = directory.path;
+  handle->response = "{}";
+  // Redirect cerr, so the the terminal output doesn't imply failure.
+  std::stringstream error_message;
+  std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+
+  auto trace_ids = [](MockHandle* handle) {
+    std::vector<uint64_t> ids;
+    for (auto& request : handle->getTracesPerRequest()) {
+      for (auto& trace : request) {
+        ids.push_back(trace[0].trace_id);
+      }
+    }
+    return ids;
+  };
+
+  SECTION("failed payloads are sent once the agent accepts a request again") {
+    handle->perform_result = {HandleResult::operation_timedout};
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(trace_ids(handle) == std::vector<uint64_t>{1});
+    REQUIRE(directory.files().size() == 1);
+
+    handle->perform_result = {HandleResult::ok};
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 2, 1, 0, 69, 420, 0}}));
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(trace_ids(handle) == std::vector<uint64_t>{1, 2, 1});
+    REQUIRE(directory.files().empty());
+  }
+
+  SECTION("payloads waiting to be retried are spooled on stopping, and sent by the next writer") {
+    options.retry_periods = {std::chrono::seconds(60)};
+    handle->perform_result = {HandleResult::operation_timedout};
+    {
+      AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                         std::make_shared<RulesSampler>()};
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush(std::chrono::milliseconds(250));
+    }
+    REQUIRE(directory.files().size() == 1);
+
+    std::unique_ptr<MockHandle> next_handle_ptr{new MockHandle{}};
+    MockHandle* next_handle = next_handle_ptr.get();
+    next_handle->response = "{}";
+    AgentWriter writer{std::move(next_handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(trace_ids(next_handle) == std::vector<uint64_t>{1});
+    REQUIRE(directory.files().empty());
+  }
+
+  SECTION("spooled payloads the agent responds to with errors are kept") {
+    handle->perform_result = {HandleResult::operation_timedout};
+    {
+      AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                         std::make_shared<RulesSampler>()};
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush(std::chrono::seconds(10));
+    }
+    REQUIRE(directory.files().size() == 1);
+
+    // The next writer replays the spool at once, and the agent responds 503.
+    std::unique_ptr<MockHandle> next_handle_ptr{new MockHandle{}};
+    MockHandle* next_handle = next_handle_ptr.get();
+    next_handle->response = "{}";
+    next_handle->error = "Agent responded with HTTP/1.1 503 Service Unavailable";
+    next_handle->perform_result = {HandleResult::http_returned_error};
+    AgentWriter writer{std::move(next_handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(trace_ids(next_handle) == std::vector<uint64_t>{1});
+    REQUIRE(directory.files().size() == 1);
+
+    next_handle->setPerformResult({HandleResult::ok});
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 2, 1, 0, 69, 420, 0}}));
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(trace_ids(next_handle) == std::vector<uint64_t>{1, 2, 1});
+    REQUIRE(directory.files().empty());
+  }
+
+  SECTION("a spool that can't be opened is done without") {
+    options.spool.directory = directory.path + "/missing/spool";
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    REQUIRE(error_message.str().find("Unable to spool traces: ") == 0);
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(trace_ids(handle) == std::vector<uint64_t>{1});
+  }
+
+  std::cerr.rdbuf(stderr);  // Restore stderr.
+}
+
+TEST_CASE("circuit breaker") {
+  // Keeps what's logged.
+  struct RecordingLogger : public Logger {
+    RecordingLogger() : Logger([](LogLevel, ot::string_view) {}) {}
+    void Log(LogLevel, ot::string_view message) const noexcept override {
+      std::unique_lock<std::mutex> lock(mutex);
+      messages.push_back(message);
+    }
+    void Log(LogLevel, uint64_t, ot::string_view) const noexcept override {}
+    void Log(LogLevel, uint64_t, uint64_t, ot::string_view) const noexcept override {}
+    void Trace(ot::string_view) const noexcept override {}
+    void Trace(uint64_t, ot::string_view) const noexcept override {}
+    void Trace(uint64_t, uint64_t, ot::string_view) const noexcept override {}
+    std::vector<std::string> getMessages() const {
+      std::unique_lock<std::mutex> lock(mutex);
+      return messages;
+    }
+
+    mutable std::mutex mutex;
+    mutable std::vector<std::string> messages;
+  };
+
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  handle->response = "{}";
+  handle->error = "error from libcurl";
+  auto logger = std::make_shared<RecordingLogger>();
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.retry_periods = {};
+  options.max_consecutive_failures = 3;
+  options.min_probe_period = std::chrono::milliseconds(20);
+  options.max_probe_period = std::chrono::milliseconds(80);
+  options.logger = logger;
+  options.log_period = std::chrono::seconds(3600);
+
+  auto write = [](AgentWriter& writer, uint64_t trace_id) {
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", trace_id, 1, 0, 69, 420, 0}}));
+  };
+  auto probes = [&]() {
+    size_t count = 0;
+    for (auto& request : handle->getRequests()) {
+      if (request.headers["X-Datadog-Trace-Count"] == "0") {
+        count++;
+      }
+    }
+    return count;
+  };
+
+  handle->setPerformResult({HandleResult::operation_timedout});
+  AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                     std::make_shared<RulesSampler>()};
+  for (uint64_t i = 1; i <= 3; i++) {
+    write(writer, i);
+    writer.flush(std::chrono::seconds(10));
+  }
+  REQUIRE(handle->getRequests().size() == 3);
+  // Without retries or a spool, the traces that failed are dropped.
+  REQUIRE(writer.droppedTraces() == 3);
+
+  SECTION("traces are dropped while the agent is unavailable") {
+    write(writer, 4);
+    write(writer, 5);
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(writer.droppedTraces() == 5);
+    // Meanwhile the agent is probed, less and less often.
+    REQUIRE(eventually([&]() { return probes() >= 3; }));
+    for (auto& request : handle->getRequests()) {
+      if (request.headers["X-Datadog-Trace-Count"] == "0") {
+        REQUIRE(request.body == "\x90");  // An empty msgpack array.
+      }
+    }
+    REQUIRE(handle->getTracesPerRequest().size() == handle->getRequests().size());
+    for (auto& request : handle->getTracesPerRequest()) {
+      for (auto& trace : request) {
+        REQUIRE(trace[0].trace_id <= 3);
+      }
+    }
+  }
+
+  SECTION("traces are sent again once a probe succeeds") {
+    REQUIRE(eventually([&]() { return probes() >= 1; }));
+    handle->setPerformResult({HandleResult::ok});
+    REQUIRE(eventually([&]() {
+      write(writer, 6);
+      writer.flush(std::chrono::seconds(10));
+      auto requests = handle->getTracesPerRequest();
+      return !requests.back().empty() && requests.back()[0][0].trace_id == 6;
+    }));
+    auto messages = logger->getMessages();
+    REQUIRE(messages.size() == 3);
+    REQUIRE(messages[0] ==
+            "Error sending traces to agent: Timeout was reached\nerror from libcurl");
+    REQUIRE(messages[1] ==
+            "Unable to send traces to the agent after 3 attempts, dropping traces until it "
+            "responds");
+    REQUIRE(messages[2] == "The agent is responding again, sending traces");
+  }
+}
+
+TEST_CASE("circuit breaker drops traces queued before it opened") {
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  handle->response = "{}";
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.retry_periods = {};
+  options.max_consecutive_failures = 1;
+  options.min_probe_period = std::chrono::milliseconds(20);
+  // Redirect cerr, so the the terminal output doesn't imply failure.
+  std::stringstream error_message;
+  std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+
+  auto write = [](AgentWriter& writer, uint64_t trace_id) {
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", trace_id, 1, 0, 69, 420, 0}}));
+  };
+
+  handle->setPerformResult({HandleResult::operation_timedout});
+  handle->blockPerform();
+  AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                     std::make_shared<RulesSampler>()};
+  write(writer, 1);
+  writer.flush(std::chrono::milliseconds(50));
+  REQUIRE(eventually([&]() { return handle->getRequests().size() == 1; }));
+  // Queued while the request that opens the circuit is in flight.
+  write(writer, 2);
+  handle->unblockPerform();
+  // Only an open circuit sends probes.
+  REQUIRE(eventually([&]() { return handle->getRequests().size() > 1; }));
+  writer.flush(std::chrono::seconds(10));
+  // Trace 1 failed to send, and trace 2 never was.
+  REQUIRE(writer.droppedTraces() == 2);
+  for (auto& request : handle->getTracesPerRequest()) {
+    for (auto& trace : request) {
+      REQUIRE(trace[0].trace_id == 1);
+    }
+  }
+
+  std::cerr.rdbuf(stderr);  // Restore stderr.
+}
+
+TEST_CASE("circuit breaker opens when the agent responds with errors") {
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  // What the Handles make of a 500 response.
+  handle->setPerformResult({HandleResult::http_returned_error});
+  handle->error = "Agent responded with HTTP/1.1 500 Internal Server Error";
+  handle->response = "{\"rate_by_service\": {\"service:nginx,env:\": 0.5}}";
+  auto sampler = std::make_shared<MockRulesSampler>();
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.retry_periods = {};
+  options.max_consecutive_failures = 2;
+  options.min_probe_period = std::chrono::milliseconds(20);
+  // Redirect cerr, so the the terminal output doesn't imply failure.
+  std::stringstream error_message;
+  std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+
+  auto write = [](AgentWriter& writer, uint64_t trace_id) {
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", trace_id, 1, 0, 69, 420, 0}}));
+  };
+  uint64_t traces_sent = telemetry().traces_sent.value();
+  AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "", sampler};
+  for (uint64_t i = 1; i <= 2; i++) {
+    write(writer, i);
+    writer.flush(std::chrono::seconds(10));
+  }
+  REQUIRE(handle->getRequests().size() == 2);
+  // Without retries or a spool, the traces that failed are dropped.
+  REQUIRE(writer.droppedTraces() == 2);
+  // The circuit is open: traces are dropped, and the agent is probed.
+  write(writer, 3);
+  writer.flush(std::chrono::seconds(10));
+  REQUIRE(writer.droppedTraces() == 3);
+  REQUIRE(eventually([&]() { return handle->getRequests().size() > 2; }));
+  for (auto& request : handle->getTracesPerRequest()) {
+    for (auto& trace : request) {
+      REQUIRE(trace[0].trace_id <= 2);
+    }
+  }
+  // Nothing the agent said was taken as a response to traces sent.
+  REQUIRE(sampler->config == "");
+  REQUIRE(telemetry().traces_sent.value() == traces_sent);
+
+  std::cerr.rdbuf(stderr);  // Restore stderr.
+}
+
+TEST_CASE("fork") {
+  std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+  MockHandle* handle = handle_ptr.get();
+  handle->response = "{}";
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                     std::make_shared<RulesSampler>()};
+  auto write = [&](uint64_t trace_id) {
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", trace_id, 1, 0, 69, 420, 0}}));
+  };
+  // Whether the only traces sent so far are the given ones.
+  auto sent = [&](std::vector<uint64_t> trace_ids) {
+    std::vector<uint64_t> sent_ids;
+    for (auto& request : handle->getTracesPerRequest()) {
+      for (auto& trace : request) {
+        sent_ids.push_back(trace[0].trace_id);
+      }
+    }
+    return sent_ids == trace_ids;
+  };
+
+  write(1);
+  pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    // The child's writer works, and sends only its own traces. Nothing here can REQUIRE, so the
+    // result is the exit status.
+    write(2);
+    writer.flush(std::chrono::seconds(10));
+    _exit(sent({2}) ? 0 : 1);
+  }
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  // The parent's writer carries on as before.
+  write(3);
+  writer.flush(std::chrono::seconds(10));
+  REQUIRE(sent({1, 3}));
+}
+
+TEST_CASE("fork with requests in flight on a given handle") {
+  // Stands in for a Handle that makes requests asynchronously, and has one in flight at the fork.
+  struct BusyHandle : public MockHandle {
+    size_t inFlight() override { return 1; }
+  };
+  std::unique_ptr<BusyHandle> handle_ptr{new BusyHandle{}};
+  BusyHandle* handle = handle_ptr.get();
+  handle->response = "{}";
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  // Redirect cerr, so the the terminal output doesn't imply failure.
+  std::stringstream error_message;
+  std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+  AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                     std::make_shared<RulesSampler>()};
+  auto write = [&](uint64_t trace_id) {
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", trace_id, 1, 0, 69, 420, 0}}));
+  };
+
+  pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    // There's no Handle for the child, so it doesn't send anything.
+    write(1);
+    writer.flush(std::chrono::milliseconds(100));
+    bool stopped = handle->getRequests().empty() &&
+                   error_message.str().find("Unable to send traces after fork()") == 0;
+    _exit(stopped ? 0 : 1);
+  }
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  // The parent's writer carries on as before.
+  write(2);
+  writer.flush(std::chrono::seconds(10));
+  REQUIRE(handle->getRequests().size() == 1);
+  std::cerr.rdbuf(stderr);  // Restore stderr.
+}
@@ -0,0 +1,222 @@
+#include "../src/collector_writer.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+#include <thread>
+
+#include "mocks.h"
+using namespace datadog::opentracing;
+
+namespace {
+Trace makeTrace(uint64_t trace_id) {
+  Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+  trace->emplace_back(new TestSpanData{"web", "service", "resource", "service.name", trace_id, 1,
+                                       0, 69, 420, 0});
+  return trace;
+}
+
+// Waits up to 10 seconds for the condition to be true.
+bool eventually(std::function<bool()> condition) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!condition() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return condition();
+}
+
+// Shared memory names unique to the test process, removed on destruction.
+struct SharedMemoryName {
+  SharedMemoryName() { SharedMemory::remove(name); }
+  ~SharedMemoryName() { SharedMemory::remove(name); }
+  const std::string name = "/dd-opentracing-test-" + std::to_string(getpid());
+};
+}  // namespace
+
+TEST_CASE("trace ring") {
+  SharedMemoryName name;
+
+  SECTION("traces are popped in the order they were pushed") {
+    // Small enough that the traces go round the ring.
+    TraceRing ring{name.name, 128};
+    std::vector<std::string> traces;
+    REQUIRE(ring.pop(traces, 10) == 0);
+    for (int lap = 0; lap < 5; lap++) {
+      for (char c = 'a'; c < 'd'; c++) {
+        REQUIRE(ring.push(std::string(20 + lap, c)));
+      }
+      REQUIRE(ring.pop(traces, 2) == 2);
+      REQUIRE(ring.pop(traces, 10) == 1);
+    }
+    REQUIRE(traces.size() == 15);
+    for (size_t i = 0; i < traces.size(); i++) {
+      REQUIRE(traces[i] == std::string(20 + i / 3, 'a' + i % 3));
+    }
+    REQUIRE(ring.pushed() == 15);
+    REQUIRE(ring.popped() == 15);
+  }
+
+  SECTION("traces are rejected when the ring is full") {
+    TraceRing ring{name.name, 100};
+    // Each trace takes up four bytes more than its length.
+    REQUIRE(!ring.push(std::string(97, 'x')));
+    REQUIRE(ring.push(std::string(30, 'a')));
+    REQUIRE(ring.push(std::string(30, 'b')));
+    REQUIRE(!ring.push(std::string(40, 'c')));
+    std::vector<std::string> traces;
+    REQUIRE(ring.pop(traces, 1) == 1);
+    // There's room at the start of the ring now, but this doesn't fit at the end, and would skip
+    // past the start to where 'b' still is.
+    REQUIRE(!ring.push(std::string(40, 'd')));
+    REQUIRE(ring.pop(traces, 1) == 1);
+    // Now the ring is empty, so the trace can have all of it.
+    REQUIRE(ring.push(std::string(96, 'e')));
+    REQUIRE(ring.pop(traces, 10) == 1);
+    REQUIRE(traces == std::vector<std::string>{std::string(30, 'a'), std::string(30, 'b'),
+                                               std::string(96, 'e')});
+  }
+
+  SECTION("rings with the same name are the same ring") {
+    TraceRing ring{name.name, 1000};
+    TraceRing other{name.name, 1000};
+    REQUIRE(ring.push("trace"));
+    std::vector<std::string> traces;
+    REQUIRE(other.pop(traces, 10) == 1);
+    REQUIRE(traces == std::vector<std::string>{"trace"});
+    REQUIRE_THROWS_AS((TraceRing{name.name, 2000}), std::runtime_error);
+  }
+
+  SECTION("there is one collector at a time") {
+    TraceRing ring{name.name, 1000};
+    REQUIRE(ring.tryCollect());
+    bool collected = true;
+    std::thread([&]() { collected = ring.tryCollect(); }).join();
+    REQUIRE(!collected);
+    ring.stopCollecting();
+    std::thread([&]() {
+      collected = ring.tryCollect();
+      ring.stopCollecting();
+    }).join();
+    REQUIRE(collected);
+  }
+
+  SECTION("sampling rates are shared") {
+    TraceRing ring{name.name, 1000};
+    TraceRing other{name.name, 1000};
+    uint64_t version = 0;
+    std::string rates;
+    REQUIRE(!other.samplingRates(version, rates));
+    ring.setSamplingRates("{\"service:nginx,env:\":0.5}");
+    REQUIRE(other.samplingRates(version, rates));
+    REQUIRE(rates == "{\"service:nginx,env:\":0.5}");
+    REQUIRE(!other.samplingRates(version, rates));
+  }
+}
+
+TEST_CASE("collector writer") {
+  SharedMemoryName name;
+  CollectorWriterOptions options;
+  options.name = name.name;
+  options.ring_bytes = 64 * 1024;
+  options.collect_period = std::chrono::milliseconds(10);
+  options.agent_writer.write_period = std::chrono::seconds(3600);
+
+  MockHandle* handle = nullptr;
+  auto make_agent_writer = [&](std::shared_ptr<RulesSampler> sampler) {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    handle = handle_ptr.get();
+    handle->response = "{\"rate_by_service\": {\"service:nginx,env:\": 0.5}}";
+    return std::unique_ptr<AgentWriter>{new AgentWriter{std::move(handle_ptr),
+                                                        options.agent_writer, "hostname", 6319,
+                                                        "", sampler}};
+  };
+  // The ids of the traces sent, in the order they were sent.
+  auto sent = [&]() {
+    std::vector<uint64_t> trace_ids;
+    for (auto& request : handle->getTracesPerRequest()) {
+      for (auto& trace : request) {
+        trace_ids.push_back(trace[0].trace_id);
+      }
+    }
+    return trace_ids;
+  };
+
+  SECTION("one writer collects the traces of every writer") {
+    auto sampler = std::make_shared<MockRulesSampler>();
+    CollectorWriter collector{make_agent_writer, options, sampler};
+    REQUIRE(eventually([&]() { return collector.isCollector(); }));
+    auto other_sampler = std::make_shared<MockRulesSampler>();
+    CollectorWriter other{make_agent_writer, options, other_sampler};
+    other.write(makeTrace(1));
+    collector.write(makeTrace(2));
+    other.write(makeTrace(3));
+    other.flush(std::chrono::seconds(10));
+    collector.flush(std::chrono::seconds(10));
+    REQUIRE(!other.isCollector());
+    // All in one request.
+    REQUIRE(handle->getTracesPerRequest().size() == 1);
+    REQUIRE(sent() == std::vector<uint64_t>{1, 2, 3});
+
+    // The agent's sampling rates reach the other writer's sampler too.
+    REQUIRE(sampler->config == "{\"service:nginx,env:\":0.5}");
+    REQUIRE(eventually([&]() { return other_sampler->config == sampler->config; }));
+  }
+
+  SECTION("traces are dropped when the ring is full") {
+    options.ring_bytes = 1024;
+    CollectorWriter writer{make_agent_writer, options, std::make_shared<RulesSampler>()};
+    for (uint64_t id = 1; id <= 100; id++) {
+      writer.write(makeTrace(id));
+    }
+    REQUIRE(writer.droppedTraces() > 0);
+  }
+
+  SECTION("another writer takes over when the collector's process dies") {
+    int ready[2];
+    REQUIRE(pipe(ready) == 0);
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+      auto writer = new CollectorWriter{make_agent_writer, options, nullptr};
+      bool collecting = eventually([&]() { return writer->isCollector(); });
+      char result = collecting ? 'y' : 'n';
+      (void)!write(ready[1], &result, 1);
+      _exit(0);  // Without stopping the writer.
+    }
+    char result = 0;
+    REQUIRE(read(ready[0], &result, 1) == 1);
+    close(ready[0]);
+    close(ready[1]);
+    REQUIRE(result == 'y');
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+
+    CollectorWriter writer{make_agent_writer, options, std::make_shared<RulesSampler>()};
+    REQUIRE(eventually([&]() { return writer.isCollector(); }));
+  }
+
+  SECTION("traces are collected from a forked process") {
+    CollectorWriter writer{make_agent_writer, options, std::make_shared<RulesSampler>()};
+    REQUIRE(eventually([&]() { return writer.isCollector(); }));
+    writer.write(makeTrace(1));
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+      // The child isn't the collector, but its traces reach the parent. Nothing here can REQUIRE,
+      // so the result is the exit status.
+      bool collector = writer.isCollector();
+      writer.write(makeTrace(2));
+      writer.flush(std::chrono::seconds(10));
+      _exit(collector ? 1 : 0);
+    }
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+    REQUIRE(writer.isCollector());
+    writer.write(makeTrace(3));
+    writer.flush(std::chrono::seconds(10));
+    REQUIRE(sent() == std::vector<uint64_t>{1, 2, 3});
+  }
+}
@@ -1,7 +1,11 @@
 #include "../src/limiter.h"
 
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <catch2/catch.hpp>
 
+#include "../src/shared_memory.h"
 #include "mocks.h"
 using namespace datadog::opentracing;
 
@@ -87,4 +91,38 @@ TEST_CASE("limiter") {
     all_consumed = lim.allow();
     REQUIRE(!all_consumed.allowed);
   }
+
+  SECTION("shares tokens with limiters of the same name") {
+    const std::string name = "/dd-opentracing-test-limiter-" + std::to_string(getpid());
+    SharedMemory::remove(name);
+    {
+      Limiter lim(get_time, 2, 1.0, 1, name);
+      Limiter other(get_time, 2, 1.0, 1, name);
+      Limiter different(get_time, 2, 1.0, 1, name + "-different");
+      REQUIRE(lim.allow().allowed);
+      REQUIRE(different.allow().allowed);
+      // In another process, too.
+      pid_t pid = fork();
+      REQUIRE(pid >= 0);
+      if (pid == 0) {
+        Limiter child(get_time, 2, 1.0, 1, name);
+        _exit(child.allow().allowed ? 0 : 1);
+      }
+      int status = 0;
+      REQUIRE(waitpid(pid, &status, 0) == pid);
+      REQUIRE(WIFEXITED(status));
+      REQUIRE(WEXITSTATUS(status) == 0);
+      auto result = other.allow();
+      REQUIRE(!result.allowed);
+      // So is the effective rate: two of the three requests so far were allowed.
+      REQUIRE(result.effective_rate == Approx((9.0 + 2.0 / 3.0) / 10.0));
+      REQUIRE(different.allow().allowed);
+
+      advanceTime(time, std::chrono::seconds(1));
+      REQUIRE(other.allow().allowed);
+      REQUIRE(!lim.allow().allowed);
+    }
+    SharedMemory::remove(name);
+    SharedMemory::remove(name + "-different");
+  }
 }
@@ -1,6 +1,7 @@
 #include "../src/logger.h"
 
 #include <catch2/catch.hpp>
+#include <thread>
 using namespace datadog::opentracing;
 
 TEST_CASE("logger") {
@@ -82,3 +83,28 @@ TEST_CASE("logger") {
   }
   reset();
 }
+
+TEST_CASE("rate limited logger") {
+  std::vector<std::string> messages;
+  auto logger = std::make_shared<StandardLogger>(
+      [&](LogLevel, ot::string_view message) { messages.push_back(message); });
+
+  SECTION("passes on at most one message per period") {
+    RateLimitedLogger rate_limited{logger, std::chrono::milliseconds(100)};
+    rate_limited.Log(LogLevel::error, "first");
+    rate_limited.Log(LogLevel::error, "second");
+    rate_limited.Log(LogLevel::error, "third");
+    REQUIRE(messages == std::vector<std::string>{"first"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    rate_limited.Log(LogLevel::error, "fourth");
+    REQUIRE(messages ==
+            std::vector<std::string>{"first", "fourth (2 similar messages were suppressed)"});
+  }
+
+  SECTION("passes on everything with a period of zero") {
+    RateLimitedLogger rate_limited{logger, std::chrono::milliseconds(0)};
+    rate_limited.Log(LogLevel::error, "first");
+    rate_limited.Log(LogLevel::error, "second");
+    REQUIRE(messages == std::vector<std::string>{"first", "second"});
+  }
+}
@@ -1,8 +1,11 @@
 #ifndef DD_OPENTRACING_TEST_MOCKS_H
 #define DD_OPENTRACING_TEST_MOCKS_H
 
-#include <curl/curl.h>
+#include <dirent.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <list>
 #include <map>
@@ -167,12 +170,13 @@ struct MockBuffer : public WritingSpanBuffer {
       : WritingSpanBuffer(std::make_shared<MockLogger>(), nullptr, sampler,
                           WritingSpanBufferOptions{}){};
 
-  void unbufferAndWriteTrace(uint64_t /* trace_id */) override{
+  void unbufferAndWriteTrace(uint64_t /* trace_id */,
+                             const std::shared_ptr<PendingTrace>& /* trace */) override{
       // Haha NOPE.
       // Leave the trace inside the traces map instead of deleting it.
   };
 
-  std::unordered_map<uint64_t, PendingTrace>& traces() { return traces_; };
+  std::unordered_map<uint64_t, std::shared_ptr<PendingTrace>>& traces() { return traces_; };
 
   void setEnabled(bool enabled) { options_.enabled = enabled; };
 
@@ -209,12 +213,13 @@ struct MockHandle : public Handle {
     }
   };
 
-  CURLcode setopt(CURLoption key, const char* value) override {
+  HandleResult setopt(HandleOption key, const char* value) override {
     std::unique_lock<std::mutex> lock(mutex);
-    if (rcode == CURLE_OK) {
+    if (rcode == HandleResult::ok) {
       // We might have null characters if it's the POST data, thanks msgpack!
-      if (key == CURLOPT_POSTFIELDS && options.find(CURLOPT_POSTFIELDSIZE) != options.end()) {
-        long len = std::stol(options.find(CURLOPT_POSTFIELDSIZE)->second);
+      if (key == HandleOption::post_fields &&
+          options.find(HandleOption::post_field_size) != options.end()) {
+        long len = std::stol(options.find(HandleOption::post_field_size)->second);
         options[key] = std::string(value, len);
       } else {
         options[key] = std::string(value);
@@ -223,17 +228,17 @@ struct MockHandle : public Handle {
     return rcode;
   }
 
-  CURLcode setopt(CURLoption key, long value) override {
+  HandleResult setopt(HandleOption key, long value) override {
     std::unique_lock<std::mutex> lock(mutex);
-    if (rcode == CURLE_OK) {
+    if (rcode == HandleResult::ok) {
       options[key] = std::to_string(value);
     }
     return rcode;
   }
 
-  CURLcode setopt(CURLoption key, size_t value) override {
+  HandleResult setopt(HandleOption key, size_t value) override {
     std::unique_lock<std::mutex> lock(mutex);
-    if (rcode == CURLE_OK) {
+    if (rcode == HandleResult::ok) {
       options[key] = std::to_string(value);
     }
     return rcode;
@@ -245,9 +250,14 @@ struct MockHandle : public Handle {
     }
   }
 
-  CURLcode perform() override {
+  HandleResult perform() override {
     std::unique_lock<std::mutex> lock(mutex);
+    auto body = options.find(HandleOption::post_fields);
+    if (body != options.end()) {
+      requests.push_back({headers, body->second});
+    }
     perform_called.notify_all();
+    perform_unblocked.wait(lock, [&]() { return !perform_blocked; });
     return nextPerformResult();
   }
 
@@ -257,6 +267,20 @@ struct MockHandle : public Handle {
     perform_called.wait(lock);
   }
 
+  // While blocked, calls to perform() don't return, like an agent that's stopped responding.
+  void blockPerform() {
+    std::unique_lock<std::mutex> lock(mutex);
+    perform_blocked = true;
+  }
+
+  void unblockPerform() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      perform_blocked = false;
+    }
+    perform_unblocked.notify_all();
+  }
+
   std::string getError() override {
     std::unique_lock<std::mutex> lock(mutex);
     return error;
@@ -273,38 +297,104 @@ struct MockHandle : public Handle {
     std::unique_lock<std::mutex> lock(mutex);
     std::unique_ptr<std::vector<std::vector<TestSpanData>>> dst{
         new std::vector<std::vector<TestSpanData>>{}};
-    if (options.find(CURLOPT_POSTFIELDS) != options.end()) {
-      std::string packed_span = options[CURLOPT_POSTFIELDS];
+    if (options.find(HandleOption::post_fields) != options.end()) {
+      std::string packed_span = options[HandleOption::post_fields];
       msgpack::object_handle oh = msgpack::unpack(packed_span.data(), packed_span.size());
       msgpack::object deserialized = oh.get();
       deserialized.convert(*dst.get());
-      options.erase(CURLOPT_POSTFIELDS);
+      options.erase(HandleOption::post_fields);
+    }
+    return dst;
+  }
+
+  // Decodes the traces in each request passed to perform(), including failed attempts, in the
+  // order they were made.
+  std::vector<std::vector<std::vector<TestSpanData>>> getTracesPerRequest() {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<std::vector<std::vector<TestSpanData>>> dst;
+    for (auto& request : requests) {
+      msgpack::object_handle oh = msgpack::unpack(request.body.data(), request.body.size());
+      dst.emplace_back();
+      oh.get().convert(dst.back());
     }
     return dst;
   }
 
-  std::unordered_map<CURLoption, std::string, EnumClassHash> options;
+  struct Request {
+    std::map<std::string, std::string> headers;
+    std::string body;
+  };
+
+  // For changing perform_result while requests are being made.
+  void setPerformResult(std::vector<HandleResult> result) {
+    std::unique_lock<std::mutex> lock(mutex);
+    perform_result = result;
+  }
+
+  std::vector<Request> getRequests() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return requests;
+  }
+
+  std::unordered_map<HandleOption, std::string, EnumClassHash> options;
   std::map<std::string, std::string> headers;
+  std::vector<Request> requests;
   std::string error = "";
   std::string response = "";
-  CURLcode rcode = CURLE_OK;
+  HandleResult rcode = HandleResult::ok;
   std::atomic<bool>* is_destructed = nullptr;
   // Each time an perform is called, the next perform_result is used to determine if it
   // succeeds or fails. Loops. Default is for all operations to succeed.
-  std::vector<CURLcode> perform_result{CURLE_OK};
+  std::vector<HandleResult> perform_result{HandleResult::ok};
   int perform_call_count = 0;
 
  private:
   // Returns next result code. Expects mutex to be locked already.
-  CURLcode nextPerformResult() {
+  HandleResult nextPerformResult() {
     if (perform_result.size() == 0) {
-      return CURLE_OK;
+      return HandleResult::ok;
     }
     return perform_result[perform_call_count++ % perform_result.size()];
   }
 
   std::mutex mutex;
   std::condition_variable perform_called;
+  std::condition_variable perform_unblocked;
+  bool perform_blocked = false;
+};
+
+// A directory that's created empty, and removed (along with the files in it) on destruction.
+struct TemporaryDirectory {
+  TemporaryDirectory() {
+    char path_template[] = "/tmp/dd-opentracing-test-XXXXXX";
+    path = mkdtemp(path_template);
+  }
+
+  ~TemporaryDirectory() {
+    for (auto& file : files()) {
+      unlink((path + "/" + file).c_str());
+    }
+    rmdir(path.c_str());
+  }
+
+  // The names of the files in the directory.
+  std::vector<std::string> files() const {
+    std::vector<std::string> names;
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+      return names;
+    }
+    while (dirent* entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name != "." && name != "..") {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+    return names;
+  }
+
+  std::string path;
 };
 
 // A Mock TextMapReader and TextMapWriter.
@@ -341,6 +431,37 @@ struct MockTextMapCarrier : ot::TextMapReader, ot::TextMapWriter {
   mutable int set_fails_after = -1;
 };
 
+// A Mock HTTPHeadersReader that looks up headers regardless of case, as HTTP carriers do.
+struct MockHTTPHeadersCarrier : ot::HTTPHeadersReader {
+  ot::expected<ot::string_view> LookupKey(ot::string_view key) const override {
+    lookups++;
+    auto lower_case = [](ot::string_view s) {
+      std::string lower{s};
+      std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+      return lower;
+    };
+    for (const auto& key_value : headers) {
+      if (lower_case(key_value.first) == lower_case(key)) {
+        return ot::string_view{key_value.second};
+      }
+    }
+    return ot::make_unexpected(ot::key_not_found_error);
+  }
+
+  ot::expected<void> ForeachKey(
+      std::function<ot::expected<void>(ot::string_view key, ot::string_view value)> f)
+      const override {
+    for (const auto& key_value : headers) {
+      auto result = f(key_value.first, key_value.second);
+      if (!result) return result;
+    }
+    return {};
+  }
+
+  std::unordered_map<std::string, std::string> headers;
+  mutable int lookups = 0;
+};
+
 }  // namespace opentracing
 }  // namespace datadog
 
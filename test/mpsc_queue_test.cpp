@@ -0,0 +1,102 @@
+#include "../src/mpsc_queue.h"
+
+#include <catch2/catch.hpp>
+#include <memory>
+#include <thread>
+#include <vector>
+using namespace datadog::opentracing;
+
+TEST_CASE("mpsc queue") {
+  SECTION("capacity is rounded up to a power of two") {
+    REQUIRE(MpscQueue<int>{1}.capacity() == 1);
+    REQUIRE(MpscQueue<int>{5}.capacity() == 8);
+    REQUIRE(MpscQueue<int>{7000}.capacity() == 8192);
+  }
+
+  SECTION("values are popped in the order they were pushed") {
+    MpscQueue<std::unique_ptr<int>> queue{4};
+    std::unique_ptr<int> value;
+    REQUIRE(!queue.tryPop(value));
+    // Go round the ring a few times.
+    for (int lap = 0; lap < 3; lap++) {
+      for (int i = 0; i < 4; i++) {
+        value.reset(new int{i});
+        REQUIRE(queue.tryPush(value));
+        REQUIRE(value == nullptr);
+      }
+      for (int i = 0; i < 4; i++) {
+        REQUIRE(queue.tryPop(value));
+        REQUIRE(*value == i);
+      }
+      REQUIRE(!queue.tryPop(value));
+    }
+  }
+
+  SECTION("pushing to a full queue fails, leaving the value alone") {
+    MpscQueue<std::unique_ptr<int>> queue{2};
+    for (int i = 0; i < 2; i++) {
+      std::unique_ptr<int> value{new int{i}};
+      REQUIRE(queue.tryPush(value));
+    }
+    std::unique_ptr<int> value{new int{2}};
+    REQUIRE(!queue.tryPush(value));
+    REQUIRE(*value == 2);
+    REQUIRE(queue.tryPop(value));
+    REQUIRE(*value == 0);
+    value.reset(new int{2});
+    REQUIRE(queue.tryPush(value));
+  }
+
+  SECTION("clearing empties the queue") {
+    MpscQueue<std::unique_ptr<int>> queue{4};
+    for (int i = 0; i < 3; i++) {
+      std::unique_ptr<int> value{new int{i}};
+      REQUIRE(queue.tryPush(value));
+    }
+    std::unique_ptr<int> value;
+    REQUIRE(queue.tryPop(value));
+    queue.clear();
+    REQUIRE(!queue.tryPop(value));
+    // The whole capacity is available again.
+    for (int i = 0; i < 4; i++) {
+      value.reset(new int{i});
+      REQUIRE(queue.tryPush(value));
+    }
+    REQUIRE(queue.tryPop(value));
+    REQUIRE(*value == 0);
+  }
+
+  SECTION("many producers and one consumer") {
+    const int num_producers = 8;
+    const int values_per_producer = 10000;
+    MpscQueue<int> queue{64};
+    std::vector<std::thread> producers;
+    for (int producer = 0; producer < num_producers; producer++) {
+      producers.emplace_back([&, producer]() {
+        for (int i = 0; i < values_per_producer; i++) {
+          int value = producer * values_per_producer + i;
+          while (!queue.tryPush(value)) {
+            std::this_thread::yield();
+          }
+        }
+      });
+    }
+    // Every value arrives exactly once, and each producer's values arrive in order.
+    std::vector<int> last_seen(num_producers, -1);
+    int value;
+    for (int received = 0; received < num_producers * values_per_producer;) {
+      if (!queue.tryPop(value)) {
+        std::this_thread::yield();
+        continue;
+      }
+      int producer = value / values_per_producer;
+      REQUIRE(value % values_per_producer == last_seen[producer] + 1);
+      last_seen[producer] = value % values_per_producer;
+      received++;
+    }
+    for (auto& producer : producers) {
+      producer.join();
+    }
+    REQUIRE(!queue.tryPop(value));
+  }
+}
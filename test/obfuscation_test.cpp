@@ -0,0 +1,42 @@
+#include "../src/obfuscation.h"
+
+#include <catch2/catch.hpp>
+#include <random>
+#include <regex>
+#include <string>
+using namespace datadog::opentracing;
+
+namespace {
+std::string obfuscated(std::string url) {
+  legacyObfuscateUrl(url);
+  return url;
+}
+}  // namespace
+
+TEST_CASE("legacy URL obfuscation") {
+  SECTION("keeps versions, and the names of segments with query strings") {
+    REQUIRE(obfuscated("") == "");
+    REQUIRE(obfuscated("/api/v1/check?key=1/2") == "/api/v1/check?/?");
+    REQUIRE(obfuscated("/v12/V3/v123/v4") == "/v12/V3/?/?");
+    REQUIRE(obfuscated("/a&b?c/d?/1?x") == "/a&b?c/d?/1?");
+    REQUIRE(obfuscated("//x-y//") == "//?//");
+  }
+
+  SECTION("matches the regular expression it replaced") {
+    std::regex path_mixed_alphanumerics{
+        "(\\/)(?:(?:([^?\\/&]*)(?:\\?[^\\/]+))|(?:(?![vV]\\d{1,2}\\/)[^\\/"
+        "\\d\\?]*[\\d-]+[^\\/]*))"};
+    // Short URLs made of the characters that matter, so that every case comes up.
+    const std::string alphabet = "////???&&-vV0129ab.=";
+    std::mt19937 random{42};
+    for (int i = 0; i < 100000; i++) {
+      std::string url;
+      auto length = random() % 20;
+      for (size_t j = 0; j < length; j++) {
+        url += alphabet[random() % alphabet.size()];
+      }
+      INFO(url);
+      REQUIRE(obfuscated(url) == std::regex_replace(url, path_mixed_alphanumerics, "$1$2?"));
+    }
+  }
+}
@@ -6,6 +6,7 @@
 
 #include <catch2/catch.hpp>
 #include <string>
+#include <thread>
 
 #include "../src/span.h"
 #include "../src/tracer.h"
@@ -30,8 +31,8 @@ TEST_CASE("SpanContext") {
   MockTextMapCarrier carrier{};
   auto buffer = std::make_shared<MockBuffer>();
   buffer->traces().emplace(std::make_pair(
-      123,
-      PendingTrace{logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep)}));
+      123, std::make_shared<PendingTrace>(
+               logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep))));
   SpanContext context{logger, 420, 123, "synthetics", {{"ayy", "lmao"}, {"hi", "haha"}}};
 
   auto propagation_styles =
@@ -161,13 +162,52 @@ TEST_CASE("SpanContext") {
   }
 }
 
+TEST_CASE("baggage") {
+  auto logger = std::make_shared<const MockLogger>();
+  SpanContext parent{logger, 420, 123, "", {{"ayy", "lmao"}}};
+
+  SECTION("is inherited by children, but changed independently") {
+    auto child = parent.withId(421);
+    auto clone = std::unique_ptr<ot::SpanContext>{parent.Clone()};
+    REQUIRE(getBaggage(&child) == dict{{"ayy", "lmao"}});
+    child.setBaggageItem("child", "1");
+    parent.setBaggageItem("parent", "2");
+    REQUIRE(getBaggage(&child) == dict{{"ayy", "lmao"}, {"child", "1"}});
+    REQUIRE(getBaggage(&parent) == dict{{"ayy", "lmao"}, {"parent", "2"}});
+    REQUIRE(getBaggage(dynamic_cast<SpanContext*>(clone.get())) == dict{{"ayy", "lmao"}});
+    REQUIRE(child.baggageItem("child") == "1");
+    REQUIRE(child.baggageItem("parent") == "");
+  }
+
+  SECTION("items can't be changed once set") {
+    parent.setBaggageItem("ayy", "changed");
+    REQUIRE(parent.baggageItem("ayy") == "lmao");
+  }
+
+  SECTION("can be set from many threads at once") {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+      threads.emplace_back([&, i]() {
+        for (int j = 0; j < 100; j++) {
+          parent.setBaggageItem(std::to_string(i) + "-" + std::to_string(j), "x");
+          getBaggage(&parent);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    REQUIRE(getBaggage(&parent).size() == 1 + 8 * 100);
+  }
+}
+
 TEST_CASE("deserialize fails") {
   auto logger = std::make_shared<const MockLogger>();
   MockTextMapCarrier carrier{};
   auto buffer = std::make_shared<MockBuffer>();
   buffer->traces().emplace(std::make_pair(
-      123,
-      PendingTrace{logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep)}));
+      123, std::make_shared<PendingTrace>(
+               logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep))));
   SpanContext context{logger, 420, 123, "", {{"ayy", "lmao"}, {"hi", "haha"}}};
 
   struct PropagationStyleTestCase {
@@ -231,6 +271,80 @@ TEST_CASE("deserialize fails") {
   }
 }
 
+// A TextMapReader that, like those over C structures, can't let an exception through its
+// ForeachKey: one from the callback fails the iteration instead.
+struct ExceptionIntolerantReader : ot::TextMapReader {
+  ot::expected<void> ForeachKey(
+      std::function<ot::expected<void>(ot::string_view key, ot::string_view value)> f)
+      const override {
+    for (const auto& key_value : text_map) {
+      try {
+        auto result = f(key_value.first, key_value.second);
+        if (!result) return result;
+      } catch (...) {
+        return ot::make_unexpected(ot::invalid_carrier_error);
+      }
+    }
+    return {};
+  }
+
+  std::unordered_map<std::string, std::string> text_map;
+};
+
+TEST_CASE("deserialize reports corrupt values without throwing through the reader") {
+  auto logger = std::make_shared<const MockLogger>();
+  ExceptionIntolerantReader reader;
+  reader.text_map["x-datadog-parent-id"] = "420";
+
+  SECTION("a trace id that isn't a number") {
+    reader.text_map["x-datadog-trace-id"] = "not a number";
+  }
+  SECTION("a trace id that's out of range") {
+    reader.text_map["x-datadog-trace-id"] = "99999999999999999999999";
+  }
+  SECTION("a sampling priority that isn't a number") {
+    reader.text_map["x-datadog-trace-id"] = "123";
+    reader.text_map["x-datadog-sampling-priority"] = "keep";
+  }
+
+  auto err = SpanContext::deserialize(logger, reader, {PropagationStyle::Datadog});
+  REQUIRE(!err);
+  REQUIRE(err.error() == ot::span_context_corrupted_error);
+}
+
+TEST_CASE("OptionalSamplingPriority") {
+  static_assert(std::is_trivially_copyable<OptionalSamplingPriority>::value,
+                "copied without allocating");
+  static_assert(sizeof(OptionalSamplingPriority) == 2, "a byte for the value, one for the flag");
+
+  OptionalSamplingPriority none;
+  REQUIRE(none == nullptr);
+  REQUIRE(!none);
+  OptionalSamplingPriority keep = SamplingPriority::UserKeep;
+  REQUIRE(keep != nullptr);
+  REQUIRE(keep.has_value());
+  REQUIRE(*keep == SamplingPriority::UserKeep);
+  REQUIRE(keep != none);
+  REQUIRE(keep != SamplingPriority::SamplerKeep);
+  REQUIRE(asSamplingPriority(-1) == SamplingPriority::UserDrop);
+  REQUIRE(asSamplingPriority(3) == nullptr);
+
+  SECTION("can be used as the std::unique_ptr it replaced") {
+    OptionalSamplingPriority priority =
+        std::make_unique<SamplingPriority>(SamplingPriority::UserDrop);
+    REQUIRE(*priority == SamplingPriority::UserDrop);
+    std::unique_ptr<SamplingPriority> pointer = priority;
+    REQUIRE(pointer != nullptr);
+    REQUIRE(*pointer == SamplingPriority::UserDrop);
+    priority.reset(new SamplingPriority(SamplingPriority::SamplerKeep));
+    REQUIRE(*priority == SamplingPriority::SamplerKeep);
+    priority.reset();
+    REQUIRE(priority == nullptr);
+    pointer = priority;
+    REQUIRE(pointer == nullptr);
+  }
+}
+
 TEST_CASE("SamplingPriority values are clamped apropriately for b3") {
   // first = value before serialization + clamping, second = value after.
   auto priority = GENERATE(values<std::pair<SamplingPriority, SamplingPriority>>(
@@ -243,7 +357,8 @@ TEST_CASE("SamplingPriority values are clamped apropriately for b3") {
   MockTextMapCarrier carrier{};
   auto buffer = std::make_shared<MockBuffer>();
   buffer->traces().emplace(std::make_pair(
-      123, PendingTrace{logger, std::make_unique<SamplingPriority>(priority.first)}));
+      123, std::make_shared<PendingTrace>(
+               logger, std::make_unique<SamplingPriority>(priority.first))));
   SpanContext context{logger, 420, 123, "", {}};
 
   REQUIRE(context.serialize(carrier, buffer, {PropagationStyle::B3}, true));
@@ -258,6 +373,39 @@ TEST_CASE("SamplingPriority values are clamped apropriately for b3") {
   REQUIRE(*received_priority == priority.second);
 }
 
+TEST_CASE("ids, sampling priorities and baggage keys are formatted for each style") {
+  auto id = GENERATE(values<std::pair<uint64_t, std::pair<std::string, std::string>>>(
+      {{0, {"0", "0"}},
+       {9, {"9", "9"}},
+       {10, {"10", "a"}},
+       {255, {"255", "ff"}},
+       {1234567890123, {"1234567890123", "11f71fb04cb"}},
+       {UINT64_MAX, {"18446744073709551615", "ffffffffffffffff"}}}));
+  auto priority = GENERATE(SamplingPriority::UserDrop, SamplingPriority::SamplerDrop,
+                           SamplingPriority::SamplerKeep, SamplingPriority::UserKeep);
+
+  auto logger = std::make_shared<const MockLogger>();
+  MockTextMapCarrier carrier{};
+  auto buffer = std::make_shared<MockBuffer>();
+  buffer->traces().emplace(std::make_pair(
+      id.first, std::make_shared<PendingTrace>(
+                    logger, std::make_unique<SamplingPriority>(priority))));
+  // Too long to prefix on the stack.
+  std::string long_key(300, 'k');
+  SpanContext context{logger, id.first, id.first, "", {{"short", "1"}, {long_key, "2"}}};
+
+  REQUIRE(context.serialize(carrier, buffer,
+                            {PropagationStyle::Datadog, PropagationStyle::B3}, true));
+  REQUIRE(carrier.text_map["x-datadog-trace-id"] == id.second.first);
+  REQUIRE(carrier.text_map["x-datadog-parent-id"] == id.second.first);
+  REQUIRE(carrier.text_map["x-datadog-sampling-priority"] ==
+          std::to_string(static_cast<int>(priority)));
+  REQUIRE(carrier.text_map["X-B3-TraceId"] == id.second.second);
+  REQUIRE(carrier.text_map["X-B3-SpanId"] == id.second.second);
+  REQUIRE(carrier.text_map["ot-baggage-short"] == "1");
+  REQUIRE(carrier.text_map["ot-baggage-" + long_key] == "2");
+}
+
 TEST_CASE("deserialize fails when there are conflicting b3 and datadog headers") {
   auto logger = std::make_shared<const MockLogger>();
   MockTextMapCarrier carrier{};
@@ -286,6 +434,63 @@ TEST_CASE("deserialize fails when there are conflicting b3 and datadog headers")
   REQUIRE(err.error() == ot::span_context_corrupted_error);
 }
 
+TEST_CASE("every style is extracted from the same headers") {
+  auto logger = std::make_shared<const MockLogger>();
+  std::unordered_map<std::string, std::string> headers{
+      {"X-Datadog-Trace-Id", "420"},
+      {"x-datadog-PARENT-id", "421"},
+      {"x-datadog-sampling-priority", "1"},
+      {"x-datadog-origin", "synthetics"},
+      {"x-b3-traceid", "1A4"},
+      {"X-B3-SPANID", "1a5"},
+      {"X-B3-Sampled", "1"},
+      {"ot-baggage-hi", "haha"},
+      // Close to, but not, headers to extract from.
+      {"x-datadog-trace-ix", "junk"},
+      {"x-datadog-trace-i", "junk"},
+      {"x-b3", "junk"},
+      {"accept", "*/*"}};
+  auto styles =
+      GENERATE(std::set<PropagationStyle>{PropagationStyle::Datadog},
+               std::set<PropagationStyle>{PropagationStyle::B3},
+               std::set<PropagationStyle>{PropagationStyle::Datadog, PropagationStyle::B3});
+
+  auto check = [&](ot::expected<std::unique_ptr<ot::SpanContext>>& result) {
+    REQUIRE(result);
+    auto context = dynamic_cast<SpanContext*>(result->get());
+    REQUIRE(context != nullptr);
+    REQUIRE(context->traceId() == 420);
+    REQUIRE(context->id() == 421);
+    REQUIRE(context->origin() == "synthetics");
+    REQUIRE(*context->getPropagatedSamplingPriority() == SamplingPriority::SamplerKeep);
+    REQUIRE(getBaggage(context) == dict{{"hi", "haha"}});
+  };
+
+  SECTION("from a text map") {
+    MockTextMapCarrier carrier;
+    carrier.text_map = headers;
+    auto result = SpanContext::deserialize(logger, carrier, styles);
+    check(result);
+  }
+
+  SECTION("from HTTP headers that can be looked up") {
+    MockHTTPHeadersCarrier carrier;
+    carrier.headers = headers;
+    auto result = SpanContext::deserialize(logger, carrier, styles);
+    check(result);
+    REQUIRE(carrier.lookups > 0);
+  }
+
+  SECTION("ignoring invalid headers of styles not extracted") {
+    auto datadog_only = std::set<PropagationStyle>{PropagationStyle::Datadog};
+    headers["x-b3-traceid"] = "not hex";
+    MockTextMapCarrier carrier;
+    carrier.text_map = headers;
+    auto result = SpanContext::deserialize(logger, carrier, datadog_only);
+    check(result);
+  }
+}
+
 TEST_CASE("deserialize returns a null context if both trace ID and parent ID are missing") {
   auto logger = std::make_shared<const MockLogger>();
 
@@ -309,8 +514,8 @@ TEST_CASE("Binary Span Context") {
   std::stringstream carrier{};
   auto buffer = std::make_shared<MockBuffer>();
   buffer->traces().emplace(std::make_pair(
-      123,
-      PendingTrace{logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep)}));
+      123, std::make_shared<PendingTrace>(
+               logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep))));
   auto priority_sampling = GENERATE(false, true);
 
   SECTION("can be serialized") {
@@ -375,6 +580,101 @@ TEST_CASE("Binary Span Context") {
   }
 }
 
+TEST_CASE("Compact binary Span Context") {
+  auto logger = std::make_shared<const MockLogger>();
+  std::stringstream carrier{};
+  auto buffer = std::make_shared<MockBuffer>();
+  auto priority = GENERATE(SamplingPriority::UserDrop, SamplingPriority::UserKeep);
+  buffer->traces().emplace(std::make_pair(
+      UINT64_MAX, std::make_shared<PendingTrace>(
+                      logger, std::make_unique<SamplingPriority>(priority))));
+  auto priority_sampling = GENERATE(false, true);
+  SpanContext context{logger,
+                      420,
+                      UINT64_MAX,
+                      "synthetics",
+                      {{"ayy", "lmao"}, {"", ""}, {"long", std::string(10000, 'x')}}};
+  REQUIRE(context.serializeCompact(carrier, buffer, priority_sampling));
+  const std::string encoded = carrier.str();
+
+  SECTION("starts with a magic byte and version, and has fixed-width ids") {
+    REQUIRE(static_cast<unsigned char>(encoded[0]) == 0xdd);
+    REQUIRE(encoded[1] == 1);
+    REQUIRE(encoded.substr(3, 8) == std::string(8, '\xff'));
+    REQUIRE(encoded.substr(11, 8) == std::string("\xa4\x01\0\0\0\0\0\0", 8));
+  }
+
+  SECTION("can be deserialized") {
+    auto sc = SpanContext::deserialize(logger, carrier);
+    REQUIRE(sc);
+    auto received_context = dynamic_cast<SpanContext*>(sc->get());
+    REQUIRE(received_context);
+    REQUIRE(received_context->id() == 420);
+    REQUIRE(received_context->traceId() == UINT64_MAX);
+    REQUIRE(getBaggage(received_context) ==
+            dict{{"ayy", "lmao"}, {"", ""}, {"long", std::string(10000, 'x')}});
+    auto received_priority = received_context->getPropagatedSamplingPriority();
+    if (priority_sampling) {
+      REQUIRE(received_priority != nullptr);
+      REQUIRE(*received_priority == priority);
+      REQUIRE(received_context->origin() == "synthetics");
+    } else {
+      REQUIRE(received_priority == nullptr);
+      REQUIRE(received_context->origin() == "");
+    }
+  }
+
+  SECTION("deserialize fails when truncated") {
+    for (size_t size = 1; size < encoded.size(); size++) {
+      std::stringstream truncated{encoded.substr(0, size)};
+      auto err = SpanContext::deserialize(logger, truncated);
+      REQUIRE(!err);
+      REQUIRE(err.error() == ot::span_context_corrupted_error);
+    }
+  }
+
+  SECTION("deserialize fails when the version is unknown") {
+    std::string changed = encoded;
+    changed[1] = 2;
+    std::stringstream unknown{changed};
+    auto err = SpanContext::deserialize(logger, unknown);
+    REQUIRE(!err);
+    REQUIRE(err.error() == ot::span_context_corrupted_error);
+  }
+
+  SECTION("deserialize doesn't trust lengths") {
+    // A baggage key claiming to be 2^63 bytes long.
+    std::string changed = encoded.substr(0, priority_sampling ? 31 : 19);
+    changed += std::string("\x01\xff\xff\xff\xff\xff\xff\xff\xff\x7f", 10) + "short";
+    std::stringstream lying{changed};
+    auto err = SpanContext::deserialize(logger, lying);
+    REQUIRE(!err);
+    REQUIRE(err.error() == ot::span_context_corrupted_error);
+  }
+
+  SECTION("deserialize survives corruption") {
+    // Flips every bit in turn. Whatever the result, it mustn't crash or hang.
+    for (size_t bit = 0; bit < std::min<size_t>(encoded.size(), 64) * 8; bit++) {
+      std::string changed = encoded;
+      changed[bit / 8] ^= static_cast<char>(1 << (bit % 8));
+      std::stringstream corrupted{changed};
+      SpanContext::deserialize(logger, corrupted);
+    }
+  }
+
+  SECTION("is written by Tracer::Inject if enabled") {
+    TracerOptions options{"", 0, "service", "web"};
+    options.inject_binary_compact = true;
+    auto tracer = std::make_shared<Tracer>(options, buffer, getRealTime, getId);
+    std::stringstream injected;
+    REQUIRE(tracer->Inject(context, injected));
+    REQUIRE(static_cast<unsigned char>(injected.str()[0]) == 0xdd);
+    auto extracted = tracer->Extract(injected);
+    REQUIRE(extracted);
+    REQUIRE(dynamic_cast<SpanContext*>(extracted->get())->traceId() == UINT64_MAX);
+  }
+}
+
 TEST_CASE("sampling behaviour") {
   auto logger = std::make_shared<MockLogger>();
   auto sampler = std::make_shared<MockRulesSampler>();
@@ -613,8 +913,8 @@ TEST_CASE("origin header propagation") {
   auto sampler = std::make_shared<MockRulesSampler>();
   auto buffer = std::make_shared<MockBuffer>();
   buffer->traces().emplace(std::make_pair(
-      123,
-      PendingTrace{logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep)}));
+      123, std::make_shared<PendingTrace>(
+               logger, std::make_unique<SamplingPriority>(SamplingPriority::SamplerKeep))));
 
   std::shared_ptr<Tracer> tracer{new Tracer{{}, buffer, getRealTime, getId}};
   SpanContext context{logger, 420, 123, "madeuporigin", {{"ayy", "lmao"}, {"hi", "haha"}}};
@@ -666,7 +966,7 @@ TEST_CASE("origin header propagation") {
     auto& traces = buffer->traces();
     auto it = traces.find(123);
     REQUIRE(it != traces.end());
-    auto& spans = it->second.finished_spans;
+    auto& spans = it->second->finished_spans;
     REQUIRE(spans->size() == 3);
     // The local root span should have the tag.
     auto& meta = spans->at(2)->meta;
@@ -132,6 +132,57 @@ TEST_CASE("span buffer") {
     REQUIRE(writer->traces.size() == 2);
   }
 
+  SECTION("shares the sampling priority with the trace's spans") {
+    auto span = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420, 0,
+                                               123, 456, 0);
+    auto shared = buffer->registerSpan(context_from_span(*span));
+    REQUIRE(shared->get() == nullptr);
+    buffer->setSamplingPriority(420, SamplingPriority::UserKeep);
+    REQUIRE(shared->get() == SamplingPriority::UserKeep);
+    buffer->setSamplingPriority(420, nullptr);
+    REQUIRE(shared->get() == nullptr);
+    buffer->assignSamplingPriority(span.get());
+    REQUIRE(shared->get() == SamplingPriority::SamplerKeep);
+    // Locked, so unchanged.
+    buffer->setSamplingPriority(420, SamplingPriority::UserDrop);
+    REQUIRE(shared->get() == SamplingPriority::SamplerKeep);
+    // And still readable after the trace is written.
+    buffer->finishSpan(std::move(span));
+    REQUIRE(writer->traces.size() == 1);
+    REQUIRE(shared->get() == SamplingPriority::SamplerKeep);
+  }
+
+  SECTION("writes a trace without holding any lock") {
+    // A Writer that starts another trace on the same buffer from inside write(). That would
+    // deadlock if the buffer, or the finished trace, were still locked.
+    struct ReentrantWriter : public MockWriter {
+      ReentrantWriter(std::shared_ptr<RulesSampler> sampler) : MockWriter(sampler) {}
+      void write(Trace trace) override {
+        uint64_t trace_id = trace->at(0)->trace_id;
+        MockWriter::write(std::move(trace));
+        auto logger = std::make_shared<const MockLogger>();
+        buffer->registerSpan(SpanContext{logger, trace_id + 1, trace_id + 1, "", {}});
+        REQUIRE(buffer->getSamplingPriority(trace_id) == nullptr);
+      }
+      std::shared_ptr<WritingSpanBuffer> buffer;
+    };
+    auto reentrant_writer = std::make_shared<ReentrantWriter>(sampler);
+    auto reentrant_buffer = std::make_shared<WritingSpanBuffer>(logger, reentrant_writer, sampler,
+                                                                WritingSpanBufferOptions{});
+    reentrant_writer->buffer = reentrant_buffer;
+    auto span = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420, 0,
+                                               123, 456, 0);
+    reentrant_buffer->registerSpan(context_from_span(*span));
+    reentrant_buffer->finishSpan(std::move(span));
+    REQUIRE(reentrant_writer->traces.size() == 1);
+    // The trace the writer started is there to finish.
+    auto next_span = std::make_unique<TestSpanData>("type", "service", "resource", "name", 421,
+                                                    421, 0, 123, 456, 0);
+    reentrant_buffer->finishSpan(std::move(next_span));
+    REQUIRE(reentrant_writer->traces.size() == 2);
+    reentrant_writer->buffer = nullptr;  // Break the cycle.
+  }
+
   SECTION("thread safe") {
     std::vector<std::thread> trace_writers;
     // Buffer 5 traces at once.
@@ -5,10 +5,12 @@
 
 #include <catch2/catch.hpp>
 #include <ctime>
+#include <limits>
 #include <nlohmann/json.hpp>
 #include <thread>
 
 #include "../src/sample.h"
+#include "../src/url_normalizer.h"
 #include "mocks.h"
 using namespace datadog::opentracing;
 namespace tags = datadog::tags;
@@ -37,7 +39,7 @@ TEST_CASE("span") {
               "",         ""};
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->span_id == 100);
     REQUIRE(result->trace_id == 100);
     REQUIRE(result->parent_id == 0);
@@ -51,8 +53,8 @@ TEST_CASE("span") {
               "",         ""};
     REQUIRE(buffer->traces().size() == 1);
     REQUIRE(buffer->traces().find(100) != buffer->traces().end());
-    REQUIRE(buffer->traces().at(100).finished_spans->size() == 0);
-    REQUIRE(buffer->traces().at(100).all_spans.size() == 1);
+    REQUIRE(buffer->traces().at(100)->finished_spans->size() == 0);
+    REQUIRE(buffer->traces().at(100)->all_spans.size() == 1);
   }
 
   SECTION("timed correctly") {
@@ -64,7 +66,7 @@ TEST_CASE("span") {
     advanceTime(time, std::chrono::seconds(10));
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->duration == 10000000000);
   }
 
@@ -92,11 +94,81 @@ TEST_CASE("span") {
       const ot::FinishSpanOptions finish_options;
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(span_id).finished_spans->back();
+      auto& result = buffer->traces().at(span_id)->finished_spans->back();
       REQUIRE(result->meta.find(ot::ext::http_url)->second == test_case.second);
     }
   }
 
+  SECTION("audits span data (url normalizer)") {
+    UrlNormalizerRules rules;
+    rules.integers = true;
+    rules.routes = {"/users/{id}/repo/{repo}"};
+    auto url_normalizer = std::make_shared<const UrlNormalizer>(rules);
+    std::list<std::pair<std::string, std::string>> test_cases{
+        {"/search?id=100&private=true", "/search"},
+        {"/user/1/repo/50/?private=true", "/user/?/repo/?/"},
+        {"http://example.com/users/1/repo/dd-opentracing-cpp",
+         "http://example.com/users/{id}/repo/{repo}"},
+    };
+
+    std::shared_ptr<SpanBuffer> buffer_ptr{buffer};
+    for (auto& test_case : test_cases) {
+      auto span_id = get_id();
+      // Normalizes the resource too, even with legacy obfuscation.
+      Span span{logger,     nullptr, buffer_ptr, get_time, span_id,
+                span_id,    0,       SpanContext{logger, span_id, span_id, "", {}},
+                get_time(), "",      "",         "",       "GET " + test_case.first,
+                "",         true,    url_normalizer};
+      span.SetTag(ot::ext::http_url, test_case.first);
+      const ot::FinishSpanOptions finish_options;
+      span.FinishWithOptions(finish_options);
+
+      auto& result = buffer->traces().at(span_id)->finished_spans->back();
+      REQUIRE(result->meta.find(ot::ext::http_url)->second == test_case.second);
+      REQUIRE(result->resource == "GET " + test_case.second);
+    }
+  }
+
+  SECTION("leaves resources that aren't URLs alone (url normalizer)") {
+    UrlNormalizerRules rules;
+    rules.integers = true;
+    auto url_normalizer = std::make_shared<const UrlNormalizer>(rules);
+    // Pairs of span type and resource.
+    std::list<std::pair<std::string, std::string>> test_cases{
+        {"sql", "SELECT * FROM users WHERE id = ? AND name = ?"},
+        // Not a URL, even in an HTTP span.
+        {"web", "SELECT * FROM users WHERE id = ?"},
+        // Looks like a URL, but it isn't an HTTP span.
+        {"cache", "/users/1?fresh"},
+    };
+
+    std::shared_ptr<SpanBuffer> buffer_ptr{buffer};
+    for (auto& test_case : test_cases) {
+      auto span_id = get_id();
+      Span span{logger,
+                nullptr,
+                buffer_ptr,
+                get_time,
+                span_id,
+                span_id,
+                0,
+                SpanContext{logger, span_id, span_id, "", {}},
+                get_time(),
+                "",
+                test_case.first,
+                "",
+                test_case.second,
+                "",
+                false,
+                url_normalizer};
+      const ot::FinishSpanOptions finish_options;
+      span.FinishWithOptions(finish_options);
+
+      auto& result = buffer->traces().at(span_id)->finished_spans->back();
+      REQUIRE(result->resource == test_case.second);
+    }
+  }
+
   SECTION("audits span data (legacy)") {
     std::list<std::pair<std::string, std::string>> test_cases{
         // Should remove query params
@@ -134,7 +206,7 @@ TEST_CASE("span") {
       const ot::FinishSpanOptions finish_options;
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(span_id).finished_spans->back();
+      auto& result = buffer->traces().at(span_id)->finished_spans->back();
       REQUIRE(result->meta.find(ot::ext::http_url)->second == test_case.second);
     }
   }
@@ -152,7 +224,7 @@ TEST_CASE("span") {
     std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
     REQUIRE(buffer->traces().size() == 1);
     REQUIRE(buffer->traces().find(100) != buffer->traces().end());
-    REQUIRE(buffer->traces().at(100).finished_spans->size() == 1);
+    REQUIRE(buffer->traces().at(100)->finished_spans->size() == 1);
   }
 
   SECTION("handles tags") {
@@ -177,7 +249,7 @@ TEST_CASE("span") {
 
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     // Check "map" seperately, because JSON key order is non-deterministic therefore we can't do
     // simple string matching.
     REQUIRE(json::parse(result->meta["map"]) ==
@@ -196,6 +268,48 @@ TEST_CASE("span") {
                             });
   }
 
+  SECTION("serializes nested tag values as nlohmann::json would") {
+    auto span_id = get_id();
+    Span span{logger,     nullptr, buffer, get_time,
+              span_id,    span_id, 0,      SpanContext{logger, span_id, span_id, "", {}},
+              get_time(), "",      "",     "",
+              "",         ""};
+
+    span.SetTag("list", std::vector<ot::Value>{0.1,
+                                               -0.0,
+                                               1e300,
+                                               std::numeric_limits<double>::infinity(),
+                                               int64_t{-1},
+                                               uint64_t{18446744073709551615u},
+                                               "quote\" backslash\\ tab\t unit\x1f caf\xc3\xa9",
+                                               nullptr,
+                                               std::vector<ot::Value>{},
+                                               std::unordered_map<std::string, ot::Value>{}});
+    span.SetTag("map",
+                std::unordered_map<std::string, ot::Value>{
+                    {"b", std::vector<ot::Value>{std::unordered_map<std::string, ot::Value>{
+                              {"z\n", false}, {"a", std::vector<ot::Value>{"deep"}}}}},
+                    {"a", 1.5},
+                    {"c", std::string("x")}});
+    span.SetTag("empty list", std::vector<ot::Value>{});
+    span.FinishWithOptions(finish_options);
+
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
+    json list = {0.1,
+                 -0.0,
+                 1e300,
+                 nullptr,
+                 -1,
+                 18446744073709551615u,
+                 "quote\" backslash\\ tab\t unit\x1f caf\xc3\xa9",
+                 "nullptr",
+                 nullptr,
+                 nullptr};
+    REQUIRE(result->meta["list"] == list.dump());
+    REQUIRE(result->meta["map"] == R"({"a":1.5,"b":[{"a":["deep"],"z\n":false}],"c":"x"})");
+    REQUIRE(result->meta["empty list"] == "null");
+  }
+
   SECTION("replaces colons with dots in tag key") {
     auto span_id = get_id();
     Span span{logger,     nullptr, buffer, get_time,
@@ -207,7 +321,7 @@ TEST_CASE("span") {
 
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->meta == std::unordered_map<std::string, std::string>{
                                 {"foo.bar.baz", "x"},
                             });
@@ -237,7 +351,7 @@ TEST_CASE("span") {
 
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     // Datadog special tags aren't kept, they just set the Span values.
     REQUIRE(result->meta == std::unordered_map<std::string, std::string>{
                                 {"tag with no special meaning", "ayy lmao"}});
@@ -249,6 +363,61 @@ TEST_CASE("span") {
     REQUIRE(result->metrics["_dd1.sr.eausr"] == 1.0);
   }
 
+  SECTION("the last datadog tag set wins, even over SetOperationName") {
+    auto span_id = get_id();
+    Span span{logger,     nullptr, buffer, get_time,
+              span_id,    span_id, 0,      SpanContext{logger, span_id, span_id, "", {}},
+              get_time(), "",      "",     "",
+              "",         ""};
+    span.SetTag("resource:name", "first resource");
+    span.SetTag(tags::resource_name, "second resource");
+    span.SetOperationName("new operation");
+    span.SetTag(tags::analytics_event, true);
+    span.SetTag(tags::analytics_event, "not a number at all");
+    span.SetTag("service.nam", "not special");
+    span.FinishWithOptions(finish_options);
+
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
+    REQUIRE(result->name == "new operation");
+    REQUIRE(result->resource == "second resource");
+    REQUIRE(result->metrics.find("_dd1.sr.eausr") == result->metrics.end());
+    REQUIRE(result->meta == std::unordered_map<std::string, std::string>{
+                                {"service.nam", "not special"}});
+  }
+
+  SECTION("sets tags by TagKey, singly or all at once") {
+    auto span_id = get_id();
+    Span span{logger,     nullptr, buffer, get_time,
+              span_id,    span_id, 0,      SpanContext{logger, span_id, span_id, "", {}},
+              get_time(), "",      "",     "",
+              "",         ""};
+    const TagKey method{"http:method"};
+    const TagKey url{ot::ext::http_url};
+    const TagKey resource{tags::resource_name};
+    const TagKey error{ot::ext::error};
+    const TagKey keep{tags::manual_keep};
+    REQUIRE(method.name() == "http.method");
+
+    span.SetTag(method, "POST");
+    span.SetTags({{method, "GET"},
+                  {url, "http://example.com/users/1?secret"},
+                  {resource, "GET /users/{id}"},
+                  {error, true},
+                  {keep, ""}});
+    span.SetOperationName("overridden by the resource tag");
+    span.FinishWithOptions(finish_options);
+
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
+    REQUIRE(result->resource == "GET /users/{id}");
+    REQUIRE(result->error == 1);
+    REQUIRE(result->meta == std::unordered_map<std::string, std::string>{
+                                {"http.method", "GET"},
+                                {"http.url", "http://example.com/users/1"},
+                                {"error", "true"},
+                                {"manual.keep", ""}});
+    REQUIRE(*buffer->traces().at(100)->sampling_priority == SamplingPriority::UserKeep);
+  }
+
   SECTION("values for analytics_event tag") {
     auto span_id = get_id();
     Span span{logger,     nullptr, buffer, get_time,
@@ -278,7 +447,7 @@ TEST_CASE("span") {
 
     span.SetTag(tags::analytics_event, test_case.tag_value);
     span.FinishWithOptions(finish_options);
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     auto metric = result->metrics.find("_dd1.sr.eausr");
 
     if (test_case.expected) {
@@ -319,7 +488,7 @@ TEST_CASE("span") {
 
     span.SetTag("error", error_tag_test_case.value);
     span.FinishWithOptions(finish_options);
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
 
     REQUIRE(result->error == error_tag_test_case.span_error);
     REQUIRE(result->meta["error"] == error_tag_test_case.span_tag);
@@ -344,7 +513,7 @@ TEST_CASE("span") {
 
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->meta ==
             std::unordered_map<std::string, std::string>{{"operation", "original span name"}});
     REQUIRE(result->name == "overridden operation name");
@@ -373,7 +542,7 @@ TEST_CASE("span") {
     span.SetTag("resource.name", "new resource");
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->meta ==
             std::unordered_map<std::string, std::string>{{"operation", "original span name"}});
     REQUIRE(result->name == "overridden operation name");
@@ -404,7 +573,7 @@ TEST_CASE("span") {
       const ot::FinishSpanOptions finish_options;
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(100).finished_spans->at(0);
+      auto& result = buffer->traces().at(100)->finished_spans->at(0);
       REQUIRE(result->name == "operation name");
       REQUIRE(result->resource == "operation name");
     }
@@ -414,7 +583,7 @@ TEST_CASE("span") {
       const ot::FinishSpanOptions finish_options;
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(100).finished_spans->at(0);
+      auto& result = buffer->traces().at(100)->finished_spans->at(0);
       REQUIRE(result->name == "operation name");
       REQUIRE(result->resource == "resource tag override");
     }
@@ -440,7 +609,7 @@ TEST_CASE("span") {
     const ot::FinishSpanOptions finish_options;
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->name == "overridden name");
     REQUIRE(result->resource == "updated operation name");
     REQUIRE(result->meta[tags::operation_name] == "updated operation name");
@@ -454,7 +623,7 @@ TEST_CASE("span") {
                 "",         ""};
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(100).finished_spans->at(0);
+      auto& result = buffer->traces().at(100)->finished_spans->at(0);
       REQUIRE(result->metrics.find("_sampling_priority_v1") != result->metrics.end());
       REQUIRE(result->metrics["_sampling_priority_v1"] == 1);
     }
@@ -469,7 +638,7 @@ TEST_CASE("span") {
                 "",         ""};
       span.FinishWithOptions(finish_options);
 
-      REQUIRE(*buffer->traces().at(42).sampling_priority == SamplingPriority::SamplerKeep);
+      REQUIRE(*buffer->traces().at(42)->sampling_priority == SamplingPriority::SamplerKeep);
     }
 
     SECTION(
@@ -493,7 +662,7 @@ TEST_CASE("span") {
                 "",         ""};
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(42).finished_spans->at(0);
+      auto& result = buffer->traces().at(42)->finished_spans->at(0);
       REQUIRE(result->metrics.find("_sampling_priority_v1") != result->metrics.end());
       REQUIRE(result->metrics["_sampling_priority_v1"] == 1);
     }
@@ -514,7 +683,7 @@ TEST_CASE("span") {
                 "",         ""};
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(100).finished_spans->at(0);
+      auto& result = buffer->traces().at(100)->finished_spans->at(0);
       REQUIRE(result->metrics.find("_sampling_priority_v1") != result->metrics.end());
       REQUIRE(result->metrics["_sampling_priority_v1"] == -1);
     }
@@ -535,7 +704,7 @@ TEST_CASE("span") {
                 "",         ""};
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces().at(100).finished_spans->at(0);
+      auto& result = buffer->traces().at(100)->finished_spans->at(0);
       REQUIRE(result->metrics.find("_dd.rule_psr") != result->metrics.end());
       REQUIRE(result->metrics.find("_dd.limit_psr") != result->metrics.end());
       REQUIRE(result->metrics["_dd.rule_psr"] == 0.42);
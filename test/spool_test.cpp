@@ -0,0 +1,245 @@
+#include "../src/spool.h"
+
+#include <catch2/catch.hpp>
+#include <thread>
+
+#include "mocks.h"
+using namespace datadog::opentracing;
+
+namespace {
+EncodedPayload makePayload(size_t num_traces, std::string body) {
+  return EncodedPayload{{{"Content-Type", "application/msgpack"},
+                         {"X-Datadog-Trace-Count", std::to_string(num_traces)}},
+                        body,
+                        num_traces};
+}
+}  // namespace
+
+TEST_CASE("spool") {
+  TemporaryDirectory directory;
+  SpoolOptions options;
+  options.directory = directory.path;
+
+  SECTION("payloads are read back in the order they were pushed") {
+    // Small enough that the payloads span several segments.
+    options.segment_bytes = 256;
+    Spool spool{options};
+    EncodedPayload payload;
+    REQUIRE(spool.empty());
+    REQUIRE(!spool.peek(payload));
+    for (size_t i = 1; i <= 10; i++) {
+      REQUIRE(spool.push(makePayload(i, std::string(i * 20, 'a' + i))));
+    }
+    REQUIRE(directory.files().size() > 1);
+    for (size_t i = 1; i <= 10; i++) {
+      REQUIRE(!spool.empty());
+      REQUIRE(spool.peek(payload));
+      REQUIRE(payload.num_traces == i);
+      REQUIRE(payload.body == std::string(i * 20, 'a' + i));
+      REQUIRE(payload.headers == makePayload(i, "").headers);
+      // Peeking again gives the same payload.
+      REQUIRE(spool.peek(payload));
+      REQUIRE(payload.num_traces == i);
+      spool.pop();
+    }
+    REQUIRE(spool.empty());
+    REQUIRE(!spool.peek(payload));
+    // Segments are removed once they've been read.
+    REQUIRE(directory.files().empty());
+    REQUIRE(spool.bytes() == 0);
+
+    // And it can be used again.
+    REQUIRE(spool.push(makePayload(11, "body")));
+    REQUIRE(spool.peek(payload));
+    REQUIRE(payload.num_traces == 11);
+  }
+
+  SECTION("payloads survive the spool being reopened") {
+    {
+      Spool spool{options};
+      for (size_t i = 1; i <= 3; i++) {
+        REQUIRE(spool.push(makePayload(i, "body " + std::to_string(i))));
+      }
+      spool.pop();
+    }
+    Spool spool{options};
+    EncodedPayload payload;
+    REQUIRE(spool.peek(payload));
+    REQUIRE(payload.body == "body 2");
+    spool.pop();
+    // New payloads go after the recovered ones.
+    REQUIRE(spool.push(makePayload(4, "body 4")));
+    REQUIRE(spool.peek(payload));
+    REQUIRE(payload.body == "body 3");
+    spool.pop();
+    REQUIRE(spool.peek(payload));
+    REQUIRE(payload.body == "body 4");
+    spool.pop();
+    REQUIRE(spool.empty());
+  }
+
+  SECTION("files that aren't segments are left alone, and bad segments are discarded") {
+    std::string other = directory.path + "/other";
+    std::string bad_segment = directory.path + "/segment-00000000000000000000.spool";
+    FILE* file = std::fopen(other.c_str(), "w");
+    REQUIRE(file != nullptr);
+    std::fclose(file);
+    file = std::fopen(bad_segment.c_str(), "w");
+    REQUIRE(file != nullptr);
+    std::fputs("not a spool segment", file);
+    std::fclose(file);
+
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    Spool spool{options};
+    std::cerr.rdbuf(stderr);  // Restore stderr.
+    REQUIRE(spool.empty());
+    REQUIRE(directory.files() == std::vector<std::string>{"other"});
+    REQUIRE(error_message.str() == "Discarding spool segment " + bad_segment +
+                                       ": not a spool segment\n");
+  }
+
+  SECTION("problems are logged to the logger, at most once per log period") {
+    std::vector<std::string> messages;
+    options.logger = std::make_shared<StandardLogger>(
+        [&](LogLevel, ot::string_view message) { messages.push_back(message); });
+    options.log_period = std::chrono::seconds(60);
+    std::vector<std::string> bad_segments{
+        directory.path + "/segment-00000000000000000000.spool",
+        directory.path + "/segment-00000000000000000001.spool"};
+    for (auto& bad_segment : bad_segments) {
+      FILE* file = std::fopen(bad_segment.c_str(), "w");
+      REQUIRE(file != nullptr);
+      std::fputs("not a spool segment", file);
+      std::fclose(file);
+    }
+
+    Spool spool{options};
+    REQUIRE(spool.empty());
+    REQUIRE(directory.files().empty());
+    REQUIRE(messages ==
+            std::vector<std::string>{"Discarding spool segment " + bad_segments[0] +
+                                     ": not a spool segment"});
+  }
+
+  SECTION("segments with corrupt records are discarded") {
+    // Past the segment header (magic and read offset), and the first record's length, time and
+    // number of traces.
+    const long headers_size_offset = 8 + 8 + 4 + 8 + 4;
+    auto corrupt = [&](uint32_t headers_size) {
+      {
+        Spool spool{options};
+        REQUIRE(spool.push(makePayload(1, "body 1")));
+        REQUIRE(spool.push(makePayload(2, "body 2")));
+      }
+      std::string segment = directory.path + "/" + directory.files()[0];
+      FILE* file = std::fopen(segment.c_str(), "r+");
+      REQUIRE(file != nullptr);
+      std::fseek(file, headers_size_offset, SEEK_SET);
+      std::fwrite(&headers_size, sizeof(headers_size), 1, file);
+      std::fclose(file);
+      return segment;
+    };
+
+    SECTION("headers larger than the record") {
+      std::string segment = corrupt(UINT32_MAX);
+      std::stringstream error_message;
+      std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+      Spool spool{options};
+      EncodedPayload payload;
+      REQUIRE(!spool.peek(payload));
+      std::cerr.rdbuf(stderr);  // Restore stderr.
+      REQUIRE(spool.empty());
+      REQUIRE(directory.files().empty());
+      REQUIRE(error_message.str() ==
+              "Discarding spool segment " + segment + ": bad record headers size\n");
+    }
+
+    SECTION("headers that aren't null-terminated") {
+      // Cuts the last header value short of its terminator.
+      uint32_t headers_size = 0;
+      for (auto& header : makePayload(1, "").headers) {
+        headers_size += header.first.size() + header.second.size() + 2;
+      }
+      std::string segment = corrupt(headers_size - 1);
+      std::stringstream error_message;
+      std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+      Spool spool{options};
+      EncodedPayload payload;
+      REQUIRE(!spool.peek(payload));
+      std::cerr.rdbuf(stderr);  // Restore stderr.
+      REQUIRE(directory.files().empty());
+      REQUIRE(error_message.str() ==
+              "Discarding spool segment " + segment + ": bad record headers\n");
+    }
+  }
+
+  SECTION("a directory in use by another spool is an error") {
+    {
+      Spool spool{options};
+      REQUIRE_THROWS_AS(Spool{options}, std::runtime_error);
+    }
+    // But not once the other is closed.
+    Spool spool{options};
+    REQUIRE(spool.empty());
+  }
+
+  SECTION("the oldest payloads are discarded to stay under the size limit") {
+    options.segment_bytes = 256;
+    options.max_bytes = 1024;
+    Spool spool{options};
+    // One payload per segment.
+    for (size_t i = 1; i <= 10; i++) {
+      REQUIRE(spool.push(makePayload(i, std::string(150, 'x'))));
+      REQUIRE(spool.bytes() <= options.max_bytes);
+    }
+    EncodedPayload payload;
+    REQUIRE(spool.peek(payload));
+    REQUIRE(payload.num_traces == 7);
+  }
+
+  SECTION("payloads too large for the spool are rejected") {
+    options.segment_bytes = 256;
+    options.max_bytes = 1024;
+    Spool spool{options};
+    REQUIRE(!spool.push(makePayload(1, std::string(1024, 'x'))));
+    // Payloads larger than a segment get one of their own.
+    REQUIRE(spool.push(makePayload(2, std::string(512, 'x'))));
+    EncodedPayload payload;
+    REQUIRE(spool.peek(payload));
+    REQUIRE(payload.num_traces == 2);
+    REQUIRE(payload.body.size() == 512);
+  }
+
+  SECTION("payloads that are too old are discarded") {
+    options.max_age = std::chrono::milliseconds(50);
+    Spool spool{options};
+    REQUIRE(spool.push(makePayload(1, "old")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(spool.push(makePayload(2, "new")));
+    EncodedPayload payload;
+    REQUIRE(spool.peek(payload));
+    REQUIRE(payload.body == "new");
+    spool.pop();
+    REQUIRE(spool.push(makePayload(3, "old")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(!spool.peek(payload));
+    REQUIRE(spool.empty());
+  }
+
+  SECTION("the directory is created if need be") {
+    options.directory = directory.path + "/spool";
+    {
+      Spool spool{options};
+      REQUIRE(spool.push(makePayload(1, "body")));
+      REQUIRE(directory.files() == std::vector<std::string>{"spool"});
+      spool.pop();
+    }
+    rmdir(options.directory.c_str());
+  }
+
+  SECTION("a directory that can't be created is an error") {
+    options.directory = directory.path + "/missing/spool";
+    REQUIRE_THROWS_AS(Spool{options}, std::runtime_error);
+  }
+}
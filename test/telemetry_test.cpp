@@ -0,0 +1,270 @@
+#include "../src/telemetry.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+#include <thread>
+
+#include "../src/agent_writer.h"
+#include "../src/tracer.h"
+#include "mocks.h"
+using namespace datadog::opentracing;
+
+TEST_CASE("counter") {
+  Counter counter;
+  REQUIRE(counter.value() == 0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 32; i++) {
+    threads.emplace_back([&]() {
+      for (int j = 0; j < 1000; j++) {
+        counter.add();
+      }
+      counter.add(5);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(counter.value() == 32 * 1005);
+}
+
+TEST_CASE("latency histogram") {
+  SECTION("buckets are within about 3% of their values") {
+    size_t last_index = 0;
+    for (uint64_t value = 0; value < (uint64_t{1} << 36); value = value * 11 / 10 + 1) {
+      size_t index = LatencyHistogram::bucketIndex(value);
+      REQUIRE(index < LatencyHistogram::num_buckets);
+      REQUIRE(index >= last_index);
+      last_index = index;
+      uint64_t max = LatencyHistogram::bucketMax(index);
+      REQUIRE(max >= value);
+      REQUIRE(max - value <= value / LatencyHistogram::sub_buckets);
+      if (index > 0) {
+        REQUIRE(LatencyHistogram::bucketMax(index - 1) < value);
+      }
+    }
+    // Larger values go in the last bucket.
+    REQUIRE(LatencyHistogram::bucketIndex(uint64_t{1} << 40) ==
+            LatencyHistogram::num_buckets - 1);
+  }
+
+  SECTION("summary") {
+    LatencyHistogram histogram;
+    REQUIRE(histogram.summary().count == 0);
+    REQUIRE(histogram.summary().p99 == 0);
+    for (uint64_t value = 1; value <= 1000; value++) {
+      histogram.recordMicroseconds(value);
+    }
+    histogram.record(std::chrono::milliseconds(2));
+    auto summary = histogram.summary();
+    REQUIRE(summary.count == 1001);
+    REQUIRE(summary.mean == Approx((500500.0 + 2000.0) / 1001));
+    REQUIRE(summary.p50 == Approx(501).epsilon(0.04));
+    REQUIRE(summary.p90 == Approx(901).epsilon(0.04));
+    REQUIRE(summary.p99 == Approx(991).epsilon(0.04));
+    REQUIRE(summary.max == 2000);
+  }
+
+  SECTION("summary of the values recorded between two points") {
+    LatencyHistogram histogram;
+    histogram.record(std::chrono::seconds(5));
+    auto since = histogram.bucketCounts();
+    REQUIRE(LatencyHistogram::summary(since, histogram.bucketCounts()).count == 0);
+    for (uint64_t value = 1; value <= 100; value++) {
+      histogram.recordMicroseconds(value);
+    }
+    auto summary = LatencyHistogram::summary(since, histogram.bucketCounts());
+    REQUIRE(summary.count == 100);
+    REQUIRE(summary.mean == Approx(50.5).epsilon(0.04));
+    REQUIRE(summary.p50 == Approx(50).epsilon(0.04));
+    REQUIRE(summary.p90 == Approx(90).epsilon(0.04));
+    REQUIRE(summary.p99 == Approx(99).epsilon(0.04));
+    REQUIRE(summary.max == Approx(100).epsilon(0.04));
+  }
+}
+
+TEST_CASE("telemetry") {
+  auto before = getTelemetry();
+
+  SECTION("spans and pending traces are counted") {
+    auto sampler = std::make_shared<RulesSampler>();
+    auto writer = std::make_shared<MockWriter>(sampler);
+    TracerOptions tracer_options{"", 0, "service_name", "web"};
+    auto tracer = std::make_shared<Tracer>(tracer_options, writer, sampler);
+    auto root = tracer->StartSpan("root");
+    auto child = tracer->StartSpan("child", {ot::ChildOf(&root->context())});
+    REQUIRE(getTelemetry().spans_created == before.spans_created + 2);
+    REQUIRE(getTelemetry().pending_traces == before.pending_traces + 1);
+    child->Finish();
+    root->Finish();
+    REQUIRE(getTelemetry().pending_traces == before.pending_traces);
+  }
+
+  SECTION("the writer's work is counted") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    handle->response = "{}";
+    handle->perform_result = {HandleResult::operation_timedout, HandleResult::ok};
+    AgentWriterOptions options;
+    options.write_period = std::chrono::seconds(3600);
+    options.retry_periods = {std::chrono::milliseconds(10)};
+    AgentWriter writer{std::move(handle_ptr), options, "hostname", 6319, "",
+                       std::make_shared<RulesSampler>()};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    for (uint64_t id = 1; id <= 2; id++) {
+      Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+      trace->emplace_back(
+          new TestSpanData{"web", "service", "resource", "name", id, 1, 0, 0, 0, 0});
+      writer.write(std::move(trace));
+    }
+    writer.flush(std::chrono::seconds(10));
+    std::cerr.rdbuf(stderr);  // Restore stderr.
+
+    auto after = getTelemetry();
+    REQUIRE(after.traces_written - before.traces_written == 2);
+    REQUIRE(after.traces_dropped == before.traces_dropped);
+    REQUIRE(after.traces_sent - before.traces_sent == 2);
+    REQUIRE(after.payloads_sent - before.payloads_sent == 1);
+    REQUIRE(after.payload_bytes - before.payload_bytes == handle->getRequests()[1].body.size());
+    REQUIRE(after.requests_failed - before.requests_failed == 1);
+    REQUIRE(after.retries - before.retries == 1);
+    REQUIRE(after.encode_time.count - before.encode_time.count == 1);
+    REQUIRE(after.request_latency.count - before.request_latency.count == 2);
+  }
+}
+
+TEST_CASE("dogstatsd reporter") {
+  SECTION("formats counts as changes, and the rest as gauges") {
+    TelemetrySnapshot last;
+    last.spans_created = 10;
+    last.traces_sent = 5;
+    TelemetrySnapshot current = last;
+    current.spans_created = 15;
+    current.pending_traces = 3;
+    current.request_latency.count = 1;
+    current.request_latency.p50 = 100;
+    current.request_latency.p99 = 200;
+    current.request_latency.max = 300;
+    auto datagrams = DogStatsdReporter::format(last, current, "lang:cpp");
+    REQUIRE(datagrams == std::vector<std::string>{
+                             "datadog.tracer.spans_created:5|c|#lang:cpp\n"
+                             "datadog.tracer.pending_traces:3|g|#lang:cpp\n"
+                             "datadog.tracer.request_latency_us.p50:100|g|#lang:cpp\n"
+                             "datadog.tracer.request_latency_us.p99:200|g|#lang:cpp\n"
+                             "datadog.tracer.request_latency_us.max:300|g|#lang:cpp"});
+  }
+
+  SECTION("splits metrics across datagrams") {
+    TelemetrySnapshot last;
+    TelemetrySnapshot current;
+    current.spans_created = 1;
+    current.traces_written = 1;
+    std::string tags(1000, 't');
+    auto datagrams = DogStatsdReporter::format(last, current, tags);
+    REQUIRE(datagrams.size() == 3);
+    REQUIRE(datagrams[0] == "datadog.tracer.spans_created:1|c|#" + tags);
+  }
+
+  SECTION("sends to a udp endpoint") {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    REQUIRE(fd >= 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    socklen_t size = sizeof(address);
+    REQUIRE(getsockname(fd, reinterpret_cast<sockaddr*>(&address), &size) == 0);
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    DogStatsdReporter reporter{"udp://127.0.0.1:" + std::to_string(ntohs(address.sin_port)),
+                               std::chrono::hours(1), {"lang:cpp", "service:my-service"}};
+    reporter.report();
+    char buffer[2048];
+    auto received = recv(fd, buffer, sizeof(buffer), 0);
+    close(fd);
+    REQUIRE(received > 0);
+    std::string datagram{buffer, static_cast<size_t>(received)};
+    REQUIRE(datagram.find("datadog.tracer.pending_traces:") != std::string::npos);
+    REQUIRE(datagram.find("|#lang:cpp,service:my-service") != std::string::npos);
+  }
+
+  SECTION("reports the latencies recorded since the last report") {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    REQUIRE(fd >= 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    socklen_t size = sizeof(address);
+    REQUIRE(getsockname(fd, reinterpret_cast<sockaddr*>(&address), &size) == 0);
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    auto receive = [&]() {
+      char buffer[2048];
+      auto received = recv(fd, buffer, sizeof(buffer), 0);
+      REQUIRE(received > 0);
+      return std::string{buffer, static_cast<size_t>(received)};
+    };
+
+    DogStatsdReporter reporter{"udp://127.0.0.1:" + std::to_string(ntohs(address.sin_port)),
+                               std::chrono::hours(1), {}};
+    telemetry().request_latency.record(std::chrono::seconds(5));
+    reporter.report();
+    REQUIRE(receive().find("datadog.tracer.request_latency_us.max:5") != std::string::npos);
+    telemetry().request_latency.recordMicroseconds(50);
+    reporter.report();
+    std::string datagram = receive();
+    close(fd);
+    REQUIRE(datagram.find("datadog.tracer.request_latency_us.p99:50|g\n") != std::string::npos);
+    REQUIRE(datagram.find("datadog.tracer.request_latency_us.max:50|g") != std::string::npos);
+  }
+
+  SECTION("keeps reporting across fork()") {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    REQUIRE(fd >= 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    socklen_t size = sizeof(address);
+    REQUIRE(getsockname(fd, reinterpret_cast<sockaddr*>(&address), &size) == 0);
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::unique_ptr<DogStatsdReporter> reporter{
+        new DogStatsdReporter{"udp://127.0.0.1:" + std::to_string(ntohs(address.sin_port)),
+                              std::chrono::milliseconds(10),
+                              {}}};
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+      // The child's reporter has a thread of its own to stop. Nothing here can REQUIRE, so getting
+      // as far as exiting is the result.
+      reporter.reset();
+      _exit(0);
+    }
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+
+    // The parent's reporter carries on.
+    char buffer[2048];
+    REQUIRE(recv(fd, buffer, sizeof(buffer), 0) > 0);
+    reporter.reset();
+    close(fd);
+  }
+
+  SECTION("rejects bad urls") {
+    REQUIRE_THROWS_AS((DogStatsdReporter{"http://localhost:8125", std::chrono::hours(1), {}}),
+                      std::runtime_error);
+    REQUIRE_THROWS_AS((DogStatsdReporter{"udp://localhost", std::chrono::hours(1), {}}),
+                      std::runtime_error);
+  }
+}
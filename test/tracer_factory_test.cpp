@@ -4,6 +4,7 @@
 
 #include <catch2/catch.hpp>
 
+#include "../src/shared_memory.h"
 #include "../src/tracer.h"
 #include "mocks.h"
 
@@ -72,6 +73,46 @@ TEST_CASE("tracer factory") {
     REQUIRE(tracer->opts.analytics_rate == analytics_rate);
   }
 
+  SECTION("can create a tracer with agent and telemetry options") {
+    TemporaryDirectory directory;
+    const std::string pid = std::to_string(getpid());
+    const std::string collector_name = "/dd-opentracing-test-collector-" + pid;
+    const std::string limiter_name = "/dd-opentracing-test-limiter-" + pid;
+    std::ostringstream input;
+    input << R"(
+      {
+        "service": "my-service",
+        "agent_max_concurrent_requests": 4,
+        "agent_native_transport": true,
+        "agent_spool_directory": ")"
+          << directory.path << R"(",
+        "agent_max_consecutive_failures": 0,
+        "agent_collector_name": ")"
+          << collector_name << R"(",
+        "sampling_limiter_name": ")"
+          << limiter_name << R"(",
+        "propagation_inject_binary_compact": true,
+        "telemetry_dogstatsd_url": "udp://localhost:8125"
+      }
+    )";
+    std::string error = "";
+    auto result = factory.MakeTracer(input.str().c_str(), error);
+    REQUIRE(error == "");
+    REQUIRE(result->get() != nullptr);
+    auto tracer = dynamic_cast<MockTracer *>(result->get());
+    REQUIRE(tracer->opts.agent_max_concurrent_requests == 4);
+    REQUIRE(tracer->opts.agent_native_transport);
+    REQUIRE(tracer->opts.agent_spool_directory == directory.path);
+    REQUIRE(tracer->opts.agent_max_consecutive_failures == 0);
+    REQUIRE(tracer->opts.agent_collector_name == collector_name);
+    REQUIRE(tracer->opts.sampling_limiter_name == limiter_name);
+    REQUIRE(tracer->opts.inject_binary_compact);
+    REQUIRE(tracer->opts.telemetry_dogstatsd_url == "udp://localhost:8125");
+    result->reset();
+    SharedMemory::remove(collector_name);
+    SharedMemory::remove(limiter_name);
+  }
+
   SECTION("can create a tracer without optional fields") {
     std::string input{R"(
       {
@@ -148,6 +189,21 @@ TEST_CASE("tracer factory") {
     REQUIRE(result.error() == std::make_error_code(std::errc::invalid_argument));
   }
 
+  SECTION("handles bad types of agent options") {
+    auto field = GENERATE(R"("agent_max_concurrent_requests": "four")",
+                          R"("agent_native_transport": "yes")",
+                          R"("agent_spool_directory": 42)",
+                          R"("agent_max_consecutive_failures": [5])",
+                          R"("agent_collector_name": true)",
+                          R"("propagation_inject_binary_compact": "yes")");
+    std::string input = std::string(R"({"service": "my-service", )") + field + "}";
+    std::string error = "";
+    auto result = factory.MakeTracer(input.c_str(), error);
+    REQUIRE(error == "configuration has an argument with an incorrect type");
+    REQUIRE(!result);
+    REQUIRE(result.error() == std::make_error_code(std::errc::invalid_argument));
+  }
+
   SECTION("handles bad propagation style") {
     struct BadValueTest {
       std::string value;
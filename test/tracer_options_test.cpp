@@ -39,6 +39,29 @@ void requireTracerOptionsResultsMatch(const ot::expected<TracerOptions, const ch
     REQUIRE(lhs->analytics_rate == rhs->analytics_rate);
   }
   REQUIRE(lhs->tags == rhs->tags);
+  REQUIRE(lhs->agent_max_concurrent_requests == rhs->agent_max_concurrent_requests);
+  REQUIRE(lhs->agent_native_transport == rhs->agent_native_transport);
+  REQUIRE(lhs->agent_spool_directory == rhs->agent_spool_directory);
+  REQUIRE(lhs->agent_max_consecutive_failures == rhs->agent_max_consecutive_failures);
+  REQUIRE(lhs->agent_collector_name == rhs->agent_collector_name);
+  REQUIRE(lhs->sampling_limiter_name == rhs->sampling_limiter_name);
+  REQUIRE(lhs->inject_binary_compact == rhs->inject_binary_compact);
+  REQUIRE(lhs->telemetry_dogstatsd_url == rhs->telemetry_dogstatsd_url);
+}
+
+// The TracerOptions expected from the environment variables for the agent transport, spool,
+// circuit breaker, collector, sampling limiter, propagation encoding and telemetry.
+TracerOptions transportOptions() {
+  TracerOptions options{};
+  options.agent_max_concurrent_requests = 4;
+  options.agent_native_transport = true;
+  options.agent_spool_directory = "/var/spool/datadog";
+  options.agent_max_consecutive_failures = 0;
+  options.agent_collector_name = "/datadog-trace-collector";
+  options.sampling_limiter_name = "/datadog-sampling-limiter";
+  options.inject_binary_compact = true;
+  options.telemetry_dogstatsd_url = "udp://localhost:8125";
+  return options;
 }
 
 TEST_CASE("tracer options from environment variables") {
@@ -86,6 +109,15 @@ TEST_CASE("tracer options from environment variables") {
            },
            "test-version v0.0.1",
        }},
+      {{{"DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS", "4"},
+        {"DD_TRACE_AGENT_NATIVE_TRANSPORT", "true"},
+        {"DD_TRACE_AGENT_SPOOL_DIRECTORY", "/var/spool/datadog"},
+        {"DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES", "0"},
+        {"DD_TRACE_AGENT_COLLECTOR_NAME", "/datadog-trace-collector"},
+        {"DD_TRACE_SAMPLING_LIMITER_NAME", "/datadog-sampling-limiter"},
+        {"DD_PROPAGATION_INJECT_BINARY_COMPACT", "1"},
+        {"DD_TRACE_TELEMETRY_DOGSTATSD_URL", "udp://localhost:8125"}},
+       transportOptions()},
       {{{"DD_PROPAGATION_STYLE_EXTRACT", "Not even a real style"}},
        ot::make_unexpected("Value for DD_PROPAGATION_STYLE_EXTRACT is invalid")},
       {{{"DD_PROPAGATION_STYLE_INJECT", "Not even a real style"}},
@@ -94,6 +126,18 @@ TEST_CASE("tracer options from environment variables") {
        ot::make_unexpected("Value for DD_TRACE_AGENT_PORT is invalid")},
       {{{"DD_TRACE_AGENT_PORT", "9223372036854775807"}},
        ot::make_unexpected("Value for DD_TRACE_AGENT_PORT is out of range")},
+      {{{"DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS", "0"}},
+       ot::make_unexpected("Value for DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS is invalid")},
+      {{{"DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS", "-1"}},
+       ot::make_unexpected("Value for DD_TRACE_AGENT_MAX_CONCURRENT_REQUESTS is invalid")},
+      {{{"DD_TRACE_AGENT_NATIVE_TRANSPORT", "yes please"}},
+       ot::make_unexpected("Value for DD_TRACE_AGENT_NATIVE_TRANSPORT is invalid")},
+      {{{"DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES", "five"}},
+       ot::make_unexpected("Value for DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES is invalid")},
+      {{{"DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES", "99999999999999999999999"}},
+       ot::make_unexpected("Value for DD_TRACE_AGENT_MAX_CONSECUTIVE_FAILURES is invalid")},
+      {{{"DD_PROPAGATION_INJECT_BINARY_COMPACT", "yes please"}},
+       ot::make_unexpected("Value for DD_PROPAGATION_INJECT_BINARY_COMPACT is invalid")},
       {{{"DD_TRACE_REPORT_HOSTNAME", "yes please"}},
        ot::make_unexpected("Value for DD_TRACE_REPORT_HOSTNAME is invalid")},
       {{{"DD_TRACE_ANALYTICS_ENABLED", "yes please"}},
@@ -34,7 +34,7 @@ TEST_CASE("tracer") {
     const ot::FinishSpanOptions finish_options;
     span->FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->type == "web");
     REQUIRE(result->service == "service_name");
     REQUIRE(result->name == "/what_up");
@@ -48,7 +48,7 @@ TEST_CASE("tracer") {
     const ot::FinishSpanOptions finish_options;
     span->FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->span_id == 100);
     REQUIRE(result->trace_id == 100);
     REQUIRE(result->parent_id == 0);
@@ -64,7 +64,7 @@ TEST_CASE("tracer") {
     auto span = tracer->StartSpan("fred", {ChildOf(span_context_maybe->get())});
     const ot::FinishSpanOptions finish_options;
     span->FinishWithOptions(finish_options);
-    auto& result = buffer->traces().at(69).finished_spans->at(0);
+    auto& result = buffer->traces().at(69)->finished_spans->at(0);
     REQUIRE(result->span_id == 100);
     REQUIRE(result->trace_id == 69);
     REQUIRE(result->parent_id == 420);
@@ -76,7 +76,7 @@ TEST_CASE("tracer") {
     auto span = tracer->StartSpan("fred", {ChildOf(span_context_maybe->get())});
     const ot::FinishSpanOptions finish_options;
     span->FinishWithOptions(finish_options);
-    auto& result = buffer->traces().at(100).finished_spans->at(0);
+    auto& result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(result->span_id == 100);
     REQUIRE(result->trace_id == 100);
     REQUIRE(result->parent_id == 0);
@@ -94,11 +94,11 @@ TEST_CASE("tracer") {
     buffer->setHostname("");
 
     // Tag should exist with the correct value on the root / local-root span.
-    auto& root_result = buffer->traces().at(100).finished_spans->at(1);
+    auto& root_result = buffer->traces().at(100)->finished_spans->at(1);
     REQUIRE(root_result->meta["_dd.hostname"] == "testhostname");
 
     // Tag should not exist on the child span(s).
-    auto& child_result = buffer->traces().at(100).finished_spans->at(0);
+    auto& child_result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(child_result->meta.find("_dd.hostname") == child_result->meta.end());
   }
 
@@ -114,11 +114,11 @@ TEST_CASE("tracer") {
     buffer->setAnalyticsRate(std::nan(""));
 
     // Metric should exist with the correct value on the root / local-root span.
-    auto& root_result = buffer->traces().at(100).finished_spans->at(1);
+    auto& root_result = buffer->traces().at(100)->finished_spans->at(1);
     REQUIRE(root_result->metrics["_dd1.sr.eausr"] == 1.0);
 
     // Tag should not exist on the child span(s).
-    auto& child_result = buffer->traces().at(100).finished_spans->at(0);
+    auto& child_result = buffer->traces().at(100)->finished_spans->at(0);
     REQUIRE(child_result->metrics.find("_dd1.sr.eausr") == child_result->metrics.end());
   }
 }
@@ -0,0 +1,434 @@
+#include "../src/curl_transport.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../src/agent_writer.h"
+#include "mocks.h"
+using namespace datadog::opentracing;
+
+// A minimal HTTP server that stands in for the agent, on localhost or a unix domain socket. It
+// waits for latency before responding to each request, and records how many requests it was
+// handling at once.
+// Not in mocks.h since we only need it here for now.
+class MockAgent {
+ public:
+  MockAgent(std::chrono::milliseconds latency, std::string response, std::string unix_socket = "",
+            bool close_after_response = false)
+      : latency_(latency),
+        response_(response),
+        unix_socket_(unix_socket),
+        close_after_response_(close_after_response) {
+    sockaddr_in tcp_address{};
+    tcp_address.sin_family = AF_INET;
+    tcp_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    tcp_address.sin_port = 0;  // Any free port.
+    sockaddr_un unix_address{};
+    unix_address.sun_family = AF_UNIX;
+    std::strncpy(unix_address.sun_path, unix_socket.c_str(), sizeof(unix_address.sun_path) - 1);
+    sockaddr* address_ptr = unix_socket.empty() ? reinterpret_cast<sockaddr*>(&tcp_address)
+                                                : reinterpret_cast<sockaddr*>(&unix_address);
+    socklen_t address_size = unix_socket.empty() ? sizeof(tcp_address) : sizeof(unix_address);
+    unlink(unix_socket.c_str());
+    listener_ = socket(unix_socket.empty() ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (listener_ < 0 || bind(listener_, address_ptr, address_size) != 0 ||
+        listen(listener_, 16) != 0 || getsockname(listener_, address_ptr, &address_size) != 0) {
+      throw std::runtime_error("Unable to start mock agent");
+    }
+    port_ = ntohs(tcp_address.sin_port);
+    acceptor_ = std::thread([this]() { acceptConnections(); });
+  }
+
+  ~MockAgent() {
+    shutdown(listener_, SHUT_RDWR);
+    acceptor_.join();
+    close(listener_);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (int connection : connections_) {
+        shutdown(connection, SHUT_RDWR);
+      }
+    }
+    for (auto& handler : handlers_) {
+      handler.join();
+    }
+    for (int connection : connections_) {
+      close(connection);
+    }
+    if (!unix_socket_.empty()) {
+      unlink(unix_socket_.c_str());
+    }
+  }
+
+  uint32_t port() const { return port_; }
+
+  std::string url() const { return "http://127.0.0.1:" + std::to_string(port_) + "/v0.4/traces"; }
+
+  int requestCount() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return request_count_;
+  }
+
+  int maxConcurrentRequests() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return max_concurrent_requests_;
+  }
+
+  int connectionCount() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return static_cast<int>(connections_.size());
+  }
+
+  // Responds to requests with the given raw response, status line and all, rather than a 200 with
+  // the body given to the constructor.
+  void respondWith(std::string raw_response) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    raw_response_ = raw_response;
+  }
+
+  // The whole of the last request received, headers and all.
+  std::string lastRequest() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return last_request_;
+  }
+
+ private:
+  void acceptConnections() {
+    while (true) {
+      int connection = accept(listener_, nullptr, nullptr);
+      if (connection < 0) {
+        return;  // Shut down.
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      connections_.push_back(connection);
+      handlers_.emplace_back([this, connection]() { handleConnection(connection); });
+    }
+  }
+
+  // Reads requests from the connection until it's closed, responding to each in turn.
+  void handleConnection(int connection) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+      size_t header_end;
+      while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t received = recv(connection, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+          return;
+        }
+        buffer.append(chunk, received);
+      }
+      size_t content_length = 0;
+      const std::string length_header = "Content-Length: ";
+      auto length_pos = buffer.find(length_header);
+      if (length_pos != std::string::npos && length_pos < header_end) {
+        content_length = std::stoul(buffer.substr(length_pos + length_header.size()));
+      }
+      size_t request_size = header_end + 4 + content_length;
+      while (buffer.size() < request_size) {
+        ssize_t received = recv(connection, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+          return;
+        }
+        buffer.append(chunk, received);
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        last_request_ = buffer.substr(0, request_size);
+        concurrent_requests_++;
+        max_concurrent_requests_ = std::max(max_concurrent_requests_, concurrent_requests_);
+      }
+      std::this_thread::sleep_for(latency_);
+      std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                             "Content-Length: " +
+                             std::to_string(response_.size()) + "\r\n\r\n" + response_;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        concurrent_requests_--;
+        request_count_++;
+        if (!raw_response_.empty()) {
+          response = raw_response_;
+        }
+      }
+      buffer.erase(0, request_size);
+      if (send(connection, response.data(), response.size(), MSG_NOSIGNAL) < 0) {
+        return;
+      }
+      if (close_after_response_) {
+        shutdown(connection, SHUT_RDWR);
+        return;
+      }
+    }
+  }
+
+  const std::chrono::milliseconds latency_;
+  const std::string response_;
+  const std::string unix_socket_;
+  const bool close_after_response_;
+  int listener_;
+  uint32_t port_;
+  std::thread acceptor_;
+  std::mutex mutex_;
+  std::vector<int> connections_;
+  std::vector<std::thread> handlers_;
+  int concurrent_requests_ = 0;
+  int max_concurrent_requests_ = 0;
+  int request_count_ = 0;
+  std::string last_request_;
+  std::string raw_response_;
+};
+
+TEST_CASE("multi curl handle") {
+  MockAgent agent{std::chrono::milliseconds(200), "{}"};
+  struct Result {
+    HandleResult rcode;
+    std::string error;
+    std::string response;
+  };
+  std::vector<Result> results;
+  auto callback = [&](HandleResult rcode, const std::string& error, const std::string& response) {
+    results.push_back({rcode, error, response});
+  };
+  const std::string body = "body";
+  // Runs the handle until every request has completed.
+  auto run = [](Handle& handle) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (handle.inFlight() > 0 && std::chrono::steady_clock::now() < deadline) {
+      handle.run(std::chrono::milliseconds(100));
+    }
+  };
+
+  SECTION("requests are in flight concurrently") {
+    MultiCurlHandle handle{4};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    for (int i = 0; i < 4; i++) {
+      handle.post({{"Content-Type", "application/msgpack"}}, body, callback);
+    }
+    REQUIRE(handle.inFlight() == 4);
+    run(handle);
+
+    REQUIRE(results.size() == 4);
+    for (auto& result : results) {
+      REQUIRE(result.rcode == HandleResult::ok);
+      REQUIRE(result.response == "{}");
+    }
+    REQUIRE(agent.requestCount() == 4);
+    REQUIRE(agent.maxConcurrentRequests() == 4);
+  }
+
+  SECTION("connections are limited to max_in_flight") {
+    MultiCurlHandle handle{2};
+    REQUIRE(handle.maxInFlight() == 2);
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    for (int i = 0; i < 4; i++) {
+      handle.post({}, body, callback);
+    }
+    run(handle);
+
+    REQUIRE(results.size() == 4);
+    REQUIRE(agent.requestCount() == 4);
+    REQUIRE(agent.maxConcurrentRequests() == 2);
+  }
+
+  SECTION("failed requests are reported") {
+    MultiCurlHandle handle{2};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    REQUIRE(handle.setopt(HandleOption::timeout_ms, 50L) == HandleResult::ok);
+    handle.post({}, body, callback);
+    run(handle);
+
+    REQUIRE(results.size() == 1);
+    REQUIRE(results[0].rcode == HandleResult::operation_timedout);
+    REQUIRE(results[0].error.find("Error sending traces to agent: Timeout was reached") == 0);
+  }
+
+  SECTION("responses other than 2xx are failures") {
+    agent.respondWith("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 2\r\n\r\n{}");
+    MultiCurlHandle handle{2};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    handle.post({}, body, callback);
+    run(handle);
+
+    REQUIRE(results.size() == 1);
+    REQUIRE(results[0].rcode == HandleResult::http_returned_error);
+    REQUIRE(results[0].error ==
+            "Error sending traces to agent: HTTP response code said error\n"
+            "Agent responded with HTTP status 503");
+
+    // And the same without the multi interface.
+    CurlHandle single;
+    REQUIRE(single.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    single.post({}, body, callback);
+    REQUIRE(results.size() == 2);
+    REQUIRE(results[1].rcode == HandleResult::http_returned_error);
+    REQUIRE(results[1].error == results[0].error);
+  }
+
+  SECTION("wakeUp interrupts run") {
+    MultiCurlHandle handle{1};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    handle.post({}, body, callback);
+    handle.wakeUp();
+    auto start = std::chrono::steady_clock::now();
+    handle.run(std::chrono::seconds(10));
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    run(handle);
+  }
+}
+
+TEST_CASE("agent writer with concurrent requests") {
+  MockAgent agent{std::chrono::milliseconds(100),
+                  "{\"rate_by_service\": {\"service:nginx,env:\": 0.5}}"};
+  auto sampler = std::make_shared<MockRulesSampler>();
+  AgentWriterOptions options;
+  options.write_period = std::chrono::seconds(3600);
+  options.max_traces_per_payload = 1;
+  options.max_concurrent_requests = 4;
+  AgentWriter writer{"127.0.0.1", agent.port(), "", options, sampler};
+
+  for (uint64_t i = 1; i <= 8; i++) {
+    Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+    trace->emplace_back(std::unique_ptr<TestSpanData>{new TestSpanData{
+        "web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}});
+    writer.write(std::move(trace));
+  }
+  writer.flush(std::chrono::seconds(10));
+
+  REQUIRE(agent.requestCount() == 8);
+  REQUIRE(agent.maxConcurrentRequests() == 4);
+  REQUIRE(sampler->config == "{\"service:nginx,env:\":0.5}");
+}
+
+TEST_CASE("native handle") {
+  NativeHandle handle;
+  const std::string body{"\x92\x00\x01", 3};  // Null characters and all.
+  std::map<std::string, std::string> headers{{"Content-Type", "application/msgpack"},
+                                             {"X-Datadog-Trace-Count", "1"}};
+  // Makes a request the way the default Handle::post does.
+  auto perform = [&]() -> HandleResult {
+    handle.setHeaders(headers);
+    handle.setopt(HandleOption::post_field_size, body.size());
+    handle.setopt(HandleOption::post_fields, body.data());
+    return handle.perform();
+  };
+
+  SECTION("requests are sent over tcp") {
+    MockAgent agent{std::chrono::milliseconds(0), "{\"rate_by_service\": {}}"};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    REQUIRE(perform() == HandleResult::ok);
+    REQUIRE(handle.getResponse() == "{\"rate_by_service\": {}}");
+    REQUIRE(agent.lastRequest() ==
+            "POST /v0.4/traces HTTP/1.1\r\nHost: 127.0.0.1:" + std::to_string(agent.port()) +
+                "\r\nContent-Type: application/msgpack\r\nX-Datadog-Trace-Count: 1\r\n"
+                "Content-Length: 3\r\n\r\n" +
+                body);
+  }
+
+  SECTION("requests are sent over a unix domain socket") {
+    std::string socket_path = "/tmp/dd-opentracing-cpp-test-" + std::to_string(getpid()) + ".sock";
+    MockAgent agent{std::chrono::milliseconds(0), "{}", socket_path};
+    REQUIRE(handle.setopt(HandleOption::unix_socket_path, socket_path.c_str()) ==
+            HandleResult::ok);
+    REQUIRE(handle.setopt(HandleOption::url, "http://localhost:8126/v0.4/traces") ==
+            HandleResult::ok);
+    REQUIRE(perform() == HandleResult::ok);
+    REQUIRE(handle.getResponse() == "{}");
+    REQUIRE(agent.lastRequest().find("POST /v0.4/traces HTTP/1.1\r\nHost: localhost:8126\r\n") ==
+            0);
+  }
+
+  SECTION("the connection is kept between requests") {
+    MockAgent agent{std::chrono::milliseconds(0), "{}"};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    for (int i = 0; i < 3; i++) {
+      REQUIRE(perform() == HandleResult::ok);
+    }
+    REQUIRE(agent.requestCount() == 3);
+    REQUIRE(agent.connectionCount() == 1);
+  }
+
+  SECTION("reconnects if the agent closes the connection") {
+    MockAgent agent{std::chrono::milliseconds(0), "{}", "", true};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    for (int i = 0; i < 3; i++) {
+      REQUIRE(perform() == HandleResult::ok);
+    }
+    REQUIRE(agent.requestCount() == 3);
+    REQUIRE(agent.connectionCount() == 3);
+  }
+
+  SECTION("times out") {
+    MockAgent agent{std::chrono::milliseconds(200), "{}"};
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    REQUIRE(handle.setopt(HandleOption::timeout_ms, 50L) == HandleResult::ok);
+    REQUIRE(perform() == HandleResult::operation_timedout);
+    REQUIRE(handle.getError() == "Timed out waiting for agent to respond");
+  }
+
+  SECTION("responses other than 2xx are failures") {
+    MockAgent agent{std::chrono::milliseconds(0), "{}"};
+    agent.respondWith("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 2\r\n\r\n{}");
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    REQUIRE(perform() == HandleResult::http_returned_error);
+    REQUIRE(handle.getError() == "Agent responded with HTTP/1.1 503 Service Unavailable");
+    REQUIRE(handle.getResponse() == "");
+    // The connection is still fine for the next request.
+    agent.respondWith("HTTP/1.1 202 Accepted\r\nContent-Length: 2\r\n\r\n{}");
+    REQUIRE(perform() == HandleResult::ok);
+    REQUIRE(agent.connectionCount() == 1);
+  }
+
+  SECTION("chunked responses are read") {
+    MockAgent agent{std::chrono::milliseconds(0), "{}"};
+    agent.respondWith(
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "1;name=value\r\n{\r\n1\r\n}\r\n0\r\n\r\n");
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    REQUIRE(perform() == HandleResult::ok);
+    REQUIRE(handle.getResponse() == "{}");
+  }
+
+  SECTION("bad chunk sizes are rejected") {
+    auto chunk_size = GENERATE(as<std::string>{}, "", "zz", "-1", " 2", "2x",
+                               "ffffffffffffffffff", "fffffffffffffffe", "100001");
+    MockAgent agent{std::chrono::milliseconds(0), "{}"};
+    agent.respondWith("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" + chunk_size +
+                      "\r\n{}\r\n0\r\n\r\n");
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    REQUIRE(handle.setopt(HandleOption::timeout_ms, 5000L) == HandleResult::ok);
+    REQUIRE(perform() == HandleResult::weird_server_reply);
+  }
+
+  SECTION("responses that are too large are rejected") {
+    MockAgent agent{std::chrono::milliseconds(0), "{}"};
+    agent.respondWith("HTTP/1.1 200 OK\r\nContent-Length: 2000000\r\n\r\n{}");
+    REQUIRE(handle.setopt(HandleOption::url, agent.url().c_str()) == HandleResult::ok);
+    REQUIRE(perform() == HandleResult::weird_server_reply);
+    REQUIRE(handle.getError() == "Response from agent is too large");
+  }
+
+  SECTION("fails to connect") {
+    std::string socket_path = "/tmp/dd-opentracing-cpp-test-" + std::to_string(getpid()) + ".none";
+    REQUIRE(handle.setopt(HandleOption::unix_socket_path, socket_path.c_str()) ==
+            HandleResult::ok);
+    REQUIRE(handle.setopt(HandleOption::url, "http://localhost:8126/v0.4/traces") ==
+            HandleResult::ok);
+    REQUIRE(perform() == HandleResult::couldnt_connect);
+    REQUIRE(handle.getError().find("Unable to connect to agent: ") == 0);
+  }
+
+  SECTION("https is not supported") {
+    REQUIRE(handle.setopt(HandleOption::url, "https://localhost:8126/v0.4/traces") ==
+            HandleResult::unsupported_protocol);
+  }
+}
@@ -0,0 +1,125 @@
+#include "../src/url_normalizer.h"
+
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+using namespace datadog::opentracing;
+
+TEST_CASE("url normalizer") {
+  UrlNormalizerRules rules;
+
+  SECTION("drops the query string, and otherwise leaves the URL alone without rules") {
+    UrlNormalizer normalizer{rules};
+    REQUIRE(normalizer.normalize("") == "");
+    REQUIRE(normalizer.normalize("/users/1?private=true") == "/users/1");
+    REQUIRE(normalizer.normalize("http://example.com:8080/users/1/") ==
+            "http://example.com:8080/users/1/");
+    REQUIRE(normalizer.normalize("http://example.com?a=b") == "http://example.com");
+    REQUIRE(normalizer.normalize("GET /users/1") == "GET /users/1");
+    REQUIRE(normalizer.normalize("GET") == "GET");
+  }
+
+  SECTION("leaves inputs that don't look like URLs alone") {
+    rules.integers = true;
+    UrlNormalizer normalizer{rules};
+    REQUIRE(normalizer.normalize("SELECT * FROM users WHERE id = ?") ==
+            "SELECT * FROM users WHERE id = ?");
+    REQUIRE(normalizer.normalize("GET users/1?a=b") == "GET users/1?a=b");
+    REQUIRE(normalizer.normalize("://example.com/1?a=b") == "://example.com/1?a=b");
+    REQUIRE(normalizer.normalize("my query://1?a=b") == "my query://1?a=b");
+    REQUIRE(normalizer.normalize("redis+tls://cache/1?a=b") == "redis+tls://cache/?");
+    REQUIRE(normalizer.normalize("GET http://example.com/1?a=b") == "GET http://example.com/?");
+  }
+
+  SECTION("replaces segments of the enabled kinds") {
+    auto kind = GENERATE(0, 1, 2);
+    rules.integers = kind == 0;
+    rules.uuids = kind == 1;
+    rules.hex = kind == 2;
+    UrlNormalizer normalizer{rules};
+    std::string url =
+        "http://10.0.0.1:80/v2/users/42/sessions/01234567-89ab-CDEF-0123-456789abcdef/"
+        "blobs/0f3a9c2e1b/deadbeef/a42/?x=1";
+    std::vector<std::string> expected{
+        "http://10.0.0.1:80/v2/users/?/sessions/01234567-89ab-CDEF-0123-456789abcdef/"
+        "blobs/0f3a9c2e1b/deadbeef/a42/",
+        "http://10.0.0.1:80/v2/users/42/sessions/?/blobs/0f3a9c2e1b/deadbeef/a42/",
+        "http://10.0.0.1:80/v2/users/42/sessions/01234567-89ab-CDEF-0123-456789abcdef/"
+        "blobs/?/deadbeef/a42/"};
+    REQUIRE(normalizer.normalize(url) == expected[kind]);
+    REQUIRE(normalizer.normalize("POST /users/12345678") ==
+            (kind == 1 ? "POST /users/12345678" : "POST /users/?"));
+  }
+
+  SECTION("replaces paths that match a route with the route") {
+    rules.integers = true;
+    rules.routes = {"/users/{id}/orders/{order}", "/users/me/orders/{id}", "/users/{id}",
+                    "/static/{file}/", "/"};
+    UrlNormalizer normalizer{rules};
+    REQUIRE(normalizer.normalize("/users/alice/orders/x7?page=2") == "/users/{id}/orders/{order}");
+    // The first route listed wins, even over a more specific one.
+    REQUIRE(normalizer.normalize("/users/me/orders/3") == "/users/{id}/orders/{order}");
+    REQUIRE(normalizer.normalize("https://example.com/users/bob") ==
+            "https://example.com/users/{id}");
+    REQUIRE(normalizer.normalize("GET /static/app.js/") == "GET /static/{file}/");
+    REQUIRE(normalizer.normalize("/") == "/");
+    // Not matching any route, so only the segment rules apply.
+    REQUIRE(normalizer.normalize("/static/app.js") == "/static/app.js");
+    REQUIRE(normalizer.normalize("/users/7/orders") == "/users/?/orders");
+    REQUIRE(normalizer.normalize("/users/7/orders/8/items") == "/users/?/orders/?/items");
+  }
+
+  SECTION("a later route can match where an earlier one's literal segment didn't") {
+    rules.routes = {"/a/b/c", "/a/{x}/d"};
+    UrlNormalizer normalizer{rules};
+    REQUIRE(normalizer.normalize("/a/b/c") == "/a/b/c");
+    REQUIRE(normalizer.normalize("/a/b/d") == "/a/{x}/d");
+    REQUIRE(normalizer.normalize("/a/z/d") == "/a/{x}/d");
+    REQUIRE(normalizer.normalize("/a/z/c") == "/a/z/c");
+  }
+
+  SECTION("rejects a route that isn't a path") {
+    rules.routes = {"users/{id}"};
+    REQUIRE_THROWS_AS(UrlNormalizer{rules}, std::invalid_argument);
+  }
+
+  SECTION("gives the same results with and without the cache") {
+    rules.integers = true;
+    rules.routes = {"/users/{id}"};
+    rules.cache_size = 2;
+    UrlNormalizer cached{rules};
+    rules.cache_size = 0;
+    UrlNormalizer uncached{rules};
+    std::vector<std::string> urls{"/users/1", "/orders/1", "/users/1?a", "/items/2/3",
+                                  "/orders/1", "/users/1/x"};
+    for (int i = 0; i < 3; i++) {
+      for (auto& url : urls) {
+        REQUIRE(cached.normalize(url) == uncached.normalize(url));
+      }
+    }
+  }
+
+  SECTION("thread safe") {
+    rules.integers = true;
+    rules.cache_size = 8;
+    UrlNormalizer normalizer{rules};
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&]() {
+        for (int i = 0; i < 1000; i++) {
+          std::string url = "/users/" + std::to_string(i % 16) + "/items";
+          if (normalizer.normalize(url) != "/users/?/items") {
+            wrong++;
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    REQUIRE(wrong == 0);
+  }
+}